@@ -38,8 +38,15 @@
 #include "Exception.h"
 #include "RemoteConnection.h"
 #include "utils.h"
+#include <atomic>
+#include <cstdint>
+#include <fstream>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <VDMSConfigHelper.h>
@@ -54,10 +61,33 @@ enum DescriptorSetEngine {
   TileDBDense,
   TileDBSparse,
   Flinng,
-  FaissHNSWFlat
+  FaissHNSWFlat,
+  FaissBinaryFlat,
+  FaissBinaryIVF,
+  FaissBinaryHNSW
 };
 
-enum DistanceMetric { L2, IP };
+// Hamming is the metric of the binary engines, and only theirs.
+// Cosine sets are IP sets whose descriptors and queries are normalized,
+// so their distances are cosine similarities (larger is closer).
+enum DistanceMetric { L2, IP, Hamming, Cosine };
+
+// How the neighbors of a descriptor vote for its label in classify():
+// one vote each, or votes weighted by how close they are.
+enum VoteWeighting { MajorityVote, DistanceWeightedVote };
+
+/**
+ *  Convert n half-precision values, IEEE fp16 or bfloat16 (the upper
+ *  half of a float), to floats. F16C and AVX2 are used when the CPU
+ *  has them.
+ */
+void fp16_to_float(const uint16_t *src, size_t n, float *dst);
+void bf16_to_float(const uint16_t *src, size_t n, float *dst);
+
+// How an existing collection is opened. LoadMmap maps the index files
+// instead of reading them, for the engines that support it (FaissFlat,
+// FaissIVFFlat); the set is loaded in memory when first modified.
+enum DescriptorSetLoad { LoadInMemory, LoadMmap };
 // enum class Storage { LOCAL = 0, AWS = 1 };
 
 class DescriptorSet {
@@ -78,19 +108,94 @@ private:
   DescriptorSetData *_set;
   DescriptorSetEngine _eng;
 
+  // Number of Faiss indexes the set is split in (1: not sharded)
+  unsigned _n_shards;
+
+  // Cosine set: the engine holds an IP index, and descriptors are
+  // normalized before reaching it.
+  bool _cosine;
+
   RemoteConnection *_remote;
   VDMS::StorageType _storage = VDMS::StorageType::LOCAL;
 
+  // Held exclusively only while compact() swaps in the rebuilt set.
+  std::shared_mutex _set_lock;
+
+  // Changed since the last store() (or never stored)
+  std::atomic<bool> _modified;
+
+  // Removed descriptors stay in the index until compact(), marked in
+  // _deleted (by position in the index). Ids returned by add() are
+  // positions in the index until the first update() or compact(); from
+  // then on, _ext_ids maps positions to ids (-1 once deleted) and
+  // _int_ids, sorted by id, ids to positions, so ids stay the same.
+  // Every change is appended to the id log as it is made, and folded
+  // into the id map file by store(), sync() and compact().
+  std::mutex _ids_lock;
+  std::unordered_set<long> _deleted;
+  std::vector<long> _ext_ids;
+  std::vector<std::pair<long, long>> _int_ids;
+  long _next_id;
+  bool _compacting;
+  std::ofstream _ids_log;
+
   void write_set_info();
+  void write_set_info(const std::string &set_path);
   void read_set_info(const std::string &set_path);
+  void recover_compaction(const std::string &set_path);
+
+  DescriptorSetData *open_set(const std::string &set_path,
+                              DescriptorSetLoad load);
+  DescriptorSetData *create_set(const std::string &set_path, unsigned dim,
+                                DescriptorSetEngine eng, DistanceMetric metric,
+                                VCL::DescriptorParams *param);
+
+  void write_id_map();
+  void write_id_map(const std::string &set_path, long next_id,
+                    const std::vector<long> &ext_ids,
+                    const std::unordered_set<long> &deleted);
+  void read_id_map();
+  void remove_padding();
+
+  bool open_id_log(bool truncate);
+  void replay_id_log();
+
+  // These expect _ids_lock to be held
+  void write_id_map_locked();
+  void log_ids(uint8_t type, const std::vector<long> &values);
+  void index_ids();
+  void set_position(long id, long position);
+  void map_ids(long n_total, long next_id);
+  void add_ids(long position, long n, long first_id);
+  void remove_position(long position);
+  void move_id(long id, long old_position, long new_position);
+  long to_position(long id);
+  long to_id(long position);
+
+  // Returns descriptors, or a normalized copy in buffer for Cosine sets.
+  // Expects _set_lock to be held.
+  DescDataArray normalized(DescDataArray descriptors, unsigned n,
+                           std::vector<float> &buffer);
+
+  // Search that skips removed descriptors, returning positions
+  void search_positions(DescDataArray queries, unsigned n, unsigned k,
+                        long *positions, float *distances);
+
+  // Copies the descriptors at positions [begin, end) that are not
+  // removed into set, recording their new positions in new_positions
+  void copy_live(DescriptorSetData *set, long begin, long end,
+                 const std::unordered_set<long> &deleted,
+                 std::vector<long> &new_positions);
 
 public:
   /**
    *  Loads an existing collection located at set_path
    *
    *  @param set_path  Full Path to the collection folder
+   *  @param load  Whether to read or to map the index (Default is read)
    */
-  DescriptorSet(const std::string &set_path);
+  DescriptorSet(const std::string &set_path,
+                DescriptorSetLoad load = LoadInMemory);
 
   /**
    *  Creates a new collection, if it does not exist
@@ -99,6 +204,7 @@ public:
    *  @param dim  Dimension of the descriptor
    *  @param eng  DescriptorSet Engine (Default is FaissFlat)
    *  @param metric Metric for calculating distances (Default is L2)
+   *  @param param  Engine parameters, and number of shards of Faiss sets
    */
   DescriptorSet(const std::string &set_path, unsigned dim,
                 DescriptorSetEngine eng = FaissFlat, DistanceMetric metric = L2,
@@ -124,6 +230,19 @@ public:
    */
   void store(std::string set_path);
 
+  /**
+   *  Makes the changes applied since the last store() recoverable,
+   *  without rewriting the whole index when the engine supports it
+   *  (Faiss engines keep a write-ahead log of the adds).
+   */
+  void sync();
+
+  /**
+   *  Returns true if the set changed since it was last stored,
+   *  including the changes replayed from a write-ahead log on open
+   */
+  bool is_modified();
+
   /*  *********************** */
   /*      CORE INTERFACE      */
   /*  *********************** */
@@ -139,10 +258,23 @@ public:
    */
   unsigned get_dimensions();
 
+  /**
+   *  Returns the size in bytes of each descriptor in the buffers of
+   *  the set: dim floats, or dim / 8 bytes of packed bits for the
+   *  binary engines, whose dimensions are in bits
+   */
+  size_t get_descriptor_size();
+
+  /**
+   *  Returns the metric the set was created with
+   */
+  DistanceMetric get_metric();
+
   void finalize_index();
 
   /**
-   *  Returns the number of descriptors in the set
+   *  Returns the number of descriptors in the set,
+   *  not counting the removed ones
    */
   long get_n_descriptors();
 
@@ -186,15 +318,15 @@ public:
    *  Note: We only allow the radius search of a single
    *  element to avoid having to deal with results that are
    *  of different (unknown) sized for each query.
-   *  We will work on it once we have a more clear use case for
-   *  this call
    *
    *  @param query  Query vector
    *  @param radius  Maximun distance allowed
-   *  @param ids  Array of ID of the descriptors
-   *  @param distances  Distances of each neighbor
+   *  @param ids  ID of the descriptors found, closest first (resized)
+   *  @param distances  Distances of each neighbor (resized)
+   *  @param max_results  Maximum number of results, 0 for all of them
    */
-  void radius_search(DescData query, float radius, long *ids, float *distances);
+  void radius_search(DescData query, float radius, std::vector<long> &ids,
+                     std::vector<float> &distances, unsigned max_results = 0);
 
   /**
    *  Find the label of the feature vector, based on the closest
@@ -204,13 +336,15 @@ public:
    *  @param n  Number of descriptors in buffer
    *  @return labels  Label Ids
    *  @param quorum  Number of elements used for the classification vote.
+   *  @param weighting  Weight of each vote (Default is MajorityVote)
    */
   void classify(DescDataArray descriptors, unsigned n, long *labels,
-                unsigned quorum = 7);
+                unsigned quorum = 7, VoteWeighting weighting = MajorityVote);
 
   /**
    *  Get the descriptors by specifiying ids.
-   *  This is an exact search by id.
+   *  This is an exact search by id. Cosine sets return the
+   *  normalized descriptors.
    *
    *  @param ids  buffer with ids
    *  @param n  number of ids to query
@@ -219,6 +353,38 @@ public:
    */
   void get_descriptors(long *ids, unsigned n, DescDataArray descriptors);
 
+  /**
+   *  Removes descriptors from the set. They are no longer returned by
+   *  searches, and are dropped from the index by the next compact().
+   *  Nothing is removed if any of the ids does not exist.
+   *
+   *  @param ids  buffer with ids
+   *  @param n  number of ids
+   */
+  void remove(long *ids, unsigned n);
+
+  /**
+   *  Replaces a descriptor, which keeps its id.
+   *
+   *  @param id  Id of the descriptor
+   *  @param descriptor  New descriptor (size dim)
+   *  @param label  New label, or NULL to keep the current one
+   */
+  void update(long id, DescData descriptor, long *label = NULL);
+
+  /**
+   *  Returns the fraction of the index taken by removed descriptors
+   */
+  float removed_ratio();
+
+  /**
+   *  Rebuilds the index without the removed descriptors, keeping the
+   *  ids of the others. The new index is built next to the current
+   *  one, which keeps serving searches and adds until it is replaced.
+   *  Not supported by the Flinng engine.
+   */
+  void compact();
+
   /**
    *  Trains the index with the data present in the collection
    *  using the specified metric
@@ -233,6 +399,23 @@ public:
    */
   void train(DescDataArray descriptors, unsigned n);
 
+  /**
+   *  Trains a new index in the background, on a sample of the set
+   *  (or on the given descriptors), and swaps it in once it holds
+   *  all the descriptors. Searches and adds go on meanwhile.
+   *  Does nothing if a training is already running.
+   *
+   *  @param descriptors Reference Descriptors (optional)
+   *  @param n Number of descriptors
+   */
+  void train_async(DescDataArray descriptors = NULL, unsigned n = 0);
+
+  /**
+   *  Returns the progress of the background training, in [0, 1],
+   *  or -1 if none is running
+   */
+  float train_progress();
+
   /**
    *  Returns true if the index is trained (train() method called),
    *  false otherwhise.
@@ -281,10 +464,12 @@ public:
    *  @param query  Query descriptors buffer
    *  @param n_queries Number of descriptors that will be classified
    *  @param quorum  Number of elements used for the classification vote.
+   *  @param weighting  Weight of each vote (Default is MajorityVote)
    *  @return Vector with LabelIds.
    */
   LabelIdVector classify(DescDataArray descriptors, unsigned n,
-                         unsigned quorum = 7);
+                         unsigned quorum = 7,
+                         VoteWeighting weighting = MajorityVote);
 
   /**
    *  Get the label of the descriptors for the spcified ids.
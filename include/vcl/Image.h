@@ -156,6 +156,14 @@ public:
    */
   Image(Image &&img) noexcept;
 
+  /**
+   *  Move assignment, takes the data and the pending operations
+   *    of the rvalue Image object without copying them
+   *
+   *  @param img  An rvalue Image object
+   */
+  Image &operator=(Image &&img) noexcept;
+
   /**
    *  Assigns an Image object to this Image object by performing a deep
    *  copy operation
@@ -282,6 +290,12 @@ public:
    */
   int execute_operation();
 
+  /**
+   *  Performs the read of the image if it is the next operation, and
+   *    removes it from the operations (as the copy of an Image does)
+   */
+  void perform_read();
+
   /**
    *  @return Size of the operations vector
    */
@@ -345,6 +359,26 @@ public:
 
   void set_minimum_dimension(int dimension);
 
+  /**
+   *  Sets the tile extent (in pixels, in both dimensions) of the
+   *    TileDB array when the image is stored in TDB format. Smaller
+   *    tiles make reads of small areas cheaper.
+   *
+   *  @param extent  The tile extent, or -1 to derive it from the
+   *    dimensions of the image
+   */
+  void set_tile_extent(int extent);
+
+  /**
+   *  Sets the number of levels of the pyramid written with the image
+   *    when it is stored in TDB format. Each level is half the height
+   *    and width of the previous one; resizes read from the nearest
+   *    level instead of the full image.
+   *
+   *  @param levels  The number of levels, 0 for no pyramid
+   */
+  void set_pyramid_levels(int levels);
+
   /**
    *  Updates the number of operations completed
    */
@@ -511,6 +545,7 @@ private:
   // Forward declaration of Operation class, to be used of _operations
   // list
   class Operation;
+  class Read;
 
   // Forward declaration of ImageTest class, that is used for the unit
   // test to accesss private methods of this class
@@ -545,6 +580,13 @@ private:
   // Full path to image
   std::string _image_id;
 
+  // Tile extent of the TDB array the image is stored in (-1 if
+  // derived from the dimensions)
+  int _tile_extent = -1;
+
+  // Levels of the pyramid written with the TDB array
+  int _pyramid_levels = 0;
+
   // No blob stored. The file path is stored instead
   // and is accessed locally or over the network.
   bool _no_blob = false;
@@ -571,6 +613,31 @@ private:
 
   void perform_operations();
 
+  /**
+   *  Returns the read of a JPEG if it is the only operation
+   *    pending (a crop or resize can then be done by the read)
+   */
+  std::shared_ptr<Read> pending_jpeg_read();
+
+  /**
+   *  Fuses a flip or rotate operation with the flips and rotation
+   *    enqueued right before it, if any
+   *
+   *  @param op  The flip or rotate operation
+   *  @param label  The label of the operation
+   *  @return true if the operation was fused
+   */
+  bool fuse_transform(std::shared_ptr<Operation> op, const std::string &label);
+
+  /**
+   *  Copies the TDB data of an image. The copy of data not read yet
+   *    is not read either: only what it needs is read, when needed.
+   *
+   *  @param tdb  The TDB data, or NULL
+   *  @return The copy, or NULL
+   */
+  TDBImage *copy_tdb(TDBImage *tdb);
+
   /**
    *  Creates full path to Image with appropriate extension based
    *    on the VCL::Format
@@ -593,6 +660,7 @@ private:
     THRESHOLD,
     FLIP,
     ROTATE,
+    TRANSFORM,
     SYNCREMOTEOPERATION,
     REMOTEOPERATION,
     USEROPERATION
@@ -642,6 +710,19 @@ private:
   private:
     /** The full path to the object to read */
     std::string _fullpath;
+    /** Area of a crop fused with the read (empty if none) */
+    Rectangle _roi;
+    /** Size of a resize fused with the read (empty if none) */
+    cv::Size _size;
+
+    /**
+     *  Decodes an encoded JPEG, only the area of the crop and at a
+     *    reduced scale when the resize allows it
+     *
+     *  @param img  A pointer to the current Image object
+     *  @param data  The encoded image
+     */
+    void decode(Image *img, const std::vector<unsigned char> &data);
 
   public:
     /**
@@ -649,9 +730,24 @@ private:
      *
      *  @param filename  The full path to read from
      *  @param format  The format to read the image from
+     *  @param roi  The area of a crop done right after the read
+     *  @param size  The size of a resize done right after the read
+     *    (and the crop)
      *  @see Image.h for more details on ::Format
      */
-    Read(const std::string &filename, VCL::Format format);
+    Read(const std::string &filename, VCL::Format format,
+         const Rectangle &roi = Rectangle(), const cv::Size &size = cv::Size());
+
+    /**
+     *  Returns a copy of the read that also crops the image,
+     *    or resizes it
+     */
+    std::shared_ptr<Read> with_crop(const Rectangle &roi);
+    std::shared_ptr<Read> with_resize(const cv::Size &size);
+
+    Rectangle get_roi() const { return _roi; }
+    cv::Size get_size() const { return _size; }
+    bool is_fused() const { return !_roi.empty() || !_size.empty(); }
 
     /**
      *  Reads an image from the file system (based on the format
@@ -713,16 +809,22 @@ private:
     /** Gives the height and width to resize the image to */
     Rectangle _rect;
 
+    /** Area of a TDB image read to be resized (empty if whole) */
+    Rectangle _area;
+
   public:
     /**
      *  Constructor, sets the size to resize to and the format
      *
      *  @param rect  Contains height and width to resize to
      *  @param format  The current format of the image data
+     *  @param area  The area of a TDB image not read yet to resize,
+     *    empty for the whole image
      *  @see Image.h for more details on ::Format and Rectangle
      */
-    Resize(const Rectangle &rect, VCL::Format format)
-        : Operation(format), _rect(rect){};
+    Resize(const Rectangle &rect, VCL::Format format,
+           const Rectangle &area = Rectangle())
+        : Operation(format), _rect(rect), _area(area){};
 
     /**
      *  Resizes an image to the given dimensions
@@ -764,6 +866,8 @@ private:
      */
     void operator()(Image *img);
 
+    Rectangle get_rect() const { return _rect; };
+
     OperationType get_type() const { return OperationType::CROP; };
   };
 
@@ -827,6 +931,8 @@ private:
      */
     void operator()(Image *img);
 
+    int get_code() const { return _code; };
+
     OperationType get_type() const { return OperationType::FLIP; };
   };
 
@@ -858,9 +964,58 @@ private:
      */
     void operator()(Image *img);
 
+    float get_angle() const { return _angle; };
+    bool get_keep_size() const { return _keep_size; };
+
+    /**
+     *  Gets the matrix of the rotation of an image
+     *
+     *  @param size  The size of the image, set to the size of the
+     *    rotated image
+     *  @return The 2x3 affine matrix
+     */
+    cv::Mat get_matrix(cv::Size &size) const;
+
     OperationType get_type() const { return OperationType::ROTATE; };
   };
 
+  /*  *********************** */
+  /*   TRANSFORM OPERATION    */
+  /*  *********************** */
+  /**  Extends Operation, performs a run of flip and rotate operations
+   *    at once, with a single flip or affine transform of the image
+   */
+  class Transform : public Operation {
+  private:
+    /** The flips and at most one rotation, in order */
+    std::vector<std::shared_ptr<Operation>> _steps;
+
+  public:
+    /**
+     *  Constructor, sets the operations to perform
+     *
+     *  @param steps  The flip and rotate operations
+     *  @param format  The current format of the image data
+     *  @see Image.h for more details on Format
+     */
+    Transform(const std::vector<std::shared_ptr<Operation>> &steps,
+              VCL::Format format)
+        : Operation(format), _steps(steps){};
+
+    /**
+     *  Performs the operations
+     *
+     *  @param img  A pointer to the current Image object
+     */
+    void operator()(Image *img);
+
+    const std::vector<std::shared_ptr<Operation>> &get_steps() const {
+      return _steps;
+    };
+
+    OperationType get_type() const { return OperationType::TRANSFORM; };
+  };
+
   /*  *********************** */
   /*    SYNC OPERATION   */
   /*  *********************** */
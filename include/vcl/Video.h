@@ -31,6 +31,7 @@
 
 #pragma once
 
+#include <functional>
 #include <list>
 #include <memory> // For shared_ptr
 #include <string>
@@ -198,10 +199,23 @@ public:
   /**
    *  Gets mutiple frames from the video
    *
-   *  @return cv::Mat with the specified frame
+   *  @return cv::Mat of each frame of the list, in the same order
+   *  @see decode_frames()
    */
   std::vector<cv::Mat> get_frames(std::vector<unsigned> frame_list);
 
+  /**
+   *  Decodes the frames of frame_list in a single pass over the video,
+   *  in ascending frame order, and calls consumer(i, frame) with the
+   *  frame of frame_list[i] as each one is decoded, so it can be
+   *  processed while the next ones are decoded. The video is opened
+   *  once: it is only seeked when the next frame is far ahead, and
+   *  decoded forward otherwise. If key frame information is set, the
+   *  key frame decoder is used instead.
+   */
+  void decode_frames(const std::vector<unsigned> &frame_list,
+                     std::function<void(size_t, cv::Mat &)> consumer);
+
   /**
    *  Gets encoded Video data in a buffer
    *  Before calling this method, the store method must be called,
@@ -32,6 +32,7 @@
 #include <iostream>
 
 #include "BlobCommand.h"
+#include "ContentStore.h"
 #include "VDMSConfig.h"
 #include "defines.h"
 
@@ -55,12 +56,17 @@ int AddBlob::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
   int node_ref = get_value<int>(cmd, "_ref", query.get_available_reference());
 
   std::string format = "bin";
-  char binary_img_flag = 1;
-  VCL::Image img((void *)blob.data(), blob.size(), binary_img_flag);
-
   std::string blob_root = _storage_bin;
   VCL::Format blob_format = VCL::Format::BIN;
-  std::string file_name = VCL::create_unique(blob_root, format);
+
+  // A blob already stored is only linked (see ContentStore)
+  bool stored = false;
+  std::string file_name;
+  if (ContentStore::enabled())
+    file_name = ContentStore::reference(
+        blob_root, ContentStore::key(blob, ""), format, blob, stored);
+  else
+    file_name = VCL::create_unique(blob_root, format);
   // std::cout << "Blob was added in " <<_storage_bin << "\t"<< file_name <<
   // std::endl;
   Json::Value props = get_value<Json::Value>(cmd, "properties");
@@ -68,7 +74,14 @@ int AddBlob::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
 
   query.AddNode(node_ref, VDMS_BLOB_TAG, props, Json::Value());
 
-  img.store(file_name, blob_format);
+  if (!stored) {
+    char binary_img_flag = 1;
+    VCL::Image img((void *)blob.data(), blob.size(), binary_img_flag);
+    img.store(file_name, blob_format);
+
+    if (ContentStore::enabled())
+      ContentStore::commit(file_name);
+  }
 
   error["Blob_added"] = file_name;
 
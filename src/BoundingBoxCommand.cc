@@ -32,6 +32,7 @@
 #include <iostream>
 
 #include "BoundingBoxCommand.h"
+#include "ImageCache.h"
 #include "VDMSConfig.h"
 #include "defines.h"
 #include "vcl/Image.h"
@@ -278,34 +279,56 @@ Json::Value FindBoundingBox::construct_responses(
         }
 
         try {
-          std::string bucket_name = "";
-          if (_use_aws_storage) {
-            bucket_name = VDMSConfig::instance()->get_bucket_name();
+          // Only png and jpg are honored, the others keep the format of
+          // the image in disk (png for .tdb).
+          std::string requested_format =
+              get_value<std::string>(cmd, "format", "");
+          if (requested_format != "png" && requested_format != "jpg")
+            requested_format = "";
+
+          // Same key as a FindImage crop of the region
+          ImageCache *cache =
+              ImageCache::enabled() ? ImageCache::instance() : NULL;
+          std::string key;
+          std::vector<unsigned char> roi_enc;
+          if (cache) {
+            Json::Value crop;
+            crop["type"] = "crop";
+            crop["x"] = get_value<int>(coords, "x");
+            crop["y"] = get_value<int>(coords, "y");
+            crop["width"] = get_value<int>(coords, "w");
+            crop["height"] = get_value<int>(coords, "h");
+            Json::Value ops;
+            ops.append(crop);
+            key = ImageCache::key(im_path, ops, requested_format);
           }
 
-          VCL::Image img(im_path, bucket_name);
+          if (!cache || !cache->lookup(key, roi_enc)) {
+            std::string bucket_name = "";
+            if (_use_aws_storage) {
+              bucket_name = VDMSConfig::instance()->get_bucket_name();
+            }
 
-          img.crop(VCL::Rectangle(
-              get_value<int>(coords, "x"), get_value<int>(coords, "y"),
-              get_value<int>(coords, "w"), get_value<int>(coords, "h")));
+            VCL::Image img(im_path, bucket_name);
 
-          VCL::Format format = img.get_image_format() != VCL::Format::TDB
-                                   ? img.get_image_format()
-                                   : VCL::Format::PNG;
+            img.crop(VCL::Rectangle(
+                get_value<int>(coords, "x"), get_value<int>(coords, "y"),
+                get_value<int>(coords, "w"), get_value<int>(coords, "h")));
 
-          if (cmd.isMember("format")) {
-            std::string requested_format =
-                get_value<std::string>(cmd, "format");
+            VCL::Format format = img.get_image_format() != VCL::Format::TDB
+                                     ? img.get_image_format()
+                                     : VCL::Format::PNG;
 
             if (requested_format == "png") {
               format = VCL::Format::PNG;
             } else if (requested_format == "jpg") {
               format = VCL::Format::JPG;
             }
-          }
 
-          std::vector<unsigned char> roi_enc;
-          roi_enc = img.get_encoded_image(format);
+            roi_enc = img.get_encoded_image(format);
+            if (cache && !roi_enc.empty())
+              cache->insert(key, im_path, roi_enc);
+          }
 
           if (!roi_enc.empty()) {
             std::string *img_str = query_res.add_blobs();
@@ -0,0 +1,261 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <openssl/evp.h>
+
+#include "ContentStore.h"
+#include "VDMSConfig.h"
+#include "vcl/Exception.h"
+#include "vcl/utils.h"
+
+#define CAS_DIR "cas"
+
+namespace fs = std::filesystem;
+
+using namespace VDMS;
+
+bool ContentStore::_enabled = false;
+
+bool ContentStore::init() {
+  bool enabled = VDMSConfig::instance()->get_bool_value(
+      "content_addressed_storage", false);
+
+  // Objects are shared through hard links, in the local file system
+  if (enabled && VDMSConfig::instance()->get_aws_flag()) {
+    std::cerr << "ContentStore: not available with AWS storage" << std::endl;
+    enabled = false;
+  }
+
+  _enabled = enabled;
+  return _enabled;
+}
+
+static std::string sha256(const std::string &data) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int size = 0;
+  if (!EVP_Digest(data.data(), data.size(), digest, &size, EVP_sha256(),
+                  nullptr))
+    throw VCLException(UndefinedException, "SHA-256 failed");
+
+  std::ostringstream hex;
+  hex << std::hex << std::setfill('0');
+  for (unsigned int i = 0; i < size; ++i)
+    hex << std::setw(2) << (int)digest[i];
+  return hex.str();
+}
+
+// <sha256 of blob>-<size>[-<sha256 of salt>]
+std::string ContentStore::key(const std::string &blob,
+                              const std::string &salt) {
+  std::ostringstream key;
+  key << sha256(blob) << '-' << std::hex << blob.size();
+
+  if (!salt.empty())
+    key << '-' << sha256(salt);
+
+  return key.str();
+}
+
+bool ContentStore::image_salt(const Json::Value &ops,
+                              const std::string &format, std::string &salt) {
+  for (auto &op : ops) {
+    const std::string type = op["type"].asString();
+    if (type != "threshold" && type != "resize" && type != "crop" &&
+        type != "flip" && type != "rotate")
+      return false;
+  }
+
+  // jsoncpp writes the members of an object sorted by name
+  Json::FastWriter writer;
+  salt = format;
+  if (!ops.isNull())
+    salt += writer.write(ops);
+
+  return true;
+}
+
+std::string ContentStore::object_path(const std::string &root,
+                                      const std::string &key,
+                                      const std::string &ext) {
+  std::string dir = root;
+  if (dir.back() != '/')
+    dir += '/';
+
+  return dir + CAS_DIR "/" + key.substr(0, 2) + "/" + key + "." + ext;
+}
+
+// Whether s[begin, end) is a non-empty run of lowercase hex digits
+static bool is_hex(const std::string &s, size_t begin, size_t end) {
+  if (begin >= end || end > s.size())
+    return false;
+
+  for (size_t i = begin; i < end; ++i) {
+    if (!std::isdigit((unsigned char)s[i]) && (s[i] < 'a' || s[i] > 'f'))
+      return false;
+  }
+  return true;
+}
+
+// References are named <root>/cas/<xx>/<key>.<id>.<ext>, with the key
+// as built by key(), xx its first two digits and a hex id. Nothing else
+// is a reference, so that release() never removes any other file.
+std::string ContentStore::object_of(const std::string &path) {
+  fs::path file(path);
+  fs::path dir = file.parent_path();
+  if (dir.parent_path().filename() != CAS_DIR)
+    return "";
+
+  // <key>.<id>.<ext>
+  std::string name = file.filename().string();
+  size_t id_start = name.find('.');
+  if (id_start == std::string::npos)
+    return "";
+  size_t id_end = name.find('.', id_start + 1);
+  if (id_end == std::string::npos || id_end + 1 == name.size() ||
+      !is_hex(name, id_start + 1, id_end))
+    return "";
+
+  // <sha256>-<size>[-<sha256>]
+  std::string key = name.substr(0, id_start);
+  if (key.size() < 66 || !is_hex(key, 0, 64) || key[64] != '-')
+    return "";
+  size_t size_end = std::min(key.find('-', 65), key.size());
+  if (!is_hex(key, 65, size_end))
+    return "";
+  if (size_end < key.size() &&
+      (key.size() != size_end + 65 || !is_hex(key, size_end + 1, key.size())))
+    return "";
+
+  if (dir.filename() != key.substr(0, 2))
+    return "";
+
+  size_t slash = path.size() - name.size();
+  return path.substr(0, slash + id_start) + path.substr(slash + id_end);
+}
+
+bool ContentStore::same_content(const std::string &path,
+                                const std::string &content) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file || (size_t)file.tellg() != content.size())
+    return false;
+  file.seekg(0);
+
+  char buffer[1 << 16];
+  size_t offset = 0;
+  while (offset < content.size()) {
+    size_t n = std::min(sizeof(buffer), content.size() - offset);
+    if (!file.read(buffer, n) ||
+        std::memcmp(buffer, content.data() + offset, n) != 0)
+      return false;
+    offset += n;
+  }
+  return true;
+}
+
+std::string ContentStore::reference(const std::string &root,
+                                    const std::string &key,
+                                    const std::string &ext,
+                                    const std::string &content, bool &stored) {
+  std::string object = object_path(root, key, ext);
+  std::string prefix = object.substr(0, object.size() - ext.size());
+
+  std::error_code ec;
+  fs::create_directories(fs::path(object).parent_path(), ec);
+
+  while (true) {
+    std::ostringstream id;
+    id << std::hex << VCL::get_uint64();
+    std::string path = prefix + id.str() + "." + ext;
+
+    if (link(object.c_str(), path.c_str()) == 0) {
+      // The link holds the content being compared, even if the object
+      // is released meanwhile. Other content under the same key is
+      // never shared: the caller writes its own copy.
+      if (!content.empty() && !same_content(path, content)) {
+        unlink(path.c_str());
+        std::cerr << "ContentStore: content of " << object
+                  << " differs from its key" << std::endl;
+        stored = false;
+        return path;
+      }
+      stored = true;
+      return path;
+    }
+
+    if (errno == EEXIST)
+      continue;
+
+    // Not stored yet (or being released): the caller writes it
+    if (VCL::exists(path))
+      continue;
+
+    stored = false;
+    return path;
+  }
+}
+
+void ContentStore::commit(const std::string &path) {
+  std::string object = object_of(path);
+  if (object.empty())
+    return;
+
+  // If another copy was committed meanwhile, this one is left
+  // unshared: it is still removed with its reference.
+  if (link(path.c_str(), object.c_str()) != 0 && errno != EEXIST) {
+    std::cerr << "ContentStore: cannot store " << object << ": "
+              << strerror(errno) << std::endl;
+  }
+}
+
+// Also done when the store is disabled, for the references left by a
+// previous run that had it enabled.
+void ContentStore::release(const std::string &path) {
+  std::string object = object_of(path);
+  if (object.empty())
+    return;
+
+  // A reference created after the check keeps the content through its
+  // own link, even if the object is removed.
+  struct stat st;
+  if (stat(object.c_str(), &st) == 0 && st.st_nlink == 1)
+    unlink(object.c_str());
+}
@@ -0,0 +1,115 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <string>
+
+#include <jsoncpp/json/json.h>
+
+namespace VDMS {
+
+/**
+ *  Content-addressed storage of the files of images and blobs, enabled
+ *  with "content_addressed_storage" (local storage only). The content
+ *  of a file is stored once, as an object at a path derived from its
+ *  hash:
+ *
+ *      <root>/cas/<2 hex>/<key>.<ext>
+ *
+ *  and each node refers to it through its own hard link next to it,
+ *  <key>.<id>.<ext>. The number of links of the object is its
+ *  reference count: removing the file of a node, as the deletion paths
+ *  already do, drops one reference, and release() removes the object
+ *  once no node refers to it. Content that is already stored is linked
+ *  instead of being encoded and written again.
+ */
+class ContentStore {
+  static bool _enabled;
+
+  static std::string object_path(const std::string &root,
+                                 const std::string &key,
+                                 const std::string &ext);
+
+  // Object of the reference at path, empty if path is not a reference
+  static std::string object_of(const std::string &path);
+
+  // Whether the file at path holds exactly content
+  static bool same_content(const std::string &path,
+                           const std::string &content);
+
+public:
+  static bool init();
+
+  static bool enabled() { return _enabled; }
+
+  /**
+   *  Key of the content made from blob by the transformation described
+   *  by salt (empty if the blob is stored as is): the SHA-256 of the
+   *  blob, its size and the SHA-256 of salt, separated by '-'.
+   */
+  static std::string key(const std::string &blob, const std::string &salt);
+
+  /**
+   *  Sets salt for the key of an image made from a blob by the
+   *  operations (null if none) and encoded in format. Returns false if
+   *  the operations may not give the same image each time (remote,
+   *  user-defined or custom operations): the image is not
+   *  deduplicated then.
+   */
+  static bool image_salt(const Json::Value &ops, const std::string &format,
+                         std::string &salt);
+
+  /**
+   *  Creates a new reference to the content of key, under root.
+   *  Returns its path, and sets stored to whether it is linked to the
+   *  stored content. Otherwise, nothing is at the path yet: the caller
+   *  writes the content there and calls commit().
+   *  content is the bytes the stored content must be equal to, when
+   *  they are known before they are written (a blob or an image stored
+   *  as is): a stored object that differs is not linked. It is empty
+   *  for transformed images, whose key then relies on SHA-256 alone.
+   */
+  static std::string reference(const std::string &root,
+                               const std::string &key, const std::string &ext,
+                               const std::string &content, bool &stored);
+
+  /**
+   *  Makes the content just written at the reference path the stored
+   *  content of its key, for the references created after it.
+   */
+  static void commit(const std::string &path);
+
+  /**
+   *  Called once the file at path is removed: removes its object when
+   *  no other reference is left. Does nothing for other files.
+   */
+  static void release(const std::string &path);
+};
+}; // namespace VDMS
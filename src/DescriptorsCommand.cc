@@ -29,6 +29,7 @@
  *
  */
 
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
 
@@ -36,12 +37,100 @@
 #include "ExceptionsCommand.h"
 #include "VDMSConfig.h"
 #include "defines.h"
+#include "util.h" // PMGD util
 
 #include "vcl/utils.h"
 
 using namespace VDMS;
 namespace fs = std::filesystem;
 
+namespace {
+
+// Parses a time written as for PMGD, which returns times in results
+// as strings
+PMGD::Time to_time(const std::string &str) {
+  struct tm tm_e;
+  int hr, min;
+  unsigned long usec;
+  PMGD::string_to_tm(str, &tm_e, &usec, &hr, &min);
+  return PMGD::Time(&tm_e, usec, hr, min);
+}
+
+// Evaluates "op value" on a property, for the types PMGD returns.
+// Times ({"_date": ...} values) are compared as points in time.
+bool match_predicate(const Json::Value &prop, const std::string &op,
+                     const Json::Value &value) {
+  int cmp;
+  if (value.isObject() && value.isMember("_date")) {
+    if (!prop.isString() || !value["_date"].isString())
+      return false;
+    try {
+      PMGD::Time a = to_time(prop.asString());
+      PMGD::Time b = to_time(value["_date"].asString());
+      cmp = (b < a) - (a < b);
+    } catch (PMGD::Exception &e) {
+      return false;
+    }
+  } else if (prop.isInt64() && value.isInt64()) {
+    long long a = prop.asInt64(), b = value.asInt64();
+    cmp = (a > b) - (a < b);
+  } else if (prop.isNumeric() && value.isNumeric()) {
+    double a = prop.asDouble(), b = value.asDouble();
+    cmp = (a > b) - (a < b);
+  } else if (prop.isBool() && value.isBool()) {
+    cmp = int(prop.asBool()) - int(value.asBool());
+  } else if (prop.isString() && value.isString()) {
+    cmp = prop.asString().compare(value.asString());
+  } else {
+    return false;
+  }
+
+  if (op == "==")
+    return cmp == 0;
+  if (op == "!=")
+    return cmp != 0;
+  if (op == "<")
+    return cmp < 0;
+  if (op == "<=")
+    return cmp <= 0;
+  if (op == ">")
+    return cmp > 0;
+  if (op == ">=")
+    return cmp >= 0;
+  return false;
+}
+
+// Whether an entity matches all the constraints, written as for PMGD:
+// [op, value], [op, [values...]] (any of them) or [op, value, op, value].
+bool match_constraints(const Json::Value &entity,
+                       const Json::Value &constraints) {
+  for (const auto &key : constraints.getMemberNames()) {
+    const Json::Value &predicate = constraints[key];
+    if (!entity.isMember(key))
+      return false;
+
+    const Json::Value &prop = entity[key];
+    const std::string op = predicate[0].asString();
+
+    if (predicate.size() == 2 && predicate[1].isArray()) {
+      bool any = false;
+      for (const auto &value : predicate[1])
+        any = any || match_predicate(prop, op, value);
+      if (!any)
+        return false;
+    } else if (predicate.size() == 2) {
+      if (!match_predicate(prop, op, predicate[1]))
+        return false;
+    } else if (!match_predicate(prop, op, predicate[1]) ||
+               !match_predicate(prop, predicate[2].asString(), predicate[3])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
 DescriptorsCommand::DescriptorsCommand(const std::string &cmd_name)
     : RSCommand(cmd_name) {
   _dm = DescriptorsManager::instance();
@@ -109,16 +198,58 @@ std::string DescriptorsCommand::get_set_path(PMGDQuery &query_tx,
     std::string set_path = ent[VDMS_DESC_SET_PATH_PROP].asString();
     dim = ent[VDMS_DESC_SET_DIM_PROP].asInt();
     _desc_set_dims[set_name] = dim;
+    _desc_set_binary[set_name] =
+        is_binary_engine(ent[VDMS_DESC_SET_ENGIN_PROP].asString());
     _desc_set_locator[set_name] = set_path;
     return set_path;
   }
   return "";
 }
 
+bool DescriptorsCommand::is_binary_engine(const std::string &engine) {
+  return engine == "FaissBinaryFlat" || engine == "FaissBinaryIVF" ||
+         engine == "FaissBinaryHNSW";
+}
+
+size_t DescriptorsCommand::blob_element_size(const Json::Value &cmd) {
+  std::string format = get_value<std::string>(cmd, "blob_format", "fp32");
+  return format == "fp16" || format == "bf16" ? sizeof(uint16_t)
+                                              : sizeof(float);
+}
+
+// Size in bytes of a descriptor of the set in the blob of cmd: dim
+// elements of the blob format, or dim bits for binary sets, which only
+// take fp32 blobs (0 otherwise). get_set_path() must have been called
+// for the set.
+size_t DescriptorsCommand::descriptor_size(const Json::Value &cmd,
+                                           const std::string &set_name,
+                                           int dim) {
+  auto element = _desc_set_binary.find(set_name);
+  if (element != _desc_set_binary.end() && element->second)
+    return blob_element_size(cmd) == sizeof(float) ? dim / 8 : 0;
+  return blob_element_size(cmd) * dim;
+}
+
+float *DescriptorsCommand::blob_floats(const Json::Value &cmd,
+                                       const std::string &blob,
+                                       std::vector<float> &buffer) {
+  std::string format = get_value<std::string>(cmd, "blob_format", "fp32");
+  if (format != "fp16" && format != "bf16")
+    return (float *)blob.data();
+
+  size_t n = blob.size() / sizeof(uint16_t);
+  buffer.resize(n);
+  if (format == "fp16")
+    VCL::fp16_to_float((const uint16_t *)blob.data(), n, buffer.data());
+  else
+    VCL::bf16_to_float((const uint16_t *)blob.data(), n, buffer.data());
+  return buffer.data();
+}
+
 bool DescriptorsCommand::check_blob_size(const std::string &blob,
-                                         const int dimensions,
+                                         const size_t desc_size,
                                          const long n_desc) {
-  return (blob.size() / sizeof(float) / dimensions == n_desc);
+  return desc_size > 0 && blob.size() / desc_size == n_desc;
 }
 // FindDescriptorSet Method
 FindDescriptorSet::FindDescriptorSet()
@@ -178,13 +309,36 @@ Json::Value FindDescriptorSet::construct_responses(
   const std::string set_name = cmd["set"].asString();
   const std::string set_path = _storage_sets + "/" + set_name;
   try {
-    VCL::DescriptorSet *desc_set = _dm->get_descriptors_handler(set_path);
+    DescriptorSetHandle desc_set = _dm->get_descriptors_handler(set_path);
     resp["status"] = RSCommand::Success;
-    ret[_cmd_name] = resp;
 
     if (cmd.isMember("storeIndex") && cmd["storeIndex"].asBool()) {
       desc_set->store();
     }
+
+    // Training runs in the background, later calls report its progress
+    if (get_value<bool>(cmd, "train", false)) {
+      desc_set->train_async();
+    }
+
+    float progress = desc_set->train_progress();
+    resp["trained"] = desc_set->is_trained();
+    if (progress >= 0) {
+      resp["training_progress"] = progress;
+    }
+
+    if (get_value<bool>(cmd, "metrics", false)) {
+      DescriptorSetStats stats = _dm->get_stats(set_path);
+      Json::Value metrics;
+      metrics["resident"] = stats.resident;
+      metrics["memory"] = Json::UInt64(stats.memory);
+      metrics["hits"] = Json::Int64(stats.hits);
+      metrics["loads"] = Json::Int64(stats.loads);
+      metrics["evictions"] = Json::Int64(stats.evictions);
+      resp["metrics"] = metrics;
+    }
+
+    ret[_cmd_name] = resp;
   } catch (VCL::Exception e) {
     print_exception(e);
     resp["status"] = RSCommand::Error;
@@ -228,6 +382,12 @@ int AddDescriptorSet::construct_protobuf(PMGDQuery &query,
   props[VDMS_DESC_SET_DIM_PROP] = cmd["dimensions"].asInt();
   props[VDMS_DESC_SET_PATH_PROP] = desc_set_path;
   props[VDMS_DESC_SET_ENGIN_PROP] = cmd["engine"].asString();
+  if (is_binary_engine(cmd["engine"].asString()) &&
+      cmd["dimensions"].asInt() % 8 != 0) {
+    error["info"] = "Binary descriptors must have a multiple of 8 bits";
+    error["status"] = RSCommand::Error;
+    return -1;
+  }
   if (props[VDMS_DESC_SET_ENGIN_PROP] == "Flinng") {
     if (cmd.isMember("flinng_num_rows"))
       _flinng_num_rows = cmd["flinng_num_rows"].asInt();
@@ -289,7 +449,11 @@ Json::Value AddDescriptorSet::construct_responses(
   std::string desc_set_path = _storage_sets + "/" + set_name;
 
   std::string metric_str = get_value<std::string>(cmd, "metric", "L2");
-  VCL::DistanceMetric metric = metric_str == "L2" ? VCL::L2 : VCL::IP;
+  VCL::DistanceMetric metric = VCL::L2;
+  if (metric_str == "IP")
+    metric = VCL::IP;
+  else if (metric_str == "Cosine")
+    metric = VCL::Cosine;
 
   // For now, we use the default faiss index.
   std::string eng_str = get_value<std::string>(cmd, "engine", "FaissFlat");
@@ -306,9 +470,19 @@ Json::Value AddDescriptorSet::construct_responses(
     _eng = VCL::Flinng;
   else if (eng_str == "FaissHNSWFlat")
     _eng = VCL::FaissHNSWFlat;
+  else if (eng_str == "FaissBinaryFlat")
+    _eng = VCL::FaissBinaryFlat;
+  else if (eng_str == "FaissBinaryIVF")
+    _eng = VCL::FaissBinaryIVF;
+  else if (eng_str == "FaissBinaryHNSW")
+    _eng = VCL::FaissBinaryHNSW;
   else
     throw ExceptionCommand(DescriptorSetError, "Engine not supported");
 
+  // Binary sets always use the Hamming distance
+  if (is_binary_engine(eng_str))
+    metric = VCL::Hamming;
+
   // We can probably set up a mechanism
   // to fix a broken link when detected later, same with images.
   VCL::DescriptorParams *param = nullptr;
@@ -316,6 +490,7 @@ Json::Value AddDescriptorSet::construct_responses(
     param = new VCL::DescriptorParams(_flinng_num_rows, _flinng_cells_per_row,
                                       _flinng_num_hash_tables,
                                       _flinng_hashes_per_table);
+    param->num_shards = get_value<int>(cmd, "shards", 1);
     VCL::DescriptorSet desc_set(desc_set_path, dimensions, _eng, metric, param);
 
     if (_use_aws_storage) {
@@ -354,7 +529,7 @@ AddDescriptor::AddDescriptor() : DescriptorsCommand("AddDescriptor") {
 }
 
 // update to handle multiple descriptors at a go
-long AddDescriptor::insert_descriptor(const std::string &blob,
+long AddDescriptor::insert_descriptor(float *descriptors,
                                       const std::string &set_path, int nr_desc,
                                       const std::string &label,
                                       Json::Value &error) {
@@ -362,15 +537,15 @@ long AddDescriptor::insert_descriptor(const std::string &blob,
 
   try {
 
-    VCL::DescriptorSet *desc_set = _dm->get_descriptors_handler(set_path);
+    DescriptorSetHandle desc_set = _dm->get_descriptors_handler(set_path);
 
     if (!label.empty()) {
       long label_id = desc_set->get_label_id(label);
       long *label_ptr = &label_id;
-      id_first = desc_set->add((float *)blob.data(), nr_desc, label_ptr);
+      id_first = desc_set->add(descriptors, nr_desc, label_ptr);
 
     } else {
-      id_first = desc_set->add((float *)blob.data(), nr_desc);
+      id_first = desc_set->add(descriptors, nr_desc);
     }
 
     if (output_vcl_timing) {
@@ -436,10 +611,10 @@ int AddDescriptor::add_single_descriptor(PMGDQuery &query,
     return -1;
   }
 
-  if (blob.length() / 4 != dim) {
+  if (!check_blob_size(blob, descriptor_size(cmd, set_name, dim), 1)) {
     std::cerr << "AddDescriptor::insert_descriptor: ";
     std::cerr << "Dimensions mismatch: ";
-    std::cerr << blob.length() / 4 << " " << dim << std::endl;
+    std::cerr << blob.length() << " bytes, " << dim << std::endl;
     error["info"] = "Blob Dimensions Mismatch";
     return -1;
   }
@@ -451,7 +626,9 @@ int AddDescriptor::add_single_descriptor(PMGDQuery &query,
     retrieve_aws_descriptorSet(set_path);
   }
 
-  long id = insert_descriptor(blob, set_path, 1, label, error);
+  std::vector<float> buffer;
+  long id = insert_descriptor(blob_floats(cmd, blob, buffer), set_path, 1,
+                              label, error);
 
   if (id < 0) {
     error["status"] = RSCommand::Error;
@@ -519,7 +696,6 @@ int AddDescriptor::add_descriptor_batch(PMGDQuery &query,
                                         const std::string &blob, int grp_id,
                                         Json::Value &error) {
 
-  const int FOUR_BYTE_INT = 4;
   int expected_blb_size;
   int nr_expected_descs;
   int dimensions;
@@ -550,10 +726,11 @@ int AddDescriptor::add_descriptor_batch(PMGDQuery &query,
     retrieve_aws_descriptorSet(set_path);
   }
 
-  // Note dimensionse are based on a 32 bit integer, hence the /4 math on size
-  // as the string blob is sized in 8 bit ints.
+  // Descriptors are dimensions floats (or halves, with blob_format), or
+  // dimensions bits in binary sets, and the string blob is sized in bytes.
   nr_expected_descs = prop_list.size();
-  expected_blb_size = nr_expected_descs * dimensions * FOUR_BYTE_INT;
+  expected_blb_size =
+      nr_expected_descs * descriptor_size(cmd, set_name, dimensions);
 
   // Verify length of input is matching expectations
   if (blob.length() != expected_blb_size) {
@@ -565,7 +742,9 @@ int AddDescriptor::add_descriptor_batch(PMGDQuery &query,
     return -1;
   }
 
-  long id = insert_descriptor(blob, set_path, nr_expected_descs, label, error);
+  std::vector<float> buffer;
+  long id = insert_descriptor(blob_floats(cmd, blob, buffer), set_path,
+                              nr_expected_descs, label, error);
 
   if (id < 0) {
     error["status"] = RSCommand::Error;
@@ -699,7 +878,6 @@ int ClassifyDescriptor::construct_protobuf(PMGDQuery &query,
   // Query set node
   query.QueryNode(get_value<int>(cmd, "_ref", -1), VDMS_DESC_SET_TAG, link,
                   constraints, results, unique);
-  _dm->flush();
 
   return 0;
 }
@@ -739,15 +917,42 @@ Json::Value ClassifyDescriptor::construct_responses(
       assert(ent.isMember(VDMS_DESC_SET_PATH_PROP));
       std::string set_path = ent[VDMS_DESC_SET_PATH_PROP].asString();
       try {
-        VCL::DescriptorSet *set = _dm->get_descriptors_handler(set_path);
+        // Classifies against the set in memory, which is only written
+        // by checkpoints (or FindDescriptorSet with storeIndex).
+        DescriptorSetHandle set = _dm->get_descriptors_handler(set_path);
+
+        size_t desc_size = descriptor_size(cmd, cmd["set"].asString(),
+                                           set->get_dimensions());
+        if (desc_size == 0 || blob.size() % desc_size) {
+          classifyDesc["status"] = RSCommand::Error;
+          classifyDesc["info"] = "Blob (required) is null or size invalid";
+          flag_error = true;
+          break;
+        }
+        unsigned n_desc = blob.size() / desc_size;
+
+        unsigned quorum = get_value<int>(cmd, "k_neighbors", 7);
+        VCL::VoteWeighting weighting =
+            get_value<std::string>(cmd, "weighting", "majority") == "distance"
+                ? VCL::DistanceWeightedVote
+                : VCL::MajorityVote;
 
-        auto labels = set->classify((float *)blob.data(), 1);
+        std::vector<float> buffer;
+        auto labels = set->classify(blob_floats(cmd, blob, buffer), n_desc,
+                                    quorum, weighting);
 
         if (labels.size() == 0) {
           classifyDesc["info"] = "No labels, cannot classify";
           classifyDesc["status"] = RSCommand::Error;
         } else {
-          classifyDesc["label"] = (set->label_id_to_string(labels)).at(0);
+          auto str_labels = set->label_id_to_string(labels);
+          classifyDesc["label"] = str_labels.at(0);
+
+          // One label per descriptor in the blob
+          if (n_desc > 1) {
+            for (auto &label : str_labels)
+              classifyDesc["labels"].append(label);
+          }
         }
       } catch (VCL::Exception e) {
         print_exception(e);
@@ -770,12 +975,221 @@ Json::Value ClassifyDescriptor::construct_responses(
   return ret;
 }
 
+// DeleteDescriptor Methods
+
+DeleteDescriptor::DeleteDescriptor() : DescriptorsCommand("DeleteDescriptor") {}
+
+int DeleteDescriptor::construct_protobuf(PMGDQuery &query,
+                                         const Json::Value &jsoncmd,
+                                         const std::string &blob, int grp_id,
+                                         Json::Value &error) {
+  const Json::Value &cmd = jsoncmd[_cmd_name];
+
+  const std::string set_name = cmd["set"].asString();
+
+  int dimensions;
+  const std::string set_path = get_set_path(query, set_name, dimensions);
+  std::string desc_id_prop_name =
+      VDMS_DESC_ID_PROP + std::string("_") + set_name;
+
+  if (set_path.empty()) {
+    error["status"] = RSCommand::Error;
+    error["info"] = "DescriptorSet Not Found!";
+    return -1;
+  }
+
+  Json::Value results_set;
+  Json::Value list_arr_set;
+  list_arr_set.append(VDMS_DESC_SET_PATH_PROP);
+  list_arr_set.append(VDMS_DESC_SET_DIM_PROP);
+  results_set["list"] = list_arr_set;
+
+  Json::Value constraints_set;
+  Json::Value name_arr;
+  name_arr.append("==");
+  name_arr.append(set_name);
+  constraints_set[VDMS_DESC_SET_NAME_PROP] = name_arr;
+
+  Json::Value constraints = cmd["constraints"];
+  if (constraints.isMember("_label")) {
+    constraints[VDMS_DESC_LABEL_PROP] = constraints["_label"];
+    constraints.removeMember("_label");
+  }
+  if (constraints.isMember("_id")) {
+    constraints[desc_id_prop_name.c_str()] = constraints["_id"];
+    constraints.removeMember("_id");
+  }
+
+  // PMGD removes the nodes listed by the last query of the transaction
+  // when it has a _deletion constraint. The set node is never removed.
+  constraints["_deletion"].append("==");
+  constraints["_deletion"].append(1);
+
+  Json::Value results;
+  results["list"].append(desc_id_prop_name);
+
+  int ref_set = query.get_available_reference();
+
+  // Query for the set
+  query.QueryNode(ref_set, VDMS_DESC_SET_TAG, Json::nullValue,
+                  constraints_set, results_set, true, true);
+
+  Json::Value link_to_set;
+  link_to_set["ref"] = ref_set;
+
+  // Query (and remove) the descriptors of that set
+  // that match the user-defined constraints
+  query.QueryNode(-1, VDMS_DESC_TAG, link_to_set, constraints, results, false,
+                  false);
+
+  return 0;
+}
+
+Json::Value DeleteDescriptor::construct_responses(
+    Json::Value &json_responses, const Json::Value &json,
+    protobufs::queryMessage &query_res, const std::string &blob) {
+  const Json::Value &cmd = json[_cmd_name];
+  Json::Value deleteDesc;
+  Json::Value ret;
+
+  const std::string set_name = cmd["set"].asString();
+  std::string desc_id_prop_name =
+      VDMS_DESC_ID_PROP + std::string("_") + set_name;
+
+  if (json_responses.size() != 2 ||
+      !json_responses[0].isMember("entities")) {
+    deleteDesc["status"] = RSCommand::Error;
+    deleteDesc["info"] = "Not Found!";
+    ret[_cmd_name] = deleteDesc;
+    return ret;
+  }
+
+  const Json::Value &set = json_responses[0]["entities"][0];
+  assert(set.isMember(VDMS_DESC_SET_PATH_PROP));
+  std::string set_path = set[VDMS_DESC_SET_PATH_PROP].asString();
+
+  deleteDesc = json_responses[1];
+
+  if (deleteDesc["status"] != 0) {
+    deleteDesc["status"] = RSCommand::Error;
+    deleteDesc["info"] = "Descriptors Not Found";
+    ret[_cmd_name] = deleteDesc;
+    return ret;
+  }
+
+  std::vector<long> ids;
+  for (auto &ent : deleteDesc["entities"]) {
+    ids.push_back(ent[desc_id_prop_name].asInt64());
+  }
+
+  try {
+    // The removed descriptors are skipped by searches right away,
+    // and dropped from the index by the next compaction.
+    if (!ids.empty()) {
+      DescriptorSetHandle desc_set = _dm->get_descriptors_handler(set_path);
+      desc_set->remove(ids.data(), ids.size());
+    }
+  } catch (VCL::Exception e) {
+    print_exception(e);
+    deleteDesc["status"] = RSCommand::Error;
+    deleteDesc["info"] = "VCL Descriptors Exception";
+    ret[_cmd_name] = deleteDesc;
+    return ret;
+  }
+
+  deleteDesc.removeMember("entities");
+  deleteDesc["count"] = Json::Int64(ids.size());
+  deleteDesc["status"] = RSCommand::Success;
+
+  ret[_cmd_name] = deleteDesc;
+  return ret;
+}
+
+// UpdateDescriptor Methods
+
+UpdateDescriptor::UpdateDescriptor() : DescriptorsCommand("UpdateDescriptor") {}
+
+int UpdateDescriptor::construct_protobuf(PMGDQuery &query,
+                                         const Json::Value &jsoncmd,
+                                         const std::string &blob, int grp_id,
+                                         Json::Value &error) {
+  const Json::Value &cmd = jsoncmd[_cmd_name];
+
+  const std::string set_name = cmd["set"].asString();
+  long id = cmd["_id"].asInt64();
+
+  int dimensions;
+  const std::string set_path = get_set_path(query, set_name, dimensions);
+  std::string desc_id_prop_name =
+      VDMS_DESC_ID_PROP + std::string("_") + set_name;
+
+  if (set_path.empty()) {
+    error["status"] = RSCommand::Error;
+    error["info"] = "DescriptorSet Not Found!";
+    return -1;
+  }
+
+  if (!check_blob_size(blob, descriptor_size(cmd, set_name, dimensions), 1)) {
+    error["status"] = RSCommand::Error;
+    error["info"] = "Blob (required) is null or size invalid";
+    return -1;
+  }
+
+  Json::Value props = get_value<Json::Value>(cmd, "properties");
+
+  try {
+    DescriptorSetHandle desc_set = _dm->get_descriptors_handler(set_path);
+    std::vector<float> buffer;
+    float *descriptor = blob_floats(cmd, blob, buffer);
+
+    // The id stays the same, so the node only needs its properties
+    if (cmd.isMember("label")) {
+      std::string label = cmd["label"].asString();
+      long label_id = desc_set->get_label_id(label);
+      desc_set->update(id, descriptor, &label_id);
+      props[VDMS_DESC_LABEL_PROP] = label;
+    } else {
+      desc_set->update(id, descriptor);
+    }
+
+    if (output_vcl_timing) {
+      desc_set->timers.print_map_runtimes();
+    }
+    desc_set->timers.clear_all_timers();
+  } catch (VCL::Exception e) {
+    print_exception(e);
+    error["status"] = RSCommand::Error;
+    error["info"] = "VCL Descriptors Exception";
+    return -1;
+  }
+
+  Json::Value constraints;
+  constraints[desc_id_prop_name].append("==");
+  constraints[desc_id_prop_name].append(Json::Int64(id));
+
+  query.UpdateNode(-1, VDMS_DESC_TAG, props, cmd["remove_props"], constraints,
+                   true);
+
+  return 0;
+}
+
+Json::Value UpdateDescriptor::construct_responses(
+    Json::Value &json_responses, const Json::Value &json,
+    protobufs::queryMessage &query_res, const std::string &blob) {
+  Json::Value resp = check_responses(json_responses);
+
+  Json::Value ret;
+  ret[_cmd_name] = resp;
+  return ret;
+}
+
 // FindDescriptors Methods
 
 FindDescriptor::FindDescriptor() : DescriptorsCommand("FindDescriptor") {}
 
 bool FindDescriptor::need_blob(const Json::Value &cmd) {
-  return cmd[_cmd_name].isMember("k_neighbors");
+  return cmd[_cmd_name].isMember("k_neighbors") ||
+         cmd[_cmd_name].isMember("radius");
 }
 
 int FindDescriptor::construct_protobuf(PMGDQuery &query,
@@ -862,7 +1276,7 @@ int FindDescriptor::construct_protobuf(PMGDQuery &query,
                     results_set, false);
   }
   // Case (2)
-  else if (!cmd.isMember("k_neighbors")) {
+  else if (!cmd.isMember("k_neighbors") && !cmd.isMember("radius")) {
     // In this case, we either need properties of the descriptor
     // ("list") on the results block, or we need the descriptor nodes
     // because the user defined a reference.
@@ -893,6 +1307,7 @@ int FindDescriptor::construct_protobuf(PMGDQuery &query,
       return -1;
     }
     const int k_neighbors = get_value<int>(cmd, "k_neighbors", 0);
+    const unsigned max_results = get_value<int>(cmd, "max_results", 0);
 
     // This set query is a little weird and may be optimized away in the future
     //  as we no longer explicitly need the set links, however subsequent logic
@@ -906,14 +1321,14 @@ int FindDescriptor::construct_protobuf(PMGDQuery &query,
     Json::Value link_to_set;
     link_to_set["ref"] = ref_set;
 
-    if (!check_blob_size(blob, dimensions, 1)) {
+    if (!check_blob_size(blob, descriptor_size(cmd, set_name, dimensions), 1)) {
       cp_result["status"] = RSCommand::Error;
       cp_result["info"] = "Blob (required) is null or size invalid";
       return -1;
     }
 
     try {
-      VCL::DescriptorSet *set = _dm->get_descriptors_handler(set_path);
+      DescriptorSetHandle set = _dm->get_descriptors_handler(set_path);
 
       // This is a way to pass state to the construct_response
       // We just pass the cache_object_id.
@@ -926,20 +1341,21 @@ int FindDescriptor::construct_protobuf(PMGDQuery &query,
       std::vector<long> &ids = pair->first;
       std::vector<float> &distances = pair->second;
 
-      set->search((float *)blob.data(), 1, k_neighbors, ids, distances);
-
-      long returned_counter = 0;
-      std::string blob_return;
-
-      Json::Value ids_array;
-
-      for (int i = 0; i < ids.size(); ++i) {
-        if (ids[i] >= 0) {
-          ids_array.append(Json::Int64(ids[i]));
-        } else {
-          ids.erase(ids.begin() + i, ids.end());
-          distances.erase(distances.begin() + i, distances.end());
-          break;
+      std::vector<float> buffer;
+      if (cmd.isMember("radius")) {
+        float radius = get_value<double>(cmd, "radius");
+        set->radius_search(blob_floats(cmd, blob, buffer), radius, ids,
+                           distances, max_results);
+      } else {
+        set->search(blob_floats(cmd, blob, buffer), 1, k_neighbors, ids,
+                    distances);
+
+        for (int i = 0; i < ids.size(); ++i) {
+          if (ids[i] < 0) {
+            ids.erase(ids.begin() + i, ids.end());
+            distances.erase(distances.begin() + i, distances.end());
+            break;
+          }
         }
       }
 
@@ -949,30 +1365,41 @@ int FindDescriptor::construct_protobuf(PMGDQuery &query,
         results["list"].append(desc_id_prop_name);
       }
 
-      Json::Value node_constraints = constraints;
-      cp_result["ids_array"] = ids_array;
-      for (int i = 0; i < ids.size(); ++i) {
-        Json::Value k_node_constraints;
-
-        // Theoretically this makes a deep copy
-        k_node_constraints = constraints;
-
-        // Create a vector with a string and an integer
-        std::vector<Json::Value> values;
-        values.push_back("==");
-        values.push_back(ids[i]);
-
-        // Add the vector to the JSON object with a key
-        Json::Value jsonArray(Json::arrayValue);
-        for (const auto &value : values) {
-          jsonArray.append(value);
+      // The neighbors are ordered by distance on the response,
+      // not by the graph.
+      results.removeMember("limit");
+      results.removeMember("sort");
+
+      // A single query for the metadata of all the neighbors, by the
+      // list of their ids. PMGD matches a list of values as an OR of all
+      // the predicates of the query, so the user constraints are not
+      // part of it: the properties they use come along, and
+      // construct_responses drops the neighbors that do not match.
+      if (!ids.empty()) {
+        Json::Value values(Json::arrayValue);
+        for (long id : ids) {
+          values.append(Json::Int64(id));
         }
-        k_node_constraints[desc_id_prop_name] = jsonArray;
 
-        results["limit"] = 1;
+        Json::Value id_constraints;
+        id_constraints[desc_id_prop_name].append("==");
+        id_constraints[desc_id_prop_name].append(values);
+
+        if (!constraints.empty()) {
+          cp_result["constraints"] = constraints;
+          for (const auto &key : constraints.getMemberNames()) {
+            bool listed = false;
+            for (const auto &prop : results["list"])
+              listed = listed || prop.asString() == key;
+            if (!listed) {
+              results["list"].append(key);
+              cp_result["filter_props"].append(key);
+            }
+          }
+        }
 
-        query.QueryNode(get_value<int>(cmd, "_ref", -1), VDMS_DESC_TAG,
-                        Json::nullValue, k_node_constraints, results, false);
+        query.QueryNode(-1, VDMS_DESC_TAG, Json::nullValue, id_constraints,
+                        results, false);
       }
 
     } catch (VCL::Exception e) {
@@ -995,22 +1422,30 @@ void FindDescriptor::populate_blobs(const std::string &set_path,
   std::string desc_id_prop_name =
       VDMS_DESC_ID_PROP + std::string("_") + set_name;
   if (get_value<bool>(results, "blob", false)) {
-    VCL::DescriptorSet *set = _dm->get_descriptors_handler(set_path);
-    int dim = set->get_dimensions();
+    DescriptorSetHandle set = _dm->get_descriptors_handler(set_path);
+    size_t desc_size = set->get_descriptor_size();
 
+    std::vector<long> ids;
+    ids.reserve(entities.size());
     for (auto &ent : entities) {
-      long id = ent[desc_id_prop_name].asInt64();
+      ids.push_back(ent[desc_id_prop_name].asInt64());
+    }
+
+    // All the descriptors in one call to the set
+    std::vector<char> descriptors(ids.size() * desc_size);
+    set->get_descriptors(ids, (float *)descriptors.data());
+    if (output_vcl_timing) {
+      set->timers.print_map_runtimes();
+    }
+    set->timers.clear_all_timers();
 
+    const char *desc = descriptors.data();
+    for (auto &ent : entities) {
       ent["blob"] = true;
 
       std::string *desc_blob = query_res.add_blobs();
-      desc_blob->resize(sizeof(float) * dim);
-
-      set->get_descriptors(&id, 1, (float *)(*desc_blob).data());
-      if (output_vcl_timing) {
-        set->timers.print_map_runtimes();
-      }
-      set->timers.clear_all_timers();
+      desc_blob->assign(desc, desc_size);
+      desc += desc_size;
     }
   }
 }
@@ -1114,7 +1549,7 @@ Json::Value FindDescriptor::construct_responses(
     }
   }
   // Case (2)
-  else if (!cmd.isMember("k_neighbors")) {
+  else if (!cmd.isMember("k_neighbors") && !cmd.isMember("radius")) {
 
     assert(json_responses.size() == 2);
 
@@ -1173,7 +1608,7 @@ Json::Value FindDescriptor::construct_responses(
     std::string set_path = set[VDMS_DESC_SET_PATH_PROP].asString();
     int dim = set[VDMS_DESC_SET_DIM_PROP].asInt();
 
-    if (!check_blob_size(blob, dim, 1)) {
+    if (!check_blob_size(blob, descriptor_size(cmd, set_name, dim), 1)) {
       Json::Value return_error;
       return_error["status"] = RSCommand::Error;
       return_error["info"] = "Blob (required) is null or size invalid";
@@ -1199,80 +1634,48 @@ Json::Value FindDescriptor::construct_responses(
 
     long cache_obj_id = cache["cache_obj_id"].asInt64();
 
-    assert(cache.isMember("ids_array"));
-    Json::Value ids_array = cache["ids_array"];
-
     // Get from Cache
     IDDistancePair *pair = _cache_map[cache_obj_id];
     ids = &(pair->first);
     distances = &(pair->second);
 
-    Json::Value combined_tx_constraints;
-    Json::Value set_values;
-    Json::Value ent_values;
-    for (int i = 0; i < json_responses.size(); ++i) {
-
-      // Create a vector with a string and an integer
-      if (i == 0)
-        continue;
-      else {
-        Json::Value desc_data;
-        for (auto ent : json_responses[i]["entities"])
-          desc_data = ent;
-        ent_values.append(desc_data);
+    // Metadata of the neighbors, from the single query for all of them
+    // (no query when there are none)
+    std::unordered_map<long, const Json::Value *> desc_entities;
+    if (json_responses.size() > 1) {
+      if (json_responses[1]["status"] != 0) {
+        Json::Value return_error;
+        return_error["status"] = RSCommand::Error;
+        return_error["info"] = "Descriptor Not Found in graph!";
+        return error(return_error);
       }
-      // Add the vector to the JSON object with a key
-    }
-    set_values["status"] = 0;
-    set_values["returned"] = json_responses.size() - 1;
-    set_values["entities"] = ent_values;
 
-    findDesc = set_values;
-
-    if (findDesc["status"] != 0 || !findDesc.isMember("entities")) {
-
-      Json::Value return_error;
-      return_error["status"] = RSCommand::Error;
-      return_error["info"] = "Descriptor Not Found in graph!";
-      return error(return_error);
+      const Json::Value &constraints = cache["constraints"];
+      for (const auto &ent : json_responses[1]["entities"]) {
+        if (match_constraints(ent, constraints))
+          desc_entities[ent[desc_id_prop_name].asInt64()] = &ent;
+      }
     }
 
-    Json::Value aux_entities = findDesc["entities"];
-    findDesc.removeMember("entities");
+    findDesc["status"] = 0;
+    findDesc["returned"] = 0;
 
     uint64_t new_cnt = 0;
     for (int i = 0; i < (*ids).size(); ++i) {
 
-      Json::Value desc_data;
+      // Neighbors that do not match the constraints are not found
+      auto it = desc_entities.find((*ids)[i]);
+      if (it == desc_entities.end())
+        continue;
 
-      long d_id = (*ids)[i];
-      bool pass_constraints = false;
+      Json::Value desc_data = *it->second;
 
-      for (auto ent : aux_entities) {
-        if (ent[desc_id_prop_name].asInt64() == d_id) {
-          for (int idx = 0; idx < ids_array.size(); ++idx) {
-            if (ent[desc_id_prop_name].asInt64() == ids_array[idx].asInt64()) {
-              desc_data = ent;
-              pass_constraints = true;
-              break;
-            }
-          }
-        }
-        if (pass_constraints) {
-          break;
-        }
-      }
-
-      if (!pass_constraints)
-        continue;
+      // Fetched only to check the constraints
+      for (const auto &prop : cache["filter_props"])
+        desc_data.removeMember(prop.asString());
 
       if (compute_distance) {
         desc_data["_distance"] = (*distances)[i];
-
-        // Should be already sorted,
-        // but if not, we need to match the id with
-        // whatever is on the cache
-        // desc_data["cache_id"]  = Json::Int64((*ids)[i]);
       }
 
       findDesc["entities"].append(desc_data);
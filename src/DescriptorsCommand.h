@@ -61,12 +61,28 @@ protected:
   static tbb::concurrent_unordered_map<std::string, std::string>
       _desc_set_locator;
   static tbb::concurrent_unordered_map<std::string, int> _desc_set_dims;
+  static tbb::concurrent_unordered_map<std::string, bool> _desc_set_binary;
 
   // Will return the path to the set and the dimensions
   std::string get_set_path(PMGDQuery &query_tx, const std::string &set,
                            int &dim);
 
-  bool check_blob_size(const std::string &blob, const int dimensions,
+  bool is_binary_engine(const std::string &engine);
+
+  // Bytes per element of the descriptors in the blob of cmd
+  // ("blob_format" fp32, or fp16 / bf16)
+  size_t blob_element_size(const Json::Value &cmd);
+
+  // Size in bytes of each descriptor of the set in the blob of cmd
+  size_t descriptor_size(const Json::Value &cmd, const std::string &set,
+                         int dim);
+
+  // Returns the descriptors in blob as floats: blob itself for fp32,
+  // or its fp16 / bf16 values converted into buffer
+  float *blob_floats(const Json::Value &cmd, const std::string &blob,
+                     std::vector<float> &buffer);
+
+  bool check_blob_size(const std::string &blob, const size_t desc_size,
                        const long n_desc);
 
 public:
@@ -127,7 +143,7 @@ public:
 class AddDescriptor : public DescriptorsCommand {
   // bool _use_aws_storage;
 
-  long insert_descriptor(const std::string &blob, const std::string &path,
+  long insert_descriptor(float *descriptors, const std::string &path,
                          int dim, const std::string &label, Json::Value &error);
 
   void retrieve_aws_descriptorSet(const std::string &set_path);
@@ -172,6 +188,38 @@ public:
                                   const std::string &blob);
 };
 
+class DeleteDescriptor : public DescriptorsCommand {
+
+public:
+  DeleteDescriptor();
+
+  int construct_protobuf(PMGDQuery &tx, const Json::Value &root,
+                         const std::string &blob, int grp_id,
+                         Json::Value &error);
+
+  Json::Value construct_responses(Json::Value &json_responses,
+                                  const Json::Value &json,
+                                  protobufs::queryMessage &response,
+                                  const std::string &blob);
+};
+
+class UpdateDescriptor : public DescriptorsCommand {
+
+public:
+  UpdateDescriptor();
+
+  int construct_protobuf(PMGDQuery &tx, const Json::Value &root,
+                         const std::string &blob, int grp_id,
+                         Json::Value &error);
+
+  bool need_blob(const Json::Value &cmd) { return true; }
+
+  Json::Value construct_responses(Json::Value &json_responses,
+                                  const Json::Value &json,
+                                  protobufs::queryMessage &response,
+                                  const std::string &blob);
+};
+
 class FindDescriptor : public DescriptorsCommand {
 
 private:
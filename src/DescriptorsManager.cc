@@ -28,8 +28,13 @@
  */
 
 #include "DescriptorsManager.h"
+#include "VDMSConfig.h"
 #include <iostream>
 
+#define DEFAULT_DESCRIPTORS_CHECKPOINT_INTERVAL 300 // seconds
+#define DEFAULT_DESCRIPTORS_MEMORY_BUDGET 0          // MB, no limit
+#define DEFAULT_DESCRIPTORS_COMPACTION_THRESHOLD 20  // % removed
+
 using namespace VDMS;
 
 DescriptorsManager *DescriptorsManager::_dm;
@@ -38,7 +43,20 @@ bool DescriptorsManager::init() {
   if (_dm)
     return false;
 
-  _dm = new DescriptorsManager();
+  int budget = VDMSConfig::instance()->get_int_value(
+      "descriptors_memory_budget", DEFAULT_DESCRIPTORS_MEMORY_BUDGET);
+  int checkpoint_interval = VDMSConfig::instance()->get_int_value(
+      "descriptors_checkpoint_interval",
+      DEFAULT_DESCRIPTORS_CHECKPOINT_INTERVAL);
+  bool use_mmap =
+      VDMSConfig::instance()->get_bool_value("descriptors_mmap", false);
+  int compaction_threshold = VDMSConfig::instance()->get_int_value(
+      "descriptors_compaction_threshold",
+      DEFAULT_DESCRIPTORS_COMPACTION_THRESHOLD);
+
+  _dm = new DescriptorsManager(budget > 0 ? size_t(budget) * 1024 * 1024 : 0,
+                               checkpoint_interval, use_mmap,
+                               compaction_threshold);
   return true;
 }
 
@@ -50,28 +68,297 @@ DescriptorsManager *DescriptorsManager::instance() {
   return NULL;
 }
 
-DescriptorsManager::DescriptorsManager() {}
+DescriptorsManager::DescriptorsManager(size_t memory_budget,
+                                       int checkpoint_interval, bool use_mmap,
+                                       int compaction_threshold)
+    : _memory_budget(memory_budget), _memory_used(0),
+      _checkpoint_interval(checkpoint_interval), _checkpoint_stop(false),
+      _use_mmap(use_mmap), _compaction_threshold(compaction_threshold) {
+  if (_checkpoint_interval > 0) {
+    _checkpoint_thread =
+        std::thread(&DescriptorsManager::checkpoint_loop, this);
+  }
+}
+
+DescriptorsManager::~DescriptorsManager() {
+  shutdown();
+  for (auto &element : _sets)
+    delete element.second.set;
+}
+
+void DescriptorsManager::checkpoint_loop() {
+  std::unique_lock<std::mutex> lock(_checkpoint_lock);
+
+  while (!_checkpoint_stop) {
+    _checkpoint_cv.wait_for(lock, std::chrono::seconds(_checkpoint_interval));
+    if (_checkpoint_stop)
+      break;
+
+    try {
+      checkpoint();
+    } catch (VCL::Exception &e) {
+      std::cerr << "DescriptorsManager: checkpoint failed" << std::endl;
+      print_exception(e);
+    }
+
+    if (_compaction_threshold > 0)
+      compact();
+  }
+}
+
+// Sets keep serving requests while they are compacted.
+void DescriptorsManager::compact() {
+  for (auto &handle : pin_all()) {
+    if (handle->removed_ratio() * 100 < _compaction_threshold)
+      continue;
+
+    try {
+      handle->compact();
+    } catch (VCL::Exception &e) {
+      std::cerr << "DescriptorsManager: compaction failed: "
+                << handle->get_path() << std::endl;
+      print_exception(e);
+    } catch (std::exception &e) {
+      std::cerr << "DescriptorsManager: compaction failed: "
+                << handle->get_path() << ": " << e.what() << std::endl;
+    }
+  }
+}
+
+void DescriptorsManager::shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(_checkpoint_lock);
+    _checkpoint_stop = true;
+  }
+  _checkpoint_cv.notify_all();
+
+  if (_checkpoint_thread.joinable())
+    _checkpoint_thread.join();
+}
 
 void DescriptorsManager::flush() {
-  for (auto desc_set : _descriptors_handlers) {
-    desc_set.second->store();
-    delete desc_set.second;
+  std::lock_guard<std::mutex> lock(_lock);
+  for (auto it = _sets.begin(); it != _sets.end();) {
+    SetEntry &entry = it->second;
+    if (entry.busy) {
+      ++it;
+      continue;
+    }
+
+    if (entry.set->is_modified())
+      entry.set->store();
+
+    if (entry.pins > 0) {
+      ++it;
+      continue;
+    }
+
+    delete entry.set;
+    _memory_used -= entry.memory;
+    _lru.erase(entry.lru_pos);
+    it = _sets.erase(it);
   }
-  _descriptors_handlers.clear();
 }
 
-VCL::DescriptorSet *
+// The sets are pinned instead of holding _lock,
+// so that requests are not blocked while they are written.
+// Sets that did not change since their last store() are skipped.
+void DescriptorsManager::checkpoint() {
+  for (auto &handle : pin_all()) {
+    if (handle->is_modified())
+      handle->store();
+  }
+}
+
+void DescriptorsManager::sync() {
+  for (auto &handle : pin_all()) {
+    handle->sync();
+  }
+}
+
+std::vector<DescriptorSetHandle> DescriptorsManager::pin_all() {
+  std::vector<DescriptorSetHandle> handles;
+  std::lock_guard<std::mutex> lock(_lock);
+  handles.reserve(_lru.size());
+  for (auto &path : _lru) {
+    SetEntry &entry = _sets[path];
+    entry.pins++;
+    handles.emplace_back(this, path, entry.set);
+  }
+  return handles;
+}
+
+DescriptorSetHandle
 DescriptorsManager::get_descriptors_handler(std::string path) {
-  VCL::DescriptorSet *desc_ptr;
+  std::unique_lock<std::mutex> lock(_lock);
+
+  // Another request is opening or closing this set
+  _busy_cv.wait(lock, [&] {
+    auto element = _sets.find(path);
+    return element == _sets.end() || !element->second.busy;
+  });
 
-  auto element = _descriptors_handlers.find(path);
+  auto element = _sets.find(path);
 
-  if (element == _descriptors_handlers.end()) {
-    desc_ptr = new VCL::DescriptorSet(path);
-    _descriptors_handlers[path] = desc_ptr;
-  } else {
-    desc_ptr = element->second;
+  if (element != _sets.end()) {
+    SetEntry &entry = element->second;
+    _counters[path].hits++;
+    _lru.splice(_lru.begin(), _lru, entry.lru_pos);
+    entry.pins++;
+    return DescriptorSetHandle(this, path, entry.set);
   }
 
-  return desc_ptr;
+  // Opened without holding _lock, so that requests for the other sets
+  // are not blocked meanwhile. References to the entry stay valid.
+  SetEntry &entry = _sets[path];
+  entry.busy = true;
+  lock.unlock();
+
+  VCL::DescriptorSet *desc_ptr = NULL;
+  size_t memory;
+  try {
+    desc_ptr = new VCL::DescriptorSet(path, _use_mmap ? VCL::LoadMmap
+                                                      : VCL::LoadInMemory);
+    memory = estimate_memory(desc_ptr);
+  } catch (...) {
+    delete desc_ptr;
+    lock.lock();
+    _sets.erase(path);
+    _busy_cv.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  entry.set = desc_ptr;
+  entry.busy = false;
+  entry.pins++;
+  entry.memory = memory;
+  _memory_used += memory;
+  _counters[path].loads++;
+  _lru.push_front(path);
+  entry.lru_pos = _lru.begin();
+  _busy_cv.notify_all();
+
+  evict(lock);
+
+  return DescriptorSetHandle(this, path, desc_ptr);
+}
+
+DescriptorSetStats DescriptorsManager::get_stats(const std::string &path) {
+  DescriptorSetStats stats = {false, 0, 0, 0, 0, 0};
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto element = _sets.find(path);
+  if (element != _sets.end() && !element->second.busy) {
+    SetEntry &entry = element->second;
+    stats.resident = true;
+    stats.pins = entry.pins;
+    stats.memory = entry.memory;
+  }
+
+  auto counters = _counters.find(path);
+  if (counters != _counters.end()) {
+    stats.hits = counters->second.hits;
+    stats.loads = counters->second.loads;
+    stats.evictions = counters->second.evictions;
+  }
+
+  return stats;
+}
+
+void DescriptorsManager::release(const std::string &path) {
+  std::unique_lock<std::mutex> lock(_lock);
+  SetEntry &entry = _sets[path];
+  entry.pins--;
+
+  // The set may have grown while it was in use
+  size_t memory = estimate_memory(entry.set);
+  _memory_used = _memory_used - entry.memory + memory;
+  entry.memory = memory;
+
+  evict(lock);
+}
+
+// The descriptors take most of the memory of a set,
+// whatever the engine.
+size_t DescriptorsManager::estimate_memory(VCL::DescriptorSet *set) {
+  return size_t(set->get_n_descriptors()) * set->get_descriptor_size();
+}
+
+// Closes the least recently used unpinned sets until the resident ones fit
+// in the budget. sync() is enough to reopen them later: the sets that keep
+// a write-ahead log replay it, the others are stored.
+// The sets are marked busy and closed after releasing _lock; the ones
+// closed are then removed from _sets, the others are resident again.
+void DescriptorsManager::evict(std::unique_lock<std::mutex> &lock) {
+  if (_memory_budget == 0)
+    return;
+
+  std::vector<std::string> paths;
+  auto it = _lru.end();
+  while (_memory_used > _memory_budget && it != _lru.begin()) {
+    --it;
+    SetEntry &entry = _sets[*it];
+    if (entry.pins > 0)
+      continue;
+
+    entry.busy = true;
+    _memory_used -= entry.memory;
+    paths.push_back(*it);
+    it = _lru.erase(it);
+  }
+
+  if (paths.empty())
+    return;
+
+  std::vector<SetEntry *> entries;
+  for (auto &path : paths)
+    entries.push_back(&_sets[path]);
+  lock.unlock();
+
+  std::vector<bool> closed(paths.size(), false);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    try {
+      entries[i]->set->sync();
+    } catch (VCL::Exception &e) {
+      std::cerr << "DescriptorsManager: cannot evict " << paths[i]
+                << std::endl;
+      print_exception(e);
+      continue;
+    }
+
+    delete entries[i]->set;
+    closed[i] = true;
+  }
+
+  lock.lock();
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (closed[i]) {
+      _counters[paths[i]].evictions++;
+      _sets.erase(paths[i]);
+    } else {
+      SetEntry &entry = *entries[i];
+      entry.busy = false;
+      _memory_used += entry.memory;
+      _lru.push_back(paths[i]);
+      entry.lru_pos = std::prev(_lru.end());
+    }
+  }
+  _busy_cv.notify_all();
+}
+
+DescriptorSetHandle::DescriptorSetHandle(DescriptorsManager *dm,
+                                         const std::string &path,
+                                         VCL::DescriptorSet *set)
+    : _dm(dm), _path(path), _set(set) {}
+
+DescriptorSetHandle::DescriptorSetHandle(DescriptorSetHandle &&other)
+    : _dm(other._dm), _path(std::move(other._path)), _set(other._set) {
+  other._dm = NULL;
+  other._set = NULL;
+}
+
+DescriptorSetHandle::~DescriptorSetHandle() {
+  if (_dm)
+    _dm->release(_path);
 }
@@ -29,34 +29,174 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <list>
 #include <mutex>
 #include <queue>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
-#include "tbb/concurrent_unordered_map.h"
 #include "vcl/DescriptorSet.h"
 
 namespace VDMS {
 
+class DescriptorsManager;
+
+/**
+ *  Pins an open descriptor set while it is in use: a pinned set
+ *  is never evicted nor deleted. The pin is released when the
+ *  handle goes out of scope.
+ */
+class DescriptorSetHandle {
+  DescriptorsManager *_dm;
+  std::string _path;
+  VCL::DescriptorSet *_set;
+
+public:
+  DescriptorSetHandle(DescriptorsManager *dm, const std::string &path,
+                      VCL::DescriptorSet *set);
+  DescriptorSetHandle(DescriptorSetHandle &&other);
+  DescriptorSetHandle(const DescriptorSetHandle &) = delete;
+  DescriptorSetHandle &operator=(const DescriptorSetHandle &) = delete;
+  ~DescriptorSetHandle();
+
+  VCL::DescriptorSet *operator->() const { return _set; }
+  VCL::DescriptorSet *get() const { return _set; }
+};
+
+struct DescriptorSetStats {
+  bool resident;    // open in memory
+  int pins;         // handles in use
+  size_t memory;    // estimated size in memory, in bytes
+  long hits;        // requests served by the open set
+  long loads;       // requests that had to open the set
+  long evictions;   // times the set was closed to stay in budget
+};
+
 class DescriptorsManager {
+  friend class DescriptorSetHandle;
+
+  struct SetEntry {
+    VCL::DescriptorSet *set = NULL; // NULL while being opened
+    bool busy = false;              // being opened or closed
+    int pins = 0;
+    size_t memory = 0;
+    std::list<std::string>::iterator lru_pos; // valid when not busy
+  };
+
+  struct SetCounters {
+    long hits = 0;
+    long loads = 0;
+    long evictions = 0;
+  };
+
   static DescriptorsManager *_dm;
-  tbb::concurrent_unordered_map<std::string, VCL::DescriptorSet *>
-      _descriptors_handlers;
 
-  DescriptorsManager();
+  // The resident sets, and the ones being opened or closed, which are
+  // read or written without holding _lock: requests for a busy set
+  // wait on _busy_cv. _lru lists the resident sets from most to least
+  // recently used, and _counters every set requested so far.
+  std::unordered_map<std::string, SetEntry> _sets;
+  std::unordered_map<std::string, SetCounters> _counters;
+  std::list<std::string> _lru;
+  std::mutex _lock;
+  std::condition_variable _busy_cv;
+
+  // Memory budget for the resident sets, in bytes (0 means no limit)
+  size_t _memory_budget;
+  size_t _memory_used;
+
+  // Background checkpoints (seconds between them, <= 0 disables them)
+  int _checkpoint_interval;
+  bool _checkpoint_stop;
+  std::mutex _checkpoint_lock;
+  std::condition_variable _checkpoint_cv;
+  std::thread _checkpoint_thread;
+
+  // Map the index files of the sets instead of reading them on open
+  bool _use_mmap;
+
+  // Percentage of removed descriptors from which a set is compacted
+  // by the background checkpoints (<= 0 disables it)
+  int _compaction_threshold;
+
+  void checkpoint_loop();
+  void compact();
+
+  size_t estimate_memory(VCL::DescriptorSet *set);
+
+  // Must be called with _lock held, released while closing the sets
+  void evict(std::unique_lock<std::mutex> &lock);
+
+  void release(const std::string &path);
+  std::vector<DescriptorSetHandle> pin_all();
 
 public:
   static bool init();
   static DescriptorsManager *instance();
 
   /**
-   *  Handles descriptors and lock for the descriptor
-   *  This is a blocking call until the descriptor is free
+   *  init() creates the manager of the server with the values of the
+   *  config file: "descriptors_memory_budget" (in MB),
+   *  "descriptors_checkpoint_interval", "descriptors_mmap" and
+   *  "descriptors_compaction_threshold".
+   *
+   *  @param memory_budget  Memory for the resident sets, in bytes
+   *                        (0 means no limit)
+   *  @param checkpoint_interval  Seconds between background checkpoints
+   *                              (<= 0 disables them)
+   *  @param use_mmap  Map the index files of the sets
+   *  @param compaction_threshold  Percentage of removed descriptors from
+   *                               which a set is compacted (<= 0 never)
+   */
+  DescriptorsManager(size_t memory_budget, int checkpoint_interval = 0,
+                     bool use_mmap = false, int compaction_threshold = 0);
+
+  /**
+   *  Stops the background checkpoints and closes the resident sets,
+   *  which must not be in use.
+   */
+  ~DescriptorsManager();
+
+  /**
+   *  Returns the descriptor set at path, opening it if it is not
+   *  resident. The set stays pinned in memory while the handle lives.
+   *  Opening a set may evict the least recently used unpinned sets,
+   *  to stay within "descriptors_memory_budget".
    *
    *  @param path  Path to the descriptor set
    */
-  VCL::DescriptorSet *get_descriptors_handler(std::string path);
+  DescriptorSetHandle get_descriptors_handler(std::string path);
+
+  /**
+   *  Residency and hit counters of the set at path
+   *  (all zero if it has never been requested).
+   */
+  DescriptorSetStats get_stats(const std::string &path);
+
+  /**
+   *  Stores every open set that changed since its last store() and
+   *  removes it from memory (pinned sets are stored but kept open).
+   */
   void flush();
+
+  /**
+   *  Stores every open set modified since its last store (the Faiss
+   *  write-ahead logs are truncated) and keeps it in memory.
+   */
+  void checkpoint();
+
+  /**
+   *  Makes every open set recoverable from disk without rewriting
+   *  the indexes that keep a write-ahead log.
+   */
+  void sync();
+
+  /**
+   *  Stops the background checkpoints.
+   */
+  void shutdown();
 };
 }; // namespace VDMS
@@ -0,0 +1,297 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include "ImageCache.h"
+#include "VDMSConfig.h"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#define DEFAULT_IMAGE_CACHE_SIZE 0       // MB, disabled
+#define DEFAULT_IMAGE_CACHE_SPILL_SIZE 0 // MB, no spill
+
+namespace fs = std::filesystem;
+
+using namespace VDMS;
+
+ImageCache *ImageCache::_cache;
+
+bool ImageCache::init() {
+  if (_cache)
+    return false;
+
+  int size = VDMSConfig::instance()->get_int_value("image_cache_size",
+                                                   DEFAULT_IMAGE_CACHE_SIZE);
+  std::string spill_path = VDMSConfig::instance()->get_string_value(
+      "image_cache_spill_path", "");
+  int spill_size = VDMSConfig::instance()->get_int_value(
+      "image_cache_spill_size", DEFAULT_IMAGE_CACHE_SPILL_SIZE);
+
+  _cache = new ImageCache(size > 0 ? size_t(size) * 1024 * 1024 : 0,
+                          spill_path,
+                          spill_size > 0 ? size_t(spill_size) * 1024 * 1024
+                                         : 0);
+  return true;
+}
+
+ImageCache *ImageCache::instance() {
+  if (_cache)
+    return _cache;
+
+  std::cerr << "ERROR: ImageCache not init" << std::endl;
+  return NULL;
+}
+
+bool ImageCache::enabled() { return _cache && _cache->_memory_budget > 0; }
+
+// jsoncpp writes the members of an object sorted by name, so the same
+// operations give the same key whatever the order of their parameters.
+std::string ImageCache::key(const std::string &path, const Json::Value &ops,
+                            const std::string &format) {
+  Json::FastWriter writer;
+  std::string key = path;
+  key += '\0';
+  if (!ops.isNull())
+    key += writer.write(ops);
+  key += '\0';
+  key += format;
+  return key;
+}
+
+ImageCache::ImageCache(size_t memory_budget, const std::string &spill_path,
+                       size_t spill_budget)
+    : _memory_budget(memory_budget), _memory_used(0),
+      _spill_path(spill_path), _spill_budget(spill_budget), _spill_used(0),
+      _spill_files(0), _hits(0), _misses(0) {
+  if (_spill_path.empty() || _spill_budget == 0) {
+    _spill_budget = 0;
+    return;
+  }
+
+  // Entries left by a previous run may be stale
+  try {
+    fs::create_directories(_spill_path);
+    for (auto &file : fs::directory_iterator(_spill_path)) {
+      if (file.is_regular_file() && file.path().extension() == ".cache")
+        fs::remove(file.path());
+    }
+  } catch (fs::filesystem_error &e) {
+    std::cerr << "ImageCache: spill directory not available: " << e.what()
+              << std::endl;
+    _spill_budget = 0;
+  }
+}
+
+ImageCache::~ImageCache() {
+  std::lock_guard<std::mutex> lock(_lock);
+  while (!_spill_lru.empty())
+    remove_spilled(_spill_lru.back());
+}
+
+bool ImageCache::lookup(const std::string &key,
+                        std::vector<unsigned char> &data) {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto it = _entries.find(key);
+  if (it != _entries.end()) {
+    _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+    data = it->second.data;
+    _hits++;
+    return true;
+  }
+
+  if (_spilled.count(key) > 0 && unspill(key, data)) {
+    _hits++;
+    return true;
+  }
+
+  _misses++;
+  return false;
+}
+
+void ImageCache::insert(const std::string &key, const std::string &path,
+                        const std::vector<unsigned char> &data) {
+  if (data.size() > _memory_budget)
+    return;
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  // Another request may have cached it in the meantime
+  if (_entries.count(key) > 0)
+    return;
+  if (_spilled.count(key) > 0)
+    remove_spilled(key);
+
+  _lru.push_front(key);
+  Entry &entry = _entries[key];
+  entry.path = path;
+  entry.data = data;
+  entry.lru_pos = _lru.begin();
+  _keys[path].insert(key);
+  _memory_used += data.size();
+
+  evict();
+}
+
+void ImageCache::invalidate(const std::string &path) {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto it = _keys.find(path);
+  if (it == _keys.end())
+    return;
+
+  for (const std::string &key : it->second) {
+    auto entry = _entries.find(key);
+    if (entry != _entries.end()) {
+      _memory_used -= entry->second.data.size();
+      _lru.erase(entry->second.lru_pos);
+      _entries.erase(entry);
+    }
+    remove_spilled(key);
+  }
+  _keys.erase(it);
+}
+
+ImageCacheStats ImageCache::get_stats() {
+  std::lock_guard<std::mutex> lock(_lock);
+
+  ImageCacheStats stats;
+  stats.hits = _hits;
+  stats.misses = _misses;
+  stats.memory = _memory_used;
+  stats.spilled = _spill_used;
+  stats.entries = _entries.size() + _spilled.size();
+  return stats;
+}
+
+void ImageCache::evict() {
+  while (_memory_used > _memory_budget && !_lru.empty()) {
+    const std::string key = _lru.back();
+    Entry &entry = _entries[key];
+    _memory_used -= entry.data.size();
+    _lru.pop_back();
+
+    if (_spill_budget > 0 && entry.data.size() <= _spill_budget) {
+      spill(key, entry);
+      _entries.erase(key);
+    } else {
+      std::string path = entry.path;
+      _entries.erase(key);
+      remove_key(path, key);
+    }
+  }
+}
+
+void ImageCache::spill(const std::string &key, Entry &entry) {
+  std::string file =
+      _spill_path + "/" + std::to_string(_spill_files++) + ".cache";
+
+  std::ofstream out(file, std::ios::binary);
+  out.write((const char *)entry.data.data(), entry.data.size());
+  out.close();
+  if (!out) {
+    std::cerr << "ImageCache: cannot write " << file << std::endl;
+    fs::remove(file);
+    remove_key(entry.path, key);
+    return;
+  }
+
+  _spill_lru.push_front(key);
+  SpillEntry &spilled = _spilled[key];
+  spilled.path = entry.path;
+  spilled.file = file;
+  spilled.size = entry.data.size();
+  spilled.lru_pos = _spill_lru.begin();
+  _spill_used += spilled.size;
+
+  evict_spilled();
+}
+
+void ImageCache::evict_spilled() {
+  while (_spill_used > _spill_budget && !_spill_lru.empty()) {
+    const std::string key = _spill_lru.back();
+    std::string path = _spilled[key].path;
+    remove_spilled(key);
+    remove_key(path, key);
+  }
+}
+
+// Moves the entry of key from the spill directory to memory
+bool ImageCache::unspill(const std::string &key,
+                         std::vector<unsigned char> &data) {
+  SpillEntry spilled = _spilled[key];
+
+  std::ifstream in(spilled.file, std::ios::binary);
+  data.resize(spilled.size);
+  in.read((char *)data.data(), spilled.size);
+  bool ok = bool(in);
+  in.close();
+  remove_spilled(key);
+
+  if (!ok) {
+    std::cerr << "ImageCache: cannot read " << spilled.file << std::endl;
+    remove_key(spilled.path, key);
+    data.clear();
+    return false;
+  }
+
+  _lru.push_front(key);
+  Entry &entry = _entries[key];
+  entry.path = spilled.path;
+  entry.data = data;
+  entry.lru_pos = _lru.begin();
+  _memory_used += data.size();
+
+  evict();
+  return true;
+}
+
+// Drops the entry of key from the spill directory, keeping it in _keys
+void ImageCache::remove_spilled(const std::string &key) {
+  auto it = _spilled.find(key);
+  if (it == _spilled.end())
+    return;
+
+  std::error_code ec;
+  fs::remove(it->second.file, ec);
+  _spill_used -= it->second.size;
+  _spill_lru.erase(it->second.lru_pos);
+  _spilled.erase(it);
+}
+
+void ImageCache::remove_key(const std::string &path, const std::string &key) {
+  auto it = _keys.find(path);
+  if (it == _keys.end())
+    return;
+
+  it->second.erase(key);
+  if (it->second.empty())
+    _keys.erase(it);
+}
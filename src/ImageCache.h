@@ -0,0 +1,155 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <jsoncpp/json/json.h>
+
+namespace VDMS {
+
+struct ImageCacheStats {
+  long hits;      // lookups served from memory or from the spill directory
+  long misses;    // lookups that had to read the image
+  size_t memory;  // bytes of encoded images in memory
+  size_t spilled; // bytes of encoded images in the spill directory
+  size_t entries; // images in memory or in the spill directory
+};
+
+/**
+ *  Encoded images returned by recent requests, so that an image
+ *  fetched again with the same operations and format is not read,
+ *  decoded, transformed and encoded again. Entries are kept in
+ *  memory up to "image_cache_size", and the least recently used ones
+ *  are dropped beyond it, or moved to "image_cache_spill_path" (up to
+ *  "image_cache_spill_size") when it is set. A hit in the spill
+ *  directory moves the entry back to memory.
+ *
+ *  Entries are invalidated when the image is updated or deleted.
+ */
+class ImageCache {
+  struct Entry {
+    std::string path;
+    std::vector<unsigned char> data;
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  struct SpillEntry {
+    std::string path;
+    std::string file;
+    size_t size;
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  static ImageCache *_cache;
+
+  // Entries in memory and in the spill directory, from most to least
+  // recently used, and the keys of the entries of each image path.
+  std::unordered_map<std::string, Entry> _entries;
+  std::list<std::string> _lru;
+  std::unordered_map<std::string, SpillEntry> _spilled;
+  std::list<std::string> _spill_lru;
+  std::unordered_map<std::string, std::unordered_set<std::string>> _keys;
+  std::mutex _lock;
+
+  size_t _memory_budget;
+  size_t _memory_used;
+
+  std::string _spill_path;
+  size_t _spill_budget;
+  size_t _spill_used;
+  unsigned long _spill_files;
+
+  long _hits;
+  long _misses;
+
+  // Must be called with _lock held
+  void evict();
+  void spill(const std::string &key, Entry &entry);
+  void evict_spilled();
+  bool unspill(const std::string &key, std::vector<unsigned char> &data);
+  void remove_spilled(const std::string &key);
+  void remove_key(const std::string &path, const std::string &key);
+
+public:
+  static bool init();
+  static ImageCache *instance();
+
+  /**
+   *  Whether the cache is initialized with a memory budget. The
+   *  callers skip the cache altogether otherwise.
+   */
+  static bool enabled();
+
+  /**
+   *  Key of an image read from path, transformed by the operations
+   *  (null if none) and encoded in the requested format (empty for
+   *  the format of the image in disk).
+   */
+  static std::string key(const std::string &path, const Json::Value &ops,
+                         const std::string &format);
+
+  /**
+   *  @param memory_budget  Bytes of encoded images kept in memory
+   *  @param spill_path  Directory for the entries evicted from
+   *    memory (empty to drop them)
+   *  @param spill_budget  Bytes of entries kept in spill_path
+   */
+  ImageCache(size_t memory_budget, const std::string &spill_path = "",
+             size_t spill_budget = 0);
+  ~ImageCache();
+
+  /**
+   *  Copies the encoded image of key into data.
+   *  Returns false if it is not cached.
+   */
+  bool lookup(const std::string &key, std::vector<unsigned char> &data);
+
+  /**
+   *  Caches the encoded image of key, read from path.
+   *  Images larger than the memory budget are not cached.
+   */
+  void insert(const std::string &key, const std::string &path,
+              const std::vector<unsigned char> &data);
+
+  /**
+   *  Drops every entry of the image at path.
+   */
+  void invalidate(const std::string &path);
+
+  ImageCacheStats get_stats();
+};
+}; // namespace VDMS
@@ -29,13 +29,19 @@
  *
  */
 
+#include <fcntl.h>
 #include <iostream>
+#include <set>
+#include <unistd.h>
 
+#include "ContentStore.h"
 #include "ImageCommand.h"
 #include "VDMSConfig.h"
 #include "defines.h"
 
+#include "ImageCache.h"
 #include "ImageLoop.h"
+#include "WorkerPool.h"
 
 using namespace VDMS;
 
@@ -124,6 +130,18 @@ VCL::Format ImageCommand::get_requested_format(const Json::Value &cmd) {
   return VCL::Format::NONE_IMAGE;
 }
 
+std::string ImageCommand::storage_root(const std::string &format) {
+  if (format == "png")
+    return VDMSConfig::instance()->get_path_png();
+  if (format == "jpg")
+    return VDMSConfig::instance()->get_path_jpg();
+  if (format == "tdb")
+    return VDMSConfig::instance()->get_path_tdb();
+  if (format == "bin")
+    return VDMSConfig::instance()->get_path_bin();
+  return "";
+}
+
 //========= AddImage definitions =========
 
 AddImage::AddImage() : ImageCommand("AddImage") {
@@ -156,12 +174,34 @@ int AddImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
   VCL::Format input_format =
       VCL::read_image_format((void *)blob.data(), blob.size());
   std::string image_fomrat = VCL::format_to_string(input_format);
-  if ((image_fomrat == format) && (!cmd.isMember("operations"))) {
+  bool same_format = (image_fomrat == format) && (!cmd.isMember("operations"));
+
+  // With content-addressed storage, an image already stored is linked
+  // instead of being decoded, encoded and written again.
+  std::string salt, none;
+  bool dedup = ContentStore::enabled() && from_file_path.empty() &&
+               format != "tdb" && !storage_root(format).empty() &&
+               ContentStore::image_salt(cmd["operations"],
+                                        same_format ? "" : format, salt);
+  bool stored = false;
+  if (dedup) {
+    file_name = ContentStore::reference(storage_root(format),
+                                        ContentStore::key(blob, salt), format,
+                                        same_format ? blob : none, stored);
+  }
+
+  if (stored) {
+    Json::Value props = get_value<Json::Value>(cmd, "properties");
+    props[VDMS_IM_PATH_PROP] = file_name;
+
+    query.AddNode(node_ref, VDMS_IM_TAG, props, Json::Value());
+  } else if (same_format) {
     if (image_fomrat == "png")
       img_root = _storage_png;
     else if (image_fomrat == "jpg")
       img_root = _storage_jpg;
-    file_name = VCL::create_unique(img_root, format);
+    if (!dedup)
+      file_name = VCL::create_unique(img_root, format);
     Json::Value props = get_value<Json::Value>(cmd, "properties");
     props[VDMS_IM_PATH_PROP] = file_name;
 
@@ -185,6 +225,8 @@ int AddImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
       img.set_connection(connection);
     }
     img.save_image(file_name, blob);
+    if (dedup)
+      ContentStore::commit(file_name);
 
   } else { // used when input format is not the same as the output format
     VCL::Image img;
@@ -194,6 +236,8 @@ int AddImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
     } else {
       if (is_local_file) {
         img = VCL::Image(from_file_path, false);
+        // Read from the file system, before the connection is set
+        img.perform_read();
       } else {
         img = VCL::Image(from_file_path, true);
       }
@@ -209,6 +253,14 @@ int AddImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
       operation_flags = enqueue_operations(img, cmd["operations"], true);
     }
 
+    if (cmd.isMember("tile_extent")) {
+      img.set_tile_extent(get_value<int>(cmd, "tile_extent"));
+    }
+
+    if (cmd.isMember("pyramid_levels")) {
+      img.set_pyramid_levels(get_value<int>(cmd, "pyramid_levels"));
+    }
+
     if (operation_flags != 0) {
       error["info"] = "custom function process not found";
       error["status"] = RSCommand::Error;
@@ -233,7 +285,8 @@ int AddImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
       return -1;
     }
 
-    file_name = VCL::create_unique(img_root, format);
+    if (!dedup)
+      file_name = VCL::create_unique(img_root, format);
 
     // Modifiyng the existing properties that the user gives
     // is a good option to make the AddNode more simple.
@@ -250,6 +303,8 @@ int AddImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
     query.AddNode(node_ref, VDMS_IM_TAG, props, Json::Value());
 
     img.store(file_name, input_format);
+    if (dedup)
+      ContentStore::commit(file_name);
 
     std::vector<Json::Value> image_metadata = img.get_ingest_metadata();
 
@@ -297,6 +352,241 @@ bool AddImage::need_blob(const Json::Value &cmd) {
   throw VCLException(UndefinedException, "Query Error");
 }
 
+//========= AddImageBatch definitions =========
+
+AddImageBatch::AddImageBatch() : ImageCommand("AddImageBatch") {
+  _use_aws_storage = VDMSConfig::instance()->get_aws_flag();
+}
+
+unsigned AddImageBatch::blob_count(const Json::Value &cmd) {
+  return get_value<int>(cmd[_cmd_name], "count");
+}
+
+void AddImageBatch::sync_files(const std::vector<std::string> &paths,
+                               std::vector<std::string> &errors) {
+  WorkerPool::instance()->parallel_for(paths.size(), [&](size_t i) {
+    if (!errors[i].empty())
+      return;
+
+    int fd = open(paths[i].c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0)
+      errors[i] = "Image could not be written";
+    if (fd >= 0)
+      close(fd);
+  });
+
+  std::set<std::string> dirs;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (errors[i].empty())
+      dirs.insert(paths[i].substr(0, paths[i].rfind('/')));
+  }
+
+  for (auto &dir : dirs) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+}
+
+int AddImageBatch::construct_protobuf(PMGDQuery &query,
+                                      const Json::Value &jsoncmd,
+                                      const std::string &blob, int grp_id,
+                                      Json::Value &error) {
+  std::vector<const std::string *> blobs = {&blob};
+  return construct_protobuf_blobs(query, jsoncmd, blobs, grp_id, error);
+}
+
+int AddImageBatch::construct_protobuf_blobs(
+    PMGDQuery &query, const Json::Value &jsoncmd,
+    const std::vector<const std::string *> &blobs, int grp_id,
+    Json::Value &error) {
+  const Json::Value &cmd = jsoncmd[_cmd_name];
+  const Json::Value &columns = cmd["properties"];
+  const std::string format = get_value<std::string>(cmd, "format", "");
+  size_t n = blobs.size();
+
+  for (auto &name : columns.getMemberNames()) {
+    if (columns[name].size() != n) {
+      error["info"] = "Property " + name + " must have " + std::to_string(n) +
+                      " values, one per image";
+      error["status"] = RSCommand::Error;
+      return -1;
+    }
+  }
+
+  std::vector<std::string> paths(n);
+  std::vector<std::string> errors(n);
+  std::vector<VCL::Format> input_formats(n);
+  std::vector<VCL::Format> formats(n, get_requested_format(cmd));
+
+  // Without "format", the images are kept in the format they come in
+  for (size_t i = 0; i < n; ++i) {
+    input_formats[i] =
+        VCL::read_image_format((void *)blobs[i]->data(), blobs[i]->size());
+    if (format.empty())
+      formats[i] = input_formats[i];
+
+    if (storage_root(VCL::format_to_string(formats[i])).empty())
+      errors[i] = "Image format not recognized";
+  }
+
+  // Decode, transform, encode and write each image on the worker threads
+  WorkerPool::instance()->parallel_for(n, [&](size_t i) {
+    if (!errors[i].empty())
+      return;
+
+    const std::string &blob = *blobs[i];
+    const std::string img_format = VCL::format_to_string(formats[i]);
+    const std::string img_root = storage_root(img_format);
+    bool as_is = formats[i] == input_formats[i] && !cmd.isMember("operations");
+
+    // Images already stored are only linked (see AddImage)
+    std::string salt, none;
+    bool dedup = ContentStore::enabled() && formats[i] != VCL::Format::TDB &&
+                 ContentStore::image_salt(cmd["operations"],
+                                          as_is ? "" : img_format, salt);
+    bool stored = false;
+    if (dedup) {
+      paths[i] = ContentStore::reference(
+          img_root, ContentStore::key(blob, salt), img_format,
+          as_is ? blob : none, stored);
+      if (stored)
+        return;
+    } else {
+      paths[i] = VCL::create_unique(img_root, img_format);
+    }
+
+    try {
+      VCL::Image img;
+
+      if (as_is) {
+        img = VCL::Image(paths[i], blob, input_formats[i]);
+      } else {
+        char binary_img_flag = formats[i] == VCL::Format::BIN ? 1 : 0;
+        img = VCL::Image((void *)blob.data(), blob.size(), binary_img_flag);
+      }
+
+      if (_use_aws_storage) {
+        VCL::RemoteConnection *connection = new VCL::RemoteConnection();
+        std::string bucket = VDMSConfig::instance()->get_bucket_name();
+        connection->_bucket_name = bucket;
+        img.set_connection(connection);
+      }
+
+      if (as_is) {
+        // Written as is, without decoding and encoding it again
+        img.save_image(paths[i], blob);
+        if (dedup)
+          ContentStore::commit(paths[i]);
+        return;
+      }
+
+      if (cmd.isMember("operations") &&
+          enqueue_operations(img, cmd["operations"], true) != 0) {
+        errors[i] = "custom function process not found";
+        return;
+      }
+
+      img.store(paths[i], formats[i]);
+      if (dedup)
+        ContentStore::commit(paths[i]);
+
+      if (output_vcl_timing) {
+        img.timers.print_map_runtimes();
+      }
+    } catch (VCL::Exception &e) {
+      print_exception(e);
+      errors[i] = "VCL Exception";
+    } catch (ExceptionCommand &e) {
+      print_exception(e);
+      errors[i] = "Image operation not defined";
+    }
+  });
+
+  // TileDB arrays are directories, synced by TileDB
+  if (!_use_aws_storage) {
+    std::vector<size_t> files;
+    for (size_t i = 0; i < n; ++i) {
+      if (formats[i] != VCL::Format::TDB && errors[i].empty())
+        files.push_back(i);
+    }
+
+    std::vector<std::string> file_paths, file_errors(files.size());
+    for (size_t i : files)
+      file_paths.push_back(paths[i]);
+
+    sync_files(file_paths, file_errors);
+    for (size_t j = 0; j < files.size(); ++j) {
+      if (!file_errors[j].empty())
+        errors[files[j]] = file_errors[j];
+    }
+  }
+
+  Json::Value items(Json::arrayValue);
+  Json::Value images_added(Json::arrayValue);
+
+  for (size_t i = 0; i < n; ++i) {
+    Json::Value item;
+
+    if (!errors[i].empty()) {
+      item["status"] = RSCommand::Error;
+      item["info"] = errors[i];
+      items.append(item);
+      continue;
+    }
+
+    Json::Value props;
+    for (auto &name : columns.getMemberNames())
+      props[name] = columns[name][(int)i];
+    props[VDMS_IM_PATH_PROP] = paths[i];
+
+    query.AddNode(query.get_available_reference(), VDMS_IM_TAG, props,
+                  Json::Value());
+
+    item["status"] = RSCommand::Success;
+    items.append(item);
+    images_added.append(paths[i]);
+  }
+
+  // In case we need to cleanup the query
+  error["images_added"] = images_added;
+  error["items"] = items;
+
+  return 0;
+}
+
+Json::Value AddImageBatch::construct_responses(
+    Json::Value &responses, const Json::Value &json,
+    protobufs::queryMessage &query_res, const std::string &blob) {
+  Json::Value items = json["cp_result"]["items"];
+
+  // One response per node added, in the order of the images
+  unsigned added = 0;
+  unsigned r = 0;
+  for (auto &item : items) {
+    if (item["status"] != RSCommand::Success)
+      continue;
+
+    if (r >= responses.size() ||
+        responses[r]["status"] != PMGDCmdResponse::Success) {
+      item["status"] = RSCommand::Error;
+      item["info"] = "Image node not added";
+    } else {
+      added++;
+    }
+    r++;
+  }
+
+  Json::Value ret;
+  ret[_cmd_name]["status"] = RSCommand::Success;
+  ret[_cmd_name]["count"] = added;
+  ret[_cmd_name]["items"] = items;
+
+  return ret;
+}
+
 //========= UpdateImage definitions =========
 
 UpdateImage::UpdateImage() : ImageCommand("UpdateImage") {}
@@ -359,14 +649,92 @@ int FindImage::construct_protobuf(PMGDQuery &query, const Json::Value &jsoncmd,
   return 0;
 }
 
+// The operations that only use the image itself, which can run on
+// many images at once. The others go through the ImageLoop (remote
+// operations), or share a single channel with another process.
+bool FindImage::parallel_operations(const Json::Value &ops) {
+  for (auto &op : ops) {
+    const std::string &type = get_value<std::string>(op, "type");
+    if (type != "threshold" && type != "resize" && type != "crop" &&
+        type != "flip" && type != "rotate")
+      return false;
+  }
+  return true;
+}
+
+// We will return the image in the format the user request, or on its
+// format in disk, except for the case of .tdb, where we will encode as png.
+VCL::Format FindImage::image_format(VCL::Image &img, const Json::Value &cmd) {
+  if (cmd.isMember("format"))
+    return get_requested_format(cmd);
+
+  return img.get_image_format() != VCL::Format::TDB ? img.get_image_format()
+                                                    : VCL::Format::PNG;
+}
+
+std::string FindImage::encode_parallel(const std::vector<std::string> &paths,
+                                       const Json::Value &cmd,
+                                       protobufs::queryMessage &query_res) {
+  std::vector<std::vector<unsigned char>> encoded(paths.size());
+  std::vector<std::string> errors(paths.size());
+
+  ImageCache *cache = ImageCache::enabled() ? ImageCache::instance() : NULL;
+  const std::string format = get_value<std::string>(cmd, "format", "");
+
+  // Read, transform and encode each image on the worker threads
+  WorkerPool::instance()->parallel_for(paths.size(), [&](size_t i) {
+    std::string key;
+    if (cache) {
+      key = ImageCache::key(paths[i], cmd["operations"], format);
+      if (cache->lookup(key, encoded[i]))
+        return;
+    }
+
+    try {
+      VCL::Image img(paths[i]);
+      if (_use_aws_storage) {
+        VCL::RemoteConnection *connection = new VCL::RemoteConnection();
+        std::string bucket = VDMSConfig::instance()->get_bucket_name();
+        connection->_bucket_name = bucket;
+        img.set_connection(connection);
+      }
+
+      if (cmd.isMember("operations"))
+        enqueue_operations(img, cmd["operations"]);
+
+      encoded[i] = img.get_encoded_image(image_format(img, cmd));
+      if (cache && !encoded[i].empty())
+        cache->insert(key, paths[i], encoded[i]);
+
+      if (output_vcl_timing) {
+        img.timers.print_map_runtimes();
+      }
+    } catch (VCL::Exception e) {
+      print_exception(e);
+      errors[i] = "VCL Exception";
+    }
+  });
+
+  // The blobs go in the order of the entities
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!errors[i].empty())
+      return errors[i];
+    if (encoded[i].empty())
+      return "Image Data not found";
+
+    std::string *img_str = query_res.add_blobs();
+    img_str->assign((const char *)encoded[i].data(), encoded[i].size());
+  }
+
+  return "";
+}
+
 Json::Value FindImage::construct_responses(Json::Value &responses,
                                            const Json::Value &json,
                                            protobufs::queryMessage &query_res,
                                            const std::string &blob) {
   const Json::Value &cmd = json[_cmd_name];
   int operation_flags = 0;
-  bool has_operations = false;
-  std::string no_op_def_image;
   Json::Value ret;
 
   std::map<std::string, VCL::Format> formats;
@@ -409,108 +777,87 @@ Json::Value FindImage::construct_responses(Json::Value &responses,
   // Check if blob (image) must be returned
   if (get_value<bool>(results, "blob", true)) {
 
-    ImageLoop eventloop;
-    eventloop.set_nrof_entities(findImage["entities"].size());
-
+    std::vector<std::string> paths;
     for (auto &ent : findImage["entities"]) {
       assert(ent.isMember(VDMS_IM_PATH_PROP));
 
-      std::string im_path;
       if (cmd.isMember("metaconstraints")) {
-        im_path = ent[VDMS_DM_IMG_NAME_PROP].asString();
+        paths.push_back(ent[VDMS_DM_IMG_NAME_PROP].asString());
       } else {
-        im_path = ent[VDMS_IM_PATH_PROP].asString();
+        paths.push_back(ent[VDMS_IM_PATH_PROP].asString());
         ent.removeMember(VDMS_IM_PATH_PROP);
       }
 
       if (ent.getMemberNames().size() == 0) {
         flag_empty = true;
       }
+    }
 
-      try {
-        VCL::Image img(im_path);
-        if (_use_aws_storage) {
-          VCL::RemoteConnection *connection = new VCL::RemoteConnection();
-          std::string bucket = VDMSConfig::instance()->get_bucket_name();
-          connection->_bucket_name = bucket;
-          img.set_connection(connection);
-        }
-
-        if (cmd.isMember("operations")) {
-          operation_flags = enqueue_operations(img, cmd["operations"]);
-          has_operations = true;
-        }
+    if (cmd.isMember("format")) {
+      VCL::Format format = get_requested_format(cmd);
+      if (format == VCL::Format::NONE_IMAGE || format == VCL::Format::TDB) {
+        Json::Value return_error;
+        return_error["status"] = RSCommand::Error;
+        return_error["info"] = "Invalid Requested Format for FindImage";
+        return error(return_error);
+      }
+    }
 
-        // We will return the image in the format the user
-        // request, or on its format in disk, except for the case
-        // of .tdb, where we will encode as png.
-        VCL::Format format = img.get_image_format() != VCL::Format::TDB
-                                 ? img.get_image_format()
-                                 : VCL::Format::PNG;
+    if (!cmd.isMember("operations") || parallel_operations(cmd["operations"])) {
+      std::string info = encode_parallel(paths, cmd, query_res);
+      if (!info.empty()) {
+        Json::Value return_error;
+        return_error["status"] = RSCommand::Error;
+        return_error["info"] = info;
+        return error(return_error);
+      }
+    } else {
+      ImageLoop eventloop;
+      eventloop.set_nrof_entities(paths.size());
+
+      for (const std::string &im_path : paths) {
+        try {
+          VCL::Image img(im_path);
+          if (_use_aws_storage) {
+            VCL::RemoteConnection *connection = new VCL::RemoteConnection();
+            std::string bucket = VDMSConfig::instance()->get_bucket_name();
+            connection->_bucket_name = bucket;
+            img.set_connection(connection);
+          }
 
-        if (operation_flags != 0) {
-          Json::Value return_error;
-          return_error["info"] = "custom function process not found";
-          return_error["status"] = RSCommand::Error;
-          return error(return_error);
-        }
-        if (cmd.isMember("format")) {
-          format = get_requested_format(cmd);
-          if (format == VCL::Format::NONE_IMAGE || format == VCL::Format::TDB) {
+          operation_flags = enqueue_operations(img, cmd["operations"]);
+          if (operation_flags != 0) {
             Json::Value return_error;
+            return_error["info"] = "custom function process not found";
             return_error["status"] = RSCommand::Error;
-            return_error["info"] = "Invalid Requested Format for FindImage";
             return error(return_error);
           }
-        }
 
-        if (has_operations) {
-          formats.insert(
-              std::pair<std::string, VCL::Format>(img.get_image_id(), format));
+          formats.insert(std::pair<std::string, VCL::Format>(
+              img.get_image_id(), image_format(img, cmd)));
           eventloop.enqueue(&img);
-        } else {
-          std::vector<unsigned char> img_enc;
-          img_enc = img.get_encoded_image(format);
-          no_op_def_image = img.get_image_id();
-          if (!img_enc.empty()) {
-            std::string *img_str = query_res.add_blobs();
-            img_str->resize(img_enc.size());
-            std::memcpy((void *)img_str->data(), (void *)img_enc.data(),
-                        img_enc.size());
-          } else {
-            Json::Value return_error;
-            return_error["status"] = RSCommand::Error;
-            return_error["info"] = "Image Data not found";
-            return error(return_error);
-          }
-        }
 
-      } catch (VCL::Exception e) {
-        print_exception(e);
-        Json::Value return_error;
-        return_error["status"] = RSCommand::Error;
-        return_error["info"] = "VCL Exception";
-        return error(return_error);
+        } catch (VCL::Exception e) {
+          print_exception(e);
+          Json::Value return_error;
+          return_error["status"] = RSCommand::Error;
+          return_error["info"] = "VCL Exception";
+          return error(return_error);
+        }
       }
-    }
 
-    if (has_operations) {
-      while (eventloop.is_loop_running()) {
-        continue;
-      }
-      std::map<std::string, VCL::Image *> imageMap = eventloop.get_image_map();
-      std::map<std::string, VCL::Image *>::iterator iter = imageMap.begin();
+      eventloop.wait();
 
-      if (iter->second->get_query_error_response() != "") {
+      if (!eventloop.get_error().empty()) {
         Json::Value return_error;
         return_error["status"] = RSCommand::Error;
-        return_error["info"] = iter->second->get_query_error_response();
+        return_error["info"] = eventloop.get_error();
         return error(return_error);
       }
 
-      while (iter != imageMap.end()) {
+      for (VCL::Image *img : eventloop.get_images()) {
         std::vector<unsigned char> img_enc =
-            iter->second->get_encoded_image_async(formats[iter->first]);
+            img->get_encoded_image_async(formats[img->get_image_id()]);
         if (!img_enc.empty()) {
           std::string *img_str = query_res.add_blobs();
           img_str->resize(img_enc.size());
@@ -524,18 +871,28 @@ Json::Value FindImage::construct_responses(Json::Value &responses,
         }
 
         if (output_vcl_timing) {
-          iter->second->timers.print_map_runtimes();
+          img->timers.print_map_runtimes();
         }
-
-        iter++;
       }
-    } else {
-      eventloop.close_no_operation_loop(no_op_def_image);
     }
   }
   if (flag_empty) {
     findImage.removeMember("entities");
   }
+
+  if (get_value<bool>(cmd, "metrics", false) && ImageCache::enabled()) {
+    ImageCacheStats stats = ImageCache::instance()->get_stats();
+    long lookups = stats.hits + stats.misses;
+    Json::Value metrics;
+    metrics["hits"] = Json::Int64(stats.hits);
+    metrics["misses"] = Json::Int64(stats.misses);
+    metrics["hit_ratio"] = lookups > 0 ? double(stats.hits) / lookups : 0.0;
+    metrics["memory"] = Json::UInt64(stats.memory);
+    metrics["spilled"] = Json::UInt64(stats.spilled);
+    metrics["entries"] = Json::UInt64(stats.entries);
+    findImage["metrics"] = metrics;
+  }
+
   ret[_cmd_name].swap(findImage);
   return ret;
 }
@@ -66,6 +66,9 @@ public:
 
 protected:
   bool output_vcl_timing;
+
+  // Directory of the images stored in format, empty if not supported
+  std::string storage_root(const std::string &format);
 };
 
 class AddImage : public ImageCommand {
@@ -85,6 +88,39 @@ public:
   bool need_blob(const Json::Value &cmd);
 };
 
+// Adds "count" images, from as many blobs, with the properties given
+// as columns (one array of "count" values per property). The images
+// are encoded and written in parallel, synced to disk together, and
+// all their nodes go in the transaction of the query. An image that
+// cannot be added is reported in "items" and left out, without
+// failing the others.
+class AddImageBatch : public ImageCommand {
+  // Syncs the files written, and then each of their directories once.
+  // Sets the error of the files that could not be synced.
+  void sync_files(const std::vector<std::string> &paths,
+                  std::vector<std::string> &errors);
+
+public:
+  AddImageBatch();
+
+  int construct_protobuf(PMGDQuery &tx, const Json::Value &root,
+                         const std::string &blob, int grp_id,
+                         Json::Value &error);
+
+  int construct_protobuf_blobs(PMGDQuery &tx, const Json::Value &root,
+                               const std::vector<const std::string *> &blobs,
+                               int grp_id, Json::Value &error);
+
+  bool need_blob(const Json::Value &cmd) { return true; }
+
+  unsigned blob_count(const Json::Value &cmd);
+
+  Json::Value construct_responses(Json::Value &json_responses,
+                                  const Json::Value &json,
+                                  protobufs::queryMessage &response,
+                                  const std::string &blob);
+};
+
 class UpdateImage : public ImageCommand {
 public:
   UpdateImage();
@@ -100,6 +136,15 @@ public:
 class FindImage : public ImageCommand {
   // bool _use_aws_storage;
 
+  bool parallel_operations(const Json::Value &ops);
+  VCL::Format image_format(VCL::Image &img, const Json::Value &cmd);
+
+  // Adds the encoded images at paths to the blobs of query_res, in
+  // order. Returns the error info, empty on success.
+  std::string encode_parallel(const std::vector<std::string> &paths,
+                              const Json::Value &cmd,
+                              protobufs::queryMessage &query_res);
+
 public:
   FindImage();
   int construct_protobuf(PMGDQuery &tx, const Json::Value &root,
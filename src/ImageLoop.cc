@@ -33,112 +33,151 @@
 #include <curl/curl.h>
 
 #include "VDMSConfig.h"
+#include "WorkerPool.h"
 
 ImageLoop::~ImageLoop() noexcept {
-  VCL::Image img(imageMap.begin()->first);
-  m_running = false;
-  r_running = false;
-  destroyed = true;
-
-  enqueue(&img);
-  m_thread.join();
+  // After a failure, the tasks of the other images may still be running
+  std::unique_lock<std::mutex> lock(_lock);
+  _tasks_done.wait(lock, [this] { return _tasks == 0; });
+}
 
-  r_enqueue(&img);
-  r_thread.join();
+void ImageLoop::set_nrof_entities(int nrof_entities) {
+  std::lock_guard<std::mutex> guard(_lock);
+  _nrof_entities = nrof_entities;
 }
 
-bool ImageLoop::is_loop_running() {
-  if (m_running || r_running) {
-    return true;
-  } else {
-    return false;
+void ImageLoop::enqueue(VCL::Image *img) noexcept {
+  VCL::Image *moved = new VCL::Image(std::move(*img));
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _images.emplace_back(moved);
+    ++_pending;
   }
+  submit(moved);
 }
 
-void ImageLoop::close_no_operation_loop(std::string imageid) {
-  VCL::Image img(imageid);
-  auto const result =
-      imageMap.insert(std::pair<std::string, VCL::Image *>(imageid, &img));
-  if (not result.second) {
-    result.first->second = &img;
+// Nothing else is enqueued from here: the remote operations no longer
+// wait for the entities that were not enqueued.
+void ImageLoop::wait() {
+  std::vector<VCL::Image *> batch;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _closed = true;
+    if (take_remote_batch(batch))
+      ++_tasks;
+    else if (_tasks == 0)
+      finish();
   }
+
+  if (!batch.empty()) {
+    execute_remote_operations(batch);
+    task_done();
+  }
+
+  _finished_future.wait();
 }
 
-void ImageLoop::set_nrof_entities(int nrof_entities) {
-  _nrof_entities = nrof_entities;
+std::string ImageLoop::get_error() {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _error;
 }
 
-void ImageLoop::enqueue(VCL::Image *img) noexcept {
+std::vector<VCL::Image *> ImageLoop::get_images() {
+  std::lock_guard<std::mutex> guard(_lock);
+  std::vector<VCL::Image *> images;
+  for (auto &img : _images)
+    images.push_back(img.get());
+  return images;
+}
+
+void ImageLoop::submit(VCL::Image *img) {
   {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    m_writeBuffer.push_back(new VCL::Image(*img));
+    std::lock_guard<std::mutex> guard(_lock);
+    ++_tasks;
   }
-  m_condVar.notify_one();
+  VDMS::WorkerPool::instance()->submit([this, img]() {
+    run_operations(img);
+    task_done();
+  });
 }
 
-void ImageLoop::r_enqueue(VCL::Image *img) noexcept {
-  {
-    std::lock_guard<std::mutex> guard(r_mutex);
-    r_writeBuffer.push_back(new VCL::Image(*img));
+void ImageLoop::task_done() {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (--_tasks == 0) {
+    finish();
+    _tasks_done.notify_all();
   }
-  r_condVar.notify_one();
 }
 
-std::map<std::string, VCL::Image *> ImageLoop::get_image_map() {
-  return imageMap;
+void ImageLoop::finish() {
+  if (!_finished && _closed && (_pending == 0 || !_error.empty())) {
+    _finished = true;
+    _done.set_value();
+  }
 }
 
-void ImageLoop::operationThread() noexcept {
-  std::vector<VCL::Image *> readBuffer;
+void ImageLoop::fail(const std::string &error) {
+  if (_error.empty())
+    _error = error.empty() ? "Image operation failed" : error;
+}
 
-  while (m_running) {
-    {
-      std::unique_lock<std::mutex> lock(m_mutex);
-      m_condVar.wait(lock, [this] { return !m_writeBuffer.empty(); });
-      readBuffer.swap(m_writeBuffer);
-    }
-    int flag = 0;
-    for (VCL::Image *img : readBuffer) {
-      int enqueued_operations = img->get_enqueued_operation_count();
-
-      for (int i = img->get_op_completed(); i < enqueued_operations; i++) {
-        int response = img->execute_operation();
-        if (response == -1) {
-          // Remote operation encountered. Enqueue to remote thread
-          r_enqueue(img);
-          flag = 1;
-          break;
-        } else if (response == -2) {
-          // Exception thrown. Terminate eventloop.
-          auto const result = imageMap.insert(
-              std::pair<std::string, VCL::Image *>(img->get_image_id(), img));
-          if (not result.second) {
-            result.first->second = img;
-          }
-          _remote_running = false;
-          flag = 0;
-          m_writeBuffer.clear();
-          r_writeBuffer.clear();
-          m_running = false;
-          r_running = false;
-          break;
+bool ImageLoop::take_remote_batch(std::vector<VCL::Image *> &batch) {
+  if (_remote_batch.empty() || _remote_batch.size() < _pending)
+    return false;
+  if (!_closed && _images.size() < _nrof_entities)
+    return false;
+  batch.swap(_remote_batch);
+  return true;
+}
 
-        } else {
-          auto const result = imageMap.insert(
-              std::pair<std::string, VCL::Image *>(img->get_image_id(), img));
-          if (not result.second) {
-            result.first->second = img;
-          }
-        }
+// Runs the operations of the image up to its next remote operation.
+// The last image to get there sends all of them to the remote server.
+void ImageLoop::run_operations(VCL::Image *img) {
+  std::vector<VCL::Image *> batch;
+
+  try {
+    // The image is read on the worker, not when it is enqueued
+    img->perform_read();
+
+    int enqueued_operations = img->get_enqueued_operation_count();
+
+    for (int i = img->get_op_completed(); i < enqueued_operations; i++) {
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!_error.empty())
+          return;
+      }
+
+      int response = img->execute_operation();
+      if (response == -2) {
+        std::lock_guard<std::mutex> guard(_lock);
+        fail(img->get_query_error_response());
+        return;
+      }
+
+      if (response == -1) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _remote_batch.push_back(img);
+        if (!take_remote_batch(batch))
+          return;
+        break;
       }
     }
-    readBuffer.clear();
-    if (flag == 0 && _remote_running == false && m_writeBuffer.size() == 0 &&
-        r_writeBuffer.size() == 0) {
-      m_running = false;
-      r_running = false;
-    }
+  } catch (VCL::Exception e) {
+    print_exception(e);
+    std::lock_guard<std::mutex> guard(_lock);
+    fail(e.msg);
+    return;
   }
+
+  if (batch.empty()) {
+    std::lock_guard<std::mutex> guard(_lock);
+    --_pending;
+    if (!take_remote_batch(batch))
+      return;
+  }
+
+  execute_remote_operations(batch);
 }
 
 size_t writeCallback(char *ip, size_t size, size_t nmemb, void *op) {
@@ -223,16 +262,15 @@ void clear_temp_files(std::vector<std::string> tempfiles) {
   }
 }
 
+// Runs on a task of the pool: the images continue with their next
+// operations on tasks of their own once the responses are decoded.
 void ImageLoop::execute_remote_operations(
     std::vector<VCL::Image *> &readBuffer) {
-  int flag = 0;
   int start_index = 0;
   int step = 10;
   int end_index = readBuffer.size() > step ? step : readBuffer.size();
   std::vector<std::string> responseBuffer(readBuffer.size());
   int rindex = 0;
-  std::vector<std::string> redoBuffer;
-  std::vector<VCL::Image *> pendingImages;
   try {
     while (start_index != readBuffer.size()) {
       CURLM *multi_handle;
@@ -280,6 +318,8 @@ void ImageLoop::execute_remote_operations(
           curl_easy_getinfo(eh, CURLINFO_REQUEST_SIZE, &rsize);
 
           if (http_status_code != 200) {
+            curl_multi_cleanup(multi_handle);
+
             // Throw specific exceptions if error codes received as response.
             if (http_status_code == 0) {
               throw VCLException(ObjectEmpty, "Remote server is not running.");
@@ -309,85 +349,39 @@ void ImageLoop::execute_remote_operations(
         }
       }
 
+      curl_multi_cleanup(multi_handle);
+
       tempBuffer.clear();
       start_index = end_index;
       end_index = readBuffer.size() > (end_index + step) ? (end_index + step)
                                                          : readBuffer.size();
     }
-    rindex = -1;
-    for (VCL::Image *img : readBuffer) {
-      rindex++;
-      if (std::find(redoBuffer.begin(), redoBuffer.end(),
-                    img->get_image_id().data()) != redoBuffer.end()) {
-        pendingImages.push_back(img);
-        continue;
-      }
 
-      int rthresh = 0;
-      auto t_start = std::chrono::high_resolution_clock::now();
-      bool rflag = false;
-      while (responseBuffer[rindex].size() == 0) {
-        continue;
-      }
+    // The transfers are complete: every response is in its buffer
+    for (rindex = 0; rindex < readBuffer.size(); ++rindex) {
       cv::Mat dmat = write_image(responseBuffer[rindex]);
       if (dmat.empty()) {
-        pendingImages.push_back(img);
+        throw VCLException(ObjectEmpty,
+                           "Remote server returned an invalid image.");
       }
 
+      VCL::Image *img = readBuffer[rindex];
       img->shallow_copy_cv(dmat);
       img->update_op_completed();
-
-      auto const result = imageMap.insert(
-          std::pair<std::string, VCL::Image *>(img->get_image_id(), img));
-      if (not result.second) {
-        result.first->second = img;
-      }
-      if (rindex == readBuffer.size() - 1 && pendingImages.size() == 0) {
-        _remote_running = false;
-      }
-
-      enqueue(img);
     }
-    readBuffer.clear();
-    std::swap(readBuffer, pendingImages);
   } catch (VCL::Exception e) {
-    VCL::Image *img = readBuffer[0];
-    img->set_query_error_response(e.msg);
-    auto const result = imageMap.insert(
-        std::pair<std::string, VCL::Image *>(img->get_image_id(), img));
-    if (not result.second) {
-      result.first->second = img;
-    }
-    readBuffer.clear();
     print_exception(e);
-    _remote_running = false;
-    m_writeBuffer.clear();
-    r_writeBuffer.clear();
-    m_running = false;
-    r_running = false;
+    clear_temp_files(_tempfiles);
+    _tempfiles.clear();
+    std::lock_guard<std::mutex> guard(_lock);
+    fail(e.msg);
     return;
   }
-}
-
-void ImageLoop::remoteOperationThread() noexcept {
-  std::vector<VCL::Image *> readBuffer;
 
-  while (r_running) {
-    {
-      std::unique_lock<std::mutex> rlock(r_mutex);
-      r_condVar.wait(rlock, [this] { return !r_writeBuffer.empty(); });
-      if (r_writeBuffer.size() == _nrof_entities) {
-        std::swap(readBuffer, r_writeBuffer);
-      }
-    }
+  clear_temp_files(_tempfiles);
+  _tempfiles.clear();
 
-    if (readBuffer.size() == _nrof_entities && destroyed == false) {
-      _remote_running = true;
-      while (readBuffer.size() > 0) {
-        execute_remote_operations(readBuffer);
-      }
-      clear_temp_files(_tempfiles);
-      _remote_running = false;
-    }
+  for (VCL::Image *img : readBuffer) {
+    submit(img);
   }
-}
\ No newline at end of file
+}
@@ -29,13 +29,26 @@
  *
  */
 
+#pragma once
+
 #include "vcl/Image.h"
 #include <condition_variable>
-#include <functional>
 #include <future>
-#include <thread>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
+#include <curl/curl.h>
+
+/**
+ * Runs the operations of the images of a query on the WorkerPool.
+ * The local operations of each image run as a task of the pool;
+ * when every image reaches a remote operation, a single task sends
+ * them to the remote server, and the images continue with their
+ * next operations. No threads are created per query, and wait()
+ * blocks until the images are done.
+ */
 class ImageLoop {
 public:
   ImageLoop() = default;
@@ -46,37 +59,70 @@ public:
   ImageLoop &operator=(const ImageLoop &) = delete;
   ImageLoop &operator=(ImageLoop &&) noexcept = delete;
 
+  /**
+   * Sets the number of images that will be enqueued
+   * @param nrof_entities Number of entities in the query response
+   */
   void set_nrof_entities(int nrof_entities);
 
+  /**
+   * Starts the operations of the image, which is moved into the loop:
+   * img is left without data or operations
+   * @param img The image, with its operations enqueued
+   */
   void enqueue(VCL::Image *img) noexcept;
-  void r_enqueue(VCL::Image *img) noexcept;
 
-  std::map<std::string, VCL::Image *> get_image_map();
+  /**
+   * Blocks until the operations of every image enqueued are done,
+   * or one of them failed. No images are enqueued after it.
+   */
+  void wait();
 
-  bool is_loop_running();
-  void close_no_operation_loop(std::string imageid);
+  /**
+   * The error of the image that failed, empty if none
+   */
+  std::string get_error();
+
+  /**
+   * The operated images, in the order they were enqueued
+   */
+  std::vector<VCL::Image *> get_images();
 
 private:
+  std::vector<std::unique_ptr<VCL::Image>> _images;
+
+  // Images enqueued whose operations are not done, out of the
+  // expected ones. No more are enqueued once closed.
+  int _pending = 0;
   int _nrof_entities = 0;
-  bool destroyed = false;
-  bool _remote_running = false;
+  bool _closed = false;
+
+  std::string _error;
+
+  // Images waiting for the others to reach their remote operation
+  std::vector<VCL::Image *> _remote_batch;
   std::vector<std::string> _tempfiles;
-  std::map<std::string, VCL::Image *> imageMap;
-
-  std::vector<VCL::Image *> m_writeBuffer;
-  std::mutex m_mutex;
-  std::condition_variable m_condVar;
-  bool m_running{true};
-  std::thread m_thread{&ImageLoop::operationThread, this};
-  void operationThread() noexcept;
-
-  std::vector<VCL::Image *> r_writeBuffer;
-  std::mutex r_mutex;
-  std::condition_variable r_condVar;
-  bool r_running{true};
-  std::thread r_thread{&ImageLoop::remoteOperationThread, this};
-  void remoteOperationThread() noexcept;
+
+  // Tasks of this loop on the pool, which the destructor waits for
+  int _tasks = 0;
+
+  std::mutex _lock;
+  std::condition_variable _tasks_done;
+
+  // Set once the images are done (or failed) and no task is left
+  bool _finished = false;
+  std::promise<void> _done;
+  std::future<void> _finished_future = _done.get_future();
+
+  void submit(VCL::Image *img);
+  void run_operations(VCL::Image *img);
+  void task_done();
+
+  // Must be called with _lock held
+  void finish();
+  void fail(const std::string &error);
+  bool take_remote_batch(std::vector<VCL::Image *> &batch);
 
   CURL *get_easy_handle(VCL::Image *img, std::string &readBuffer);
   void execute_remote_operations(std::vector<VCL::Image *> &readBuffer);
-};
\ No newline at end of file
+};
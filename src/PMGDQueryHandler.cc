@@ -30,6 +30,8 @@
  */
 
 #include "PMGDQueryHandler.h"
+#include "ContentStore.h"
+#include "ImageCache.h"
 #include "PMGDIterators.h"
 #include "VDMSConfig.h"
 #include "defines.h"
@@ -296,9 +298,16 @@ int PMGDQueryHandler::update_node(const protobufs::UpdateNode &un,
 
   auto nit = it->second;
   long updated = 0;
+  bool image_cache = ImageCache::enabled();
   for (; *nit; nit->next()) {
     Node &n = **nit;
     updated++;
+
+    // The cached encodings of an image are not valid after an update
+    Property img_prop;
+    if (image_cache && n.check_property(VDMS_IM_PATH_PROP, img_prop))
+      ImageCache::instance()->invalidate(img_prop.string_value());
+
     for (int i = 0; i < un.properties_size(); ++i) {
       const protobufs::Property &p = un.properties(i);
       set_property(n, p);
@@ -801,6 +810,8 @@ void PMGDQueryHandler::build_results(Iterator &ni,
                                img_prop)) // delete image if present
         {
           _cleanup_filename_list.push_back(img_prop.string_value());
+          if (ImageCache::enabled())
+            ImageCache::instance()->invalidate(img_prop.string_value());
         }
         Property vid_prop;
         if (ni->check_property(VDMS_VID_PATH_PROP,
@@ -951,6 +962,9 @@ int PMGDQueryHandler::delete_expired_nodes() {
                                         img_prop)) // delete image if present
       {
         remove(img_prop.string_value().c_str());
+        ContentStore::release(img_prop.string_value());
+        if (ImageCache::enabled())
+          ImageCache::instance()->invalidate(img_prop.string_value());
       }
       Property vid_prop;
       if (tmp_node_node->check_property(VDMS_VID_PATH_PROP,
@@ -963,6 +977,7 @@ int PMGDQueryHandler::delete_expired_nodes() {
                                         blob_prop)) // delete image if present
       {
         remove(blob_prop.string_value().c_str());
+        ContentStore::release(blob_prop.string_value());
       }
 
       _db->remove(*(
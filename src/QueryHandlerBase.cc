@@ -3,6 +3,7 @@
 //
 
 #include "QueryHandlerBase.h"
+#include "ContentStore.h"
 #include "ImageCommand.h"
 #include "VideoCommand.h"
 
@@ -29,6 +30,7 @@ void QueryHandlerBase::cleanup_query(const std::vector<std::string> &images,
         throw VCLException(UndefinedException,
                            "delete_image() failed: " + img_path);
       }
+      ContentStore::release(img_path);
     }
 
     for (auto &vid_path : videos) {
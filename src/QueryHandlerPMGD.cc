@@ -36,9 +36,12 @@
 
 #include "BlobCommand.h"
 #include "BoundingBoxCommand.h"
+#include "ContentStore.h"
 #include "DescriptorsCommand.h"
+#include "ImageCache.h"
 #include "ImageCommand.h"
 #include "VideoCommand.h"
+#include "WorkerPool.h"
 
 #include "ExceptionsCommand.h"
 
@@ -65,9 +68,14 @@ tbb::concurrent_unordered_map<std::string, std::string>
     DescriptorsCommand::_desc_set_locator;
 tbb::concurrent_unordered_map<std::string, int>
     DescriptorsCommand::_desc_set_dims;
+tbb::concurrent_unordered_map<std::string, bool>
+    DescriptorsCommand::_desc_set_binary;
 
 void QueryHandlerPMGD::init() {
   DescriptorsManager::init();
+  WorkerPool::init();
+  ImageCache::init();
+  ContentStore::init();
 
   _rs_cmds["AddEntity"] = new AddEntity();
   _rs_cmds["UpdateEntity"] = new UpdateEntity();
@@ -78,6 +86,7 @@ void QueryHandlerPMGD::init() {
   _rs_cmds["FindConnection"] = new FindConnection();
 
   _rs_cmds["AddImage"] = new AddImage();
+  _rs_cmds["AddImageBatch"] = new AddImageBatch();
   _rs_cmds["UpdateImage"] = new UpdateImage();
   _rs_cmds["FindImage"] = new FindImage();
   _rs_cmds["DeleteExpired"] = new DeleteExpired();
@@ -87,6 +96,8 @@ void QueryHandlerPMGD::init() {
   _rs_cmds["AddDescriptor"] = new AddDescriptor();
   _rs_cmds["FindDescriptor"] = new FindDescriptor();
   _rs_cmds["ClassifyDescriptor"] = new ClassifyDescriptor();
+  _rs_cmds["DeleteDescriptor"] = new DeleteDescriptor();
+  _rs_cmds["UpdateDescriptor"] = new UpdateDescriptor();
 
   _rs_cmds["AddBoundingBox"] = new AddBoundingBox();
   _rs_cmds["UpdateBoundingBox"] = new UpdateBoundingBox();
@@ -224,9 +235,7 @@ int QueryHandlerPMGD::parse_commands(const protobufs::queryMessage &proto_query,
       assert(query.getMemberNames().size() == 1);
       std::string cmd = query.getMemberNames()[0];
 
-      if (_rs_cmds[cmd]->need_blob(query)) {
-        blob_counter++;
-      }
+      blob_counter += _rs_cmds[cmd]->blob_count(query);
     }
 
     if (blob_counter != proto_query.blobs().size()) {
@@ -318,20 +327,34 @@ void QueryHandlerPMGD::process_query(
 
       RSCommand *rscmd = _rs_cmds[cmd];
 
-      const std::string &blob =
-          rscmd->need_blob(query) ? proto_query.blobs(blob_count++) : "";
+      unsigned n_blobs = rscmd->blob_count(query);
 
       timer_id =
           "input_operation_" + cmd + "_" + std::to_string(time_input_ctr);
       time_input_ctr++;
       timers.add_timestamp(timer_id);
-      int ret_code = rscmd->construct_protobuf(pmgd_query, query, blob,
-                                               group_count, cmd_result);
+      int ret_code;
+      if (n_blobs > 1) {
+        std::vector<const std::string *> blobs;
+        for (unsigned i = 0; i < n_blobs; ++i)
+          blobs.push_back(&proto_query.blobs(blob_count++));
+        ret_code = rscmd->construct_protobuf_blobs(pmgd_query, query, blobs,
+                                                   group_count, cmd_result);
+      } else {
+        const std::string &blob =
+            n_blobs == 1 ? proto_query.blobs(blob_count++) : "";
+        ret_code = rscmd->construct_protobuf(pmgd_query, query, blob,
+                                             group_count, cmd_result);
+      }
       timers.add_timestamp(timer_id);
 
       if (cmd_result.isMember("image_added")) {
         images_log.push_back(cmd_result["image_added"].asString());
       }
+      if (cmd_result.isMember("images_added")) {
+        for (auto &image : cmd_result["images_added"])
+          images_log.push_back(image.asString());
+      }
       if (cmd_result.isMember("video_added")) {
         videos_log.push_back(cmd_result["video_added"].asString());
       }
@@ -372,8 +395,11 @@ void QueryHandlerPMGD::process_query(
 
         RSCommand *rscmd = _rs_cmds[cmd];
 
+        // Commands that take several blobs do not get them back
+        unsigned n_blobs = rscmd->blob_count(query);
         const std::string &blob =
-            rscmd->need_blob(query) ? proto_query.blobs(blob_count++) : "";
+            n_blobs == 1 ? proto_query.blobs(blob_count) : "";
+        blob_count += n_blobs;
 
         query["cp_result"] = construct_results[j];
 
@@ -445,8 +471,10 @@ void QueryHandlerPMGD::process_query(
 void QueryHandlerPMGD::regular_run_autoreplicate(
     ReplicationConfig &replicate_settings) {
 
-  DescriptorsManager::instance()
-      ->flush(); // store all descriptor sets bfore each backup operation
+  // Make all descriptor sets recoverable before each backup operation.
+  // Faiss sets are restored from their last checkpoint plus the
+  // write-ahead log, so this does not rewrite the indexes.
+  DescriptorsManager::instance()->sync();
   std::string command = "bsdtar cvfz ";
   std::string name;
   std::ostringstream oss;
@@ -73,10 +73,26 @@ public:
 
   virtual bool need_blob(const Json::Value &cmd) { return false; }
 
+  // Number of blobs of the query taken by the command
+  virtual unsigned blob_count(const Json::Value &cmd) {
+    return need_blob(cmd) ? 1 : 0;
+  }
+
   virtual int construct_protobuf(PMGDQuery &query, const Json::Value &root,
                                  const std::string &blob, int grp_id,
                                  Json::Value &error) = 0;
 
+  // Used instead of construct_protobuf by the commands that take more
+  // than one blob: blobs are the blob_count() blobs of the command,
+  // in order.
+  virtual int construct_protobuf_blobs(
+      PMGDQuery &query, const Json::Value &root,
+      const std::vector<const std::string *> &blobs, int grp_id,
+      Json::Value &error) {
+    return construct_protobuf(query, root, blobs.empty() ? "" : *blobs[0],
+                              grp_id, error);
+  }
+
   virtual Json::Value construct_responses(Json::Value &json_responses,
                                           const Json::Value &json,
                                           protobufs::queryMessage &response,
@@ -47,6 +47,7 @@
 #include "QueryHandlerNeo4j.h"
 #include "QueryHandlerPMGD.h"
 #include "VDMSConfig.h"
+#include "WorkerPool.h"
 
 #include "pmgdMessages.pb.h" // Protobuff implementation
 
@@ -305,6 +306,9 @@ Server::~Server() {
   _cm->shutdown();
   delete _cm;
   PMGDQueryHandler::destroy();
+  DescriptorsManager::instance()->shutdown();
   DescriptorsManager::instance()->flush();
+  if (WorkerPool::instance())
+    WorkerPool::instance()->shutdown();
   VDMSConfig::destroy();
 }
@@ -29,14 +29,17 @@
  *
  */
 
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 
 #include "ImageCommand.h" // for enqueue_operations of Image type
 #include "VDMSConfig.h"
 #include "VideoCommand.h"
 #include "VideoLoop.h"
+#include "WorkerPool.h"
 #include "defines.h"
 
 using namespace VDMS;
@@ -422,7 +425,6 @@ Json::Value FindVideo::construct_responses(Json::Value &responses,
 
   Json::Value ret;
   bool has_operations = false;
-  std::string no_op_def_video;
   VCL::Video::Codec op_codec;
   std::string op_container;
 
@@ -581,7 +583,6 @@ Json::Value FindVideo::construct_responses(Json::Value &responses,
         } else {
           std::vector<unsigned char> video_enc =
               video.get_encoded(container, vcl_codec);
-          no_op_def_video = video.get_video_id();
           int size = video_enc.size();
 
           if (size > 0) {
@@ -608,21 +609,17 @@ Json::Value FindVideo::construct_responses(Json::Value &responses,
   }
 
   if (has_operations) {
-    while (videoLoop.is_loop_running()) {
-      continue;
-    }
-    std::map<std::string, VCL::Video> videoMap = videoLoop.get_video_map();
-    std::map<std::string, VCL::Video>::iterator iter = videoMap.begin();
+    videoLoop.wait();
 
-    if (iter->second.get_query_error_response() != iter->second.NOERRORSTRING) {
+    if (!videoLoop.get_error().empty()) {
       Json::Value return_error;
       return_error["status"] = RSCommand::Error;
-      return_error["info"] = iter->second.get_query_error_response();
+      return_error["info"] = videoLoop.get_error();
       return error(return_error);
     }
 
-    while (iter != videoMap.end()) {
-      auto video_enc = iter->second.get_encoded(op_container, op_codec);
+    for (VCL::Video *video : videoLoop.get_videos()) {
+      auto video_enc = video->get_encoded(op_container, op_codec);
       int size = video_enc.size();
 
       if (size > 0) {
@@ -638,13 +635,9 @@ Json::Value FindVideo::construct_responses(Json::Value &responses,
       }
 
       if (output_vcl_timing) {
-        iter->second.timers.print_map_runtimes();
+        video->timers.print_map_runtimes();
       }
-
-      iter++;
     }
-  } else {
-    videoLoop.close_no_operation_loop(no_op_def_video);
   }
 
   if (flag_empty) {
@@ -814,27 +807,83 @@ Json::Value FindFrames::construct_responses(Json::Value &responses,
         }
       }
 
-      for (auto idx : frames) {
-        cv::Mat mat = video.get_frame(idx);
-        VCL::Image img(mat, false);
-        if (!operations.empty()) {
-          img_cmd.enqueue_operations(img, operations);
+      // The frames are decoded in a single pass over the video, on this
+      // thread, and encoded by the worker pool as they come out.
+      WorkerPool *pool = WorkerPool::instance();
+      size_t max_pending = pool->get_max_request_workers();
+      if (max_pending == 0 || max_pending > pool->get_n_threads())
+        max_pending = pool->get_n_threads();
+
+      std::vector<std::vector<unsigned char>> encoded(frames.size());
+      std::string encode_error;
+      size_t pending = 0;
+      std::mutex lock;
+      std::condition_variable done;
+
+      auto encode = [&](size_t i, cv::Mat &frame) {
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          done.wait(guard, [&]() { return pending < max_pending; });
+          ++pending;
         }
 
-        std::vector<unsigned char> img_enc;
-        img_enc = img.get_encoded_image(format);
+        pool->submit([&, i, frame]() mutable {
+          std::vector<unsigned char> img_enc;
+          std::string err;
+          try {
+            VCL::Image img(frame, false);
+            if (!operations.empty()) {
+              img_cmd.enqueue_operations(img, operations);
+            }
+            img_enc = img.get_encoded_image(format);
+            if (img_enc.empty())
+              err = "Image Data not found";
+          } catch (VCL::Exception &e) {
+            print_exception(e);
+            err = "VCL Exception";
+          } catch (ExceptionCommand &e) {
+            print_exception(e);
+            err = "Image operation not defined";
+          }
 
-        if (!img_enc.empty()) {
-          std::string *img_str = query_res.add_blobs();
-          img_str->resize(img_enc.size());
-          std::memcpy((void *)img_str->data(), (void *)img_enc.data(),
-                      img_enc.size());
-        } else {
-          Json::Value return_error;
-          return_error["status"] = RSCommand::Error;
-          return_error["info"] = "Image Data not found";
-          return error(return_error);
-        }
+          std::lock_guard<std::mutex> guard(lock);
+          encoded[i].swap(img_enc);
+          if (!err.empty() && encode_error.empty())
+            encode_error = err;
+          --pending;
+          done.notify_all();
+        });
+      };
+
+      // The tasks refer to the locals above: they are waited for even
+      // if decoding fails.
+      std::exception_ptr decode_error;
+      try {
+        video.decode_frames(frames, encode);
+      } catch (...) {
+        decode_error = std::current_exception();
+      }
+
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]() { return pending == 0; });
+      }
+
+      if (decode_error)
+        std::rethrow_exception(decode_error);
+
+      if (!encode_error.empty()) {
+        Json::Value return_error;
+        return_error["status"] = RSCommand::Error;
+        return_error["info"] = encode_error;
+        return error(return_error);
+      }
+
+      for (auto &img_enc : encoded) {
+        std::string *img_str = query_res.add_blobs();
+        img_str->resize(img_enc.size());
+        std::memcpy((void *)img_str->data(), (void *)img_enc.data(),
+                    img_enc.size());
       }
 
       // delete the video from local storage here, done with it for now
@@ -3,137 +3,144 @@
 #include <curl/curl.h>
 
 #include "VDMSConfig.h"
+#include "WorkerPool.h"
 
 VideoLoop::~VideoLoop() noexcept {
-  VCL::Video video(videoMap.begin()->first);
-  m_running = false;
-  r_running = false;
-  destroyed = true;
-
-  enqueue(video);
-  m_thread.join();
+  // After a failure, the tasks of the other videos may still be running
+  std::unique_lock<std::mutex> lock(_lock);
+  _tasks_done.wait(lock, [this] { return _tasks == 0; });
+}
 
-  r_enqueue(video);
-  r_thread.join();
+void VideoLoop::set_nrof_entities(int nrof_entities) {
+  std::lock_guard<std::mutex> guard(_lock);
+  _nrof_entities = nrof_entities;
 }
 
-bool VideoLoop::is_loop_running() {
-  if (m_running || r_running) {
-    return true;
-  } else {
-    return false;
+void VideoLoop::enqueue(VCL::Video video) noexcept {
+  VCL::Video *copy = new VCL::Video(video);
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _videos.emplace_back(copy);
+    ++_pending;
   }
+  submit(copy);
 }
 
-void VideoLoop::close_no_operation_loop(std::string videoid) {
-  VCL::Video video(videoid);
-  auto const result =
-      videoMap.insert(std::pair<std::string, VCL::Video>(videoid, video));
-  if (not result.second) {
-    result.first->second = video;
+// Nothing else is enqueued from here: the remote operations no longer
+// wait for the entities that were not enqueued.
+void VideoLoop::wait() {
+  std::vector<VCL::Video *> batch;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _closed = true;
+    if (take_remote_batch(batch))
+      ++_tasks;
+    else if (_tasks == 0)
+      finish();
   }
+
+  if (!batch.empty()) {
+    execute_remote_operations(batch);
+    task_done();
+  }
+
+  _finished_future.wait();
 }
 
-void VideoLoop::set_nrof_entities(int nrof_entities) {
-  _nrof_entities = nrof_entities;
+std::string VideoLoop::get_error() {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _error;
 }
 
-void VideoLoop::enqueue(VCL::Video video) noexcept {
+std::vector<VCL::Video *> VideoLoop::get_videos() {
+  std::lock_guard<std::mutex> guard(_lock);
+  std::vector<VCL::Video *> videos;
+  for (auto &video : _videos)
+    videos.push_back(video.get());
+  return videos;
+}
+
+void VideoLoop::submit(VCL::Video *video) {
   {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    m_writeBuffer.push_back(video);
+    std::lock_guard<std::mutex> guard(_lock);
+    ++_tasks;
   }
-  m_condVar.notify_one();
+  VDMS::WorkerPool::instance()->submit([this, video]() {
+    run_operations(video);
+    task_done();
+  });
 }
 
-void VideoLoop::r_enqueue(VCL::Video video) noexcept {
-  {
-    std::lock_guard<std::mutex> guard(r_mutex);
-    r_writeBuffer.push_back(video);
+void VideoLoop::task_done() {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (--_tasks == 0) {
+    finish();
+    _tasks_done.notify_all();
   }
-  r_condVar.notify_one();
 }
 
-std::map<std::string, VCL::Video> VideoLoop::get_video_map() {
-  return videoMap;
+void VideoLoop::finish() {
+  if (!_finished && _closed && (_pending == 0 || !_error.empty())) {
+    _finished = true;
+    _done.set_value();
+  }
 }
 
-void VideoLoop::operationThread() noexcept {
-  std::vector<VCL::Video> readBuffer;
+void VideoLoop::fail(const std::string &error) {
+  if (_error.empty())
+    _error = error.empty() ? "Video operation failed" : error;
+}
 
-  while (m_running) {
-    {
-      std::unique_lock<std::mutex> lock(m_mutex);
-      m_condVar.wait(lock, [this] { return !m_writeBuffer.empty(); });
-      readBuffer.swap(m_writeBuffer);
-    }
-    int flag = 0;
-    for (VCL::Video video : readBuffer) {
-      // Execute operations on the video
-      int response = video.execute_operations();
-
-      if (response == -1) {
-        // An exception occured while executing the operations
-        // Terminate the eventloop
-        auto const result = videoMap.insert(
-            std::pair<std::string, VCL::Video>(video.get_video_id(), video));
-        if (not result.second) {
-          result.first->second = video;
-        }
-        _remote_running = false;
-        flag = 0;
-        m_writeBuffer.clear();
-        r_writeBuffer.clear();
-        m_running = false;
-        r_running = false;
-        break;
-      } else {
-        if (video.get_enqueued_operation_count() > 0) {
-          // Remote operation encountered
-          response = video.execute_operations(true);
-          if (response == -1) {
-            // An exception occured while executing the operations
-            // Terminate the eventloop
-            auto const result =
-                videoMap.insert(std::pair<std::string, VCL::Video>(
-                    video.get_video_id(), video));
-            if (not result.second) {
-              result.first->second = video;
-            }
-            _remote_running = false;
-            flag = 0;
-            m_writeBuffer.clear();
-            r_writeBuffer.clear();
-            m_running = false;
-            r_running = false;
-            break;
-          } else {
-            // Enqueue the video onto the remote queue
-            r_enqueue(video);
-            flag = 1;
-          }
-        } else {
-          // All operations executed
-          // Finalize the videomap
-          auto const result = videoMap.insert(
-              std::pair<std::string, VCL::Video>(video.get_video_id(), video));
-          if (not result.second) {
-            result.first->second = video;
-            result.first->second.set_operated_video_id(
-                video.get_operated_video_id());
-          }
-        }
-      }
-    }
-    readBuffer.clear();
-    if (flag == 0 && _remote_running == false && m_writeBuffer.size() == 0 &&
-        r_writeBuffer.size() == 0) {
-      // All eventloop tasks are completed
-      // setup terminating conditions
-      m_running = false;
-      r_running = false;
+bool VideoLoop::take_remote_batch(std::vector<VCL::Video *> &batch) {
+  if (_remote_batch.empty() || _remote_batch.size() < _pending)
+    return false;
+  if (!_closed && _videos.size() < _nrof_entities)
+    return false;
+  batch.swap(_remote_batch);
+  return true;
+}
+
+// Runs the operations of the video up to its next remote operation.
+// The last video to get there sends all of them to the remote server.
+void VideoLoop::run_operations(VCL::Video *video) {
+  std::vector<VCL::Video *> batch;
+
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_error.empty())
+      return;
+  }
+
+  // Execute operations on the video
+  int response = video->execute_operations();
+
+  if (response != -1 && video->get_enqueued_operation_count() > 0) {
+    // Remote operation encountered
+    response = video->execute_operations(true);
+    if (response != -1) {
+      std::lock_guard<std::mutex> guard(_lock);
+      _remote_batch.push_back(video);
+      if (!take_remote_batch(batch))
+        return;
     }
   }
+
+  if (response == -1) {
+    // An exception occured while executing the operations
+    std::lock_guard<std::mutex> guard(_lock);
+    fail(video->get_query_error_response());
+    return;
+  }
+
+  if (batch.empty()) {
+    // All operations executed
+    std::lock_guard<std::mutex> guard(_lock);
+    --_pending;
+    if (!take_remote_batch(batch))
+      return;
+  }
+
+  execute_remote_operations(batch);
 }
 
 /**
@@ -220,8 +227,10 @@ CURL *VideoLoop::get_easy_handle(VCL::Video video,
   return NULL;
 }
 
-void VideoLoop::execute_remote_operations(std::vector<VCL::Video> &readBuffer) {
-  int flag = 0;
+// Runs on a task of the pool: the videos continue with their next
+// operations on tasks of their own once the responses are stored.
+void VideoLoop::execute_remote_operations(
+    std::vector<VCL::Video *> &readBuffer) {
   int start_index = 0;
   int step = 10;
   int end_index = readBuffer.size() > step ? step : readBuffer.size();
@@ -247,24 +256,20 @@ void VideoLoop::execute_remote_operations(std::vector<VCL::Video> &readBuffer) {
       auto start = readBuffer.begin() + start_index;
       auto end = readBuffer.begin() + end_index;
 
-      std::vector<VCL::Video> tempBuffer(start, end);
+      std::vector<VCL::Video *> tempBuffer(start, end);
 
-      for (VCL::Video video : tempBuffer) {
-        std::string video_id = video.get_operated_video_id();
+      for (VCL::Video *video : tempBuffer) {
+        std::string video_id = video->get_operated_video_id();
 
-        Json::Value rParams = video.get_remoteOp_params();
+        Json::Value rParams = video->get_remoteOp_params();
         Json::Value options = rParams["options"];
 
+        // Extension of the file (strtok is not safe with the batches of
+        // other queries running at the same time)
         std::string format = "";
-        char *s = const_cast<char *>(video_id.data());
-        std::string delimiter = ".";
-        char *p = std::strtok(s, delimiter.data());
-        while (p != NULL) {
-          p = std::strtok(NULL, delimiter.data());
-          if (p != NULL) {
-            format.assign(p, std::strlen(p));
-          }
-        }
+        size_t dot = video_id.find_last_of('.');
+        if (dot != std::string::npos)
+          format = video_id.substr(dot + 1);
 
         auto time_now = std::chrono::system_clock::now();
         std::chrono::duration<double> utc_time = time_now.time_since_epoch();
@@ -273,7 +278,7 @@ void VideoLoop::execute_remote_operations(std::vector<VCL::Video> &readBuffer) {
             std::to_string(utc_time.count()) + "." + format;
 
         responseBuffer.push_back(response_filepath);
-        CURL *curl = get_easy_handle(video, responseBuffer[rindex]);
+        CURL *curl = get_easy_handle(*video, responseBuffer[rindex]);
         FILE *response_file = fopen(response_filepath.data(), "wb");
         responseFileMaps.insert(
             std::pair<std::string, FILE *>(response_filepath, response_file));
@@ -336,74 +341,28 @@ void VideoLoop::execute_remote_operations(std::vector<VCL::Video> &readBuffer) {
         }
       }
 
+      curl_multi_cleanup(multi_handle);
+
       tempBuffer.clear();
       start_index = end_index;
       end_index = readBuffer.size() > (end_index + step) ? (end_index + step)
                                                          : readBuffer.size();
     }
-    rindex = -1;
-    // Finalize the remote operation and enqueue video on local queue
-    for (VCL::Video video : readBuffer) {
-      rindex++;
+    // Finalize the remote operation
+    for (rindex = 0; rindex < readBuffer.size(); ++rindex) {
       fclose(responseFileMaps[responseBuffer[rindex].data()]);
-      video.set_operated_video_id(responseBuffer[rindex]);
-
-      auto const result = videoMap.insert(
-          std::pair<std::string, VCL::Video>(video.get_video_id(), video));
-      if (not result.second) {
-        result.first->second = video;
-      }
-      if (rindex == readBuffer.size() - 1) {
-        _remote_running = false;
-      }
-      enqueue(video);
+      readBuffer[rindex]->set_operated_video_id(responseBuffer[rindex]);
     }
-    readBuffer.clear();
   } catch (VCL::Exception e) {
     // Exception occured. Terminate the event loop.
-    VCL::Video video = readBuffer[0];
-    video.set_query_error_response(e.msg);
-
-    auto const result = videoMap.insert(
-        std::pair<std::string, VCL::Video>(video.get_video_id(), video));
-    if (not result.second) {
-      result.first->second = video;
-    }
-
-    readBuffer.clear();
-    _remote_running = false;
-    m_writeBuffer.clear();
-    r_writeBuffer.clear();
-    m_running = false;
-    r_running = false;
-
     print_exception(e);
+    std::lock_guard<std::mutex> guard(_lock);
+    fail(e.msg);
     return;
   }
-}
-
-void VideoLoop::remoteOperationThread() noexcept {
-  std::vector<VCL::Video> readBuffer;
-
-  while (r_running) {
-    // Swap the remote queue with a temporary vector on which operations can be
-    // performed
-    {
-      std::unique_lock<std::mutex> rlock(r_mutex);
-      r_condVar.wait(rlock, [this] { return !r_writeBuffer.empty(); });
-      if (r_writeBuffer.size() == _nrof_entities) {
-        std::swap(readBuffer, r_writeBuffer);
-      }
-    }
 
-    if (readBuffer.size() == _nrof_entities && destroyed == false) {
-      // Set flag that remote operations are running and
-      // start the execution of remote operations on the temporary vector
-      _remote_running = true;
-      while (readBuffer.size() > 0) {
-        execute_remote_operations(readBuffer);
-      }
-      _remote_running = false;
-    }
+  // Continue with the local operations
+  for (VCL::Video *video : readBuffer) {
+    submit(video);
   }
-}
\ No newline at end of file
+}
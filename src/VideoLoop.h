@@ -29,19 +29,30 @@
  *
  */
 
+#pragma once
+
 #include "vcl/Image.h"
 #include "vcl/Video.h"
 #include <condition_variable>
-#include <functional>
 #include <future>
-#include <thread>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
+#include <curl/curl.h>
+
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 
+/**
+ * Runs the operations of the videos of a query on the WorkerPool, as
+ * the ImageLoop: the local operations of each video run as a task of
+ * the pool, and a single task sends the videos to the remote server
+ * once all of them reach a remote operation.
+ */
 class VideoLoop {
 public:
   VideoLoop() = default;
@@ -53,74 +64,66 @@ public:
   VideoLoop &operator=(VideoLoop &&) noexcept = delete;
 
   /**
-   * Sets the number of entities to be filled in the queue
+   * Sets the number of videos that will be enqueued
    * @param nrof_entities Number of entities in the query response
    */
   void set_nrof_entities(int nrof_entities);
 
   /**
-   * Enqueue into the local queue
+   * Starts the operations on the video
    * @param video The video object to be enqueued
    */
   void enqueue(VCL::Video video) noexcept;
 
   /**
-   * Enqueue into the remote queue
-   * @param video The video object to be enqueued
-   */
-  void r_enqueue(VCL::Video video) noexcept;
-
-  /**
-   * Get the map containing the operated video objects
+   * Blocks until the operations of every video enqueued are done,
+   * or one of them failed. No videos are enqueued after it.
    */
-  std::map<std::string, VCL::Video> get_video_map();
+  void wait();
 
   /**
-   * Check if the event loop is running
+   * The error of the video that failed, empty if none
    */
-  bool is_loop_running();
+  std::string get_error();
 
   /**
-   * If no operations are to be executed then create a dummy entry
-   * in the event loop and destroy it.
+   * The operated videos, in the order they were enqueued
    */
-  void close_no_operation_loop(std::string videoId);
+  std::vector<VCL::Video *> get_videos();
 
 private:
-  // Number of entities in the VDMS query response
+  std::vector<std::unique_ptr<VCL::Video>> _videos;
+
+  // Videos enqueued whose operations are not done, out of the
+  // expected ones. No more are enqueued once closed.
+  int _pending = 0;
   int _nrof_entities = 0;
+  bool _closed = false;
 
-  // Is the event loop ready to be destroyed
-  bool destroyed = false;
+  std::string _error;
 
-  // Are any remote operations running
-  bool _remote_running = false;
+  // Videos waiting for the others to reach their remote operation
+  std::vector<VCL::Video *> _remote_batch;
 
-  // Stores the operated videos. Key is the video id
-  std::map<std::string, VCL::Video> videoMap;
+  // Tasks of this loop on the pool, which the destructor waits for
+  int _tasks = 0;
 
-  /**
-   * The Local Queue parameters
-   */
+  std::mutex _lock;
+  std::condition_variable _tasks_done;
 
-  std::vector<VCL::Video> m_writeBuffer;
-  std::mutex m_mutex;
-  std::condition_variable m_condVar;
-  bool m_running{true};
-  std::thread m_thread{&VideoLoop::operationThread, this};
-  // Local thread function
-  void operationThread() noexcept;
+  // Set once the videos are done (or failed) and no task is left
+  bool _finished = false;
+  std::promise<void> _done;
+  std::future<void> _finished_future = _done.get_future();
 
-  /**
-   * The Remote Queue parameters
-   */
-  std::vector<VCL::Video> r_writeBuffer;
-  std::mutex r_mutex;
-  std::condition_variable r_condVar;
-  bool r_running{true};
-  std::thread r_thread{&VideoLoop::remoteOperationThread, this};
-  // Local thread function
-  void remoteOperationThread() noexcept;
+  void submit(VCL::Video *video);
+  void run_operations(VCL::Video *video);
+  void task_done();
+
+  // Must be called with _lock held
+  void finish();
+  void fail(const std::string &error);
+  bool take_remote_batch(std::vector<VCL::Video *> &batch);
 
   /**
    * Get the curl easy handles that will be used for multi-curl
@@ -136,5 +139,5 @@ private:
    * @param readBuffer Stores all the videos on which the remote operation will
    * be performed
    */
-  void execute_remote_operations(std::vector<VCL::Video> &readBuffer);
-};
\ No newline at end of file
+  void execute_remote_operations(std::vector<VCL::Video *> &readBuffer);
+};
@@ -0,0 +1,109 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "WorkerPool.h"
+#include "VDMSConfig.h"
+#include <algorithm>
+#include <iostream>
+
+#define DEFAULT_WORKER_THREADS 0      // one per core
+#define DEFAULT_MAX_REQUEST_WORKERS 8 // including the connection thread
+
+using namespace VDMS;
+
+WorkerPool *WorkerPool::_pool;
+
+bool WorkerPool::init() {
+  if (_pool)
+    return false;
+
+  int n_threads = VDMSConfig::instance()->get_int_value(
+      "worker_threads", DEFAULT_WORKER_THREADS);
+  int max_request_workers = VDMSConfig::instance()->get_int_value(
+      "max_request_workers", DEFAULT_MAX_REQUEST_WORKERS);
+
+  _pool = new WorkerPool(n_threads > 0 ? n_threads : 0,
+                         max_request_workers > 0 ? max_request_workers : 0);
+  return true;
+}
+
+WorkerPool *WorkerPool::instance() {
+  if (_pool)
+    return _pool;
+
+  std::cerr << "ERROR: WorkerPool not init" << std::endl;
+  return NULL;
+}
+
+WorkerPool::WorkerPool(unsigned n_threads, unsigned max_request_workers)
+    : _stop(false), _max_request_workers(max_request_workers) {
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < n_threads; ++i)
+    _threads.emplace_back(&WorkerPool::worker_loop, this);
+}
+
+WorkerPool::~WorkerPool() { shutdown(); }
+
+void WorkerPool::worker_loop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cv.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+      if (_tasks.empty())
+        return;
+      task = std::move(_tasks.front());
+      _tasks.pop();
+    }
+    task();
+  }
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _tasks.push(std::move(task));
+  }
+  _cv.notify_one();
+}
+
+void WorkerPool::shutdown() {
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _stop = true;
+  }
+  _cv.notify_all();
+
+  for (auto &thread : _threads) {
+    if (thread.joinable())
+      thread.join();
+  }
+}
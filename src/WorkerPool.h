@@ -0,0 +1,152 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace VDMS {
+
+/**
+ *  Fixed set of threads shared by all the connections, for the work
+ *  of a request that can run in parallel (decoding, transforming and
+ *  encoding the images of a response, for instance). Requests cap
+ *  how many of the threads they use at once, so a single large
+ *  response does not starve the others.
+ */
+class WorkerPool {
+  static WorkerPool *_pool;
+
+  std::vector<std::thread> _threads;
+  std::queue<std::function<void()>> _tasks;
+  std::mutex _lock;
+  std::condition_variable _cv;
+  bool _stop;
+
+  // Threads a single request uses at once
+  unsigned _max_request_workers;
+
+  void worker_loop();
+
+public:
+  /**
+   *  @param n_threads  Threads of the pool (0 for one per core)
+   *  @param max_request_workers  Threads used at once by a request,
+   *         including the caller (0 for all of them)
+   */
+  WorkerPool(unsigned n_threads, unsigned max_request_workers);
+  WorkerPool(const WorkerPool &) = delete;
+  ~WorkerPool();
+
+  static bool init();
+  static WorkerPool *instance();
+  static bool is_init() { return _pool != NULL; }
+
+  unsigned get_n_threads() { return _threads.size(); }
+  unsigned get_max_request_workers() { return _max_request_workers; }
+
+  /**
+   *  Runs task in one of the threads of the pool, once the tasks
+   *  submitted before it have started. The task must not throw.
+   */
+  void submit(std::function<void()> task);
+
+  /**
+   *  Runs f(i) for i in [0, n), on up to max_request_workers threads
+   *  at once: the calling thread and threads of the pool.
+   *  The calling thread takes part, so it completes even when every
+   *  thread of the pool is busy. Returns once all of them are done,
+   *  rethrowing the first exception thrown by f, if any (the indexes
+   *  left are still processed).
+   */
+  template <typename F> void parallel_for(size_t n, F f);
+
+  /**
+   *  Stops the threads once the tasks submitted are done.
+   */
+  void shutdown();
+};
+
+template <typename F> void WorkerPool::parallel_for(size_t n, F f) {
+  // Owned by the helpers too: they may start after all the indexes
+  // are done, and find none left.
+  struct State {
+    std::atomic<size_t> next{0};
+    size_t done = 0;
+    std::exception_ptr error;
+    std::mutex lock;
+    std::condition_variable cv;
+  };
+  auto state = std::make_shared<State>();
+
+  // f is only called for indexes < n, while the caller waits
+  auto run = [state, n, &f]() {
+    for (size_t i = state->next++; i < n; i = state->next++) {
+      std::exception_ptr error;
+      try {
+        f(i);
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> guard(state->lock);
+      if (error && !state->error)
+        state->error = error;
+      if (++state->done == n)
+        state->cv.notify_all();
+    }
+  };
+
+  size_t workers = _threads.size() + 1;
+  if (_max_request_workers > 0 && _max_request_workers < workers)
+    workers = _max_request_workers;
+  if (n < workers)
+    workers = n;
+
+  for (size_t i = 1; i < workers; ++i)
+    submit(run);
+
+  run();
+
+  std::unique_lock<std::mutex> lock(state->lock);
+  state->cv.wait(lock, [&]() { return state->done == n; });
+
+  if (state->error)
+    std::rethrow_exception(state->error);
+}
+
+}; // namespace VDMS
@@ -62,6 +62,9 @@ public:
                           // 32, otherwise segfault will happen
   uint64_t cut_off;
 
+  /* Number of indexes a Faiss set is split in */
+  unsigned num_shards = 1;
+
   DescriptorParams(uint64_t numrows = 3, uint64_t cellsperrow = (1 << 12),
                    uint64_t numhashtables = (1 << 9),
                    uint64_t hashespertable = 14, uint64_t subhashbits = 2,
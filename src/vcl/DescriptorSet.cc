@@ -29,8 +29,11 @@
  *
  */
 
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+#include <numeric>
 #include <stdlib.h>
 #include <string>
 
@@ -39,73 +42,153 @@
 #include "DescriptorSetData.h"
 #include "DescriptorParams.h"
 #include "FaissDescriptorSet.h"
+#include "FaissBinaryDescriptorSet.h"
 #include "TDBDescriptorSet.h"
 #include "FlinngDescriptorSet.h"
+#include "ShardedDescriptorSet.h"
+#include "DistanceKernels.h"
 // clang-format on
 
 #define INFO_FILE_NAME "eng_info.txt"
+#define IDS_FILE_NAME "id_map.bin"
+#define IDS_LOG_FILE_NAME "id_map.log"
+
+// Id log record types
+#define ID_LOG_MAP 1
+#define ID_LOG_ADD 2
+#define ID_LOG_REMOVE 3
+#define ID_LOG_MOVE 4
+
+// Suffix of the directory where compact() builds the new index
+#define COMPACT_SUFFIX ".compact"
+// Suffix of the directory of the set being replaced by compact()
+#define OLD_SUFFIX ".old"
+// Descriptors copied at a time by compact()
+#define COMPACT_BATCH 10000
 
 namespace fs = std::filesystem;
 
 namespace VCL {
 
-DescriptorSet::DescriptorSet(const std::string &set_path) {
+DescriptorSet::DescriptorSet(const std::string &set_path,
+                             DescriptorSetLoad load) {
+  recover_compaction(set_path);
   read_set_info(set_path);
   _remote = nullptr;
+  _set = open_set(set_path, load);
+  _modified = _set->recovered();
+  _next_id = 0;
+  _compacting = false;
+  read_id_map();
+  replay_id_log();
+  remove_padding();
+}
+
+DescriptorSet::DescriptorSet(const std::string &set_path, unsigned dim,
+                             DescriptorSetEngine eng, DistanceMetric metric,
+                             VCL::DescriptorParams *param)
+    : _eng(eng) {
+  _remote = nullptr;
+  _n_shards = param ? std::max(param->num_shards, 1u) : 1;
+  _cosine = metric == Cosine;
+  _set = create_set(set_path, dim, eng, _cosine ? IP : metric, param);
+  _modified = true;
+  _next_id = 0;
+  _compacting = false;
+}
+
+DescriptorSet::~DescriptorSet() { delete _set; }
+
+DescriptorSet::DescriptorSetData *
+DescriptorSet::open_set(const std::string &set_path, DescriptorSetLoad load) {
+  bool use_mmap = load == LoadMmap;
+
+  if (_n_shards > 1)
+    return new ShardedDescriptorSet(set_path, _eng, _n_shards, use_mmap);
 
   if (_eng == DescriptorSetEngine(FaissFlat))
-    _set = new FaissFlatDescriptorSet(set_path);
+    return new FaissFlatDescriptorSet(set_path, use_mmap);
   else if (_eng == DescriptorSetEngine(FaissIVFFlat))
-    _set = new FaissIVFFlatDescriptorSet(set_path);
+    return new FaissIVFFlatDescriptorSet(set_path, use_mmap);
   else if (_eng == DescriptorSetEngine(TileDBDense))
-    _set = new TDBDenseDescriptorSet(set_path);
+    return new TDBDenseDescriptorSet(set_path);
   else if (_eng == DescriptorSetEngine(TileDBSparse))
-    _set = new TDBSparseDescriptorSet(set_path);
+    return new TDBSparseDescriptorSet(set_path);
   else if (_eng == DescriptorSetEngine(Flinng))
-    _set = new FlinngDescriptorSet(set_path);
+    return new FlinngDescriptorSet(set_path);
   else if (_eng == DescriptorSetEngine(FaissHNSWFlat))
-    _set = new FaissHNSWFlatDescriptorSet(set_path);
-  else {
-    std::cerr << "Index Not supported" << std::endl;
-    throw VCLException(UnsupportedIndex, "Index not supported");
-  }
+    return new FaissHNSWFlatDescriptorSet(set_path);
+  else if (_eng == DescriptorSetEngine(FaissBinaryFlat))
+    return new FaissBinaryFlatDescriptorSet(set_path);
+  else if (_eng == DescriptorSetEngine(FaissBinaryIVF))
+    return new FaissBinaryIVFDescriptorSet(set_path);
+  else if (_eng == DescriptorSetEngine(FaissBinaryHNSW))
+    return new FaissBinaryHNSWDescriptorSet(set_path);
+
+  std::cerr << "Index Not supported" << std::endl;
+  throw VCLException(UnsupportedIndex, "Index not supported");
 }
 
-DescriptorSet::DescriptorSet(const std::string &set_path, unsigned dim,
-                             DescriptorSetEngine eng, DistanceMetric metric,
-                             VCL::DescriptorParams *param)
-    : _eng(eng) {
-  _remote = nullptr;
+DescriptorSet::DescriptorSetData *
+DescriptorSet::create_set(const std::string &set_path, unsigned dim,
+                          DescriptorSetEngine eng, DistanceMetric metric,
+                          VCL::DescriptorParams *param) {
+  if (_n_shards > 1)
+    return new ShardedDescriptorSet(set_path, dim, eng, metric, _n_shards);
 
   if (eng == DescriptorSetEngine(FaissFlat))
-    _set = new FaissFlatDescriptorSet(set_path, dim, metric);
+    return new FaissFlatDescriptorSet(set_path, dim, metric);
   else if (eng == DescriptorSetEngine(FaissIVFFlat))
-    _set = new FaissIVFFlatDescriptorSet(set_path, dim, metric);
+    return new FaissIVFFlatDescriptorSet(set_path, dim, metric);
   else if (eng == DescriptorSetEngine(TileDBDense))
-    _set = new TDBDenseDescriptorSet(set_path, dim, metric);
+    return new TDBDenseDescriptorSet(set_path, dim, metric);
   else if (eng == DescriptorSetEngine(TileDBSparse))
-    _set = new TDBSparseDescriptorSet(set_path, dim, metric);
+    return new TDBSparseDescriptorSet(set_path, dim, metric);
   else if (eng == DescriptorSetEngine(Flinng))
-    _set = new FlinngDescriptorSet(set_path, dim, metric, param);
+    return new FlinngDescriptorSet(set_path, dim, metric, param);
   else if (eng == DescriptorSetEngine(FaissHNSWFlat))
-    _set = new FaissHNSWFlatDescriptorSet(set_path, dim, metric);
-  else {
-    std::cerr << "Index Not supported" << std::endl;
-    throw VCLException(UnsupportedIndex, "Index not supported");
-  }
+    return new FaissHNSWFlatDescriptorSet(set_path, dim, metric);
+  else if (eng == DescriptorSetEngine(FaissBinaryFlat))
+    return new FaissBinaryFlatDescriptorSet(set_path, dim);
+  else if (eng == DescriptorSetEngine(FaissBinaryIVF))
+    return new FaissBinaryIVFDescriptorSet(set_path, dim);
+  else if (eng == DescriptorSetEngine(FaissBinaryHNSW))
+    return new FaissBinaryHNSWDescriptorSet(set_path, dim);
+
+  std::cerr << "Index Not supported" << std::endl;
+  throw VCLException(UnsupportedIndex, "Index not supported");
 }
 
-DescriptorSet::~DescriptorSet() { delete _set; }
+void DescriptorSet::write_set_info() { write_set_info(_set->get_path()); }
 
-void DescriptorSet::write_set_info() {
+void DescriptorSet::write_set_info(const std::string &set_path) {
   timers.add_timestamp("write_set_info");
-  std::string path = _set->get_path() + "/" + INFO_FILE_NAME;
+  std::string path = set_path + "/" + INFO_FILE_NAME;
   std::ofstream info_file(path);
   info_file << _eng << std::endl;
+  if (_n_shards > 1 || _cosine)
+    info_file << _n_shards << std::endl;
+  if (_cosine)
+    info_file << Cosine << std::endl;
   info_file.close();
   timers.add_timestamp("write_set_info");
 }
 
+// compact() replaces the directory of the set with two renames. A crash
+// between them leaves only the directory being replaced, which still has
+// every descriptor, as the set is locked meanwhile. Directories left
+// behind by a crash before or after the renames are removed.
+void DescriptorSet::recover_compaction(const std::string &set_path) {
+  std::string old_path = set_path + OLD_SUFFIX;
+
+  if (!fs::exists(set_path) && fs::exists(old_path))
+    fs::rename(old_path, set_path);
+  else
+    fs::remove_all(old_path);
+
+  fs::remove_all(set_path + COMPACT_SUFFIX);
+}
+
 void DescriptorSet::read_set_info(const std::string &set_path) {
   timers.add_timestamp("read_set_info");
   std::string path = set_path + "/" + INFO_FILE_NAME;
@@ -122,46 +205,478 @@ void DescriptorSet::read_set_info(const std::string &set_path) {
   std::stringstream sstr(str);
   sstr >> num;
   _eng = (DescriptorSetEngine)num;
+
+  // Sets written before sharding have no second line,
+  // and only Cosine sets have a third one, with the metric
+  _n_shards = 1;
+  if (std::getline(info_file, str)) {
+    std::stringstream shards_sstr(str);
+    shards_sstr >> _n_shards;
+  }
+  _cosine = false;
+  if (std::getline(info_file, str)) {
+    std::stringstream metric_sstr(str);
+    metric_sstr >> num;
+    _cosine = DistanceMetric(num) == Cosine;
+  }
   info_file.close();
   timers.add_timestamp("read_set_info");
 }
 
+// The id map file holds the next id, the id of each position in the
+// index (none while they are the same) and the removed positions:
+// next_id, n_ids, ids..., n_removed, positions...
+void DescriptorSet::write_id_map(const std::string &set_path, long next_id,
+                                 const std::vector<long> &ext_ids,
+                                 const std::unordered_set<long> &deleted) {
+  std::string path = set_path + "/" + IDS_FILE_NAME;
+
+  if (ext_ids.empty() && deleted.empty()) {
+    std::remove(path.c_str());
+    return;
+  }
+
+  std::vector<long> removed(deleted.begin(), deleted.end());
+  long n_ids = ext_ids.size();
+  long n_removed = removed.size();
+
+  std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ofstream::binary);
+  out.write((char *)&next_id, sizeof(long));
+  out.write((char *)&n_ids, sizeof(long));
+  out.write((char *)ext_ids.data(), sizeof(long) * n_ids);
+  out.write((char *)&n_removed, sizeof(long));
+  out.write((char *)removed.data(), sizeof(long) * n_removed);
+  out.close();
+
+  if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw VCLException(OpenFailed, "Cannot write " + path);
+  }
+}
+
+// It replaces the id log, which only holds the changes made after it.
+// Expects _ids_lock to be held.
+void DescriptorSet::write_id_map_locked() {
+  write_id_map(_set->get_path(), _next_id, _ext_ids, _deleted);
+  open_id_log(true);
+}
+
+void DescriptorSet::write_id_map() {
+  std::lock_guard<std::mutex> lock(_ids_lock);
+  write_id_map_locked();
+}
+
+void DescriptorSet::read_id_map() {
+  std::string path = _set->get_path() + "/" + IDS_FILE_NAME;
+  std::ifstream in(path, std::ifstream::binary);
+  if (!in.good())
+    return; // Ids are positions, nothing removed
+
+  long n_ids = 0, n_removed = 0;
+  in.read((char *)&_next_id, sizeof(long));
+  in.read((char *)&n_ids, sizeof(long));
+  _ext_ids.resize(n_ids);
+  in.read((char *)_ext_ids.data(), sizeof(long) * n_ids);
+  in.read((char *)&n_removed, sizeof(long));
+  std::vector<long> removed(n_removed);
+  in.read((char *)removed.data(), sizeof(long) * n_removed);
+
+  if (!in) {
+    throw VCLException(OpenFailed, "Id map is truncated: " + path);
+  }
+
+  _deleted.insert(removed.begin(), removed.end());
+  index_ids();
+}
+
+// Id log layout: records of type, n (uint32) and n longs:
+//   ID_LOG_MAP:    n_total, next_id
+//   ID_LOG_ADD:    first position, n, first id
+//   ID_LOG_REMOVE: positions...
+//   ID_LOG_MOVE:   id, old position, new position
+bool DescriptorSet::open_id_log(bool truncate) {
+  if (_ids_log.is_open())
+    _ids_log.close();
+
+  std::string path = _set->get_path() + "/" + IDS_LOG_FILE_NAME;
+  _ids_log.open(path, std::ofstream::binary |
+                          (truncate ? std::ofstream::trunc
+                                    : std::ofstream::app));
+  return _ids_log.good();
+}
+
+// Expects _ids_lock to be held. Sets created and not stored yet have
+// no log: store() writes all their ids at once.
+void DescriptorSet::log_ids(uint8_t type, const std::vector<long> &values) {
+  if (!_ids_log.is_open())
+    return;
+
+  uint32_t n = values.size();
+  _ids_log.write((char *)&type, sizeof(type));
+  _ids_log.write((char *)&n, sizeof(n));
+  _ids_log.write((char *)values.data(), sizeof(long) * n);
+  _ids_log.flush();
+
+  if (!_ids_log.good()) {
+    throw VCLException(UndefinedException,
+                       "Cannot write log: " + _set->get_path() + "/" +
+                           IDS_LOG_FILE_NAME);
+  }
+}
+
+// Applies the id log on top of the id map just read. Descriptors in the
+// index with no id, whose add did not complete, are removed.
+void DescriptorSet::replay_id_log() {
+  std::string path = _set->get_path() + "/" + IDS_LOG_FILE_NAME;
+  std::ifstream in(path, std::ifstream::binary);
+  std::streamoff valid_size = 0;
+
+  while (in.good()) {
+    uint8_t type;
+    uint32_t n;
+    if (!in.read((char *)&type, sizeof(type)) ||
+        !in.read((char *)&n, sizeof(n)))
+      break;
+
+    std::vector<long> values(n);
+    if (!in.read((char *)values.data(), sizeof(long) * n))
+      break;
+
+    if (type == ID_LOG_MAP && n == 2) {
+      map_ids(values[0], values[1]);
+    } else if (type == ID_LOG_ADD && n == 3) {
+      add_ids(values[0], values[1], values[2]);
+    } else if (type == ID_LOG_REMOVE) {
+      for (long pos : values)
+        remove_position(pos);
+    } else if (type == ID_LOG_MOVE && n == 3) {
+      move_id(values[0], values[1], values[2]);
+    } else {
+      break;
+    }
+
+    valid_size = in.tellg();
+  }
+  in.close();
+
+  if (!_ext_ids.empty()) {
+    long n_total = _set->get_n_total();
+    if (_ext_ids.size() < n_total)
+      _ext_ids.resize(n_total, -1);
+    for (long pos = 0; pos < n_total; ++pos) {
+      if (_ext_ids[pos] < 0)
+        _deleted.insert(pos);
+    }
+  }
+
+  // Drop a partially written record at the end of the log (if any)
+  if (fs::exists(path))
+    fs::resize_file(path, valid_size);
+  if (fs::exists(_set->get_path()) && !open_id_log(false)) {
+    throw VCLException(OpenFailed, "Cannot open log: " + path);
+  }
+}
+
+// Rebuilds _int_ids from _ext_ids
+void DescriptorSet::index_ids() {
+  _int_ids.clear();
+  for (long pos = 0; pos < long(_ext_ids.size()); ++pos) {
+    if (_ext_ids[pos] >= 0)
+      _int_ids.emplace_back(_ext_ids[pos], pos);
+  }
+  std::sort(_int_ids.begin(), _int_ids.end());
+}
+
+// A negative position removes the id. New ids are the largest ones,
+// so they are mostly appended.
+void DescriptorSet::set_position(long id, long position) {
+  auto it = std::lower_bound(
+      _int_ids.begin(), _int_ids.end(), id,
+      [](const std::pair<long, long> &entry, long id) {
+        return entry.first < id;
+      });
+
+  bool found = it != _int_ids.end() && it->first == id;
+  if (position < 0) {
+    if (found)
+      _int_ids.erase(it);
+  } else if (found) {
+    it->second = position;
+  } else {
+    _int_ids.insert(it, std::make_pair(id, position));
+  }
+}
+
+// The placeholders inserted by the engine on open are removed like
+// any other descriptor, so searches skip them until compact().
+void DescriptorSet::remove_padding() {
+  std::vector<long> padding = _set->padding_ids();
+  if (padding.empty())
+    return;
+
+  for (long pos : padding)
+    remove_position(pos);
+  _modified = true;
+}
+
+// Switches from ids equal to positions to an explicit map.
+void DescriptorSet::map_ids(long n_total, long next_id) {
+  if (!_ext_ids.empty())
+    return;
+
+  _ext_ids.resize(n_total);
+  std::iota(_ext_ids.begin(), _ext_ids.end(), 0);
+  for (long pos : _deleted) {
+    if (pos < n_total)
+      _ext_ids[pos] = -1;
+  }
+
+  index_ids();
+  _next_id = next_id;
+}
+
+void DescriptorSet::add_ids(long position, long n, long first_id) {
+  if (_ext_ids.size() < position + n)
+    _ext_ids.resize(position + n, -1);
+
+  for (long i = 0; i < n; ++i) {
+    _ext_ids[position + i] = first_id + i;
+    set_position(first_id + i, position + i);
+  }
+  _next_id = std::max(_next_id, first_id + n);
+}
+
+void DescriptorSet::remove_position(long position) {
+  _deleted.insert(position);
+
+  if (position < _ext_ids.size() && _ext_ids[position] >= 0) {
+    set_position(_ext_ids[position], -1);
+    _ext_ids[position] = -1;
+  }
+}
+
+void DescriptorSet::move_id(long id, long old_position, long new_position) {
+  if (_ext_ids.size() < new_position + 1)
+    _ext_ids.resize(new_position + 1, -1);
+
+  _deleted.insert(old_position);
+  _ext_ids[old_position] = -1;
+  _ext_ids[new_position] = id;
+  set_position(id, new_position);
+}
+
+long DescriptorSet::to_position(long id) {
+  if (_ext_ids.empty()) {
+    bool valid = id >= 0 && id < _set->get_n_total() && !_deleted.count(id);
+    return valid ? id : -1;
+  }
+
+  auto it = std::lower_bound(
+      _int_ids.begin(), _int_ids.end(), id,
+      [](const std::pair<long, long> &entry, long id) {
+        return entry.first < id;
+      });
+  return it == _int_ids.end() || it->first != id ? -1 : it->second;
+}
+
+long DescriptorSet::to_id(long position) {
+  if (position < 0 || _deleted.count(position))
+    return -1;
+
+  if (_ext_ids.empty())
+    return position;
+
+  return position < _ext_ids.size() ? _ext_ids[position] : -1;
+}
+
 /*  *********************** */
 /*      CORE INTERFACE      */
 /*  *********************** */
 
-std::string DescriptorSet::get_path() { return _set->get_path(); }
+std::string DescriptorSet::get_path() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  return _set->get_path();
+}
+
+unsigned DescriptorSet::get_dimensions() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  return _set->get_dimensions();
+}
+
+size_t DescriptorSet::get_descriptor_size() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  return _set->get_descriptor_size();
+}
+
+DistanceMetric DescriptorSet::get_metric() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  return _cosine ? Cosine : _set->get_metric();
+}
+
+DescriptorSet::DescDataArray
+DescriptorSet::normalized(DescDataArray descriptors, unsigned n,
+                          std::vector<float> &buffer) {
+  if (!_cosine || n == 0)
+    return descriptors;
+
+  unsigned dim = _set->get_dimensions();
+  buffer.assign(descriptors, descriptors + size_t(n) * dim);
+  DistanceKernels::normalize(buffer.data(), n, dim);
+  return buffer.data();
+}
+
+long DescriptorSet::get_n_descriptors() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  std::lock_guard<std::mutex> ids_lock(_ids_lock);
+  return _set->get_n_total() - _deleted.size();
+}
+
+// Asks the engine for more neighbors than k, as many times as needed
+// for k of them not to be removed.
+void DescriptorSet::search_positions(DescDataArray queries, unsigned n,
+                                     unsigned k, long *positions,
+                                     float *distances) {
+  long n_total = _set->get_n_total();
+
+  _ids_lock.lock();
+  bool filter = !_deleted.empty();
+  _ids_lock.unlock();
+
+  if (!filter || k == 0) {
+    _set->search(queries, n, k, positions, distances);
+    return;
+  }
+
+  unsigned kk = std::min<long>(2 * long(k), std::max(n_total, long(k)));
+  std::vector<long> res_pos;
+  std::vector<float> res_dist;
+
+  while (true) {
+    res_pos.resize(n * kk);
+    res_dist.resize(n * kk);
+    _set->search(queries, n, kk, res_pos.data(), res_dist.data());
+
+    bool complete = true;
 
-unsigned DescriptorSet::get_dimensions() { return _set->get_dimensions(); }
+    _ids_lock.lock();
+    for (unsigned q = 0; q < n; ++q) {
+      unsigned found = 0;
+      for (unsigned j = 0; j < kk && found < k; ++j) {
+        long pos = res_pos[q * kk + j];
+        if (pos < 0 || _deleted.count(pos))
+          continue;
+        positions[q * k + found] = pos;
+        distances[q * k + found] = res_dist[q * kk + j];
+        ++found;
+      }
+
+      if (found < k)
+        complete = false;
 
-long DescriptorSet::get_n_descriptors() { return _set->get_n_total(); }
+      for (; found < k; ++found) {
+        positions[q * k + found] = -1;
+        distances[q * k + found] = -1;
+      }
+    }
+    _ids_lock.unlock();
+
+    if (complete || kk >= n_total)
+      break;
+
+    kk = std::min<long>(2 * long(kk), n_total);
+  }
+}
 
 void DescriptorSet::search(DescDataArray queries, unsigned n_queries,
                            unsigned k, long *descriptors_ids,
                            float *distances) {
   timers.add_timestamp("desc_set_search");
-  _set->search(queries, n_queries, k, descriptors_ids, distances);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  std::vector<float> buffer;
+  queries = normalized(queries, n_queries, buffer);
+  search_positions(queries, n_queries, k, descriptors_ids, distances);
+
+  _ids_lock.lock();
+  if (!_ext_ids.empty()) {
+    for (long i = 0; i < long(n_queries) * k; ++i) {
+      descriptors_ids[i] = to_id(descriptors_ids[i]);
+    }
+  }
+  _ids_lock.unlock();
   timers.add_timestamp("desc_set_search");
 }
 
 void DescriptorSet::search(DescDataArray queries, unsigned n_queries,
                            unsigned k, long *descriptors_ids) {
-  timers.add_timestamp("desc_set_search");
-  _set->search(queries, n_queries, k, descriptors_ids);
-  timers.add_timestamp("desc_set_search");
+  std::vector<float> distances(n_queries * k);
+  search(queries, n_queries, k, descriptors_ids, distances.data());
 }
 
-void DescriptorSet::radius_search(DescData queries, float radius,
-                                  long *descriptors_ids, float *distances) {
+// Removed descriptors are still in the index: asks for as many more
+// results as there are, so that max_results remain once filtered.
+void DescriptorSet::radius_search(DescData query, float radius,
+                                  std::vector<long> &descriptors_ids,
+                                  std::vector<float> &distances,
+                                  unsigned max_results) {
   timers.add_timestamp("desc_set_radius_search");
-  _set->radius_search(queries, radius, descriptors_ids, distances);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  _ids_lock.lock();
+  size_t n_deleted = _deleted.size();
+  _ids_lock.unlock();
+
+  unsigned n_results = 0;
+  if (max_results > 0) {
+    n_results = std::min<uint64_t>(uint64_t(max_results) + n_deleted,
+                                   std::numeric_limits<unsigned>::max());
+  }
+
+  std::vector<float> buffer;
+  _set->radius_search(normalized(query, 1, buffer), radius, n_results,
+                      descriptors_ids, distances);
+
+  size_t found = 0;
+  _ids_lock.lock();
+  for (size_t i = 0; i < descriptors_ids.size(); ++i) {
+    if (max_results > 0 && found == max_results)
+      break;
+    long id = to_id(descriptors_ids[i]);
+    if (id < 0)
+      continue;
+    descriptors_ids[found] = id;
+    distances[found] = distances[i];
+    ++found;
+  }
+  _ids_lock.unlock();
+
+  descriptors_ids.resize(found);
+  distances.resize(found);
   timers.add_timestamp("desc_set_radius_search");
 }
 
 long DescriptorSet::add(DescDataArray descriptors, unsigned n, long *labels) {
   long rc;
   timers.add_timestamp("desc_set_add");
-  rc = _set->add(descriptors, n, labels);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  std::vector<float> buffer;
+  rc = _set->add(normalized(descriptors, n, buffer), n, labels);
+  _modified = true;
+
+  std::unique_lock<std::mutex> ids_lock(_ids_lock);
+  if (!_ext_ids.empty()) {
+    // Positions mapped by map_ids() while being added keep their ids
+    if (rc < _ext_ids.size() && _ext_ids[rc] >= 0) {
+      rc = _ext_ids[rc];
+    } else {
+      long first_id = _next_id;
+      add_ids(rc, n, first_id);
+      log_ids(ID_LOG_ADD, {rc, long(n), first_id});
+      rc = first_id;
+    }
+  }
+  ids_lock.unlock();
+
   timers.add_timestamp("desc_set_add");
   return rc;
 }
@@ -170,49 +685,408 @@ long DescriptorSet::add_and_store(DescDataArray descriptors, unsigned n,
                                   long *labels) {
   long rc;
   timers.add_timestamp("desc_set_add_and_store");
-  rc = _set->add_and_store(descriptors, n, labels);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  _ids_lock.lock();
+  bool mapped = !_ext_ids.empty();
+  _ids_lock.unlock();
+  if (mapped) {
+    throw VCLException(UnsupportedOperation,
+                       "add_and_store() after update() or compact()");
+  }
+
+  std::vector<float> buffer;
+  rc = _set->add_and_store(normalized(descriptors, n, buffer), n, labels);
+  _modified = true;
   timers.add_timestamp("desc_set_add_and_store");
   return rc;
 }
 
 void DescriptorSet::train() {
   timers.add_timestamp("desc_set_add_and_store");
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
   _set->train();
+  _modified = true;
   timers.add_timestamp("desc_set_add_and_store");
 }
 
 void DescriptorSet::finalize_index() {
   timers.add_timestamp("desc_set_finalize_idx");
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
   _set->finalize_index();
   timers.add_timestamp("desc_set_finalize_idx");
 }
 
 void DescriptorSet::train(DescDataArray descriptors, unsigned n) {
   timers.add_timestamp("desc_set_train");
-  _set->train(descriptors, n);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  std::vector<float> buffer;
+  _set->train(normalized(descriptors, n, buffer), n);
+  _modified = true;
   timers.add_timestamp("desc_set_train");
 }
 
-bool DescriptorSet::is_trained() { return _set->is_trained(); }
+void DescriptorSet::train_async(DescDataArray descriptors, unsigned n) {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  std::vector<float> buffer;
+  _set->train_async(normalized(descriptors, n, buffer), n);
+  _modified = true;
+}
+
+float DescriptorSet::train_progress() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  return _set->train_progress();
+}
+
+bool DescriptorSet::is_trained() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  return _set->is_trained();
+}
 
 void DescriptorSet::classify(DescDataArray descriptors, unsigned n,
-                             long *labels, unsigned quorum) {
+                             long *labels, unsigned quorum,
+                             VoteWeighting weighting) {
   timers.add_timestamp("desc_set_classify");
-  _set->classify(descriptors, n, labels, quorum);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  std::vector<float> buffer;
+  descriptors = normalized(descriptors, n, buffer);
+
+  _ids_lock.lock();
+  bool filter = !_deleted.empty();
+  _ids_lock.unlock();
+
+  if (!filter) {
+    _set->classify(descriptors, n, labels, quorum, weighting);
+    timers.add_timestamp("desc_set_classify");
+    return;
+  }
+
+  // Removed descriptors must not vote
+  std::vector<long> positions(n * quorum);
+  std::vector<float> distances(n * quorum);
+  search_positions(descriptors, n, quorum, positions.data(),
+                   distances.data());
+
+  std::vector<long> found;
+  for (long pos : positions) {
+    if (pos >= 0)
+      found.push_back(pos);
+  }
+  std::vector<long> found_labels(found.size());
+  _set->get_labels(found.data(), found.size(), found_labels.data());
+
+  std::vector<long> neighbor_labels(n * quorum, -1);
+  for (long i = 0, j = 0; i < positions.size(); ++i) {
+    if (positions[i] >= 0)
+      neighbor_labels[i] = found_labels[j++];
+  }
+
+  DistanceMetric metric = _set->get_metric();
+  for (int i = 0; i < n; ++i) {
+    labels[i] = _set->vote(neighbor_labels.data() + quorum * i,
+                           distances.data() + quorum * i, quorum, weighting,
+                           metric);
+  }
   timers.add_timestamp("desc_set_classify");
 }
 
 void DescriptorSet::get_descriptors(long *ids, unsigned n,
                                     DescDataArray descriptors) {
   timers.add_timestamp("desc_set_get_descs");
-  _set->get_descriptors(ids, n, descriptors);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  std::vector<long> positions(n);
+  _ids_lock.lock();
+  for (int i = 0; i < n; ++i) {
+    positions[i] = to_position(ids[i]);
+    if (positions[i] < 0) {
+      _ids_lock.unlock(); // unlock before throwing exception
+      throw VCLException(ObjectNotFound,
+                         "Descriptor " + std::to_string(ids[i]) +
+                             " does not exist");
+    }
+  }
+  _ids_lock.unlock();
+
+  _set->get_descriptors(positions.data(), n, descriptors);
   timers.add_timestamp("desc_set_get_descs");
 }
 
+void DescriptorSet::remove(long *ids, unsigned n) {
+  timers.add_timestamp("desc_set_remove");
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  _ids_lock.lock();
+
+  std::vector<long> positions(n);
+  for (int i = 0; i < n; ++i) {
+    positions[i] = to_position(ids[i]);
+    if (positions[i] < 0) {
+      _ids_lock.unlock(); // unlock before throwing exception
+      throw VCLException(ObjectNotFound,
+                         "Descriptor " + std::to_string(ids[i]) +
+                             " does not exist");
+    }
+  }
+
+  for (int i = 0; i < n; ++i) {
+    remove_position(positions[i]);
+  }
+  _modified = true;
+
+  try {
+    log_ids(ID_LOG_REMOVE, positions);
+  } catch (VCL::Exception &e) {
+    _ids_lock.unlock(); // unlock before throwing exception
+    throw e;
+  }
+
+  _ids_lock.unlock();
+  timers.add_timestamp("desc_set_remove");
+}
+
+// The new descriptor is added at the end of the index, and the id
+// moves to it.
+void DescriptorSet::update(long id, DescData descriptor, long *label) {
+  timers.add_timestamp("desc_set_update");
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  _ids_lock.lock();
+  long old_pos = to_position(id);
+  if (old_pos < 0) {
+    _ids_lock.unlock(); // unlock before throwing exception
+    throw VCLException(ObjectNotFound,
+                       "Descriptor " + std::to_string(id) + " does not exist");
+  }
+  try {
+    if (_ext_ids.empty()) {
+      long n_total = _set->get_n_total();
+      map_ids(n_total, n_total);
+      log_ids(ID_LOG_MAP, {n_total, n_total});
+    }
+  } catch (VCL::Exception &e) {
+    _ids_lock.unlock(); // unlock before throwing exception
+    throw e;
+  }
+  _ids_lock.unlock();
+
+  long new_label;
+  if (label != NULL)
+    new_label = *label;
+  else
+    _set->get_labels(&old_pos, 1, &new_label);
+
+  std::vector<float> buffer;
+  long new_pos = _set->add(normalized(descriptor, 1, buffer), 1, &new_label);
+  _modified = true;
+
+  std::lock_guard<std::mutex> ids_lock(_ids_lock);
+  if (to_position(id) == old_pos) {
+    move_id(id, old_pos, new_pos);
+    log_ids(ID_LOG_MOVE, {id, old_pos, new_pos});
+  } else {
+    // Removed or updated meanwhile: the new descriptor is dropped
+    remove_position(new_pos);
+    log_ids(ID_LOG_REMOVE, {new_pos});
+  }
+
+  timers.add_timestamp("desc_set_update");
+}
+
+float DescriptorSet::removed_ratio() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  std::lock_guard<std::mutex> ids_lock(_ids_lock);
+
+  long n_total = _set->get_n_total();
+  return n_total == 0 ? 0 : float(_deleted.size()) / n_total;
+}
+
+void DescriptorSet::copy_live(DescriptorSetData *set, long begin, long end,
+                              const std::unordered_set<long> &deleted,
+                              std::vector<long> &new_positions) {
+  unsigned dim = _set->get_dimensions();
+  new_positions.resize(end, -1);
+
+  std::vector<long> positions;
+  std::vector<float> descriptors;
+  std::vector<long> labels;
+
+  for (long start = begin; start < end; start += COMPACT_BATCH) {
+    positions.clear();
+    for (long pos = start; pos < std::min(end, start + COMPACT_BATCH); ++pos) {
+      if (!deleted.count(pos))
+        positions.push_back(pos);
+    }
+
+    if (positions.empty())
+      continue;
+
+    descriptors.resize(positions.size() * dim);
+    labels.resize(positions.size());
+    _set->get_descriptors(positions.data(), positions.size(),
+                          descriptors.data());
+    _set->get_labels(positions.data(), positions.size(), labels.data());
+
+    long first = set->add(descriptors.data(), positions.size(), labels.data());
+    for (long i = 0; i < positions.size(); ++i) {
+      new_positions[positions[i]] = first + i;
+    }
+  }
+}
+
+// The new index is built and stored in a separate directory from the
+// descriptors in the current one, while it keeps serving requests.
+// Descriptors added meanwhile are copied, and the ids remapped, while
+// holding _set_lock exclusively, right before the directories and the
+// sets in memory are swapped.
+void DescriptorSet::compact() {
+  if (_eng == DescriptorSetEngine(Flinng)) {
+    throw VCLException(UnsupportedOperation, "Flinng sets cannot be compacted");
+  }
+
+  _ids_lock.lock();
+  if (_compacting || _deleted.empty()) {
+    _ids_lock.unlock();
+    return;
+  }
+  _compacting = true;
+  std::unordered_set<long> deleted = _deleted;
+  _ids_lock.unlock();
+
+  timers.add_timestamp("desc_set_compact");
+
+  std::string set_path = get_path();
+  std::string tmp_path = set_path + COMPACT_SUFFIX;
+  std::string old_path = set_path + OLD_SUFFIX;
+  DescriptorSetData *new_set = NULL;
+  std::vector<long> new_positions;
+  long snapshot;
+
+  try {
+    fs::remove_all(tmp_path);
+
+    {
+      std::shared_lock<std::shared_mutex> lock(_set_lock);
+      snapshot = _set->get_n_total();
+
+      new_set = create_set(tmp_path, _set->get_dimensions(), _eng,
+                           _set->get_metric(), NULL);
+      auto labels_map = _set->get_labels_map();
+      new_set->set_labels_map(labels_map);
+      new_set->copy_training(_set);
+
+      copy_live(new_set, 0, snapshot, deleted, new_positions);
+    }
+
+    // Checkpoint of the copy: the descriptors copied under the exclusive
+    // lock only have to be synced
+    new_set->store();
+    write_set_info(tmp_path);
+  } catch (...) {
+    delete new_set;
+    fs::remove_all(tmp_path);
+    _ids_lock.lock();
+    _compacting = false;
+    _ids_lock.unlock();
+    throw;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(_set_lock);
+  _ids_lock.lock();
+
+  DescriptorSetData *old_set = _set;
+
+  try {
+    long n_total = _set->get_n_total();
+    copy_live(new_set, snapshot, n_total, _deleted, new_positions);
+    new_set->sync();
+
+    if (_ext_ids.empty())
+      _next_id = n_total;
+
+    std::vector<long> ext_ids(new_set->get_n_total(), -1);
+    std::unordered_set<long> new_deleted;
+    for (long pos = 0; pos < n_total; ++pos) {
+      long new_pos = new_positions[pos];
+      if (new_pos < 0)
+        continue;
+
+      // Removed after the copy started
+      if (_deleted.count(pos)) {
+        new_deleted.insert(new_pos);
+        continue;
+      }
+      ext_ids[new_pos] = _ext_ids.empty() ? pos : _ext_ids[pos];
+    }
+
+    write_id_map(tmp_path, _next_id, ext_ids, new_deleted);
+
+    // From here on, the current set is replaced. Its files, and the
+    // ones new_set keeps open, follow the renames.
+    _ids_log.close();
+    fs::remove_all(old_path);
+    fs::rename(set_path, old_path);
+    fs::rename(tmp_path, set_path);
+
+    new_set->set_path(set_path);
+    _set = new_set;
+    new_set = NULL;
+
+    _ext_ids.swap(ext_ids);
+    _deleted.swap(new_deleted);
+    index_ids();
+    open_id_log(true);
+  } catch (...) {
+    delete new_set;
+    fs::remove_all(tmp_path);
+
+    if (_set == old_set) {
+      // Back to the directory as it was before compact()
+      if (!fs::exists(set_path) && fs::exists(old_path))
+        fs::rename(old_path, set_path);
+      if (!_ids_log.is_open())
+        open_id_log(false);
+    }
+
+    _compacting = false;
+    _ids_lock.unlock(); // unlock before throwing exception
+    throw;
+  }
+
+  _ids_lock.unlock();
+  lock.unlock();
+
+  // Nothing refers to the replaced set anymore
+  delete old_set;
+  std::error_code ec;
+  fs::remove_all(old_path, ec);
+
+  _ids_lock.lock();
+  _compacting = false;
+  _ids_lock.unlock();
+
+  timers.add_timestamp("desc_set_compact");
+}
+
 void DescriptorSet::store() {
   timers.add_timestamp("desc_set_store");
-  _set->store();
-  write_set_info();
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  // Changes made while storing mark the set as modified again
+  _modified = false;
+  try {
+    _set->store();
+    write_set_info();
+    write_id_map();
+  } catch (...) {
+    _modified = true;
+    throw;
+  }
+
+  // A background training swaps its index in after this store()
+  if (_set->train_progress() >= 0)
+    _modified = true;
 
   // grab the descriptor files from local storage, upload them, delete the local
   // copies not deleting the local copies currently to resolve concurrency
@@ -239,11 +1113,33 @@ void DescriptorSet::store() {
 
 void DescriptorSet::store(std::string set_path) {
   timers.add_timestamp("desc_set_store");
-  _set->store(set_path);
-  write_set_info();
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  _modified = false;
+  try {
+    _set->store(set_path);
+    write_set_info();
+    write_id_map();
+  } catch (...) {
+    _modified = true;
+    throw;
+  }
+
+  if (_set->train_progress() >= 0)
+    _modified = true;
   timers.add_timestamp("desc_set_store");
 }
 
+bool DescriptorSet::is_modified() { return _modified; }
+
+void DescriptorSet::sync() {
+  timers.add_timestamp("desc_set_sync");
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  _set->sync();
+  write_id_map();
+  timers.add_timestamp("desc_set_sync");
+}
+
 /*  *********************** */
 /*   VECTOR-BASED INTERFACE */
 /*  *********************** */
@@ -292,11 +1188,12 @@ void DescriptorSet::search(DescDataArray queries, unsigned n, unsigned k,
 }
 
 std::vector<long> DescriptorSet::classify(DescDataArray descriptors, unsigned n,
-                                          unsigned quorum) {
+                                          unsigned quorum,
+                                          VoteWeighting weighting) {
   timers.add_timestamp("desc_set_vec_classify");
   LabelIdVector labels;
   labels.resize(n);
-  classify(descriptors, n, labels.data(), quorum);
+  classify(descriptors, n, labels.data(), quorum, weighting);
   timers.add_timestamp("desc_set_vec_classify");
   return labels;
 }
@@ -313,10 +1210,13 @@ void DescriptorSet::get_descriptors(std::vector<long> &ids,
 /*  *********************** */
 
 void DescriptorSet::set_labels_map(std::map<long, std::string> &labels) {
-  return _set->set_labels_map(labels);
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+  _set->set_labels_map(labels);
+  _modified = true;
 }
 
 std::map<long, std::string> DescriptorSet::get_labels_map() {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
   return _set->get_labels_map();
 }
 
@@ -334,7 +1234,7 @@ void DescriptorSet::set_labels_map(LabelIdVector &ids,
 std::vector<std::string>
 DescriptorSet::label_id_to_string(LabelIdVector &l_id) {
   std::vector<std::string> ret_labels(l_id.size());
-  std::map<long, std::string> labels_map = _set->get_labels_map();
+  std::map<long, std::string> labels_map = get_labels_map();
 
   for (int i = 0; i < l_id.size(); ++i) {
     ret_labels[i] = labels_map[l_id[i]];
@@ -343,6 +1243,7 @@ DescriptorSet::label_id_to_string(LabelIdVector &l_id) {
 }
 
 long DescriptorSet::get_label_id(const std::string &label) {
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
   auto map = _set->get_labels_map();
 
   for (auto it = map.begin(); it != map.end(); ++it) {
@@ -354,12 +1255,28 @@ long DescriptorSet::get_label_id(const std::string &label) {
   long id = map.size();
   map[id] = label;
   _set->set_labels_map(map);
+  _modified = true;
 
   return id;
 }
 
 std::vector<std::string> DescriptorSet::get_str_labels(DescIdVector &ids) {
-  return _set->get_str_labels(ids.data(), ids.size());
+  std::shared_lock<std::shared_mutex> lock(_set_lock);
+
+  std::vector<long> positions(ids.size());
+  _ids_lock.lock();
+  for (int i = 0; i < ids.size(); ++i) {
+    positions[i] = to_position(ids[i]);
+    if (positions[i] < 0) {
+      _ids_lock.unlock(); // unlock before throwing exception
+      throw VCLException(ObjectNotFound,
+                         "Descriptor " + std::to_string(ids[i]) +
+                             " does not exist");
+    }
+  }
+  _ids_lock.unlock();
+
+  return _set->get_str_labels(positions.data(), positions.size());
 }
 
 void DescriptorSet::set_connection(RemoteConnection *remote) {
@@ -30,7 +30,10 @@
  *
  */
 
+#include <algorithm>
 #include <assert.h>
+#include <functional>
+#include <limits>
 #include <sstream>
 
 #include "DescriptorSetData.h"
@@ -61,12 +64,81 @@ DescriptorSet::DescriptorSetData::DescriptorSetData(const std::string &set_path,
 
 DescriptorSet::DescriptorSetData::~DescriptorSetData() {}
 
-void DescriptorSet::DescriptorSetData::radius_search(float *query, float radius,
-                                                     long *descriptors,
-                                                     float *distances) {
+void DescriptorSet::DescriptorSetData::radius_search(
+    float *query, float radius, unsigned max_results, std::vector<long> &ids,
+    std::vector<float> &distances) {
   throw VCLException(UnsupportedOperation, "Not Implemented");
 }
 
+void DescriptorSet::DescriptorSetData::sort_radius_results(
+    std::vector<long> &ids, std::vector<float> &distances,
+    unsigned max_results, DistanceMetric metric) {
+  std::vector<std::pair<float, long>> found(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    found[i] = std::make_pair(distances[i], ids[i]);
+
+  size_t n = found.size();
+  if (max_results > 0 && max_results < n)
+    n = max_results;
+
+  // Larger inner products are closer
+  if (metric == DistanceMetric::IP || metric == DistanceMetric::Cosine)
+    std::partial_sort(found.begin(), found.begin() + n, found.end(),
+                      std::greater<std::pair<float, long>>());
+  else
+    std::partial_sort(found.begin(), found.begin() + n, found.end());
+
+  ids.resize(n);
+  distances.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    distances[i] = found[i].first;
+    ids[i] = found[i].second;
+  }
+}
+
+// Closer neighbors weigh more with DistanceWeightedVote: the inverse of
+// the distance for L2; for IP, where a larger product means closer, the
+// product minus the smallest one in the quorum, so weights stay positive.
+long DescriptorSet::DescriptorSetData::vote(const long *labels,
+                                            const float *distances,
+                                            unsigned quorum,
+                                            VoteWeighting weighting,
+                                            DistanceMetric metric) {
+  const float epsilon = 1e-6;
+
+  float min_score = std::numeric_limits<float>::max();
+  if (weighting == DistanceWeightedVote && metric == DistanceMetric::IP) {
+    for (unsigned i = 0; i < quorum; ++i) {
+      if (labels[i] >= 0)
+        min_score = std::min(min_score, distances[i]);
+    }
+  }
+
+  std::map<long, float> map_voting;
+  long winner = -1;
+  float max = 0;
+  for (unsigned i = 0; i < quorum; ++i) {
+    if (labels[i] < 0)
+      continue; // Means not found, or no label
+
+    float weight = 1;
+    if (weighting == DistanceWeightedVote) {
+      weight = metric == DistanceMetric::IP
+                   ? distances[i] - min_score + epsilon
+                   : 1 / (distances[i] + epsilon);
+    }
+
+    float &votes = map_voting[labels[i]];
+    votes += weight;
+    if (max < votes) {
+      max = votes;
+      winner = labels[i];
+    }
+  }
+
+  return winner;
+}
+
 // String labels handling
 
 void DescriptorSet::DescriptorSetData::set_labels_map(
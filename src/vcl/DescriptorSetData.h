@@ -125,13 +125,38 @@ public:
 
   std::string get_path() { return _set_path; }
 
+  /**
+   *  Points the set to its directory after it was renamed.
+   *  Files the set keeps open follow the rename.
+   */
+  virtual void set_path(const std::string &set_path) { _set_path = set_path; }
+
   unsigned get_dimensions() { return _dimensions; }
 
+  /**
+   *  Returns the size in bytes of each descriptor in the buffers
+   *  of this interface (dim floats, except for binary sets)
+   */
+  virtual size_t get_descriptor_size() { return sizeof(float) * _dimensions; }
+
   /**
    *  Returns the number of descriptors in the set
    */
   long get_n_total() { return _n_total; }
 
+  virtual DistanceMetric get_metric() { return _metric; }
+
+  // Label voted by the quorum neighbors of a descriptor, given their
+  // labels and distances (-1 if none of them has a label).
+  long vote(const long *labels, const float *distances, unsigned quorum,
+            VoteWeighting weighting, DistanceMetric metric);
+
+  // Sorts the results of a radius search closest first for the metric,
+  // and keeps the max_results closest ones (all of them if 0).
+  static void sort_radius_results(std::vector<long> &ids,
+                                  std::vector<float> &distances,
+                                  unsigned max_results, DistanceMetric metric);
+
   /**
    *  Inserts n descriptors and their labels into the set
    *  Both descriptors and labels must have the same number of elements,
@@ -177,16 +202,16 @@ public:
    *  Note: We only allow the radius search of a single
    *  element to avoid having to deal with results that are
    *  of different (unknown) sized for each query.
-   *  We will work on it once we have a more clear use case for
-   *  this call
    *
    *  @param query  Query vector
    *  @param radius  Maximun distance allowed
-   *  @param ids  Array of ID of the descriptors
-   *  @param distances  Distances of each neighbor
+   *  @param max_results  Maximum number of results, 0 for all of them
+   *  @param ids  Positions of the neighbors, closest first (resized)
+   *  @param distances  Distances of each neighbor (resized)
    */
-  virtual void radius_search(float *query, float radius, long *descriptors,
-                             float *distances);
+  virtual void radius_search(float *query, float radius, unsigned max_results,
+                             std::vector<long> &ids,
+                             std::vector<float> &distances);
 
   /**
    *  Find the label of the feature vector, based on the closest
@@ -196,9 +221,10 @@ public:
    *  @param n  Number of descriptors in buffer
    *  @return labels  Label Ids
    *  @param quorum  Number of elements used for the classification vote.
+   *  @param weighting  Weight of each vote
    */
   virtual void classify(float *descriptors, unsigned n, long *ids,
-                        unsigned quorum) = 0;
+                        unsigned quorum, VoteWeighting weighting) = 0;
 
   /**
    *  Get the descriptors by specifiying ids.
@@ -227,8 +253,33 @@ public:
    */
   virtual void train(float *descriptors, unsigned n) { train(); }
 
+  /**
+   *  Trains the index in the background, with the given descriptors
+   *  or a sample of the set when n is 0. Engines without background
+   *  training train before returning.
+   */
+  virtual void train_async(float *descriptors, unsigned n) {
+    if (n == 0)
+      train();
+    else
+      train(descriptors, n);
+  }
+
+  /**
+   *  Returns the progress of the background training, in [0, 1],
+   *  or -1 if none is running
+   */
+  virtual float train_progress() { return -1; }
+
   virtual bool is_trained() { return false; }
 
+  /**
+   *  Trains this empty set as the given one, of the same engine, is
+   *  trained, so that adding the descriptors of that set keeps its
+   *  training. Engines that need no training do nothing.
+   */
+  virtual void copy_training(DescriptorSetData *set) {}
+
   virtual void finalize_index() {}
 
   /**
@@ -243,6 +294,25 @@ public:
    */
   virtual void store(std::string collection_path) = 0;
 
+  /**
+   *  Makes every change applied since the last store() recoverable
+   *  after a restart. Engines that persist their changes incrementally
+   *  override this with something cheaper than a full store().
+   */
+  virtual void sync() { store(); }
+
+  /**
+   *  Returns true if opening the set replayed changes applied after
+   *  its last store(), from a write-ahead log.
+   */
+  virtual bool recovered() { return false; }
+
+  /**
+   *  Returns the ids of the placeholder descriptors the engine had to
+   *  insert when the set was opened. They are not part of the set.
+   */
+  virtual std::vector<long> padding_ids() { return std::vector<long>(); }
+
   // String labels handling
 
   /**
@@ -272,7 +342,7 @@ public:
    *  @param ids  ids of the labels
    *  @param labels  string for each label
    */
-  void set_labels_map(std::map<long, std::string> &labels);
+  virtual void set_labels_map(std::map<long, std::string> &labels);
 };
 
 }; // namespace VCL
\ No newline at end of file
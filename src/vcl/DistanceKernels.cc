@@ -0,0 +1,488 @@
+/**
+ * @file   DistanceKernels.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VCL_X86_KERNELS
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "DistanceKernels.h"
+
+// Descriptors compared against a block of queries at a time.
+// 256KB keeps a block in L2 cache while the queries go through it.
+#define DATA_BLOCK_BYTES (256 * 1024)
+#define QUERY_BLOCK 8
+
+using namespace VCL;
+
+namespace {
+
+typedef float (*DistanceFn)(const float *, const float *, size_t);
+
+float l2_sqr_scalar(const float *x, const float *y, size_t dim) {
+  float sum = 0;
+  for (size_t i = 0; i < dim; ++i) {
+    float diff = x[i] - y[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+float inner_product_scalar(const float *x, const float *y, size_t dim) {
+  float sum = 0;
+  for (size_t i = 0; i < dim; ++i) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+typedef void (*ConvertFn)(const uint16_t *, size_t, float *);
+
+float fp16_to_float_one(uint16_t h) {
+  uint32_t sign = uint32_t(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+
+  if (exp == 0x1f) { // Inf and NaN (made quiet, as F16C does)
+    bits = sign | 0x7f800000 | (mant << 13) | (mant ? 0x400000 : 0);
+  } else if (exp != 0) {
+    bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    bits = sign;
+  } else { // Subnormal, normalized as a float
+    exp = 127 - 14;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      --exp;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+void fp16_to_float_scalar(const uint16_t *src, size_t n, float *dst) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = fp16_to_float_one(src[i]);
+}
+
+// bfloat16 is the upper half of a float
+void bf16_to_float_scalar(const uint16_t *src, size_t n, float *dst) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t bits = uint32_t(src[i]) << 16;
+    std::memcpy(dst + i, &bits, sizeof(float));
+  }
+}
+
+#ifdef VCL_X86_KERNELS
+
+__attribute__((target("avx,f16c"))) void
+fp16_to_float_f16c(const uint16_t *src, size_t n, float *dst) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+  fp16_to_float_scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) void
+bf16_to_float_avx2(const uint16_t *src, size_t n, float *dst) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i w =
+        _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(w, 16)));
+  }
+  bf16_to_float_scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) inline float horizontal_sum(__m256 v) {
+  __m128 sum =
+      _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) float
+l2_sqr_avx2(const float *x, const float *y, size_t dim) {
+  __m256 acc = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= dim; i += 8) {
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+    acc = _mm256_fmadd_ps(diff, diff, acc);
+  }
+
+  float sum = horizontal_sum(acc);
+  for (; i < dim; ++i) {
+    float diff = x[i] - y[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+__attribute__((target("avx2,fma"))) float
+inner_product_avx2(const float *x, const float *y, size_t dim) {
+  __m256 acc = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= dim; i += 8) {
+    acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc);
+  }
+
+  float sum = horizontal_sum(acc);
+  for (; i < dim; ++i) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+// Through memory: the 512-bit extract intrinsics trip
+// -Wuninitialized in the GCC headers.
+__attribute__((target("avx512f"))) inline float horizontal_sum(__m512 v) {
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, v);
+  float sum = 0;
+  for (int i = 0; i < 16; ++i)
+    sum += lanes[i];
+  return sum;
+}
+
+// The tail is handled with a masked load, zeros do not change the result.
+__attribute__((target("avx512f"))) float
+l2_sqr_avx512(const float *x, const float *y, size_t dim) {
+  __m512 acc = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+    acc = _mm512_fmadd_ps(diff, diff, acc);
+  }
+
+  if (i < dim) {
+    __mmask16 mask = (__mmask16)((1u << (dim - i)) - 1);
+    __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i),
+                                _mm512_maskz_loadu_ps(mask, y + i));
+    acc = _mm512_fmadd_ps(diff, diff, acc);
+  }
+  return horizontal_sum(acc);
+}
+
+__attribute__((target("avx512f"))) float
+inner_product_avx512(const float *x, const float *y, size_t dim) {
+  __m512 acc = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc);
+  }
+
+  if (i < dim) {
+    __mmask16 mask = (__mmask16)((1u << (dim - i)) - 1);
+    acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i),
+                          _mm512_maskz_loadu_ps(mask, y + i), acc);
+  }
+  return horizontal_sum(acc);
+}
+
+#endif
+
+struct Kernels {
+  DistanceFn l2_sqr;
+  DistanceFn inner_product;
+  const char *level;
+};
+
+Kernels select_kernels() {
+#ifdef VCL_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return {l2_sqr_avx512, inner_product_avx512, "avx512"};
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return {l2_sqr_avx2, inner_product_avx2, "avx2"};
+#endif
+  return {l2_sqr_scalar, inner_product_scalar, "scalar"};
+}
+
+const Kernels &kernels() {
+  static const Kernels selected = select_kernels();
+  return selected;
+}
+
+struct Converters {
+  ConvertFn fp16_to_float;
+  ConvertFn bf16_to_float;
+};
+
+Converters select_converters() {
+  Converters selected = {fp16_to_float_scalar, bf16_to_float_scalar};
+#ifdef VCL_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+    selected.fp16_to_float = fp16_to_float_f16c;
+  if (__builtin_cpu_supports("avx2"))
+    selected.bf16_to_float = bf16_to_float_avx2;
+#endif
+  return selected;
+}
+
+const Converters &converters() {
+  static const Converters selected = select_converters();
+  return selected;
+}
+
+int n_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+int thread_id() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Threads of the current parallel region, which may be fewer
+// than were asked for
+int team_size() {
+#ifdef _OPENMP
+  return omp_get_num_threads();
+#else
+  return 1;
+#endif
+}
+
+// Bounded heap with the k best results of a query, the worst one on top.
+// Scores are distances for L2 and negated inner products for IP,
+// so that a smaller score is always better.
+class TopK {
+  unsigned _k;
+  std::vector<std::pair<float, long>> _heap;
+
+public:
+  TopK(unsigned k) : _k(k) { _heap.reserve(k); }
+
+  void push(float score, long id) {
+    if (_heap.size() < _k) {
+      _heap.emplace_back(score, id);
+      std::push_heap(_heap.begin(), _heap.end());
+    } else if (_k > 0 && score < _heap.front().first) {
+      std::pop_heap(_heap.begin(), _heap.end());
+      _heap.back() = std::make_pair(score, id);
+      std::push_heap(_heap.begin(), _heap.end());
+    }
+  }
+
+  void merge(const TopK &other) {
+    for (auto &res : other._heap)
+      push(res.first, res.second);
+  }
+
+  // Best result first, padded with -1 ids.
+  void write(bool negated, long *ids, float *distances) {
+    std::sort_heap(_heap.begin(), _heap.end());
+    for (unsigned j = 0; j < _k; ++j) {
+      if (j < _heap.size()) {
+        ids[j] = _heap[j].second;
+        distances[j] = negated ? -_heap[j].first : _heap[j].first;
+      } else {
+        ids[j] = -1;
+        distances[j] = negated ? -std::numeric_limits<float>::max()
+                               : std::numeric_limits<float>::max();
+      }
+    }
+  }
+};
+
+} // namespace
+
+float DistanceKernels::l2_sqr(const float *x, const float *y, size_t dim) {
+  return kernels().l2_sqr(x, y, dim);
+}
+
+float DistanceKernels::inner_product(const float *x, const float *y,
+                                     size_t dim) {
+  return kernels().inner_product(x, y, dim);
+}
+
+const char *DistanceKernels::simd_level() { return kernels().level; }
+
+void DistanceKernels::normalize(float *x, size_t n, size_t dim) {
+  for (size_t i = 0; i < n; ++i) {
+    float *v = x + i * dim;
+    float norm = std::sqrt(kernels().inner_product(v, v, dim));
+    if (norm == 0)
+      continue;
+
+    float inv = 1 / norm;
+    for (size_t j = 0; j < dim; ++j)
+      v[j] *= inv;
+  }
+}
+
+void VCL::fp16_to_float(const uint16_t *src, size_t n, float *dst) {
+  converters().fp16_to_float(src, n, dst);
+}
+
+void VCL::bf16_to_float(const uint16_t *src, size_t n, float *dst) {
+  converters().bf16_to_float(src, n, dst);
+}
+
+void DistanceKernels::knn(const float *queries, size_t n_queries,
+                          const float *data, size_t n, size_t dim, unsigned k,
+                          DistanceMetric metric, long *ids, float *distances) {
+  bool ip = metric == DistanceMetric::IP;
+  DistanceFn distance = ip ? kernels().inner_product : kernels().l2_sqr;
+  auto score = [&](const float *q, size_t j) {
+    float d = distance(q, data + j * dim, dim);
+    return ip ? -d : d;
+  };
+
+  int threads = n_threads();
+
+  // Too few queries to keep every thread busy:
+  // each thread goes through a slice of the data instead.
+  if (n_queries < size_t(threads)) {
+    for (size_t q = 0; q < n_queries; ++q) {
+      const float *query = queries + q * dim;
+      std::vector<TopK> heaps(threads, TopK(k));
+
+#pragma omp parallel num_threads(threads)
+      {
+        int t = thread_id();
+        int team = team_size();
+        size_t begin = n * t / team;
+        size_t end = n * (t + 1) / team;
+        for (size_t j = begin; j < end; ++j) {
+          heaps[t].push(score(query, j), j);
+        }
+      }
+
+      // The heaps of threads that were not granted are empty
+      for (int t = 1; t < threads; ++t) {
+        heaps[0].merge(heaps[t]);
+      }
+      heaps[0].write(ip, ids + q * k, distances + q * k);
+    }
+    return;
+  }
+
+  size_t data_block =
+      std::max<size_t>(1, DATA_BLOCK_BYTES / (dim * sizeof(float)));
+
+#pragma omp parallel for schedule(dynamic)
+  for (long qb = 0; qb < long(n_queries); qb += QUERY_BLOCK) {
+    size_t q_end = std::min(n_queries, size_t(qb) + QUERY_BLOCK);
+    std::vector<TopK> heaps(q_end - qb, TopK(k));
+
+    for (size_t db = 0; db < n; db += data_block) {
+      size_t d_end = std::min(n, db + data_block);
+      for (size_t q = qb; q < q_end; ++q) {
+        const float *query = queries + q * dim;
+        for (size_t j = db; j < d_end; ++j) {
+          heaps[q - qb].push(score(query, j), j);
+        }
+      }
+    }
+
+    for (size_t q = qb; q < q_end; ++q) {
+      heaps[q - qb].write(ip, ids + q * k, distances + q * k);
+    }
+  }
+}
+
+void DistanceKernels::merge_knn(size_t n_queries, unsigned k,
+                                DistanceMetric metric, const long *ids,
+                                const float *distances, long id_offset,
+                                long *best_ids, float *best_distances) {
+  bool ip = metric == DistanceMetric::IP;
+
+  for (size_t q = 0; q < n_queries; ++q) {
+    TopK heap(k);
+    for (size_t j = q * k; j < (q + 1) * k; ++j) {
+      if (best_ids[j] >= 0)
+        heap.push(ip ? -best_distances[j] : best_distances[j], best_ids[j]);
+      if (ids[j] >= 0)
+        heap.push(ip ? -distances[j] : distances[j], ids[j] + id_offset);
+    }
+    heap.write(ip, best_ids + q * k, best_distances + q * k);
+  }
+}
+
+void DistanceKernels::kmeans(const float *data, size_t n, size_t dim,
+                             unsigned k, unsigned iterations,
+                             float *centroids) {
+  for (size_t c = 0; c < k; ++c) {
+    std::memcpy(centroids + c * dim, data + (c * n / k) * dim,
+                sizeof(float) * dim);
+  }
+
+  std::vector<long> assignment(n);
+  std::vector<float> distances(n);
+  std::vector<double> sums(k * dim);
+  std::vector<size_t> counts(k);
+
+  for (unsigned it = 0; it < iterations; ++it) {
+    knn(data, n, centroids, k, dim, 1, DistanceMetric::L2, assignment.data(),
+        distances.data());
+
+    std::fill(sums.begin(), sums.end(), 0);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (size_t i = 0; i < n; ++i) {
+      long c = assignment[i];
+      counts[c]++;
+      for (size_t j = 0; j < dim; ++j)
+        sums[c * dim + j] += data[i * dim + j];
+    }
+
+    for (size_t c = 0; c < k; ++c) {
+      if (counts[c] == 0)
+        continue;
+      for (size_t j = 0; j < dim; ++j)
+        centroids[c * dim + j] = sums[c * dim + j] / counts[c];
+    }
+  }
+}
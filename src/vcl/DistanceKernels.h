@@ -0,0 +1,108 @@
+/**
+ * @file   DistanceKernels.h
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Brute force k nearest neighbors search over a buffer of descriptors,
+ * with SIMD distance kernels (AVX-512, AVX2) selected at runtime.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "vcl/DescriptorSet.h"
+
+namespace VCL {
+
+namespace DistanceKernels {
+
+/**
+ *  Squared L2 distance between x and y, of dim floats each
+ */
+float l2_sqr(const float *x, const float *y, size_t dim);
+
+/**
+ *  Inner product of x and y, of dim floats each
+ */
+float inner_product(const float *x, const float *y, size_t dim);
+
+/**
+ *  Scales each of the n descriptors (of dim floats) to unit length.
+ *  Zero descriptors are left as they are.
+ */
+void normalize(float *x, size_t n, size_t dim);
+
+/**
+ *  Instruction set used by the kernels on this CPU:
+ *  "avx512", "avx2" or "scalar"
+ */
+const char *simd_level();
+
+/**
+ *  Finds the k nearest descriptors of each query.
+ *  Queries are processed in blocks against blocks of the data that stay
+ *  in cache, and each query keeps a bounded heap of its k best results,
+ *  so no buffer of the size of the data is allocated.
+ *
+ *  @param queries  n_queries * dim floats
+ *  @param data  n * dim floats
+ *  @param metric  L2 (smallest squared distance first) or IP (largest
+ *                 inner product first)
+ *  @param ids  n_queries * k ids (-1 when fewer than k descriptors)
+ *  @param distances  n_queries * k distances
+ */
+void knn(const float *queries, size_t n_queries, const float *data, size_t n,
+         size_t dim, unsigned k, DistanceMetric metric, long *ids,
+         float *distances);
+
+/**
+ *  Merges the results of knn over a part of the data, whose first
+ *  descriptor has id id_offset, into the best results found so far
+ *  (in the output format of knn), so a set can be searched in chunks.
+ */
+void merge_knn(size_t n_queries, unsigned k, DistanceMetric metric,
+               const long *ids, const float *distances, long id_offset,
+               long *best_ids, float *best_distances);
+
+/**
+ *  Clusters the data with k-means (L2), starting from k descriptors
+ *  evenly spread over the data. Clusters left empty by an iteration
+ *  keep their previous centroid.
+ *
+ *  @param data  n * dim floats, n >= k
+ *  @param k  Number of clusters
+ *  @param iterations  Number of Lloyd iterations
+ *  @param centroids  k * dim floats
+ */
+void kmeans(const float *data, size_t n, size_t dim, unsigned k,
+            unsigned iterations, float *centroids);
+
+}; // namespace DistanceKernels
+}; // namespace VCL
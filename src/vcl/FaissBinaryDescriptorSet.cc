@@ -0,0 +1,694 @@
+/**
+ * @file   FaissBinaryDescriptorSet.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * This file implements the DescriptorSets of binary vectors.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "FaissBinaryDescriptorSet.h"
+#include "vcl/Exception.h"
+
+#include "faiss/impl/AuxIndexStructures.h"
+#include <faiss/IndexBinaryFlat.h>
+#include <faiss/IndexBinaryHNSW.h>
+#include <faiss/IndexBinaryIVF.h>
+#include <faiss/clone_index.h>
+#include <faiss/impl/FaissException.h>
+#include <faiss/index_io.h>
+
+#define FAISS_IDX_FILE_NAME "faiss.idx"
+#define IDS_IDX_FILE_NAME "ids.arr"
+#define LOG_FILE_NAME "wal.log"
+
+// Write-ahead log record types
+#define LOG_RECORD_ADD 1
+#define LOG_RECORD_LABELS_MAP 2
+
+// Faiss k-means warns below 39 training points per centroid
+#define IVF_NLIST 16
+#define IVF_TRAIN_PER_LIST 39
+
+#define HNSW_M 32
+#define HNSW_EF_CONSTRUCTION 64
+#define HNSW_EF_SEARCH 64
+
+using namespace VCL;
+
+FaissBinaryDescriptorSet::FaissBinaryDescriptorSet(const std::string &set_path)
+    : DescriptorSetData(set_path) {
+  _index = NULL;
+  _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+  _log_enabled = true;
+  _recovered = false;
+  read_label_ids();
+  read_labels_map();
+  read_index();
+
+  _dimensions = _index->d;
+  _n_total = _index->ntotal;
+  _metric = Hamming;
+}
+
+FaissBinaryDescriptorSet::FaissBinaryDescriptorSet(const std::string &set_path,
+                                                   unsigned dim)
+    : DescriptorSetData(set_path, dim) {
+  _index = NULL;
+  _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+  _log_enabled = true;
+  _recovered = false;
+  _metric = Hamming;
+  check_dimensions();
+  // The log is created on the first store(), as for the float sets
+}
+
+FaissBinaryDescriptorSet::~FaissBinaryDescriptorSet() { delete _index; }
+
+void FaissBinaryDescriptorSet::check_dimensions() {
+  if (_dimensions == 0 || _dimensions % 8 != 0) {
+    throw VCLException(SizeMismatch,
+                       "Binary descriptors must have a multiple of 8 bits");
+  }
+}
+
+void FaissBinaryDescriptorSet::read_index() {
+  try {
+    _index = faiss::read_index_binary(_faiss_file.c_str());
+  } catch (faiss::FaissException &e) {
+    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
+  }
+
+  // Faiss will sometimes throw, or sometimes return NULL,
+  // we check both just in case.
+  if (!_index) {
+    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
+  }
+}
+
+// Same format as the labels file of the float Faiss sets
+void FaissBinaryDescriptorSet::write_label_ids() {
+  std::string ids_file = _set_path + "/" + IDS_IDX_FILE_NAME;
+  std::string tmp_file = ids_file + ".tmp";
+  std::ofstream out_ids(tmp_file, std::ofstream::binary);
+
+  unsigned ids_size = _label_ids.size();
+  out_ids.write((char *)&ids_size, sizeof(ids_size));
+  out_ids.write((char *)_label_ids.data(), sizeof(long) * ids_size);
+  out_ids.close();
+
+  std::rename(tmp_file.c_str(), ids_file.c_str());
+}
+
+void FaissBinaryDescriptorSet::read_label_ids() {
+  std::ifstream in_ids(_set_path + "/" + IDS_IDX_FILE_NAME,
+                       std::ofstream::binary);
+
+  if (!in_ids.good()) {
+    throw VCLException(OpenFailed, "Cannot read labels file");
+  }
+
+  unsigned ids_size;
+  in_ids.read((char *)&ids_size, sizeof(ids_size));
+  _label_ids.resize(ids_size);
+  in_ids.read((char *)_label_ids.data(), sizeof(long) * ids_size);
+  in_ids.close();
+}
+
+long FaissBinaryDescriptorSet::add(float *descriptors, unsigned n,
+                                   long *labels) {
+  assert(n > 0);
+
+  _lock.lock();
+
+  // Logged first: the index is left as it was if the log cannot be
+  // written, and the record is dropped if the index rejects the codes
+  std::streampos log_start = _log.tellp();
+  if (!append_log(descriptors, n, labels)) {
+    _lock.unlock(); // unlock before throwing exception
+    throw VCLException(UndefinedException, "Cannot write log: " + _log_file);
+  }
+
+  long id_first = _index->ntotal;
+
+  try {
+    _index->add(n, (const uint8_t *)descriptors);
+  } catch (faiss::FaissException &e) {
+    drop_log_record(log_start);
+    _lock.unlock(); // unlock before throwing exception
+    throw VCLException(UndefinedException, "faiss::add failed");
+  }
+  _n_total = _index->ntotal;
+
+  if (labels != NULL) {
+    _label_ids.resize(id_first + n);
+    std::memcpy(_label_ids.data() + id_first, labels, n * sizeof(long));
+  }
+
+  _lock.unlock();
+
+  return id_first;
+}
+
+// Write-ahead log
+
+// Same layout as the log of the float sets, with the codes
+// (get_descriptor_size() bytes each) in place of the floats.
+bool FaissBinaryDescriptorSet::open_log(bool truncate) {
+  if (_log.is_open())
+    _log.close();
+
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+
+  if (truncate) {
+    _log.open(_log_file, std::ofstream::binary | std::ofstream::trunc);
+    uint64_t checkpoint_ntotal = _index->ntotal;
+    _log.write((char *)&checkpoint_ntotal, sizeof(checkpoint_ntotal));
+    _log.flush();
+  } else {
+    _log.open(_log_file, std::ofstream::binary | std::ofstream::app);
+  }
+
+  return _log.good();
+}
+
+// Must be called with _lock held
+bool FaissBinaryDescriptorSet::append_log(float *descriptors, unsigned n,
+                                          long *labels) {
+  if (!_log_enabled || !_log.is_open())
+    return true;
+
+  std::streampos start = _log.tellp();
+  uint8_t type = LOG_RECORD_ADD;
+  uint8_t has_labels = labels != NULL;
+  uint32_t n_desc = n;
+  _log.write((char *)&type, sizeof(type));
+  _log.write((char *)&n_desc, sizeof(n_desc));
+  _log.write((char *)&has_labels, sizeof(has_labels));
+  _log.write((char *)descriptors, get_descriptor_size() * n);
+  if (has_labels)
+    _log.write((char *)labels, sizeof(long) * n);
+
+  return end_log_record(start);
+}
+
+// Must be called with _lock held
+bool FaissBinaryDescriptorSet::append_log(
+    std::map<long, std::string> &labels) {
+  if (!_log_enabled || !_log.is_open())
+    return true;
+
+  std::streampos start = _log.tellp();
+  uint8_t type = LOG_RECORD_LABELS_MAP;
+  uint32_t n_labels = labels.size();
+  _log.write((char *)&type, sizeof(type));
+  _log.write((char *)&n_labels, sizeof(n_labels));
+  for (auto &label : labels) {
+    long id = label.first;
+    uint32_t length = label.second.size();
+    _log.write((char *)&id, sizeof(id));
+    _log.write((char *)&length, sizeof(length));
+    _log.write(label.second.data(), length);
+  }
+
+  return end_log_record(start);
+}
+
+// Must be called with _lock held
+bool FaissBinaryDescriptorSet::end_log_record(std::streampos start) {
+  _log.flush();
+  if (_log.good())
+    return true;
+
+  drop_log_record(start);
+  return false;
+}
+
+// Truncates the log to start, where the last record began.
+// Must be called with _lock held
+void FaissBinaryDescriptorSet::drop_log_record(std::streampos start) {
+  if (!_log_enabled || !_log.is_open())
+    return;
+
+  _log.clear();
+  _log.seekp(start);
+  std::error_code ec;
+  std::filesystem::resize_file(_log_file, start, ec);
+}
+
+// Applies the log on top of the index that was just read, and leaves
+// the log open for appending. Called by the constructors of the
+// subclasses, so that add() is theirs.
+void FaissBinaryDescriptorSet::replay_log() {
+  std::ifstream in_log(_log_file, std::ifstream::binary);
+
+  uint64_t checkpoint_ntotal;
+  if (!in_log.good() ||
+      !in_log.read((char *)&checkpoint_ntotal, sizeof(checkpoint_ntotal))) {
+    // Set stored before logging was in place, start a new log.
+    in_log.close();
+    if (!open_log(true)) {
+      throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+    }
+    return;
+  }
+
+  // The index may already contain the first records, if the server
+  // crashed between writing it and truncating the log.
+  long skip = _index->ntotal - checkpoint_ntotal;
+  std::streamoff valid_size = in_log.tellg();
+  size_t code_size = get_descriptor_size();
+
+  _log_enabled = false;
+
+  while (true) {
+    uint8_t type;
+    uint32_t n;
+    if (!in_log.read((char *)&type, sizeof(type)) ||
+        !in_log.read((char *)&n, sizeof(n)))
+      break;
+
+    if (type == LOG_RECORD_ADD) {
+      uint8_t has_labels;
+      std::vector<uint8_t> codes(size_t(n) * code_size);
+      std::vector<long> labels;
+
+      if (!in_log.read((char *)&has_labels, sizeof(has_labels)) ||
+          !in_log.read((char *)codes.data(), codes.size()))
+        break;
+
+      if (has_labels) {
+        labels.resize(n);
+        if (!in_log.read((char *)labels.data(), sizeof(long) * n))
+          break;
+      }
+
+      unsigned applied = skip > 0 ? std::min<long>(skip, n) : 0;
+      skip -= applied;
+
+      if (applied < n) {
+        add((float *)(codes.data() + size_t(applied) * code_size),
+            n - applied, has_labels ? labels.data() + applied : NULL);
+        _recovered = true;
+      }
+    } else if (type == LOG_RECORD_LABELS_MAP) {
+      std::map<long, std::string> labels;
+      bool complete = true;
+      for (uint32_t i = 0; i < n && complete; ++i) {
+        long id;
+        uint32_t length;
+        complete = bool(in_log.read((char *)&id, sizeof(id))) &&
+                   bool(in_log.read((char *)&length, sizeof(length)));
+        if (complete) {
+          std::string label(length, '\0');
+          complete = bool(in_log.read(&label[0], length));
+          labels[id] = label;
+        }
+      }
+
+      if (!complete)
+        break;
+
+      DescriptorSetData::set_labels_map(labels);
+      _recovered = true;
+    } else {
+      break;
+    }
+
+    valid_size = in_log.tellg();
+  }
+
+  _log_enabled = true;
+  in_log.close();
+
+  // Drop a partially written record at the end of the log (if any)
+  std::filesystem::resize_file(_log_file, valid_size);
+  if (!open_log(false)) {
+    throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+  }
+}
+
+void FaissBinaryDescriptorSet::set_labels_map(
+    std::map<long, std::string> &labels) {
+  _lock.lock();
+  bool logged = append_log(labels);
+  _lock.unlock();
+
+  if (!logged) {
+    throw VCLException(UndefinedException, "Cannot write log: " + _log_file);
+  }
+
+  DescriptorSetData::set_labels_map(labels);
+}
+
+void FaissBinaryDescriptorSet::train() { train(NULL, 0); }
+
+void FaissBinaryDescriptorSet::train(float *descriptors, unsigned n) {
+  _lock.lock();
+
+  long n_total = _index->ntotal;
+  std::vector<uint8_t> recons(n_total * get_descriptor_size());
+
+  try {
+    if (n_total > 0)
+      _index->reconstruct_n(0, n_total, recons.data());
+    _index->reset();
+    if (n == 0)
+      _index->train(n_total, recons.data());
+    else
+      _index->train(n, (const uint8_t *)descriptors);
+    if (n_total > 0)
+      _index->add(n_total, recons.data());
+  } catch (faiss::FaissException &e) {
+    _lock.unlock(); // unlock before throwing exception
+    throw VCLException(UndefinedException, "faiss::train failed");
+  }
+
+  _lock.unlock();
+}
+
+bool FaissBinaryDescriptorSet::is_trained() { return _index->is_trained; }
+
+// Binary searches are thread-safe in Faiss, as float ones
+void FaissBinaryDescriptorSet::search(float *query, unsigned n_queries,
+                                      unsigned k, long *ids,
+                                      float *distances) {
+  std::vector<int32_t> hamming(n_queries * k);
+  _index->search(n_queries, (const uint8_t *)query, k, hamming.data(), ids);
+
+  for (long i = 0; i < hamming.size(); ++i) {
+    distances[i] = hamming[i];
+  }
+}
+
+// Returns the descriptors at a distance strictly below the radius,
+// as the float Faiss sets.
+void FaissBinaryDescriptorSet::radius_search(float *query, float radius,
+                                             unsigned max_results,
+                                             std::vector<long> &ids,
+                                             std::vector<float> &distances) {
+  faiss::RangeSearchResult rs(1); // 1 is the Number of queries
+
+  try {
+    _index->range_search(1, (const uint8_t *)query, int(radius), &rs);
+  } catch (faiss::FaissException &e) {
+    throw VCLException(UnsupportedOperation,
+                       "Radius search not supported by this index");
+  }
+
+  long found = rs.lims[1];
+  ids.assign(rs.labels, rs.labels + found);
+  distances.assign(rs.distances, rs.distances + found);
+
+  sort_radius_results(ids, distances, max_results, Hamming);
+}
+
+void FaissBinaryDescriptorSet::classify(float *descriptors, unsigned n,
+                                        long *ids, unsigned quorum,
+                                        VoteWeighting weighting) {
+  std::vector<float> distances(n * quorum);
+  std::vector<long> labels(n * quorum);
+
+  search(descriptors, n, quorum, labels.data(), distances.data());
+
+  // From neighbor ids to their labels
+  _lock.lock();
+  for (long &idx : labels) {
+    if (idx >= 0) // Means found
+      idx = idx < _label_ids.size() ? _label_ids[idx] : -1;
+  }
+  _lock.unlock();
+
+  for (int j = 0; j < n; ++j) {
+    ids[j] = vote(labels.data() + quorum * j, distances.data() + quorum * j,
+                  quorum, weighting, Hamming);
+  }
+}
+
+void FaissBinaryDescriptorSet::get_labels(long *ids, unsigned n,
+                                          long *labels) {
+  _lock.lock();
+
+  for (int i = 0; i < n; ++i) {
+    long idx = ids[i];
+    if (idx < 0 || idx >= _index->ntotal) {
+      _lock.unlock(); // unlock before throwing exception
+      throw VCLException(ObjectNotFound, "Label id does not exists");
+    }
+    labels[i] = idx < _label_ids.size() ? _label_ids[idx] : -1;
+  }
+
+  _lock.unlock();
+}
+
+// Binary indexes have no reconstruct_batch(): the ids are sorted, and
+// each run of consecutive ids is read with one reconstruct_n().
+void FaissBinaryDescriptorSet::get_descriptors(long *ids, unsigned n,
+                                               float *descriptors) {
+  size_t code_size = get_descriptor_size();
+  uint8_t *codes = (uint8_t *)descriptors;
+
+  std::vector<unsigned> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [ids](unsigned a, unsigned b) { return ids[a] < ids[b]; });
+
+  _lock.lock();
+
+  for (int i = 0; i < n; ++i) {
+    if (ids[i] < 0 || ids[i] >= _index->ntotal) {
+      _lock.unlock(); // unlock before throwing exception
+      throw VCLException(ObjectNotFound, "Descriptor id does not exists");
+    }
+  }
+
+  try {
+    std::vector<uint8_t> run;
+    for (unsigned i = 0; i < n;) {
+      unsigned j = i + 1;
+      while (j < n && ids[order[j]] <= ids[order[j - 1]] + 1)
+        ++j;
+
+      long first = ids[order[i]];
+      long count = ids[order[j - 1]] - first + 1;
+      run.resize(count * code_size);
+      _index->reconstruct_n(first, count, run.data());
+
+      for (unsigned r = i; r < j; ++r) {
+        std::memcpy(codes + order[r] * code_size,
+                    run.data() + (ids[order[r]] - first) * code_size,
+                    code_size);
+      }
+      i = j;
+    }
+  } catch (faiss::FaissException &e) {
+    _lock.unlock(); // unlock before throwing exception
+    throw VCLException(UndefinedException, "faiss::reconstruct failed");
+  }
+
+  _lock.unlock();
+}
+
+void FaissBinaryDescriptorSet::store() { store(_set_path); }
+
+void FaissBinaryDescriptorSet::store(std::string set_path) {
+  _lock.lock();
+
+  _set_path = set_path;
+  _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
+
+  int ret = create_dir(_set_path.c_str());
+  if (ret == 0 || ret == EEXIST) { // Directory exists or created
+    std::string tmp_file = _faiss_file + ".tmp";
+    faiss::write_index_binary(_index, tmp_file.c_str());
+    std::rename(tmp_file.c_str(), _faiss_file.c_str());
+    write_label_ids();
+    write_labels_map();
+
+    // Everything is in the checkpoint now, start over with an empty log.
+    bool log_opened = open_log(true);
+    _lock.unlock();
+
+    if (!log_opened) {
+      throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+    }
+  } else {
+    _lock.unlock(); // unlock before throwing exception
+    throw VCLException(OpenFailed, _faiss_file +
+                                       "cannot be created or written. " +
+                                       "Error: " + std::to_string(ret));
+  }
+}
+
+void FaissBinaryDescriptorSet::sync() {
+  _lock.lock();
+  if (_log.is_open()) {
+    _log.flush();
+    _lock.unlock();
+    return;
+  }
+  _lock.unlock();
+
+  // Never stored, there is no checkpoint the log could be applied to.
+  store();
+}
+
+void FaissBinaryDescriptorSet::set_path(const std::string &set_path) {
+  std::lock_guard<std::mutex> lock(_lock);
+  _set_path = set_path;
+  _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+}
+
+// FaissBinaryFlatDescriptorSet
+
+FaissBinaryFlatDescriptorSet::FaissBinaryFlatDescriptorSet(
+    const std::string &set_path)
+    : FaissBinaryDescriptorSet(set_path) {
+  replay_log();
+}
+
+FaissBinaryFlatDescriptorSet::FaissBinaryFlatDescriptorSet(
+    const std::string &set_path, unsigned dim)
+    : FaissBinaryDescriptorSet(set_path, dim) {
+  _index = new faiss::IndexBinaryFlat(_dimensions);
+}
+
+// FaissBinaryIVFDescriptorSet
+
+FaissBinaryIVFDescriptorSet::FaissBinaryIVFDescriptorSet(
+    const std::string &set_path)
+    : FaissBinaryDescriptorSet(set_path) {
+  replay_log();
+}
+
+FaissBinaryIVFDescriptorSet::FaissBinaryIVFDescriptorSet(
+    const std::string &set_path, unsigned dim)
+    : FaissBinaryDescriptorSet(set_path, dim) {
+  faiss::IndexBinaryFlat *quantizer = new faiss::IndexBinaryFlat(_dimensions);
+  faiss::IndexBinaryIVF *index =
+      new faiss::IndexBinaryIVF(quantizer, _dimensions, IVF_NLIST);
+  index->own_fields = true;
+  _index = index;
+}
+
+long FaissBinaryIVFDescriptorSet::add(float *descriptors, unsigned n,
+                                      long *labels) {
+  assert(n > 0);
+
+  _lock.lock();
+
+  // As with the float IVF sets, the index is trained the first time
+  // something is added, with the inserted elements. They are repeated
+  // when there are too few of them; train() can later be called with
+  // better data.
+  if (!_index->is_trained) {
+    size_t code_size = get_descriptor_size();
+    long desc_4_training = std::max<long>(n, IVF_NLIST * IVF_TRAIN_PER_LIST);
+
+    std::vector<uint8_t> aux_desc(desc_4_training * code_size);
+    for (long i = 0; i < desc_4_training; ++i) {
+      std::memcpy(aux_desc.data() + i * code_size,
+                  (uint8_t *)descriptors + (i % n) * code_size, code_size);
+    }
+
+    try {
+      _index->train(desc_4_training, aux_desc.data());
+    } catch (faiss::FaissException &e) {
+      _lock.unlock(); // unlock before throwing exception
+      throw VCLException(UndefinedException, "faiss::train failed");
+    }
+
+    // Needed for doing reconstructions
+    ((faiss::IndexBinaryIVF *)_index)->make_direct_map();
+  }
+  _lock.unlock();
+
+  return FaissBinaryDescriptorSet::add(descriptors, n, labels);
+}
+
+void FaissBinaryIVFDescriptorSet::copy_training(DescriptorSetData *set) {
+  FaissBinaryIVFDescriptorSet *from = (FaissBinaryIVFDescriptorSet *)set;
+
+  from->_lock.lock();
+  faiss::IndexBinaryIVF *ivf = (faiss::IndexBinaryIVF *)from->_index;
+  if (!ivf->is_trained) {
+    from->_lock.unlock();
+    return;
+  }
+  faiss::IndexBinaryIVF *index = new faiss::IndexBinaryIVF(
+      faiss::clone_binary_index(ivf->quantizer), _dimensions, ivf->nlist);
+  index->nprobe = ivf->nprobe;
+  from->_lock.unlock();
+
+  index->own_fields = true;
+  // Needed for doing reconstructions
+  index->make_direct_map();
+
+  _lock.lock();
+  delete _index;
+  _index = index;
+  _lock.unlock();
+}
+
+// FaissBinaryHNSWDescriptorSet
+
+FaissBinaryHNSWDescriptorSet::FaissBinaryHNSWDescriptorSet(
+    const std::string &set_path)
+    : FaissBinaryDescriptorSet(set_path) {
+  replay_log();
+}
+
+FaissBinaryHNSWDescriptorSet::FaissBinaryHNSWDescriptorSet(
+    const std::string &set_path, unsigned dim)
+    : FaissBinaryDescriptorSet(set_path, dim) {
+  faiss::IndexBinaryHNSW *index =
+      new faiss::IndexBinaryHNSW(_dimensions, HNSW_M);
+  index->hnsw.efConstruction = HNSW_EF_CONSTRUCTION;
+  _index = index;
+}
+
+void FaissBinaryHNSWDescriptorSet::search(float *query, unsigned n_queries,
+                                          unsigned k, long *ids,
+                                          float *distances) {
+  // Same runtime trade-off as the float HNSW sets
+  ((faiss::IndexBinaryHNSW *)_index)->hnsw.efSearch = HNSW_EF_SEARCH;
+  FaissBinaryDescriptorSet::search(query, n_queries, k, ids, distances);
+}
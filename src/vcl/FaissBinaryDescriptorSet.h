@@ -0,0 +1,157 @@
+/**
+ * @file   FaissBinaryDescriptorSet.h
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * This file declares the DescriptorSets of binary vectors, based on
+ * the binary indexes of Faiss.
+ */
+
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DescriptorSetData.h"
+
+#include <faiss/IndexBinary.h>
+
+namespace VCL {
+
+// Sets of binary vectors compared with the Hamming distance.
+// The dimensions are in bits, and must be a multiple of 8: each
+// descriptor is dim / 8 bytes of packed bits. The float buffers of the
+// DescriptorSetData interface hold these bytes, so they are
+// get_descriptor_size() bytes per descriptor instead of dim floats.
+// Distances are the number of differing bits.
+class FaissBinaryDescriptorSet : public DescriptorSet::DescriptorSetData {
+
+protected:
+  std::string _faiss_file;
+
+  faiss::IndexBinary *_index;
+
+  std::mutex _lock;
+  std::vector<long> _label_ids;
+
+  void read_index();
+  void write_label_ids();
+  void read_label_ids();
+
+  void check_dimensions();
+
+  // Write-ahead log, as for the float sets: store() writes the index
+  // and truncates it, opening a set replays it on top of the index.
+  std::string _log_file;
+  std::ofstream _log;
+  bool _log_enabled;
+  bool _recovered;
+
+  bool open_log(bool truncate);
+  bool append_log(float *descriptors, unsigned n, long *labels);
+  bool append_log(std::map<long, std::string> &labels);
+  bool end_log_record(std::streampos start);
+  void drop_log_record(std::streampos start);
+  void replay_log();
+
+public:
+  FaissBinaryDescriptorSet(const std::string &set_path);
+  FaissBinaryDescriptorSet(const std::string &set_path, unsigned dim);
+
+  ~FaissBinaryDescriptorSet();
+
+  size_t get_descriptor_size() { return _dimensions / 8; }
+
+  virtual long add(float *descriptors, unsigned n_descriptors, long *labels);
+
+  void train();
+
+  void train(float *descriptors, unsigned n);
+
+  bool is_trained();
+
+  DistanceMetric get_metric() { return Hamming; }
+
+  virtual void search(float *query, unsigned n, unsigned k, long *ids,
+                      float *distances);
+
+  void radius_search(float *query, float radius, unsigned max_results,
+                     std::vector<long> &ids, std::vector<float> &distances);
+
+  void classify(float *descriptors, unsigned n, long *ids, unsigned quorum,
+                VoteWeighting weighting);
+
+  void get_descriptors(long *ids, unsigned n, float *descriptors);
+
+  void get_labels(long *ids, unsigned n, long *labels);
+
+  void store();
+  void store(std::string set_path);
+
+  void sync();
+
+  void set_path(const std::string &set_path);
+
+  bool recovered() { return _recovered; }
+
+  void set_labels_map(std::map<long, std::string> &labels);
+};
+
+class FaissBinaryFlatDescriptorSet : public FaissBinaryDescriptorSet {
+
+public:
+  FaissBinaryFlatDescriptorSet(const std::string &set_path);
+  FaissBinaryFlatDescriptorSet(const std::string &set_path, unsigned dim);
+};
+
+class FaissBinaryIVFDescriptorSet : public FaissBinaryDescriptorSet {
+
+public:
+  FaissBinaryIVFDescriptorSet(const std::string &set_path);
+  FaissBinaryIVFDescriptorSet(const std::string &set_path, unsigned dim);
+
+  long add(float *descriptors, unsigned n_descriptors, long *labels);
+
+  void copy_training(DescriptorSetData *set);
+};
+
+class FaissBinaryHNSWDescriptorSet : public FaissBinaryDescriptorSet {
+
+public:
+  FaissBinaryHNSWDescriptorSet(const std::string &set_path);
+  FaissBinaryHNSWDescriptorSet(const std::string &set_path, unsigned dim);
+
+  void search(float *query, unsigned n_queries, unsigned k, long *ids,
+              float *distances);
+};
+
+}; // namespace VCL
@@ -27,32 +27,222 @@
  *
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <sstream>
 #include <stdlib.h>
 #include <string>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "FaissDescriptorSet.h"
 #include "vcl/Exception.h"
 
 #include "faiss/impl/AuxIndexStructures.h"
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/clone_index.h>
 #include <faiss/impl/FaissException.h>
 #include <faiss/index_io.h>
+#include <faiss/utils/distances.h>
 
 #define FAISS_IDX_FILE_NAME "faiss.idx"
 #define IDS_IDX_FILE_NAME "ids.arr"
+#define LOG_FILE_NAME "wal.log"
+
+// Write-ahead log record types
+#define LOG_RECORD_ADD 1
+#define LOG_RECORD_LABELS_MAP 2
+
+// Background training
+#define TRAIN_BATCH 10000
+#define TRAIN_SAMPLE_PER_LIST 256 // Faiss uses at most 256 points per list
+#define TRAIN_SAMPLED_PROGRESS 0.1f
+#define TRAIN_TRAINED_PROGRESS 0.4f
 
 using namespace VCL;
 
-FaissDescriptorSet::FaissDescriptorSet(const std::string &set_path)
+namespace {
+
+// Read-only IndexFlat that searches the vectors in place,
+// in a memory mapping of the index file.
+class MappedIndexFlat : public faiss::Index {
+  void *_addr;
+  size_t _length;
+  const float *_xb;
+
+public:
+  MappedIndexFlat(void *addr, size_t length, const float *xb, int dim,
+                  faiss::idx_t n, faiss::MetricType metric)
+      : faiss::Index(dim, metric), _addr(addr), _length(length), _xb(xb) {
+    ntotal = n;
+  }
+
+  ~MappedIndexFlat() { munmap(_addr, _length); }
+
+  void add(faiss::idx_t n, const float *x) override {
+    FAISS_THROW_MSG("MappedIndexFlat is read-only");
+  }
+
+  void reset() override { FAISS_THROW_MSG("MappedIndexFlat is read-only"); }
+
+  void search(faiss::idx_t n, const float *x, faiss::idx_t k,
+              float *distances, faiss::idx_t *labels,
+              const faiss::SearchParameters *params = nullptr) const override {
+    bool ip = metric_type == faiss::METRIC_INNER_PRODUCT;
+    typedef std::pair<float, faiss::idx_t> Result;
+    auto better = [ip](const Result &a, const Result &b) {
+      return ip ? a.first > b.first : a.first < b.first;
+    };
+
+#pragma omp parallel for
+    for (faiss::idx_t i = 0; i < n; ++i) {
+      const float *q = x + i * d;
+
+      // Heap of the k best results so far, the worst one on top.
+      std::vector<Result> heap;
+      heap.reserve(k);
+
+      for (faiss::idx_t j = 0; j < ntotal; ++j) {
+        Result res(ip ? faiss::fvec_inner_product(q, _xb + j * d, d)
+                      : faiss::fvec_L2sqr(q, _xb + j * d, d),
+                   j);
+        if (heap.size() < size_t(k)) {
+          heap.push_back(res);
+          std::push_heap(heap.begin(), heap.end(), better);
+        } else if (better(res, heap.front())) {
+          std::pop_heap(heap.begin(), heap.end(), better);
+          heap.back() = res;
+          std::push_heap(heap.begin(), heap.end(), better);
+        }
+      }
+
+      std::sort_heap(heap.begin(), heap.end(), better);
+
+      for (faiss::idx_t j = 0; j < k; ++j) {
+        if (size_t(j) < heap.size()) {
+          distances[i * k + j] = heap[j].first;
+          labels[i * k + j] = heap[j].second;
+        } else {
+          distances[i * k + j] = ip ? -std::numeric_limits<float>::max()
+                                    : std::numeric_limits<float>::max();
+          labels[i * k + j] = -1;
+        }
+      }
+    }
+  }
+
+  void range_search(
+      faiss::idx_t n, const float *x, float radius,
+      faiss::RangeSearchResult *result,
+      const faiss::SearchParameters *params = nullptr) const override {
+    if (metric_type == faiss::METRIC_INNER_PRODUCT)
+      faiss::range_search_inner_product(x, _xb, d, n, ntotal, radius, result);
+    else
+      faiss::range_search_L2sqr(x, _xb, d, n, ntotal, radius, result);
+  }
+
+  void reconstruct(faiss::idx_t key, float *recons) const override {
+    std::memcpy(recons, _xb + key * d, sizeof(float) * d);
+  }
+};
+
+// Maps an IndexFlat file written by faiss::write_index, whose layout is:
+// fourcc ("IxF2" or "IxFI"), d (int), ntotal (idx_t), two unused idx_t,
+// is_trained (bool), metric_type (int), number of floats (size_t),
+// and the vectors.
+// Returns NULL if the file holds any other kind of index.
+faiss::Index *map_flat_index(const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t length = sb.st_size;
+  void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  const char *ptr = (const char *)addr;
+  const size_t d_offset = 4;
+  const size_t ntotal_offset = d_offset + sizeof(int);
+  const size_t metric_offset =
+      ntotal_offset + 3 * sizeof(faiss::idx_t) + sizeof(bool);
+  const size_t size_offset = metric_offset + sizeof(int);
+  const size_t data_offset = size_offset + sizeof(size_t);
+
+  faiss::MetricType metric;
+  int dim, metric_type;
+  faiss::idx_t ntotal;
+  size_t n_floats;
+
+  if (length < data_offset) {
+    munmap(addr, length);
+    return NULL;
+  }
+
+  std::memcpy(&dim, ptr + d_offset, sizeof(dim));
+  std::memcpy(&ntotal, ptr + ntotal_offset, sizeof(ntotal));
+  std::memcpy(&metric_type, ptr + metric_offset, sizeof(metric_type));
+  std::memcpy(&n_floats, ptr + size_offset, sizeof(n_floats));
+
+  if (std::memcmp(ptr, "IxF2", 4) == 0 && metric_type == faiss::METRIC_L2)
+    metric = faiss::METRIC_L2;
+  else if (std::memcmp(ptr, "IxFI", 4) == 0 &&
+           metric_type == faiss::METRIC_INNER_PRODUCT)
+    metric = faiss::METRIC_INNER_PRODUCT;
+  else {
+    munmap(addr, length);
+    return NULL;
+  }
+
+  if (n_floats != size_t(ntotal) * dim ||
+      data_offset + n_floats * sizeof(float) > length) {
+    munmap(addr, length);
+    return NULL;
+  }
+
+  return new MappedIndexFlat(addr, length, (const float *)(ptr + data_offset),
+                             dim, ntotal, metric);
+}
+
+} // namespace
+
+FaissDescriptorSet::FaissDescriptorSet(const std::string &set_path,
+                                       bool use_mmap)
     : DescriptorSetData(set_path) {
   _index = 0;
+  _mapped = false;
+  _mapped_ids = NULL;
+  _mapped_ids_length = 0;
+  _n_mapped_ids = 0;
   _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
-  read_label_ids();
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+  _log_enabled = true;
+  _recovered = false;
+  _training = false;
+  _train_stop = false;
+  _train_progress = -1;
+  if (use_mmap)
+    map_label_ids();
+  else
+    read_label_ids();
   read_labels_map();
 }
 
@@ -60,19 +250,157 @@ FaissDescriptorSet::FaissDescriptorSet(const std::string &set_path,
                                        unsigned dim)
     : DescriptorSetData(set_path, dim) {
   _index = 0;
+  _mapped = false;
+  _mapped_ids = NULL;
+  _mapped_ids_length = 0;
+  _n_mapped_ids = 0;
   _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+  _log_enabled = true;
+  _recovered = false;
+  _training = false;
+  _train_stop = false;
+  _train_progress = -1;
+  // The log is created on the first store(), as there is
+  // no checkpoint to recover from before that.
+}
+
+FaissDescriptorSet::~FaissDescriptorSet() {
+  _train_stop = true;
+  if (_train_thread.joinable())
+    _train_thread.join();
+
+  if (_mapped)
+    delete _index;
+  if (_mapped_ids)
+    munmap(_mapped_ids, _mapped_ids_length);
 }
 
-FaissDescriptorSet::~FaissDescriptorSet() {}
+// Reads the index in _faiss_file. With use_mmap, flat indexes are
+// searched in place from the mapped file, and the inverted lists of IVF
+// indexes are mapped by Faiss (IO_FLAG_MMAP). Anything else is read
+// in memory.
+faiss::Index *FaissDescriptorSet::read_index(bool use_mmap) {
+  faiss::Index *index = NULL;
+
+  try {
+    if (use_mmap) {
+      index = map_flat_index(_faiss_file);
+      if (index) {
+        _mapped = true;
+      } else {
+        index = faiss::read_index(_faiss_file.c_str(), faiss::IO_FLAG_MMAP);
+        _mapped = dynamic_cast<faiss::IndexIVF *>(index) != NULL;
+      }
+    } else {
+      index = faiss::read_index(_faiss_file.c_str());
+    }
+  } catch (faiss::FaissException &e) {
+    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
+  }
+
+  // Faiss will sometimes throw, or sometimes return NULL,
+  // we check both just in case.
+  if (!index) {
+    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
+  }
+
+  return index;
+}
+
+void FaissDescriptorSet::map_label_ids() {
+  std::string ids_file = _set_path + "/" + IDS_IDX_FILE_NAME;
+  int fd = open(ids_file.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    throw VCLException(OpenFailed, "Cannot read labels file");
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || size_t(sb.st_size) < sizeof(unsigned)) {
+    close(fd);
+    throw VCLException(OpenFailed, "Cannot read labels file");
+  }
+
+  void *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (addr == MAP_FAILED) {
+    throw VCLException(OpenFailed, "Cannot map labels file");
+  }
+
+  unsigned ids_size;
+  std::memcpy(&ids_size, addr, sizeof(ids_size));
+
+  if (sizeof(ids_size) + sizeof(long) * ids_size > size_t(sb.st_size)) {
+    munmap(addr, sb.st_size);
+    throw VCLException(OpenFailed, "Labels file is truncated");
+  }
+
+  _mapped_ids = addr;
+  _mapped_ids_length = sb.st_size;
+  _n_mapped_ids = ids_size;
+}
+
+// Loads the mapped index and label ids in memory before modifying them.
+// Must be called with _lock held.
+void FaissDescriptorSet::ensure_writable() {
+  if (_mapped) {
+    faiss::Index *index = read_index(false);
+
+    // Searches hold _index_lock while they use the mapped index
+    std::unique_lock<std::shared_mutex> swap_lock(_index_lock);
+    std::swap(_index, index);
+    _mapped = false;
+    swap_lock.unlock();
+
+    delete index;
+  }
+
+  if (_mapped_ids) {
+    _label_ids.resize(_n_mapped_ids);
+    std::memcpy(_label_ids.data(), (char *)_mapped_ids + sizeof(unsigned),
+                sizeof(long) * _n_mapped_ids);
+    munmap(_mapped_ids, _mapped_ids_length);
+    _mapped_ids = NULL;
+    _mapped_ids_length = 0;
+    _n_mapped_ids = 0;
+  }
+}
+
+long FaissDescriptorSet::n_label_ids() {
+  return _mapped_ids ? _n_mapped_ids : _label_ids.size();
+}
+
+// Returns -1 ("no label") for descriptors added without labels.
+long FaissDescriptorSet::label_at(long idx) {
+  if (idx < 0 || idx >= n_label_ids())
+    return -1;
+
+  if (_mapped_ids) {
+    long label;
+    std::memcpy(&label,
+                (char *)_mapped_ids + sizeof(unsigned) + sizeof(long) * idx,
+                sizeof(long));
+    return label;
+  }
+
+  return _label_ids[idx];
+}
 
 void FaissDescriptorSet::write_label_ids() {
-  std::ofstream out_ids(_set_path + "/" + IDS_IDX_FILE_NAME,
-                        std::ofstream::binary);
+  // Write to a temporary file first, so that a crash while writing
+  // never leaves a truncated labels file behind.
+  std::string ids_file = _set_path + "/" + IDS_IDX_FILE_NAME;
+  std::string tmp_file = ids_file + ".tmp";
+  std::ofstream out_ids(tmp_file, std::ofstream::binary);
 
   unsigned ids_size = _label_ids.size();
   out_ids.write((char *)&ids_size, sizeof(ids_size));
   out_ids.write((char *)_label_ids.data(), sizeof(long) * ids_size);
   out_ids.close();
+
+  std::rename(tmp_file.c_str(), ids_file.c_str());
 }
 
 void FaissDescriptorSet::read_label_ids() {
@@ -95,6 +423,19 @@ long FaissDescriptorSet::add(float *descriptors, unsigned n, long *labels) {
 
   _lock.lock();
 
+  try {
+    ensure_writable();
+  } catch (VCL::Exception &e) {
+    _lock.unlock(); // unlock before throwing exception
+    throw e;
+  }
+
+  // Logged first: the index is left as it was if the log cannot be written
+  if (!append_log(descriptors, n, labels)) {
+    _lock.unlock(); // unlock before throwing exception
+    throw VCLException(UndefinedException, "Cannot write log: " + _log_file);
+  }
+
   long id_first = _index->ntotal;
 
   if (labels != NULL) {
@@ -110,6 +451,191 @@ long FaissDescriptorSet::add(float *descriptors, unsigned n, long *labels) {
   return id_first;
 }
 
+// Write-ahead log
+
+// Log layout: the index size (ntotal) at the time of the checkpoint,
+// followed by records:
+//   LOG_RECORD_ADD:        type, n, has_labels, n * dim floats,
+//                          n labels (if has_labels)
+//   LOG_RECORD_LABELS_MAP: type, n, n * (label id, length, string)
+bool FaissDescriptorSet::open_log(bool truncate) {
+  if (_log.is_open())
+    _log.close();
+
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+
+  if (truncate) {
+    _log.open(_log_file, std::ofstream::binary | std::ofstream::trunc);
+    uint64_t checkpoint_ntotal = _index->ntotal;
+    _log.write((char *)&checkpoint_ntotal, sizeof(checkpoint_ntotal));
+    _log.flush();
+  } else {
+    _log.open(_log_file, std::ofstream::binary | std::ofstream::app);
+  }
+
+  return _log.good();
+}
+
+// Must be called with _lock held
+bool FaissDescriptorSet::append_log(float *descriptors, unsigned n,
+                                    long *labels) {
+  if (!_log_enabled || !_log.is_open())
+    return true;
+
+  std::streampos start = _log.tellp();
+  uint8_t type = LOG_RECORD_ADD;
+  uint8_t has_labels = labels != NULL;
+  uint32_t n_desc = n;
+  _log.write((char *)&type, sizeof(type));
+  _log.write((char *)&n_desc, sizeof(n_desc));
+  _log.write((char *)&has_labels, sizeof(has_labels));
+  _log.write((char *)descriptors, sizeof(float) * n * _dimensions);
+  if (has_labels)
+    _log.write((char *)labels, sizeof(long) * n);
+
+  return end_log_record(start);
+}
+
+// Must be called with _lock held
+bool FaissDescriptorSet::append_log(std::map<long, std::string> &labels) {
+  if (!_log_enabled || !_log.is_open())
+    return true;
+
+  std::streampos start = _log.tellp();
+  uint8_t type = LOG_RECORD_LABELS_MAP;
+  uint32_t n_labels = labels.size();
+  _log.write((char *)&type, sizeof(type));
+  _log.write((char *)&n_labels, sizeof(n_labels));
+  for (auto &label : labels) {
+    long id = label.first;
+    uint32_t length = label.second.size();
+    _log.write((char *)&id, sizeof(id));
+    _log.write((char *)&length, sizeof(length));
+    _log.write(label.second.data(), length);
+  }
+
+  return end_log_record(start);
+}
+
+// Flushes the record written from start, so that it survives a crash of
+// the server. A record that could not be written is dropped, so that
+// the next ones follow the last complete record.
+bool FaissDescriptorSet::end_log_record(std::streampos start) {
+  _log.flush();
+  if (_log.good())
+    return true;
+
+  _log.clear();
+  _log.seekp(start);
+  std::error_code ec;
+  std::filesystem::resize_file(_log_file, start, ec);
+  return false;
+}
+
+// Applies the log on top of the checkpoint that was just loaded,
+// and leaves the log open for appending.
+void FaissDescriptorSet::replay_log() {
+  std::ifstream in_log(_log_file, std::ifstream::binary);
+
+  uint64_t checkpoint_ntotal;
+  if (!in_log.good() ||
+      !in_log.read((char *)&checkpoint_ntotal, sizeof(checkpoint_ntotal))) {
+    // Set stored before logging was in place, start a new log.
+    in_log.close();
+    if (!open_log(true)) {
+      throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+    }
+    return;
+  }
+
+  // If the server crashed after writing the index but before truncating
+  // the log, the index already contains the first records.
+  long skip = _index->ntotal - checkpoint_ntotal;
+  std::streamoff valid_size = in_log.tellg();
+
+  _log_enabled = false;
+
+  while (true) {
+    uint8_t type;
+    uint32_t n;
+    if (!in_log.read((char *)&type, sizeof(type)) ||
+        !in_log.read((char *)&n, sizeof(n)))
+      break;
+
+    if (type == LOG_RECORD_ADD) {
+      uint8_t has_labels;
+      std::vector<float> descriptors(size_t(n) * _dimensions);
+      std::vector<long> labels;
+
+      if (!in_log.read((char *)&has_labels, sizeof(has_labels)) ||
+          !in_log.read((char *)descriptors.data(),
+                       sizeof(float) * descriptors.size()))
+        break;
+
+      if (has_labels) {
+        labels.resize(n);
+        if (!in_log.read((char *)labels.data(), sizeof(long) * n))
+          break;
+      }
+
+      unsigned applied = skip > 0 ? std::min<long>(skip, n) : 0;
+      skip -= applied;
+
+      if (applied < n) {
+        add(descriptors.data() + size_t(applied) * _dimensions, n - applied,
+            has_labels ? labels.data() + applied : NULL);
+        _recovered = true;
+      }
+    } else if (type == LOG_RECORD_LABELS_MAP) {
+      std::map<long, std::string> labels;
+      bool complete = true;
+      for (uint32_t i = 0; i < n && complete; ++i) {
+        long id;
+        uint32_t length;
+        complete = bool(in_log.read((char *)&id, sizeof(id))) &&
+                   bool(in_log.read((char *)&length, sizeof(length)));
+        if (complete) {
+          std::string label(length, '\0');
+          complete = bool(in_log.read(&label[0], length));
+          labels[id] = label;
+        }
+      }
+
+      if (!complete)
+        break;
+
+      DescriptorSetData::set_labels_map(labels);
+      _recovered = true;
+    } else {
+      break;
+    }
+
+    valid_size = in_log.tellg();
+  }
+
+  _log_enabled = true;
+  in_log.close();
+
+  // Drop a partially written record at the end of the log (if any),
+  // so that new records are appended after the last valid one.
+  std::filesystem::resize_file(_log_file, valid_size);
+  if (!open_log(false)) {
+    throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+  }
+}
+
+void FaissDescriptorSet::set_labels_map(std::map<long, std::string> &labels) {
+  _lock.lock();
+  bool logged = append_log(labels);
+  _lock.unlock();
+
+  if (!logged) {
+    throw VCLException(UndefinedException, "Cannot write log: " + _log_file);
+  }
+
+  DescriptorSetData::set_labels_map(labels);
+}
+
 void FaissDescriptorSet::train() { train_core(NULL, 0); }
 
 void FaissDescriptorSet::train(float *descriptors, unsigned n) {
@@ -118,6 +644,13 @@ void FaissDescriptorSet::train(float *descriptors, unsigned n) {
 
 void FaissDescriptorSet::train_core(float *descriptors, unsigned n) {
   _lock.lock();
+
+  try {
+    ensure_writable();
+  } catch (VCL::Exception &e) {
+    _lock.unlock(); // unlock before throwing exception
+    throw e;
+  }
   long n_total = _index->ntotal;
   float *recons = new float[n_total * _dimensions];
   _index->reconstruct_n(0, n_total, recons);
@@ -129,53 +662,203 @@ void FaissDescriptorSet::train_core(float *descriptors, unsigned n) {
   delete[] recons;
 }
 
-bool FaissDescriptorSet::is_trained() { return _index->is_trained; }
+void FaissDescriptorSet::train_async(float *descriptors, unsigned n) {
+  _lock.lock();
+
+  if (_training) {
+    _lock.unlock();
+    return;
+  }
+
+  faiss::Index *index;
+  try {
+    ensure_writable();
+    index = new_index();
+  } catch (VCL::Exception &e) {
+    _lock.unlock(); // unlock before throwing exception
+    throw e;
+  }
+
+  // Nothing to train
+  if (index == NULL) {
+    _lock.unlock();
+    return;
+  }
+
+  // The previous training is over, but its thread was never joined
+  if (_train_thread.joinable())
+    _train_thread.join();
+
+  std::vector<float> sample(descriptors,
+                            descriptors + size_t(n) * _dimensions);
+
+  _training = true;
+  _train_stop = false;
+  _train_progress = 0;
+  _train_thread = std::thread(&FaissDescriptorSet::train_background, this,
+                              index, std::move(sample));
+  _lock.unlock();
+}
+
+float FaissDescriptorSet::train_progress() {
+  return _training ? _train_progress.load() : -1;
+}
+
+// Reads a uniform sample of the descriptors, in index order,
+// holding _lock for one batch at a time.
+void FaissDescriptorSet::sample_descriptors(long n_sample,
+                                            std::vector<float> &sample) {
+  _lock.lock();
+  long n_total = _index->ntotal;
+  _lock.unlock();
+
+  n_sample = std::min(n_sample, n_total);
+  std::vector<long> ids;
+  ids.reserve(n_sample);
+
+  // Selection sampling (Knuth's algorithm S)
+  std::mt19937_64 gen(n_total);
+  for (long i = 0; i < n_total && long(ids.size()) < n_sample; ++i) {
+    std::uniform_int_distribution<long> dist(0, n_total - i - 1);
+    if (dist(gen) < n_sample - long(ids.size()))
+      ids.push_back(i);
+  }
+
+  sample.resize(ids.size() * _dimensions);
+  for (long i = 0; i < long(ids.size()); i += TRAIN_BATCH) {
+    long n = std::min(long(TRAIN_BATCH), long(ids.size()) - i);
+    _lock.lock();
+    _index->reconstruct_batch(n, ids.data() + i,
+                              sample.data() + i * _dimensions);
+    _lock.unlock();
+  }
+}
+
+void FaissDescriptorSet::train_background(faiss::Index *index,
+                                          std::vector<float> sample) {
+  bool locked = false;
+
+  try {
+    if (sample.empty()) {
+      faiss::IndexIVF *ivf = dynamic_cast<faiss::IndexIVF *>(index);
+      long n_sample = ivf ? ivf->nlist * TRAIN_SAMPLE_PER_LIST
+                          : std::numeric_limits<long>::max();
+      sample_descriptors(n_sample, sample);
+    }
+    _train_progress = TRAIN_SAMPLED_PROGRESS;
+
+    index->train(sample.size() / _dimensions, sample.data());
+    std::vector<float>().swap(sample);
+    _train_progress = TRAIN_TRAINED_PROGRESS;
+
+    // Copies the current index in order, so ids do not change. Adds
+    // made meanwhile are picked up by the following batches.
+    std::vector<float> batch;
+    long copied = 0;
+    while (!_train_stop) {
+      _lock.lock();
+      locked = true;
+
+      long n_total = _index->ntotal;
+      long n = std::min(long(TRAIN_BATCH), n_total - copied);
+      batch.resize(n * _dimensions);
+      _index->reconstruct_n(copied, n, batch.data());
+
+      // Last batch: the index is swapped before adds resume
+      if (copied + n == n_total)
+        break;
+
+      _lock.unlock();
+      locked = false;
+
+      index->add(n, batch.data());
+      copied += n;
+      _train_progress =
+          TRAIN_TRAINED_PROGRESS +
+          (1 - TRAIN_TRAINED_PROGRESS) * float(copied) / n_total;
+    }
+
+    if (locked) {
+      index->add(batch.size() / _dimensions, batch.data());
+
+      std::unique_lock<std::shared_mutex> swap_lock(_index_lock);
+      std::swap(_index, index);
+      swap_lock.unlock();
+
+      _lock.unlock();
+      locked = false;
+    }
+  } catch (std::exception &e) {
+    if (locked)
+      _lock.unlock();
+    std::cerr << "FaissDescriptorSet: training failed: " << e.what()
+              << std::endl;
+  }
+
+  // Either the replaced index or the one that was not swapped in
+  delete index;
+  _training = false;
+}
+
+bool FaissDescriptorSet::is_trained() {
+  std::shared_lock<std::shared_mutex> lock(_index_lock);
+  return _index->is_trained;
+}
+
+DistanceMetric FaissDescriptorSet::get_metric() {
+  std::shared_lock<std::shared_mutex> lock(_index_lock);
+  return _index->metric_type == faiss::METRIC_INNER_PRODUCT
+             ? DistanceMetric::IP
+             : DistanceMetric::L2;
+}
 
-// No need to use locks on this read-only operation as faiss handles internally
+// faiss searches are thread-safe, _index_lock only keeps the index
+// from being replaced by a background training meanwhile
 void FaissDescriptorSet::search(float *query, unsigned n_queries, unsigned k,
                                 long *descriptors, float *distances) {
+  std::shared_lock<std::shared_mutex> lock(_index_lock);
   _index->search(n_queries, query, k, distances, descriptors);
 }
 
 void FaissDescriptorSet::radius_search(float *query, float radius,
-                                       long *descriptors, float *distances) {
+                                       unsigned max_results,
+                                       std::vector<long> &ids,
+                                       std::vector<float> &distances) {
   faiss::RangeSearchResult rs(1); // 1 is the Number of queries
+  std::shared_lock<std::shared_mutex> lock(_index_lock);
   _index->range_search(1, query, radius, &rs);
+  lock.unlock();
 
   // rs.lims is of size 2, as nq is of size 1.
   // Check faiss::RangeSearchResult definition for more details.
   long found = rs.lims[1];
-  std::memcpy(descriptors, rs.labels, sizeof(long) * found);
-  std::memcpy(distances, rs.distances, sizeof(float) * found);
+  ids.assign(rs.labels, rs.labels + found);
+  distances.assign(rs.distances, rs.distances + found);
+
+  sort_radius_results(ids, distances, max_results, get_metric());
 }
 
 void FaissDescriptorSet::classify(float *descriptors, unsigned n, long *ids,
-                                  unsigned quorum) {
-  float *distances = new float[n * quorum];
-  long *ids_aux = new long[n * quorum];
+                                  unsigned quorum, VoteWeighting weighting) {
+  std::vector<float> distances(n * quorum);
+  std::vector<long> labels(n * quorum);
+
+  search(descriptors, n, quorum, labels.data(), distances.data());
 
-  search(descriptors, n, quorum, ids_aux, distances);
+  DistanceMetric metric = get_metric();
 
+  // From neighbor ids to their labels
   _lock.lock();
-  for (int j = 0; j < n; ++j) {
-    std::map<long, int> map_voting;
-    long winner = -1;
-    unsigned max = 0;
-    for (int i = 0; i < quorum; ++i) {
-      long idx = ids_aux[quorum * j + i];
-      if (idx < 0)
-        continue; // Means not found
-
-      long label_id = _label_ids.at(idx);
-      map_voting[label_id] += 1;
-      if (max < map_voting[label_id]) {
-        max = map_voting[label_id];
-        winner = label_id;
-      }
-    }
-    ids[j] = winner;
+  for (long &idx : labels) {
+    if (idx >= 0) // Means found
+      idx = label_at(idx);
   }
   _lock.unlock();
+
+  for (int j = 0; j < n; ++j) {
+    ids[j] = vote(labels.data() + quorum * j, distances.data() + quorum * j,
+                  quorum, weighting, metric);
+  }
 }
 
 void FaissDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
@@ -183,11 +866,11 @@ void FaissDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
 
   for (int i = 0; i < n; ++i) {
     long idx = ids[i];
-    if (idx > _label_ids.size()) {
+    if (idx < 0 || idx >= n_label_ids()) {
       _lock.unlock(); // unlock before throwing exception
       throw VCLException(ObjectNotFound, "Label id does not exists");
     }
-    labels[i] = _label_ids[idx];
+    labels[i] = label_at(idx);
   }
 
   _lock.unlock();
@@ -195,31 +878,67 @@ void FaissDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
 
 void FaissDescriptorSet::get_descriptors(long *ids, unsigned n,
                                          float *descriptors) {
-  int offset = 0;
+  _lock.lock();
 
-  try {
-    for (int i = 0; i < n; ++i) {
-      _index->reconstruct(ids[i], descriptors + i * _dimensions);
+  for (int i = 0; i < n; ++i) {
+    if (ids[i] < 0 || ids[i] >= _index->ntotal) {
+      _lock.unlock(); // unlock before throwing exception
+      throw VCLException(ObjectNotFound, "Descriptor id does not exists");
     }
+  }
+
+  try {
+    _index->reconstruct_batch(n, ids, descriptors);
   } catch (faiss::FaissException &e) {
+    _lock.unlock(); // unlock before throwing exception
     throw VCLException(UndefinedException, "faiss::reconstruct(3) failed");
   }
+
+  _lock.unlock();
 }
 
 void FaissDescriptorSet::store() { store(_set_path); }
 
 void FaissDescriptorSet::store(std::string set_path) {
   _lock.lock();
+
+  // Still mapped: the index and label ids on disk are those of the set,
+  // only the labels map may have changed. Storing must not load them.
+  if (_mapped_ids && set_path == _set_path) {
+    write_labels_map();
+    bool log_opened = open_log(true);
+    _lock.unlock();
+
+    if (!log_opened) {
+      throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+    }
+    return;
+  }
+
+  try {
+    ensure_writable();
+  } catch (VCL::Exception &e) {
+    _lock.unlock(); // unlock before throwing exception
+    throw e;
+  }
   _set_path = set_path;
   _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
 
   int ret = create_dir(_set_path.c_str());
   if (ret == 0 || ret == EEXIST) { // Directory exists or created
-    faiss::write_index((const faiss::IndexFlat *)(_index), _faiss_file.c_str());
+    std::string tmp_file = _faiss_file + ".tmp";
+    faiss::write_index((const faiss::IndexFlat *)(_index), tmp_file.c_str());
+    std::rename(tmp_file.c_str(), _faiss_file.c_str());
     write_label_ids();
+    write_labels_map();
+
+    // Everything is in the checkpoint now, start over with an empty log.
+    bool log_opened = open_log(true);
     _lock.unlock();
 
-    write_labels_map();
+    if (!log_opened) {
+      throw VCLException(OpenFailed, "Cannot open log: " + _log_file);
+    }
   } else {
     _lock.unlock(); // unlock before throwing exception
     throw VCLException(OpenFailed, _faiss_file +
@@ -228,25 +947,37 @@ void FaissDescriptorSet::store(std::string set_path) {
   }
 }
 
-// FaissFlatDescriptorSet
+void FaissDescriptorSet::sync() {
+  _lock.lock();
+  if (_log.is_open()) {
+    _log.flush();
+    _lock.unlock();
+    return;
+  }
+  _lock.unlock();
 
-FaissFlatDescriptorSet::FaissFlatDescriptorSet(const std::string &set_path)
-    : FaissDescriptorSet(set_path) {
-  try {
-    _index = faiss::read_index(_faiss_file.c_str());
+  // Never stored, there is no checkpoint the log could be applied to.
+  store();
+}
 
-  } catch (faiss::FaissException &e) {
-    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
-  }
+void FaissDescriptorSet::set_path(const std::string &set_path) {
+  std::lock_guard<std::mutex> lock(_lock);
+  _set_path = set_path;
+  _faiss_file = _set_path + "/" + FAISS_IDX_FILE_NAME;
+  _log_file = _set_path + "/" + LOG_FILE_NAME;
+}
 
-  // Faiss will sometimes throw, or sometimes set _index = NULL,
-  // we check both just in case.
-  if (!_index) {
-    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
-  }
+// FaissFlatDescriptorSet
+
+FaissFlatDescriptorSet::FaissFlatDescriptorSet(const std::string &set_path,
+                                               bool use_mmap)
+    : FaissDescriptorSet(set_path, use_mmap) {
+  _index = read_index(use_mmap);
 
   _dimensions = _index->d;
   _n_total = _index->ntotal;
+
+  replay_log();
 }
 
 FaissFlatDescriptorSet::FaissFlatDescriptorSet(const std::string &set_path,
@@ -264,23 +995,14 @@ FaissFlatDescriptorSet::FaissFlatDescriptorSet(const std::string &set_path,
 // FaissIVFFlatDescriptorSet
 
 FaissIVFFlatDescriptorSet::FaissIVFFlatDescriptorSet(
-    const std::string &set_path)
-    : FaissDescriptorSet(set_path) {
-  try {
-    _index = (faiss::IndexIVFFlat *)faiss::read_index(_faiss_file.c_str());
-
-  } catch (faiss::FaissException &e) {
-    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
-  }
-
-  // Faiss will sometimes throw, or sometimes set _index = NULL,
-  // we check both just in case.
-  if (!_index) {
-    throw VCLException(OpenFailed, "Problem reading: " + _faiss_file);
-  }
+    const std::string &set_path, bool use_mmap)
+    : FaissDescriptorSet(set_path, use_mmap) {
+  _index = read_index(use_mmap);
 
   _dimensions = _index->d;
   _n_total = _index->ntotal;
+
+  replay_log();
 }
 
 FaissIVFFlatDescriptorSet::FaissIVFFlatDescriptorSet(
@@ -344,6 +1066,50 @@ long FaissIVFFlatDescriptorSet::add(float *descriptors, unsigned n,
   return id_first;
 }
 
+faiss::Index *FaissIVFFlatDescriptorSet::new_index() {
+  faiss::IndexIVF *ivf = (faiss::IndexIVF *)_index;
+  faiss::Index *quantizer;
+
+  if (ivf->metric_type == faiss::METRIC_INNER_PRODUCT)
+    quantizer = new faiss::IndexFlatIP(_dimensions);
+  else
+    quantizer = new faiss::IndexFlatL2(_dimensions);
+
+  faiss::IndexIVFFlat *index = new faiss::IndexIVFFlat(
+      quantizer, _dimensions, ivf->nlist, ivf->metric_type);
+  index->own_fields = true;
+  index->nprobe = ivf->nprobe;
+  index->make_direct_map();
+
+  return index;
+}
+
+// The new index gets a copy of the centroids of the given set,
+// which is small next to its inverted lists
+void FaissIVFFlatDescriptorSet::copy_training(DescriptorSetData *set) {
+  FaissIVFFlatDescriptorSet *from = (FaissIVFFlatDescriptorSet *)set;
+
+  from->_lock.lock();
+  faiss::IndexIVF *ivf = (faiss::IndexIVF *)from->_index;
+  if (!ivf->is_trained) {
+    from->_lock.unlock();
+    return;
+  }
+  faiss::IndexIVFFlat *index =
+      new faiss::IndexIVFFlat(faiss::clone_index(ivf->quantizer), _dimensions,
+                              ivf->nlist, ivf->metric_type);
+  index->nprobe = ivf->nprobe;
+  from->_lock.unlock();
+
+  index->own_fields = true;
+  index->make_direct_map();
+
+  _lock.lock();
+  delete _index;
+  _index = index;
+  _lock.unlock();
+}
+
 // FaissHNSWFlat
 // Note:
 // setting value of hnsw m= 48
@@ -381,6 +1147,8 @@ FaissHNSWFlatDescriptorSet::FaissHNSWFlatDescriptorSet(
 
   _dimensions = _index->d;
   _n_total = _index->ntotal;
+
+  replay_log();
 }
 
 FaissHNSWFlatDescriptorSet::FaissHNSWFlatDescriptorSet(
@@ -401,6 +1169,7 @@ FaissHNSWFlatDescriptorSet::FaissHNSWFlatDescriptorSet(
 void FaissHNSWFlatDescriptorSet::search(float *query, unsigned n_queries,
                                         unsigned k, long *descriptors,
                                         float *distances) {
+  std::shared_lock<std::shared_mutex> lock(_index_lock);
   ((faiss::IndexHNSWFlat *)_index)->hnsw.efSearch = 64;
   // set according to
   // https://github.com/facebookresearch/faiss/wiki/Indexing-1M-vectors for R@1
@@ -34,10 +34,14 @@
 
 #pragma once
 
+#include <atomic>
+#include <fstream>
 #include <map>
 #include <mutex>
+#include <shared_mutex>
 #include <stdlib.h>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -59,13 +63,60 @@ protected:
   std::mutex _lock;
   std::vector<long> _label_ids;
 
+  // Set opened with LoadMmap: the index (and the label ids) are read-only
+  // mappings of the files on disk. The first operation that modifies the
+  // set loads them in memory; the mapped index is swapped out under
+  // _index_lock, as searches run without _lock. Until then, store() has
+  // nothing to rewrite.
+  bool _mapped;
+  void *_mapped_ids;
+  size_t _mapped_ids_length;
+  unsigned _n_mapped_ids;
+
+  faiss::Index *read_index(bool use_mmap);
+  void map_label_ids();
+  void ensure_writable();
+  long n_label_ids();
+  long label_at(long idx);
+
+  // Write-ahead log with the adds applied since the last store().
+  // store() acts as a checkpoint: it writes the index and truncates the log.
+  // Opening a set loads the last checkpoint and replays the log tail.
+  std::string _log_file;
+  std::ofstream _log;
+  bool _log_enabled;
+  bool _recovered;
+
   void write_label_ids();
   void read_label_ids();
 
+  bool open_log(bool truncate);
+  bool append_log(float *descriptors, unsigned n, long *labels);
+  bool append_log(std::map<long, std::string> &labels);
+  bool end_log_record(std::streampos start);
+  void replay_log();
+
   void train_core(float *descriptors, unsigned n);
 
+  // Background training: the new index is trained and filled from the
+  // current one in batches, so adds are only blocked while the last
+  // batch (the adds made meanwhile) is copied and the index swapped.
+  // Searches hold _index_lock shared, as the swap deletes the old index.
+  std::shared_mutex _index_lock;
+  std::thread _train_thread;
+  std::atomic<bool> _training;
+  std::atomic<bool> _train_stop;
+  std::atomic<float> _train_progress;
+
+  // Returns an empty index like the current one, to be trained,
+  // or NULL if the index needs no training.
+  virtual faiss::Index *new_index() { return NULL; }
+
+  void sample_descriptors(long n_sample, std::vector<float> &sample);
+  void train_background(faiss::Index *index, std::vector<float> sample);
+
 public:
-  FaissDescriptorSet(const std::string &set_path);
+  FaissDescriptorSet(const std::string &set_path, bool use_mmap = false);
   FaissDescriptorSet(const std::string &set_path, unsigned dim);
 
   ~FaissDescriptorSet();
@@ -76,14 +127,22 @@ public:
 
   void train(float *descriptors, unsigned n);
 
+  void train_async(float *descriptors, unsigned n);
+
+  float train_progress();
+
   bool is_trained();
 
+  DistanceMetric get_metric();
+
   void search(float *query, unsigned n, unsigned k, long *ids,
               float *distances);
 
-  void radius_search(float *query, float radius, long *ids, float *distances);
+  void radius_search(float *query, float radius, unsigned max_results,
+                     std::vector<long> &ids, std::vector<float> &distances);
 
-  void classify(float *descriptors, unsigned n, long *ids, unsigned quorum);
+  void classify(float *descriptors, unsigned n, long *ids, unsigned quorum,
+                VoteWeighting weighting);
 
   void get_descriptors(long *ids, unsigned n, float *descriptors);
 
@@ -91,24 +150,38 @@ public:
 
   void store();
   void store(std::string set_path);
+
+  void sync();
+
+  void set_path(const std::string &set_path);
+
+  bool recovered() { return _recovered; }
+
+  void set_labels_map(std::map<long, std::string> &labels);
 };
 
 class FaissFlatDescriptorSet : public FaissDescriptorSet {
 
 public:
-  FaissFlatDescriptorSet(const std::string &set_path);
+  FaissFlatDescriptorSet(const std::string &set_path, bool use_mmap = false);
   FaissFlatDescriptorSet(const std::string &set_path, unsigned dim,
                          DistanceMetric metric);
 };
 
 class FaissIVFFlatDescriptorSet : public FaissDescriptorSet {
 
+protected:
+  faiss::Index *new_index();
+
 public:
-  FaissIVFFlatDescriptorSet(const std::string &set_path);
+  FaissIVFFlatDescriptorSet(const std::string &set_path,
+                            bool use_mmap = false);
   FaissIVFFlatDescriptorSet(const std::string &set_path, unsigned dim,
                             DistanceMetric metric);
 
   long add(float *descriptors, unsigned n_descriptors, long *classes);
+
+  void copy_training(DescriptorSetData *set);
 };
 
 class FaissHNSWFlatDescriptorSet : public FaissDescriptorSet {
@@ -204,39 +204,33 @@ void FlinngDescriptorSet::search(float *query, unsigned n_queries, unsigned k,
 }
 
 void FlinngDescriptorSet::radius_search(float *query, float radius,
-                                        long *descriptors, float *distances) {
+                                        unsigned max_results,
+                                        std::vector<long> &ids,
+                                        std::vector<float> &distances) {
   throw VCLException(NotImplemented,
                      "Radius Search Operation not supported for used Index");
   // TODO
 }
 
 void FlinngDescriptorSet::classify(float *descriptors, unsigned n, long *ids,
-                                   unsigned quorum) {
-  float *distances = new float[n * quorum];
-  long *ids_aux = new long[n * quorum];
+                                   unsigned quorum, VoteWeighting weighting) {
+  std::vector<float> distances(n * quorum);
+  std::vector<long> labels(n * quorum);
 
-  search(descriptors, n, quorum, ids_aux, distances);
+  search(descriptors, n, quorum, labels.data(), distances.data());
 
+  // From neighbor ids to their labels
   _lock.lock();
-  for (int j = 0; j < n; ++j) {
-    std::map<long, int> map_voting;
-    long winner = -1;
-    unsigned max = 0;
-    for (int i = 0; i < quorum; ++i) {
-      long idx = ids_aux[quorum * j + i];
-      if (idx < 0)
-        continue; // Means not found
-
-      long label_id = _label_ids.at(idx);
-      map_voting[label_id] += 1;
-      if (max < map_voting[label_id]) {
-        max = map_voting[label_id];
-        winner = label_id;
-      }
-    }
-    ids[j] = winner;
+  for (long &idx : labels) {
+    if (idx >= 0) // Means found
+      idx = idx < _label_ids.size() ? _label_ids[idx] : -1;
   }
   _lock.unlock();
+
+  for (int j = 0; j < n; ++j) {
+    ids[j] = vote(labels.data() + quorum * j, distances.data() + quorum * j,
+                  quorum, weighting, _metric);
+  }
 }
 
 void FlinngDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
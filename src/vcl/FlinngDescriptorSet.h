@@ -93,9 +93,11 @@ public:
   void search(float *query, unsigned n, unsigned k, long *ids,
               float *distances);
 
-  void radius_search(float *query, float radius, long *ids, float *distances);
+  void radius_search(float *query, float radius, unsigned max_results,
+                     std::vector<long> &ids, std::vector<float> &distances);
 
-  void classify(float *descriptors, unsigned n, long *ids, unsigned quorum);
+  void classify(float *descriptors, unsigned n, long *ids, unsigned quorum,
+                VoteWeighting weighting);
 
   void get_descriptors(long *ids, unsigned n, float *descriptors);
 
@@ -27,9 +27,13 @@
  *
  */
 
+#include <algorithm>
 #include <chrono>
+#include <csetjmp>
+#include <cstring>
 #include <fcntl.h>
 #include <fstream>
+#include <iterator>
 #include <jpeglib.h>
 #include <png.h>
 #include <stddef.h>
@@ -48,12 +52,220 @@ using namespace VCL;
 /*        OPERATION         */
 /*  *********************** */
 
+/*  *********************** */
+/*       JPEG DECODING      */
+/*  *********************** */
+
+namespace {
+
+struct JPEGError {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+  longjmp(((JPEGError *)cinfo->err)->jump, 1);
+}
+
+// Orientation tag of the Exif APP1 marker, 1 (top-left) if there is none
+int jpeg_exif_orientation(j_decompress_ptr cinfo) {
+  for (jpeg_saved_marker_ptr m = cinfo->marker_list; m; m = m->next) {
+    const JOCTET *d = m->data;
+    unsigned len = m->data_length;
+    if (m->marker != JPEG_APP0 + 1 || len < 14 || memcmp(d, "Exif\0\0", 6))
+      continue;
+
+    d += 6;
+    len -= 6;
+    bool le = d[0] == 'I';
+    auto u16 = [&](unsigned o) {
+      return le ? d[o] | d[o + 1] << 8 : d[o] << 8 | d[o + 1];
+    };
+    auto u32 = [&](unsigned o) {
+      return le ? u16(o) | unsigned(u16(o + 2)) << 16
+                : unsigned(u16(o)) << 16 | u16(o + 2);
+    };
+
+    unsigned ifd = u32(4);
+    if (ifd + 2 > len)
+      return 1;
+    unsigned n = u16(ifd);
+    for (unsigned i = 0; i < n && ifd + 2 + 12 * (i + 1) <= len; ++i) {
+      unsigned entry = ifd + 2 + 12 * i;
+      if (u16(entry) == 0x0112)
+        return u16(entry + 8);
+    }
+  }
+  return 1;
+}
+
+/**
+ *  Decodes only the area roi of a JPEG (all of it if roi is empty),
+ *  using the DCT scaling of libjpeg to decode it at 1/2, 1/4 or 1/8
+ *  of its size when that is still at least min_size. The rows above
+ *  the area are skipped, and the columns outside it are not
+ *  transformed. The result is the same as decoding the whole image
+ *  with OpenCV and cropping it (when not scaled).
+ *
+ *  Returns false when the image has to be decoded by OpenCV instead:
+ *  roi not within the image, Exif orientation, color spaces other
+ *  than gray and YCbCr/RGB, decoding errors, or no libjpeg-turbo.
+ */
+bool decode_jpeg(const std::vector<unsigned char> &data,
+                 const VCL::Rectangle &roi, const cv::Size &min_size,
+                 cv::Mat &out) {
+#ifdef LIBJPEG_TURBO_VERSION
+  // Pixels decoded around the area, so that the chroma upsampling at
+  // its borders uses the same neighbours as in the whole image.
+  const unsigned margin = 16;
+
+  struct jpeg_decompress_struct cinfo;
+  JPEGError err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, data.data(), data.size());
+  jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header(&cinfo, TRUE);
+
+  if (cinfo.data_precision != 8 || jpeg_exif_orientation(&cinfo) > 1) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  int channels;
+  if (cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    channels = 1;
+  } else if (cinfo.jpeg_color_space == JCS_YCbCr ||
+             cinfo.jpeg_color_space == JCS_RGB) {
+    cinfo.out_color_space = JCS_EXT_BGR;
+    channels = 3;
+  } else {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  VCL::Rectangle area(0, 0, cinfo.image_width, cinfo.image_height);
+  if (!roi.empty()) {
+    if (roi.x < 0 || roi.y < 0 || roi.x + roi.width > area.width ||
+        roi.y + roi.height > area.height) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    area = roi;
+  }
+
+  // Largest reduction that keeps the area at least min_size, and the
+  // area on a whole number of reduced pixels.
+  int scale = 1;
+  if (!min_size.empty()) {
+    for (int s = 8; s > 1; s /= 2) {
+      bool aligned = roi.empty() || (area.x % s == 0 && area.y % s == 0 &&
+                                     area.width % s == 0 &&
+                                     area.height % s == 0);
+      if (aligned && area.width / s >= min_size.width &&
+          area.height / s >= min_size.height) {
+        scale = s;
+        break;
+      }
+    }
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale;
+
+  jpeg_start_decompress(&cinfo);
+
+  VCL::Rectangle scaled(area.x / scale, area.y / scale, area.width / scale,
+                        area.height / scale);
+  if (roi.empty())
+    scaled = VCL::Rectangle(0, 0, cinfo.output_width, cinfo.output_height);
+
+  JDIMENSION x = scaled.x > int(margin) ? scaled.x - margin : 0;
+  JDIMENSION width =
+      std::min<JDIMENSION>(cinfo.output_width,
+                           scaled.x + scaled.width + margin) -
+      x;
+  if (x > 0 || width < cinfo.output_width)
+    jpeg_crop_scanline(&cinfo, &x, &width);
+
+  JDIMENSION y = scaled.y > int(margin) ? scaled.y - margin : 0;
+  if (y > 0)
+    y = jpeg_skip_scanlines(&cinfo, y);
+
+  // Decoded in out (not in a local, which the error jump would leak)
+  JDIMENSION rows = scaled.y + scaled.height - y;
+  out.create(rows, width, channels == 1 ? CV_8UC1 : CV_8UC3);
+  while (cinfo.output_scanline < y + rows) {
+    JSAMPROW row = out.ptr(cinfo.output_scanline - y);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  out = out(VCL::Rectangle(scaled.x - x, scaled.y - y, scaled.width,
+                           scaled.height));
+  return true;
+#else
+  return false;
+#endif
+}
+
+} // namespace
+
 /*  *********************** */
 /*       READ OPERATION     */
 /*  *********************** */
 
-Image::Read::Read(const std::string &filename, VCL::Format format)
-    : Operation(format), _fullpath(filename) {}
+Image::Read::Read(const std::string &filename, VCL::Format format,
+                  const Rectangle &roi, const cv::Size &size)
+    : Operation(format), _fullpath(filename), _roi(roi), _size(size) {}
+
+std::shared_ptr<Image::Read> Image::Read::with_crop(const Rectangle &roi) {
+  return std::make_shared<Read>(_fullpath, _format, roi, _size);
+}
+
+std::shared_ptr<Image::Read> Image::Read::with_resize(const cv::Size &size) {
+  return std::make_shared<Read>(_fullpath, _format, _roi, size);
+}
+
+// Same result as the read followed by the crop and the resize
+void Image::Read::decode(Image *img, const std::vector<unsigned char> &data) {
+  cv::Mat decoded;
+  if (!decode_jpeg(data, _roi, _size, decoded)) {
+    decoded = cv::imdecode(cv::Mat(data), cv::IMREAD_ANYCOLOR);
+    if (decoded.empty())
+      throw VCLException(ObjectEmpty,
+                         _fullpath + " could not be read, object is empty");
+
+    if (!_roi.empty()) {
+      if (decoded.rows < _roi.height + _roi.y ||
+          decoded.cols < _roi.width + _roi.x) {
+        // The image is kept whole, as with the crop operation
+        VCL::Exception e = VCLException(
+            SizeMismatch, "Requested area is not within the image");
+        img->set_query_error_response(e.msg);
+        print_exception(e);
+      } else {
+        decoded = decoded(_roi);
+      }
+    }
+  }
+
+  if (!_size.empty() && decoded.size() != _size) {
+    cv::Mat resized;
+    cv::resize(decoded, resized, _size);
+    decoded = resized;
+  }
+
+  img->shallow_copy_cv(decoded);
+}
 
 void Image::Read::operator()(Image *img) {
 
@@ -85,6 +297,14 @@ void Image::Read::operator()(Image *img) {
       } else {
         throw VCLException(OpenFailed, _fullpath + " could not be written");
       }
+    } else if (is_fused()) {
+      std::ifstream file(_fullpath, std::ios::binary);
+      std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)),
+                                      std::istreambuf_iterator<char>());
+      if (data.empty())
+        throw VCLException(ObjectEmpty,
+                           _fullpath + " could not be read, object is empty");
+      decode(img, data);
     } else {
       cv::Mat img_read = cv::imread(_fullpath, cv::IMREAD_ANYCOLOR);
       img->shallow_copy_cv(img_read);
@@ -95,11 +315,13 @@ void Image::Read::operator()(Image *img) {
   } else //_type == AWS|MINIO
   {
     std::vector<unsigned char> data = img->_remote->Read(_fullpath);
-    if (!data.empty())
-      img->deep_copy_cv(cv::imdecode(cv::Mat(data), cv::IMREAD_ANYCOLOR));
-    else
+    if (data.empty())
       throw VCLException(
           ObjectEmpty, _fullpath + " could not be read from RemoteConnection");
+    else if (is_fused())
+      decode(img, data);
+    else
+      img->deep_copy_cv(cv::imdecode(cv::Mat(data), cv::IMREAD_ANYCOLOR));
   }
 }
 
@@ -128,6 +350,9 @@ void Image::Write::operator()(Image *img) {
       }
     }
 
+    if (img->_tile_extent > 0)
+      img->_tdb->set_extent(img->_tile_extent);
+
     if (img->_tdb->has_data()) {
       if (img->_storage == VDMS::StorageType::LOCAL) {
         img->_tdb->set_configuration(img->_remote);
@@ -136,6 +361,9 @@ void Image::Write::operator()(Image *img) {
     } else {
       img->_tdb->write(img->_cv_img, _metadata);
     }
+
+    if (img->_pyramid_levels > 0)
+      img->_tdb->write_pyramid(img->_pyramid_levels);
   } else if (_format == VCL::Format::BIN) // TODO: Implement Remote
   {
     FILE *bin_file;
@@ -179,6 +407,8 @@ void Image::Write::operator()(Image *img) {
 void Image::Resize::operator()(Image *img) {
   try {
     if (_format == VCL::Format::TDB) {
+      if (!_area.empty())
+        img->_tdb->read(_area, _rect.size());
       img->_tdb->resize(_rect);
       img->_height = img->_tdb->get_image_height();
       img->_width = img->_tdb->get_image_width();
@@ -265,8 +495,7 @@ void Image::Flip::operator()(Image *img) {
                          "Operation not supported for this format");
     } else {
       if (!img->_cv_img.empty()) {
-        cv::Mat dst =
-            cv::Mat(img->_cv_img.rows, img->_cv_img.cols, img->_cv_img.type());
+        cv::Mat dst;
         cv::flip(img->_cv_img, dst, _code);
         img->shallow_copy_cv(dst);
       } else
@@ -292,35 +521,95 @@ void Image::Rotate::operator()(Image *img) {
                          "Operation not supported for this format");
     } else {
       if (!img->_cv_img.empty()) {
+        cv::Size size = img->_cv_img.size();
+        cv::Mat r = get_matrix(size);
 
-        if (_keep_size) {
-          cv::Mat dst = cv::Mat(img->_cv_img.rows, img->_cv_img.cols,
-                                img->_cv_img.type());
+        cv::Mat dst;
+        cv::warpAffine(img->_cv_img, dst, r, size);
+        img->shallow_copy_cv(dst);
+      } else
+        throw VCLException(ObjectEmpty, "Image object is empty");
+    }
+    img->_op_completed++;
+  } catch (VCL::Exception e) {
+    img->set_query_error_response(e.msg);
+    print_exception(e);
+    return;
+  }
+}
 
-          cv::Point2f im_c(img->_cv_img.cols / 2., img->_cv_img.rows / 2.);
-          cv::Mat r = cv::getRotationMatrix2D(im_c, _angle, 1.0);
+cv::Mat Image::Rotate::get_matrix(cv::Size &size) const {
+  if (_keep_size) {
+    cv::Point2f im_c(size.width / 2., size.height / 2.);
+    return cv::getRotationMatrix2D(im_c, _angle, 1.0);
+  }
 
-          cv::warpAffine(img->_cv_img, dst, r, img->_cv_img.size());
-          img->_cv_img = dst.clone();
-        } else {
+  cv::Point2f im_c((size.width - 1) / 2.0, (size.height - 1) / 2.0);
+  cv::Mat r = cv::getRotationMatrix2D(im_c, _angle, 1.0);
+  // Bbox rectangle
+  cv::Rect2f bbox =
+      cv::RotatedRect(cv::Point2f(), cv::Size2f(size), _angle).boundingRect2f();
+  // Transformation Matrix
+  r.at<double>(0, 2) += bbox.width / 2.0 - size.width / 2.0;
+  r.at<double>(1, 2) += bbox.height / 2.0 - size.height / 2.0;
+
+  size = bbox.size();
+  return r;
+}
 
-          cv::Point2f im_c((img->_cv_img.cols - 1) / 2.0,
-                           (img->_cv_img.rows - 1) / 2.0);
-          cv::Mat r = cv::getRotationMatrix2D(im_c, _angle, 1.0);
-          // Bbox rectangle
-          cv::Rect2f bbox =
-              cv::RotatedRect(cv::Point2f(), img->_cv_img.size(), _angle)
-                  .boundingRect2f();
-          // Transformation Matrix
-          r.at<double>(0, 2) += bbox.width / 2.0 - img->_cv_img.cols / 2.0;
-          r.at<double>(1, 2) += bbox.height / 2.0 - img->_cv_img.rows / 2.0;
-
-          cv::Mat dst;
-          cv::warpAffine(img->_cv_img, dst, r, bbox.size());
-          img->shallow_copy_cv(dst);
-        }
-      } else
+/*  *********************** */
+/*    TRANSFORM OPERATION   */
+/*  *********************** */
+
+// The steps are composed into one matrix. Without a rotation, the
+// flips make a single flip (or none); with it, a single warpAffine
+// samples the image where the rotation of the flipped image would.
+void Image::Transform::operator()(Image *img) {
+  try {
+    if (_format == VCL::Format::TDB) {
+      // Not implemented
+      throw VCLException(NotImplemented,
+                         "Operation not supported for this format");
+    } else {
+      if (img->_cv_img.empty())
         throw VCLException(ObjectEmpty, "Image object is empty");
+
+      cv::Size size = img->_cv_img.size();
+      cv::Matx33d m = cv::Matx33d::eye();
+      bool rotated = false;
+
+      for (auto &step : _steps) {
+        cv::Matx33d s = cv::Matx33d::eye();
+        if (step->get_type() == OperationType::FLIP) {
+          int code = std::static_pointer_cast<Flip>(step)->get_code();
+          if (code != 0) {
+            s(0, 0) = -1;
+            s(0, 2) = size.width - 1;
+          }
+          if (code <= 0) {
+            s(1, 1) = -1;
+            s(1, 2) = size.height - 1;
+          }
+        } else {
+          cv::Mat r = std::static_pointer_cast<Rotate>(step)->get_matrix(size);
+          for (int i = 0; i < 2; ++i)
+            for (int j = 0; j < 3; ++j)
+              s(i, j) = r.at<double>(i, j);
+          rotated = true;
+        }
+        m = s * m;
+      }
+
+      cv::Mat dst;
+      if (rotated) {
+        cv::warpAffine(img->_cv_img, dst, cv::Mat(m.get_minor<2, 3>(0, 0)),
+                       size);
+        img->shallow_copy_cv(dst);
+      } else if (m(0, 0) < 0 || m(1, 1) < 0) {
+        int code = m(1, 1) > 0 ? 1 : (m(0, 0) > 0 ? 0 : -1);
+        cv::flip(img->_cv_img, dst, code);
+        img->shallow_copy_cv(dst);
+      }
     }
     img->_op_completed++;
   } catch (VCL::Exception e) {
@@ -801,6 +1090,8 @@ Image::Image(const Image &img, bool copy) {
   _compress = img._compress;
   _image_id = img._image_id;
   _no_blob = img._no_blob;
+  _tile_extent = img._tile_extent;
+  _pyramid_levels = img._pyramid_levels;
 
   if (!(img._cv_img).empty()) {
     if (copy) {
@@ -810,18 +1101,21 @@ Image::Image(const Image &img, bool copy) {
     }
   }
 
-  if (img._tdb != NULL)
-    _tdb = new TDBImage(*img._tdb);
-  else
-    _tdb = NULL;
+  _tdb = copy_tdb(img._tdb);
 
   int start;
   if (img._operations.size() > 0) {
     std::shared_ptr<Operation> front = img._operations.front();
     if (front->get_type() == OperationType::READ) {
       start = 1;
-      cv::Mat img_read = cv::imread(img._image_id, cv::IMREAD_ANYCOLOR);
-      shallow_copy_cv(img_read);
+      // A crop or resize fused with the read is done by the read
+      // The TDB data is read when needed
+      if (std::static_pointer_cast<Read>(front)->is_fused()) {
+        (*front)(this);
+      } else if (_format != VCL::Format::TDB) {
+        cv::Mat img_read = cv::imread(img._image_id, cv::IMREAD_ANYCOLOR);
+        shallow_copy_cv(img_read);
+      }
     } else
       start = 0;
 
@@ -836,23 +1130,51 @@ Image::Image(const Image &img, bool copy) {
 }
 
 Image::Image(Image &&img) noexcept {
+  _tdb = nullptr;
   _bin = nullptr;
   _bin_size = 0;
-  _remote = nullptr;
-  _no_blob = img._no_blob;
+  *this = std::move(img);
+}
+
+// The pending operations (the read included) are moved along, so
+// nothing is read or copied here.
+Image &Image::operator=(Image &&img) noexcept {
+  if (this == &img)
+    return *this;
+
+  delete _tdb;
+  free(_bin);
+
+  _height = img._height;
+  _width = img._width;
+  _cv_type = img._cv_type;
+  _channels = img._channels;
+  _cv_img = std::move(img._cv_img);
 
-  _format = img._format;
-  _compress = img._compress;
-  _image_id = img._image_id;
   _tdb = img._tdb;
-  _operations = std::move(img._operations);
-  shallow_copy_cv(img._cv_img);
-  op_labels = img.op_labels;
+  _bin = img._bin;
+  _bin_size = img._bin_size;
+  _remote = img._remote;
+  _storage = img._storage;
+  img._tdb = nullptr;
+  img._bin = nullptr;
+  img._bin_size = 0;
 
-  img._tdb = NULL;
+  _format = img._format;
+  _compress = img._compress;
+  _image_id = std::move(img._image_id);
+  _no_blob = img._no_blob;
+  _tile_extent = img._tile_extent;
+  _pyramid_levels = img._pyramid_levels;
 
+  _operations = std::move(img._operations);
+  op_labels = std::move(img.op_labels);
   _op_completed = img._op_completed;
-  remoteOp_params = img.remoteOp_params;
+  remoteOp_params = std::move(img.remoteOp_params);
+  _query_error_response = std::move(img._query_error_response);
+  _ingest_metadata = std::move(img._ingest_metadata);
+
+  return *this;
 }
 
 Image &Image::operator=(const Image &img) {
@@ -875,11 +1197,10 @@ Image &Image::operator=(const Image &img) {
   _compress = img._compress;
   _image_id = img._image_id;
   _no_blob = img._no_blob;
+  _tile_extent = img._tile_extent;
+  _pyramid_levels = img._pyramid_levels;
 
-  if (img._tdb != NULL) {
-    _tdb = new TDBImage(*img._tdb);
-  } else
-    _tdb = NULL;
+  _tdb = copy_tdb(img._tdb);
 
   int start;
 
@@ -890,8 +1211,14 @@ Image &Image::operator=(const Image &img) {
     std::shared_ptr<Operation> front = img._operations.front();
     if (front->get_type() == OperationType::READ) {
       start = 1;
-      cv::Mat img_read = cv::imread(img._image_id, cv::IMREAD_ANYCOLOR);
-      shallow_copy_cv(img_read);
+      // A crop or resize fused with the read is done by the read
+      // The TDB data is read when needed
+      if (std::static_pointer_cast<Read>(front)->is_fused()) {
+        (*front)(this);
+      } else if (_format != VCL::Format::TDB) {
+        cv::Mat img_read = cv::imread(img._image_id, cv::IMREAD_ANYCOLOR);
+        shallow_copy_cv(img_read);
+      }
     } else
       start = 0;
 
@@ -981,17 +1308,8 @@ int Image::get_image_type() const { return _cv_type; }
 Image Image::get_area(const Rectangle &roi, bool performOp) const {
   Image area(*this);
 
-  if (area._format == VCL::Format::TDB && area._operations.size() == 1) {
-    if (area._tdb == NULL)
-      throw VCLException(TileDBNotFound, "VCL::Format indicates image \
-                stored in TDB format, but no data was found");
-    area._operations.pop_back();
-  }
-
-  std::shared_ptr<Operation> op = std::make_shared<Crop>(roi, area._format);
-
-  area.op_labels.push_back("get_area");
-  area._operations.push_back(op);
+  // Only the area of a TDB image not read yet is read
+  area.crop(roi);
 
   if (performOp)
     area.perform_operations();
@@ -1258,6 +1576,22 @@ void Image::set_minimum_dimension(int dimension) {
   }
 }
 
+void Image::set_tile_extent(int extent) { _tile_extent = extent; }
+
+void Image::set_pyramid_levels(int levels) { _pyramid_levels = levels; }
+
+TDBImage *Image::copy_tdb(TDBImage *tdb) {
+  if (tdb == NULL)
+    return NULL;
+
+  if (tdb->has_data())
+    return new TDBImage(*tdb);
+
+  TDBImage *copy = new TDBImage(tdb->get_object_id());
+  copy->set_compression(_compress);
+  return copy;
+}
+
 void Image::set_remoteOp_params(Json::Value options, std::string url) {
   remoteOp_params["options"] = options;
   remoteOp_params["url"] = url;
@@ -1338,6 +1672,21 @@ int Image::execute_operation() {
   }
 }
 
+void Image::perform_read() {
+  if (_operations.empty() ||
+      _operations.front()->get_type() != OperationType::READ)
+    return;
+
+  try {
+    (*_operations.front())(this);
+  } catch (cv::Exception &e) {
+    throw VCLException(OpenCVError, e.what());
+  }
+
+  _operations.erase(_operations.begin());
+  op_labels.erase(op_labels.begin());
+}
+
 void Image::read(const std::string &image_id) {
   _image_id = create_fullpath(image_id, _format);
   op_labels.push_back("read");
@@ -1367,18 +1716,81 @@ bool Image::delete_image() {
   return true;
 }
 
+std::shared_ptr<Image::Read> Image::pending_jpeg_read() {
+  if (_format != Format::JPG || _operations.size() != 1 ||
+      _operations.front()->get_type() != OperationType::READ)
+    return nullptr;
+
+  return std::static_pointer_cast<Read>(_operations.front());
+}
+
 void Image::resize(int new_height, int new_width) {
+  // A JPEG resized right after it is read is decoded at a reduced
+  // scale when the new size allows it.
+  std::shared_ptr<Read> read = pending_jpeg_read();
+  if (read && read->get_size().empty() && new_height > 0 && new_width > 0) {
+    _operations.front() = read->with_resize(cv::Size(new_width, new_height));
+    return;
+  }
+
+  // A TDB image (or area of it) resized before any other operation
+  // is read from the nearest level of its pyramid
+  if (_format == Format::TDB && _tdb != NULL && _operations.size() == 1 &&
+      _op_completed == 0) {
+    std::shared_ptr<Operation> first = _operations.front();
+    Rectangle area;
+    if (first->get_type() == OperationType::CROP)
+      area = std::static_pointer_cast<Crop>(first)->get_rect();
+
+    if (first->get_type() == OperationType::READ || !area.empty()) {
+      _operations.front() = std::make_shared<Resize>(
+          Rectangle(0, 0, new_width, new_height), _format, area);
+      op_labels.front() = area.empty() ? "resize" : "crop+resize";
+      return;
+    }
+  }
+
   _operations.push_back(std::make_shared<Resize>(
       Rectangle(0, 0, new_width, new_height), _format));
   op_labels.push_back("resize");
 }
 
 void Image::crop(const Rectangle &rect) {
-  if (_format == Format::TDB && _operations.size() == 1) {
+  if (_format == Format::TDB) {
     if (_tdb == NULL)
       throw VCLException(TileDBNotFound, "VCL::Format indicates image \
                 stored in TDB format, but no data was found");
-    _operations.pop_back();
+
+    // A crop done first reads only the tiles of the area, in place
+    // of the read of the whole array
+    if (_operations.size() == 1 &&
+        _operations.front()->get_type() == OperationType::READ) {
+      _operations.pop_back();
+      op_labels.pop_back();
+    }
+
+    // Crops of crops are one crop, of the area they end up with
+    if (!_operations.empty() && _op_completed < _operations.size() &&
+        _operations.back()->get_type() == OperationType::CROP) {
+      Rectangle last = std::static_pointer_cast<Crop>(_operations.back())
+                           ->get_rect();
+      if (rect.x >= 0 && rect.y >= 0 && rect.x + rect.width <= last.width &&
+          rect.y + rect.height <= last.height) {
+        _operations.back() = std::make_shared<Crop>(
+            Rectangle(last.x + rect.x, last.y + rect.y, rect.width,
+                      rect.height),
+            _format);
+        return;
+      }
+    }
+  }
+
+  // A JPEG cropped right after it is read only decodes the area
+  std::shared_ptr<Read> read = pending_jpeg_read();
+  if (read && read->get_roi().empty() && read->get_size().empty() &&
+      !rect.empty() && rect.x >= 0 && rect.y >= 0) {
+    _operations.front() = read->with_crop(rect);
+    return;
   }
 
   _operations.push_back(std::make_shared<Crop>(rect, _format));
@@ -1390,13 +1802,50 @@ void Image::threshold(int value) {
   op_labels.push_back("threshold");
 }
 
+// Two rotations are not fused: the first one crops (or pads) the
+// image before the second one interpolates it again.
+bool Image::fuse_transform(std::shared_ptr<Operation> op,
+                           const std::string &label) {
+  if (_format == Format::TDB || _operations.empty())
+    return false;
+
+  std::vector<std::shared_ptr<Operation>> steps;
+  std::shared_ptr<Operation> last = _operations.back();
+  if (last->get_type() == OperationType::TRANSFORM)
+    steps = std::static_pointer_cast<Transform>(last)->get_steps();
+  else if (last->get_type() == OperationType::FLIP ||
+           last->get_type() == OperationType::ROTATE)
+    steps.push_back(last);
+  else
+    return false;
+
+  if (op->get_type() == OperationType::ROTATE)
+    for (auto &step : steps)
+      if (step->get_type() == OperationType::ROTATE)
+        return false;
+
+  steps.push_back(op);
+  _operations.back() = std::make_shared<Transform>(steps, _format);
+  op_labels.back() += "+" + label;
+  return true;
+}
+
 void Image::flip(int code) {
-  _operations.push_back(std::make_shared<Flip>(code, _format));
+  std::shared_ptr<Operation> op = std::make_shared<Flip>(code, _format);
+  if (fuse_transform(op, "flip"))
+    return;
+
+  _operations.push_back(op);
   op_labels.push_back("flip");
 }
 
 void Image::rotate(float angle, bool keep_size) {
-  _operations.push_back(std::make_shared<Rotate>(angle, keep_size, _format));
+  std::shared_ptr<Operation> op =
+      std::make_shared<Rotate>(angle, keep_size, _format);
+  if (fuse_transform(op, "rotate"))
+    return;
+
+  _operations.push_back(op);
   op_labels.push_back("rotate");
 }
 
@@ -0,0 +1,484 @@
+/**
+ * @file   ShardedDescriptorSet.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <numeric>
+
+#include "../WorkerPool.h"
+#include "DistanceKernels.h"
+#include "FaissDescriptorSet.h"
+#include "ShardedDescriptorSet.h"
+#include "vcl/Exception.h"
+
+#define SHARD_DIR_PREFIX "shard_"
+
+using namespace VCL;
+
+namespace {
+
+DescriptorSet::DescriptorSetData *open_shard(const std::string &path,
+                                             DescriptorSetEngine eng,
+                                             bool use_mmap) {
+  if (eng == DescriptorSetEngine(FaissFlat))
+    return new FaissFlatDescriptorSet(path, use_mmap);
+  else if (eng == DescriptorSetEngine(FaissIVFFlat))
+    return new FaissIVFFlatDescriptorSet(path, use_mmap);
+  else if (eng == DescriptorSetEngine(FaissHNSWFlat))
+    return new FaissHNSWFlatDescriptorSet(path);
+
+  throw VCLException(UnsupportedIndex, "Only Faiss sets can be sharded");
+}
+
+DescriptorSet::DescriptorSetData *create_shard(const std::string &path,
+                                               unsigned dim,
+                                               DescriptorSetEngine eng,
+                                               DistanceMetric metric) {
+  if (eng == DescriptorSetEngine(FaissFlat))
+    return new FaissFlatDescriptorSet(path, dim, metric);
+  else if (eng == DescriptorSetEngine(FaissIVFFlat))
+    return new FaissIVFFlatDescriptorSet(path, dim, metric);
+  else if (eng == DescriptorSetEngine(FaissHNSWFlat))
+    return new FaissHNSWFlatDescriptorSet(path, dim, metric);
+
+  throw VCLException(UnsupportedIndex, "Only Faiss sets can be sharded");
+}
+
+} // namespace
+
+ShardedDescriptorSet::ShardedDescriptorSet(const std::string &set_path,
+                                           DescriptorSetEngine eng,
+                                           unsigned n_shards, bool use_mmap)
+    : DescriptorSetData(set_path) {
+  _failed = false;
+
+  try {
+    for (unsigned i = 0; i < n_shards; ++i) {
+      _shards.emplace_back(new Shard());
+      _shards[i]->set = NULL;
+      _shards[i]->set = open_shard(shard_path(set_path, i), eng, use_mmap);
+      _shards[i]->n_added = _shards[i]->set->get_n_total();
+    }
+  } catch (VCL::Exception &e) {
+    for (auto &shard : _shards)
+      delete shard->set;
+    throw e;
+  }
+
+  _dimensions = _shards[0]->set->get_dimensions();
+  _metric = _shards[0]->set->get_metric();
+
+  // The labels map is logged by the first shard
+  std::map<long, std::string> labels = _shards[0]->set->get_labels_map();
+  DescriptorSetData::set_labels_map(labels);
+
+  pad_shards();
+}
+
+ShardedDescriptorSet::ShardedDescriptorSet(const std::string &set_path,
+                                           unsigned dim,
+                                           DescriptorSetEngine eng,
+                                           DistanceMetric metric,
+                                           unsigned n_shards)
+    : DescriptorSetData(set_path, dim) {
+  _failed = false;
+  _metric = metric;
+
+  try {
+    for (unsigned i = 0; i < n_shards; ++i) {
+      _shards.emplace_back(new Shard());
+      _shards[i]->set = NULL;
+      _shards[i]->set = create_shard(shard_path(set_path, i), dim, eng, metric);
+      _shards[i]->n_added = 0;
+    }
+  } catch (VCL::Exception &e) {
+    for (auto &shard : _shards)
+      delete shard->set;
+    throw e;
+  }
+}
+
+ShardedDescriptorSet::~ShardedDescriptorSet() {
+  for (auto &shard : _shards)
+    delete shard->set;
+}
+
+std::string ShardedDescriptorSet::shard_path(const std::string &set_path,
+                                             unsigned shard) {
+  return set_path + "/" + SHARD_DIR_PREFIX + std::to_string(shard);
+}
+
+long ShardedDescriptorSet::to_id(unsigned shard, long position) {
+  return position < 0 ? -1 : position * long(_shards.size()) + shard;
+}
+
+// Shards are stored (and their logs written) one by one, so after a
+// crash the last adds may be in some of them only. Those are padded
+// with zeros, unlabeled, so the ids of the next adds map to the right
+// positions again. DescriptorSet removes the padding (padding_ids()),
+// so searches never return it.
+void ShardedDescriptorSet::pad_shards() {
+  long n_shards = _shards.size();
+  long n_total = 0;
+  for (long i = 0; i < n_shards; ++i) {
+    long n = _shards[i]->n_added;
+    if (n > 0)
+      n_total = std::max(n_total, to_id(i, n - 1) + 1);
+  }
+
+  for (long i = 0; i < n_shards; ++i) {
+    long expected = n_total > i ? (n_total - i + n_shards - 1) / n_shards : 0;
+    long missing = expected - _shards[i]->n_added;
+    if (missing > 0) {
+      std::vector<float> zeros(missing * _dimensions, 0);
+      _shards[i]->set->add(zeros.data(), missing);
+      for (long pos = _shards[i]->n_added; pos < expected; ++pos)
+        _padding.push_back(to_id(i, pos));
+      _shards[i]->n_added = expected;
+    }
+  }
+
+  _n_total = n_total;
+}
+
+// Without a WorkerPool (the set is used outside of the server),
+// the shards are processed one after the other.
+template <typename F> void ShardedDescriptorSet::fan_out(F f) {
+  if (_shards.size() == 1 || !VDMS::WorkerPool::is_init()) {
+    std::exception_ptr error;
+    for (unsigned i = 0; i < _shards.size(); ++i) {
+      try {
+        f(i);
+      } catch (...) {
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+
+    if (error)
+      std::rethrow_exception(error);
+    return;
+  }
+
+  VDMS::WorkerPool::instance()->parallel_for(
+      _shards.size(), [&](size_t shard) { f(unsigned(shard)); });
+}
+
+// Adds the descriptors (of ids first to first + n - 1) that belong
+// to the shard, waiting for the adds with lower ids to be applied.
+void ShardedDescriptorSet::add_to_shard(unsigned shard, float *descriptors,
+                                        long first, unsigned n,
+                                        long *labels) {
+  long n_shards = _shards.size();
+  long skip = ((shard - first) % n_shards + n_shards) % n_shards;
+  if (skip >= n)
+    return;
+
+  long n_local = (n - skip - 1) / n_shards + 1;
+  std::vector<float> descs(n_local * _dimensions);
+  std::vector<long> shard_labels(labels ? n_local : 0);
+  for (long i = 0; i < n_local; ++i) {
+    long src = skip + i * n_shards;
+    std::memcpy(descs.data() + i * _dimensions,
+                descriptors + src * _dimensions, sizeof(float) * _dimensions);
+    if (labels)
+      shard_labels[i] = labels[src];
+  }
+
+  long position = (first + skip) / n_shards;
+  Shard &s = *_shards[shard];
+
+  std::unique_lock<std::mutex> lock(s.lock);
+  s.cv.wait(lock, [&] { return s.n_added == position || _failed; });
+
+  if (_failed) {
+    throw VCLException(UndefinedException,
+                       "An add to the set failed, it must be reopened");
+  }
+
+  try {
+    s.set->add(descs.data(), n_local, labels ? shard_labels.data() : NULL);
+  } catch (...) {
+    _failed = true;
+    lock.unlock();
+    s.cv.notify_all();
+    throw;
+  }
+
+  s.n_added += n_local;
+  lock.unlock();
+  s.cv.notify_all();
+}
+
+long ShardedDescriptorSet::add(float *descriptors, unsigned n,
+                               long *labels) {
+  _lock.lock();
+  long first = _n_total;
+  _n_total += n;
+  _lock.unlock();
+
+  fan_out([&](unsigned shard) {
+    add_to_shard(shard, descriptors, first, n, labels);
+  });
+
+  return first;
+}
+
+void ShardedDescriptorSet::search(float *query, unsigned n, unsigned k,
+                                  long *ids, float *distances) {
+  unsigned n_shards = _shards.size();
+  std::vector<std::vector<long>> shard_ids(n_shards);
+  std::vector<std::vector<float>> shard_distances(n_shards);
+
+  fan_out([&](unsigned shard) {
+    shard_ids[shard].resize(n * k);
+    shard_distances[shard].resize(n * k);
+    _shards[shard]->set->search(query, n, k, shard_ids[shard].data(),
+                                shard_distances[shard].data());
+    for (long &id : shard_ids[shard])
+      id = to_id(shard, id);
+  });
+
+  std::fill_n(ids, n * k, -1);
+  for (unsigned i = 0; i < n_shards; ++i) {
+    DistanceKernels::merge_knn(n, k, _metric, shard_ids[i].data(),
+                               shard_distances[i].data(), 0, ids, distances);
+  }
+}
+
+// Each shard keeps its max_results closest neighbors, which include
+// the max_results closest ones overall.
+void ShardedDescriptorSet::radius_search(float *query, float radius,
+                                         unsigned max_results,
+                                         std::vector<long> &ids,
+                                         std::vector<float> &distances) {
+  unsigned n_shards = _shards.size();
+  std::vector<std::vector<long>> shard_ids(n_shards);
+  std::vector<std::vector<float>> shard_distances(n_shards);
+
+  fan_out([&](unsigned shard) {
+    _shards[shard]->set->radius_search(query, radius, max_results,
+                                       shard_ids[shard],
+                                       shard_distances[shard]);
+  });
+
+  ids.clear();
+  distances.clear();
+  for (unsigned i = 0; i < n_shards; ++i) {
+    for (long j = 0; j < shard_ids[i].size(); ++j) {
+      ids.push_back(to_id(i, shard_ids[i][j]));
+      distances.push_back(shard_distances[i][j]);
+    }
+  }
+
+  sort_radius_results(ids, distances, max_results, _metric);
+}
+
+void ShardedDescriptorSet::classify(float *descriptors, unsigned n, long *ids,
+                                    unsigned quorum,
+                                    VoteWeighting weighting) {
+  std::vector<long> neighbors(n * quorum);
+  std::vector<float> distances(n * quorum);
+
+  search(descriptors, n, quorum, neighbors.data(), distances.data());
+
+  std::vector<long> labels(n * quorum, -1);
+  std::vector<long> found;
+  std::vector<long> found_idx;
+  for (long i = 0; i < neighbors.size(); ++i) {
+    if (neighbors[i] >= 0) {
+      found.push_back(neighbors[i]);
+      found_idx.push_back(i);
+    }
+  }
+
+  std::vector<long> found_labels(found.size());
+  get_labels(found.data(), found.size(), found_labels.data());
+  for (long i = 0; i < found.size(); ++i)
+    labels[found_idx[i]] = found_labels[i];
+
+  for (unsigned j = 0; j < n; ++j) {
+    ids[j] = vote(labels.data() + quorum * j, distances.data() + quorum * j,
+                  quorum, weighting, _metric);
+  }
+}
+
+void ShardedDescriptorSet::split_ids(long *ids, unsigned n,
+                                     std::vector<std::vector<long>> &pos,
+                                     std::vector<std::vector<unsigned>> &idx) {
+  long n_shards = _shards.size();
+  long n_total = get_n_total();
+
+  pos.assign(n_shards, std::vector<long>());
+  idx.assign(n_shards, std::vector<unsigned>());
+
+  for (unsigned i = 0; i < n; ++i) {
+    if (ids[i] < 0 || ids[i] >= n_total) {
+      throw VCLException(ObjectNotFound, "Descriptor id does not exists");
+    }
+    pos[ids[i] % n_shards].push_back(ids[i] / n_shards);
+    idx[ids[i] % n_shards].push_back(i);
+  }
+}
+
+void ShardedDescriptorSet::get_descriptors(long *ids, unsigned n,
+                                           float *descriptors) {
+  std::vector<std::vector<long>> pos;
+  std::vector<std::vector<unsigned>> idx;
+  split_ids(ids, n, pos, idx);
+
+  fan_out([&](unsigned shard) {
+    if (pos[shard].empty())
+      return;
+
+    std::vector<float> descs(pos[shard].size() * _dimensions);
+    _shards[shard]->set->get_descriptors(pos[shard].data(), pos[shard].size(),
+                                         descs.data());
+    for (long i = 0; i < idx[shard].size(); ++i) {
+      std::memcpy(descriptors + idx[shard][i] * _dimensions,
+                  descs.data() + i * _dimensions,
+                  sizeof(float) * _dimensions);
+    }
+  });
+}
+
+void ShardedDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
+  std::vector<std::vector<long>> pos;
+  std::vector<std::vector<unsigned>> idx;
+  split_ids(ids, n, pos, idx);
+
+  for (unsigned shard = 0; shard < _shards.size(); ++shard) {
+    if (pos[shard].empty())
+      continue;
+
+    std::vector<long> shard_labels(pos[shard].size());
+    _shards[shard]->set->get_labels(pos[shard].data(), pos[shard].size(),
+                                    shard_labels.data());
+    for (long i = 0; i < idx[shard].size(); ++i)
+      labels[idx[shard][i]] = shard_labels[i];
+  }
+}
+
+void ShardedDescriptorSet::train() {
+  fan_out([&](unsigned shard) { _shards[shard]->set->train(); });
+}
+
+void ShardedDescriptorSet::train(float *descriptors, unsigned n) {
+  fan_out(
+      [&](unsigned shard) { _shards[shard]->set->train(descriptors, n); });
+}
+
+void ShardedDescriptorSet::train_async(float *descriptors, unsigned n) {
+  for (auto &shard : _shards)
+    shard->set->train_async(descriptors, n);
+}
+
+// Average over the shards still training
+float ShardedDescriptorSet::train_progress() {
+  float sum = 0;
+  int running = 0;
+  for (auto &shard : _shards) {
+    float progress = shard->set->train_progress();
+    if (progress >= 0) {
+      sum += progress;
+      running++;
+    }
+  }
+
+  return running == 0 ? -1 : sum / running;
+}
+
+bool ShardedDescriptorSet::is_trained() {
+  for (auto &shard : _shards) {
+    if (!shard->set->is_trained())
+      return false;
+  }
+  return true;
+}
+
+void ShardedDescriptorSet::copy_training(DescriptorSetData *set) {
+  ShardedDescriptorSet *from = (ShardedDescriptorSet *)set;
+  for (unsigned i = 0; i < _shards.size(); ++i)
+    _shards[i]->set->copy_training(from->_shards[i]->set);
+}
+
+DistanceMetric ShardedDescriptorSet::get_metric() {
+  return _shards[0]->set->get_metric();
+}
+
+void ShardedDescriptorSet::store() { store(_set_path); }
+
+void ShardedDescriptorSet::store(std::string set_path) {
+  int ret = create_dir(set_path.c_str());
+  if (ret != 0 && ret != EEXIST) {
+    throw VCLException(OpenFailed, set_path +
+                                       " cannot be created or written. " +
+                                       "Error: " + std::to_string(ret));
+  }
+
+  _set_path = set_path;
+  fan_out([&](unsigned shard) {
+    _shards[shard]->set->store(shard_path(set_path, shard));
+  });
+}
+
+void ShardedDescriptorSet::sync() {
+  int ret = create_dir(_set_path.c_str());
+  if (ret != 0 && ret != EEXIST) {
+    throw VCLException(OpenFailed, _set_path +
+                                       " cannot be created or written. " +
+                                       "Error: " + std::to_string(ret));
+  }
+
+  for (auto &shard : _shards)
+    shard->set->sync();
+}
+
+void ShardedDescriptorSet::set_path(const std::string &set_path) {
+  _set_path = set_path;
+  for (unsigned i = 0; i < _shards.size(); ++i)
+    _shards[i]->set->set_path(shard_path(set_path, i));
+}
+
+bool ShardedDescriptorSet::recovered() {
+  for (auto &shard : _shards) {
+    if (shard->set->recovered())
+      return true;
+  }
+  return false;
+}
+
+void ShardedDescriptorSet::set_labels_map(
+    std::map<long, std::string> &labels) {
+  DescriptorSetData::set_labels_map(labels);
+  _shards[0]->set->set_labels_map(labels);
+}
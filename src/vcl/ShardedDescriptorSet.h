@@ -0,0 +1,147 @@
+/**
+ * @file   ShardedDescriptorSet.h
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * This file declares a DescriptorSet split in several Faiss indexes.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DescriptorSetData.h"
+
+namespace VCL {
+
+// Set split in n Faiss indexes (shards) of the same engine, kept in
+// the shard_<i> directories of the set. Shard i holds the descriptors
+// whose id modulo n is i, at position id / n, so ids (and labels) are
+// the same as with a single index. Adds are split across the shards,
+// which are written in parallel; searches run on every shard in
+// parallel, and their results are merged.
+class ShardedDescriptorSet : public DescriptorSet::DescriptorSetData {
+
+  struct Shard {
+    DescriptorSetData *set;
+
+    // Adds are applied in the order their ids were reserved:
+    // the next one starts at position n_added.
+    std::mutex lock;
+    std::condition_variable cv;
+    long n_added;
+  };
+
+  std::vector<std::unique_ptr<Shard>> _shards;
+
+  // Reserves the ids of each add
+  std::mutex _lock;
+
+  // Set when an add to a shard failed: later adds would not land
+  // at the position their ids map to. Reopening the set fixes it.
+  std::atomic<bool> _failed;
+
+  // Ids of the zeros inserted by pad_shards()
+  std::vector<long> _padding;
+
+  std::string shard_path(const std::string &set_path, unsigned shard);
+  void pad_shards();
+
+  long to_id(unsigned shard, long position);
+
+  // Runs f(shard) for every shard, in parallel on the WorkerPool.
+  // Rethrows the first exception once all of them are done.
+  template <typename F> void fan_out(F f);
+
+  void add_to_shard(unsigned shard, float *descriptors, long first,
+                    unsigned n, long *labels);
+
+  // Splits ids by shard: the positions of ids[i] and the indexes i
+  void split_ids(long *ids, unsigned n, std::vector<std::vector<long>> &pos,
+                 std::vector<std::vector<unsigned>> &idx);
+
+public:
+  ShardedDescriptorSet(const std::string &set_path, DescriptorSetEngine eng,
+                       unsigned n_shards, bool use_mmap = false);
+  ShardedDescriptorSet(const std::string &set_path, unsigned dim,
+                       DescriptorSetEngine eng, DistanceMetric metric,
+                       unsigned n_shards);
+
+  ~ShardedDescriptorSet();
+
+  long add(float *descriptors, unsigned n_descriptors, long *labels);
+
+  void search(float *query, unsigned n, unsigned k, long *ids,
+              float *distances);
+
+  void radius_search(float *query, float radius, unsigned max_results,
+                     std::vector<long> &ids, std::vector<float> &distances);
+
+  void classify(float *descriptors, unsigned n, long *ids, unsigned quorum,
+                VoteWeighting weighting);
+
+  void get_descriptors(long *ids, unsigned n, float *descriptors);
+
+  void get_labels(long *ids, unsigned n, long *labels);
+
+  void train();
+
+  void train(float *descriptors, unsigned n);
+
+  void train_async(float *descriptors, unsigned n);
+
+  float train_progress();
+
+  bool is_trained();
+
+  void copy_training(DescriptorSetData *set);
+
+  DistanceMetric get_metric();
+
+  void store();
+  void store(std::string set_path);
+
+  void sync();
+
+  void set_path(const std::string &set_path);
+
+  bool recovered();
+
+  std::vector<long> padding_ids() { return _padding; }
+
+  void set_labels_map(std::map<long, std::string> &labels);
+};
+
+}; // namespace VCL
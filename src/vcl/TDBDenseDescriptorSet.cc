@@ -29,6 +29,7 @@
  *
  */
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <iomanip>
@@ -37,6 +38,7 @@
 #include <stdlib.h>
 #include <string>
 
+#include "DistanceKernels.h"
 #include "TDBDescriptorSet.h"
 
 // #include <tiledb/map.h>
@@ -44,6 +46,16 @@
 #define ATTRIBUTE_DESC "descriptor"
 #define ATTRIBUTE_LABEL "label"
 
+// The domain is only materialized where descriptors are written,
+// so it is sized for any set rather than grown.
+#define DENSE_MAX_DESC (uint64_t(1) << 40)
+#define DENSE_TILE_EXTENT 1000
+
+// Sets up to this size stay in memory after the first search
+#define DENSE_CACHE_MAX_BYTES (256ul << 20)
+// Size of each read when loading or streaming the set
+#define DENSE_READ_CHUNK_BYTES (16ul << 20)
+
 using namespace VCL;
 
 TDBDenseDescriptorSet::TDBDenseDescriptorSet(const std::string &filename)
@@ -55,12 +67,14 @@ TDBDenseDescriptorSet::TDBDenseDescriptorSet(const std::string &filename)
 TDBDenseDescriptorSet::TDBDenseDescriptorSet(const std::string &filename,
                                              uint32_t dim,
                                              DistanceMetric metric)
-    : TDBDescriptorSet(filename, dim), _flag_buffer_updated(true) {
+    : TDBDescriptorSet(filename, dim), _flag_buffer_updated(true),
+      _capacity(DENSE_MAX_DESC) {
+  _metric = metric;
   TDBObject descriptorSetObject;
 
-  descriptorSetObject.set_full_dimensions(std::vector<std::string>{"d"},
-                                          std::vector<uint64_t>{(MAX_DESC - 1)},
-                                          std::vector<uint64_t>{0}, 10);
+  descriptorSetObject.set_full_dimensions(
+      std::vector<std::string>{"d"}, std::vector<uint64_t>{DENSE_MAX_DESC - 1},
+      std::vector<uint64_t>{0}, DENSE_TILE_EXTENT);
   std::string desc = ATTRIBUTE_DESC;
   std::string label = ATTRIBUTE_LABEL;
   descriptorSetObject.set_single_attribute(desc, VCL::CompressionType::LZ4,
@@ -73,33 +87,63 @@ TDBDenseDescriptorSet::TDBDenseDescriptorSet(const std::string &filename,
   write_descriptor_metadata();
 }
 
+void TDBDenseDescriptorSet::read_chunk(uint64_t start, uint64_t n,
+                                       float *descriptors, long *labels) {
+  tiledb::Array array(_ctx, _set_path, TILEDB_READ);
+  tiledb::Query query(_ctx, array);
+  query.set_layout(TILEDB_ROW_MAJOR);
+  query.set_subarray<uint64_t>({start, start + n - 1});
+  if (descriptors != NULL)
+    query.set_data_buffer(ATTRIBUTE_DESC, descriptors, n * _dimensions);
+  if (labels != NULL)
+    query.set_data_buffer(ATTRIBUTE_LABEL, labels, n);
+  query.submit();
+  array.close();
+}
+
+// Labels are always kept in memory. Descriptors are only cached
+// if the set fits in DENSE_CACHE_MAX_BYTES; otherwise searches
+// stream them from the array.
 void TDBDenseDescriptorSet::load_buffer() {
-  try {
+  bool cache = _n_total * _dimensions * sizeof(float) <= DENSE_CACHE_MAX_BYTES;
+  uint64_t chunk = std::max<uint64_t>(
+      1, DENSE_READ_CHUNK_BYTES / (_dimensions * sizeof(float)));
 
+  try {
     read_descriptor_metadata();
 
-    tiledb::Array array(_ctx, _set_path, TILEDB_READ);
-    {
+    _label_ids.resize(_n_total);
+    if (cache)
       _buffer.resize(_dimensions * _n_total);
-      _label_ids.resize(_n_total);
-
-      tiledb::Query query(_ctx, array);
-      query.set_layout(TILEDB_ROW_MAJOR);
-      query.set_subarray<uint64_t>({0, _n_total - 1});
-      query.set_data_buffer(ATTRIBUTE_DESC, _buffer);
-      query.set_data_buffer(ATTRIBUTE_LABEL, _label_ids);
-      query.submit();
-    }
+    else
+      std::vector<float>().swap(_buffer);
 
+    for (uint64_t start = 0; start < _n_total; start += chunk) {
+      uint64_t n = std::min(chunk, _n_total - start);
+      read_chunk(start, n, cache ? &_buffer[start * _dimensions] : NULL,
+                 &_label_ids[start]);
+    }
   } catch (tiledb::TileDBError &e) {
     throw VCLException(TileDBError, "Error: Reading Dense array");
   }
 
-  _flag_buffer_updated = true;
+  _flag_buffer_updated = cache;
 }
 
 void TDBDenseDescriptorSet::read_descriptor_metadata() {
-  std::vector<uint64_t> subarray = {METADATA_OFFSET, (METADATA_OFFSET + 1)};
+  if (read_array_metadata()) {
+    tiledb::Array array(_ctx, _set_path, TILEDB_READ);
+    auto domain = array.schema().domain().dimension(0).domain<uint64_t>();
+    array.close();
+
+    // Sets that moved from the legacy layout keep the old metadata cells
+    _capacity = domain.second + 1 == LEGACY_MAX_DESC ? LEGACY_METADATA_OFFSET
+                                                     : domain.second + 1;
+    return;
+  }
+
+  std::vector<uint64_t> subarray = {LEGACY_METADATA_OFFSET,
+                                    (LEGACY_METADATA_OFFSET + 1)};
   std::vector<long> values(2);
 
   tiledb::Array array(_ctx, _set_path, TILEDB_READ);
@@ -114,50 +158,39 @@ void TDBDenseDescriptorSet::read_descriptor_metadata() {
 
   _dimensions = values[0];
   _n_total = values[1];
+  _capacity = LEGACY_METADATA_OFFSET;
 }
 
 void TDBDenseDescriptorSet::write_descriptor_metadata() {
-  std::vector<long> metadata;
-  metadata.push_back(_dimensions);
-  metadata.push_back(_n_total);
-
-  // This is only here because tiledb requires all the
-  // attributes when writing.
-  std::vector<float> aux_dims(_dimensions * 2, .0f);
-
-  // Write metadata
-  tiledb::Array array(_ctx, _set_path, TILEDB_WRITE);
-  tiledb::Query query(_ctx, array);
-  query.set_layout(TILEDB_ROW_MAJOR);
-  query.set_subarray<uint64_t>({METADATA_OFFSET, METADATA_OFFSET + 1});
-  query.set_data_buffer(ATTRIBUTE_LABEL, metadata);
-  query.set_data_buffer(ATTRIBUTE_DESC, aux_dims);
-  query.submit();
-  query.finalize();
+  write_array_metadata();
 }
 
 long TDBDenseDescriptorSet::add(float *descriptors, unsigned n, long *labels) {
-  try {
-    std::vector<long> att_label;
-    long *labels_buffer = labels;
+  if (_n_total + n > _capacity) {
+    throw VCLException(UnsupportedOperation,
+                       "Descriptor set is full: the legacy layout holds " +
+                           std::to_string(_capacity) + " descriptors");
+  }
 
-    if (labels == NULL) {
-      // By default, labels is -1
-      att_label = std::vector<long>(n, -1);
-      labels_buffer = att_label.data();
-    }
+  std::vector<long> att_label;
+  long *labels_buffer = labels;
 
-    {
-      tiledb::Array array(_ctx, _set_path, TILEDB_WRITE);
-      tiledb::Query query(_ctx, array);
-      query.set_layout(TILEDB_ROW_MAJOR);
-      query.set_subarray<uint64_t>({_n_total, _n_total + n - 1});
-      query.set_data_buffer(ATTRIBUTE_DESC, descriptors, n * _dimensions);
-      query.set_data_buffer(ATTRIBUTE_LABEL, labels_buffer, n);
+  if (labels == NULL) {
+    // By default, labels is -1
+    att_label = std::vector<long>(n, -1);
+    labels_buffer = att_label.data();
+  }
 
-      query.submit();
-      query.finalize();
-    }
+  try {
+    tiledb::Array array(_ctx, _set_path, TILEDB_WRITE);
+    tiledb::Query query(_ctx, array);
+    query.set_layout(TILEDB_ROW_MAJOR);
+    query.set_subarray<uint64_t>({_n_total, _n_total + n - 1});
+    query.set_data_buffer(ATTRIBUTE_DESC, descriptors, n * _dimensions);
+    query.set_data_buffer(ATTRIBUTE_LABEL, labels_buffer, n);
+
+    query.submit();
+    query.finalize();
   } catch (tiledb::TileDBError &e) {
     _flag_buffer_updated = false;
     throw VCLException(UnsupportedOperation, e.what());
@@ -166,19 +199,23 @@ long TDBDenseDescriptorSet::add(float *descriptors, unsigned n, long *labels) {
   // Write _n_total into tiledb
   // This is good because we only write metadata
   // (_n_total) after the other two writes succedded.
+  long old_n_total = _n_total;
   _n_total += n;
   write_descriptor_metadata();
 
-  // - n becase we already increase _n_total for writing metadata on tdb
-  long old_n_total = _n_total - n;
-
-  _buffer.resize((_n_total)*_dimensions);
-  std::memcpy(&_buffer[old_n_total * _dimensions], descriptors,
-              n * _dimensions * sizeof(float));
+  // Labels not loaded yet are read with the rest of the set
+  if (_label_ids.size() == old_n_total) {
+    _label_ids.insert(_label_ids.end(), labels_buffer, labels_buffer + n);
+  }
 
-  if (labels != NULL) {
-    _label_ids.resize(_n_total);
-    std::memcpy(&_label_ids[old_n_total], labels, n * sizeof(long));
+  if (_flag_buffer_updated) {
+    if (_n_total * _dimensions * sizeof(float) <= DENSE_CACHE_MAX_BYTES) {
+      _buffer.insert(_buffer.end(), descriptors,
+                     descriptors + n * _dimensions);
+    } else {
+      std::vector<float>().swap(_buffer);
+      _flag_buffer_updated = false;
+    }
   }
 
   return old_n_total;
@@ -186,37 +223,104 @@ long TDBDenseDescriptorSet::add(float *descriptors, unsigned n, long *labels) {
 
 void TDBDenseDescriptorSet::search(float *query, unsigned n_queries, unsigned k,
                                    long *ids, float *distances) {
-  if (!_flag_buffer_updated) {
+  if (!_flag_buffer_updated && _label_ids.size() != _n_total) {
     load_buffer();
   }
 
-  std::vector<float> d(_n_total);
-  std::vector<long> idxs(_n_total);
-
-  for (int i = 0; i < n_queries; ++i) {
-
-    compute_distances(query + i * _dimensions, d, _buffer);
-    std::iota(idxs.begin(), idxs.end(), 0);
-    std::partial_sort(idxs.begin(), idxs.begin() + k, idxs.end(),
-                      [&d](size_t i1, size_t i2) { return d[i1] < d[i2]; });
+  if (_flag_buffer_updated) {
+    DistanceKernels::knn(query, n_queries, _buffer.data(), _n_total,
+                         _dimensions, k, _metric, ids, distances);
+    return;
+  }
 
-    for (int j = 0; j < k; ++j) {
-      ids[i * k + j] = idxs[j];
-      distances[i * k + j] = d[idxs[j]];
+  // Too large to cache: search one chunk at a time
+  uint64_t chunk = std::max<uint64_t>(
+      1, DENSE_READ_CHUNK_BYTES / (_dimensions * sizeof(float)));
+  std::vector<float> descs(std::min<uint64_t>(chunk, _n_total) * _dimensions);
+  std::vector<long> chunk_ids(n_queries * k);
+  std::vector<float> chunk_distances(n_queries * k);
+
+  // Starts from empty (padded) results
+  DistanceKernels::knn(query, n_queries, descs.data(), 0, _dimensions, k,
+                       _metric, ids, distances);
+
+  for (uint64_t start = 0; start < _n_total; start += chunk) {
+    uint64_t n = std::min(chunk, _n_total - start);
+    try {
+      read_chunk(start, n, descs.data(), NULL);
+    } catch (tiledb::TileDBError &e) {
+      throw VCLException(TileDBError, "Error: Reading Dense array");
     }
+
+    DistanceKernels::knn(query, n_queries, descs.data(), n, _dimensions, k,
+                         _metric, chunk_ids.data(), chunk_distances.data());
+    DistanceKernels::merge_knn(n_queries, k, _metric, chunk_ids.data(),
+                               chunk_distances.data(), start, ids, distances);
   }
 }
 
 void TDBDenseDescriptorSet::get_descriptors(long *ids, unsigned n,
                                             float *descriptors) {
-  if (!_flag_buffer_updated) {
+  if (!_flag_buffer_updated && _label_ids.size() != _n_total) {
     load_buffer();
   }
 
   for (int i = 0; i < n; ++i) {
-    long idx = ids[i] * _dimensions;
-    long offset = i * _dimensions;
-    std::memcpy(descriptors + offset, &_buffer[idx],
+    if (ids[i] < 0 || ids[i] >= _n_total)
+      throw VCLException(OutOfBounds, "Descriptor id out of bounds");
+  }
+
+  if (_flag_buffer_updated) {
+    for (int i = 0; i < n; ++i) {
+      std::memcpy(descriptors + i * _dimensions, &_buffer[ids[i] * _dimensions],
+                  sizeof(float) * _dimensions);
+    }
+    return;
+  }
+
+  // Not cached: one read of the sorted ranges of ids, in range order
+  auto ranges = id_ranges(ids, n);
+  std::vector<uint64_t> range_offsets(ranges.size());
+  uint64_t n_cells = 0;
+  for (size_t r = 0; r < ranges.size(); ++r) {
+    range_offsets[r] = n_cells;
+    n_cells += ranges[r].second - ranges[r].first + 1;
+  }
+
+  std::vector<float> buffer(n_cells * _dimensions);
+
+  try {
+    tiledb::Array array(_ctx, _set_path, TILEDB_READ);
+    tiledb::Subarray subarray(_ctx, array);
+    for (auto &range : ranges) {
+      subarray.add_range<uint64_t>(0, range.first, range.second);
+    }
+
+    tiledb::Query query(_ctx, array);
+    query.set_layout(TILEDB_ROW_MAJOR);
+    query.set_subarray(subarray);
+    query.set_data_buffer(ATTRIBUTE_DESC, buffer);
+    query.submit();
+    array.close();
+  } catch (tiledb::TileDBError &e) {
+    throw VCLException(TileDBError, "Error: Reading Dense array");
+  }
+
+  for (int i = 0; i < n; ++i) {
+    uint64_t id = ids[i];
+    auto range = std::upper_bound(ranges.begin(), ranges.end(),
+                                  std::make_pair(id, UINT64_MAX)) -
+                 1;
+    uint64_t cell = range_offsets[range - ranges.begin()] + id - range->first;
+    std::memcpy(descriptors + i * _dimensions, &buffer[cell * _dimensions],
                 sizeof(float) * _dimensions);
   }
 }
+
+void TDBDenseDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
+  if (_label_ids.size() != _n_total) {
+    load_buffer();
+  }
+
+  TDBDescriptorSet::get_labels(ids, n, labels);
+}
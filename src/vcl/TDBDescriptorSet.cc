@@ -27,6 +27,7 @@
  *
  */
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <iomanip>
@@ -34,22 +35,15 @@
 #include <stdlib.h>
 #include <string>
 
-// By default, we use OMP.
-// #define USE_COMPUTE_MKL
-
-#ifndef USE_COMPUTE_MKL
-#define USE_COMPUTE_OMP
-#endif
-
-#ifdef USE_COMPUTE_MKL
-#include "mkl.h" // INTEL MKL
-#endif
-
 #include "TDBDescriptorSet.h"
 
 #define ATTRIBUTE_NAME "val"
 #define METADATA_PATH "/metadata"
 
+#define METADATA_DIMENSIONS "dimensions"
+#define METADATA_N_TOTAL "n_total"
+#define METADATA_METRIC "metric"
+
 using namespace VCL;
 
 TDBDescriptorSet::TDBDescriptorSet(const std::string &filename)
@@ -74,69 +68,80 @@ void TDBDescriptorSet::train() {
   // tiledb::Array::consolidate(_tiledb_ctx, _set_path);
 }
 
-void TDBDescriptorSet::compute_distances(float *q, std::vector<float> &d,
-                                         std::vector<float> &data) {
-  size_t n = data.size() / _dimensions;
-
-  float *sub = new float[_dimensions * n];
+void TDBDescriptorSet::classify(float *descriptors, unsigned n, long *labels,
+                                unsigned quorum, VoteWeighting weighting) {
+  std::vector<float> distances(n * quorum);
+  std::vector<long> labels_aux(n * quorum);
 
-#ifdef USE_COMPUTE_MKL
+  search(descriptors, n, quorum, labels_aux.data(), distances.data());
 
-  // Intel MKL
-  // #pragma omp parallel for
-  for (int i = 0; i < n; ++i) {
-    size_t idx = i * _dimensions;
-    vsSub(_dimensions, q, data.data() + idx, sub + idx);
-    d[i] = std::pow(cblas_snrm2(_dimensions, sub + idx, 1), 2);
+  // From neighbor ids to their labels
+  for (long &idx : labels_aux) {
+    if (idx >= 0) // Means found
+      idx = idx < _label_ids.size() ? _label_ids[idx] : -1;
   }
-#endif
 
-#ifdef USE_COMPUTE_OMP
-// Using RAW OpenMP / This can be optimized
-#pragma omp parallel for
-  for (int i = 0; i < n; ++i) {
-    size_t idx = i * _dimensions;
+  for (int j = 0; j < n; ++j) {
+    labels[j] = vote(labels_aux.data() + quorum * j,
+                     distances.data() + quorum * j, quorum, weighting, _metric);
+  }
+}
 
-    float sum = 0;
-    // #pragma omp parallel for // has to be a reduction
-    for (int j = 0; j < _dimensions; ++j) {
-      sum += std::pow(data[idx + j] - q[j], 2);
-    }
+bool TDBDescriptorSet::read_array_metadata() {
+  tiledb::Array array(_ctx, _set_path, TILEDB_READ);
 
-    d[i] = sum; // std::sqrt(sum);
+  tiledb_datatype_t type;
+  if (!array.has_metadata(METADATA_N_TOTAL, &type)) {
+    array.close();
+    return false;
   }
-#endif
-  delete[] sub;
-}
 
-void TDBDescriptorSet::classify(float *descriptors, unsigned n, long *labels,
-                                unsigned quorum) {
-  float *distances = new float[n * quorum];
-  long *ids_aux = new long[n * quorum];
+  auto get = [&array](const std::string &key) {
+    tiledb_datatype_t type;
+    uint32_t num;
+    const void *value;
+    array.get_metadata(key, &type, &num, &value);
+    if (value == NULL || type != TILEDB_INT64 || num != 1)
+      throw VCLException(TileDBError, "Wrong metadata: " + key);
+    return *static_cast<const int64_t *>(value);
+  };
+
+  _dimensions = get(METADATA_DIMENSIONS);
+  _n_total = get(METADATA_N_TOTAL);
+  _metric = DistanceMetric(get(METADATA_METRIC));
+  array.close();
+
+  return true;
+}
 
-  search(descriptors, n, quorum, ids_aux, distances);
+void TDBDescriptorSet::write_array_metadata() {
+  int64_t dims = _dimensions;
+  int64_t n_total = _n_total;
+  int64_t metric = _metric;
 
-  for (int j = 0; j < n; ++j) {
+  tiledb::Array array(_ctx, _set_path, TILEDB_WRITE);
+  array.put_metadata(METADATA_DIMENSIONS, TILEDB_INT64, 1, &dims);
+  array.put_metadata(METADATA_N_TOTAL, TILEDB_INT64, 1, &n_total);
+  array.put_metadata(METADATA_METRIC, TILEDB_INT64, 1, &metric);
+  array.close();
+}
 
-    std::map<long, int> map_voting;
-    long winner = -1;
-    unsigned max = 0;
-    for (int i = 0; i < quorum; ++i) {
-      long idx = ids_aux[quorum * j + i];
-      if (idx < 0)
-        continue; // Means not found
-
-      long label_id = _label_ids.at(idx);
-      map_voting[label_id] += 1;
-      if (max < map_voting[label_id]) {
-        max = map_voting[label_id];
-        winner = label_id;
-      }
-    }
-    labels[j] = winner;
+std::vector<std::pair<uint64_t, uint64_t>>
+TDBDescriptorSet::id_ranges(const long *ids, unsigned n) {
+  std::vector<long> sorted(ids, ids + n);
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (long id : sorted) {
+    if (id < 0)
+      continue;
+    if (!ranges.empty() && uint64_t(id) <= ranges.back().second + 1)
+      ranges.back().second = id;
+    else
+      ranges.emplace_back(id, id);
   }
-  delete[] distances;
-  delete[] ids_aux;
+
+  return ranges;
 }
 
 void TDBDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
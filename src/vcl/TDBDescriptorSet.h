@@ -36,6 +36,7 @@
 
 #include <fstream>
 #include <map>
+#include <shared_mutex>
 #include <stdlib.h>
 #include <string>
 #include <vector>
@@ -55,17 +56,28 @@ class TDBDescriptorSet : public DescriptorSet::DescriptorSetData,
                          public TDBObject {
 
 protected:
-  const unsigned long MAX_DESC = 100000;
-  const unsigned long METADATA_OFFSET = MAX_DESC - 2;
+  // Sets created before the dimensions and number of descriptors moved
+  // to the array metadata keep them in cells of the array itself.
+  // Dense sets of that layout are limited to LEGACY_MAX_DESC descriptors.
+  const unsigned long LEGACY_MAX_DESC = 100000;
+  const unsigned long LEGACY_METADATA_OFFSET = LEGACY_MAX_DESC - 2;
 
   // this is caching data
   std::vector<long> _label_ids; // we need to move this
 
-  void compute_distances(float *q, DistanceData &d, DescBuffer &data);
-
   virtual void read_descriptor_metadata() = 0;
   virtual void write_descriptor_metadata() = 0;
 
+  // Dimensions, number of descriptors and metric, as TileDB
+  // array metadata. Returns false if the array has none (legacy layout).
+  bool read_array_metadata();
+  void write_array_metadata();
+
+  // Sorted ranges [first, second] of consecutive ids, covering ids,
+  // so a batch of ids can be read with one multi-range query.
+  static std::vector<std::pair<uint64_t, uint64_t>> id_ranges(const long *ids,
+                                                              unsigned n);
+
 public:
   /**
    *  Loads an existing collection located at collection_path
@@ -92,7 +104,7 @@ public:
                       long *descriptors, float *distances) = 0;
 
   virtual void classify(float *descriptors, unsigned n, long *labels,
-                        unsigned quorum);
+                        unsigned quorum, VoteWeighting weighting);
 
   virtual void get_descriptors(long *ids, unsigned n, float *descriptors);
 
@@ -106,10 +118,16 @@ class TDBDenseDescriptorSet : public TDBDescriptorSet {
 
 private:
   // This is for caching, accelerates searches fairly well.
+  // Sets larger than the cache limit are read in chunks on each search.
   bool _flag_buffer_updated;
   std::vector<float> _buffer;
 
+  // Number of descriptors the array domain can hold
+  uint64_t _capacity;
+
   void load_buffer();
+  void read_chunk(uint64_t start, uint64_t n, float *descriptors,
+                  long *labels);
   void read_descriptor_metadata();
   void write_descriptor_metadata();
 
@@ -127,18 +145,48 @@ public:
               float *distances);
 
   void get_descriptors(long *ids, unsigned n, float *descriptors);
+
+  void get_labels(long *ids, unsigned n, long *labels);
 };
 
 class TDBSparseDescriptorSet : public TDBDescriptorSet {
 
 private:
+  // IVF index, built by train(): the centroids are stored in a dense
+  // array, and the descriptors, grouped by nearest centroid (posting
+  // lists), in a sparse array with one tile per list. A search reads
+  // the _nprobe lists closest to the query. Until then, searches scan
+  // the whole set; add() trains it once the set reaches
+  // IVF_AUTO_TRAIN_SIZE descriptors. train() holds _ivf_lock
+  // exclusively, adds and reads hold it shared.
+  std::string _ivf_centroids_path;
+  std::string _ivf_lists_path;
+  unsigned _nlist; // 0 until trained
+  unsigned _nprobe;
+  std::vector<float> _centroids;
+  std::shared_mutex _ivf_lock;
+
   void read_descriptor_metadata();
   void write_descriptor_metadata();
 
-  void load_neighbors(float *query, unsigned k, std::vector<float> &descriptors,
+  void read_ivf();
+  void create_ivf();
+  void build_ivf(float *descriptors, unsigned n);
+  void add_to_ivf(const float *descriptors, unsigned n, const long *ids,
+                  const long *labels);
+
+  void load_all(std::vector<float> &descriptors, std::vector<long> &desc_ids,
+                std::vector<long> &desc_labels);
+
+  void load_neighbors(float *query, std::vector<float> &descriptors,
                       std::vector<long> &desc_ids,
                       std::vector<long> &desc_labels);
 
+  // Descriptors and labels of the given ids, in a single read.
+  // Either output can be NULL. Ids not found get -1 values.
+  void load_ids(const long *ids, unsigned n, float *descriptors,
+                long *labels);
+
   void search(float *query, unsigned n_queries, unsigned k, long *descriptors,
               float *distances, long *labels);
 
@@ -152,13 +200,24 @@ public:
 
   long add(float *descriptors, unsigned n_descriptors, long *classes);
 
+  /**
+   *  Builds the IVF index: clusters the given descriptors (or the ones
+   *  in the set, if none are given) and groups the descriptors of
+   *  the set by cluster. Training again rebuilds the index.
+   */
+  void train();
+  void train(float *descriptors, unsigned n);
+
   void search(float *query, unsigned n_queries, unsigned k, long *descriptors,
               float *distances);
 
-  void classify(float *descriptors, unsigned n, long *labels, unsigned quorum);
+  void classify(float *descriptors, unsigned n, long *labels, unsigned quorum,
+                VoteWeighting weighting);
 
   void get_descriptors(long *ids, unsigned n, float *descriptors);
 
   void get_labels(long *ids, unsigned n, long *labels);
+
+  void set_path(const std::string &set_path);
 };
 }; // namespace VCL
@@ -27,6 +27,7 @@
  *
  */
 
+#include <algorithm>
 #include <iostream>
 #include <stddef.h>
 #include <string>
@@ -36,6 +37,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <opencv2/imgproc.hpp>
+
 #include "TDBImage.h"
 #include "TDBObject.h"
 #include "vcl/VCL.h"
@@ -44,6 +47,9 @@ using namespace VCL;
 
 #define MAX_UCHAR 256
 
+// Group of the arrays of the pyramid levels, after the object id
+#define PYRAMID_GROUP "_levels/"
+
 /*  *********************** */
 /*        CONSTRUCTORS      */
 /*  *********************** */
@@ -54,6 +60,7 @@ TDBImage::TDBImage() : TDBObject() {
   _img_size = 0;
 
   _threshold = 0;
+  _levels = -1;
 
   set_num_dimensions(2);
   set_default_attributes();
@@ -69,6 +76,7 @@ TDBImage::TDBImage(const std::string &image_id) : TDBObject(image_id) {
   _img_size = 0;
 
   _threshold = 0;
+  _levels = -1;
 
   set_num_dimensions(2);
   set_default_attributes();
@@ -86,6 +94,7 @@ TDBImage::TDBImage(const std::string &image_id, RemoteConnection &connection)
   _img_size = 0;
 
   _threshold = 0;
+  _levels = -1;
 
   set_num_dimensions(2);
   set_default_attributes();
@@ -101,6 +110,7 @@ template <class T> TDBImage::TDBImage(T *buffer, long size) : TDBObject() {
   _img_size = size;
 
   _threshold = 0;
+  _levels = -1;
 
   set_num_dimensions(2);
   set_default_attributes();
@@ -196,6 +206,7 @@ void TDBImage::set_image_data_equal(const TDBImage &tdb) {
   _img_channels = tdb._img_channels;
   _img_size = tdb._img_size;
   _threshold = tdb._threshold;
+  _levels = tdb._levels;
 }
 
 TDBImage::~TDBImage() { delete[] _raw_data; }
@@ -245,22 +256,10 @@ cv::Mat TDBImage::get_cvmat() {
   if (_raw_data == NULL)
     read();
 
-  unsigned char *buffer = new unsigned char[_img_size];
-
-  std::memcpy(buffer, _raw_data, _img_size);
-
-  cv::Mat img_clone;
+  int type = _img_channels == 1 ? CV_8UC1 : CV_8UC3;
+  cv::Mat img(cv::Size(_img_width, _img_height), type, _raw_data);
 
-  if (_img_channels == 1) {
-    cv::Mat img(cv::Size(_img_width, _img_height), CV_8UC1, buffer);
-    img_clone = img.clone();
-  } else {
-    cv::Mat img(cv::Size(_img_width, _img_height), CV_8UC3, buffer);
-    img_clone = img.clone();
-  }
-
-  delete[] buffer;
-  return img_clone;
+  return img.clone();
 }
 
 template <class T> void TDBImage::get_buffer(T *buffer, long buffer_size) {
@@ -317,6 +316,7 @@ void TDBImage::write(const std::string &image_id, bool metadata) {
   }
 
   std::string array_name = namespace_setup(image_id);
+  delete_pyramid();
 
   std::vector<unsigned char> num_values;
   if (_num_attributes == 1 && _img_channels == 3)
@@ -331,6 +331,9 @@ void TDBImage::write(const std::string &image_id, bool metadata) {
 
   write_query.set_layout(TILEDB_ROW_MAJOR);
 
+  // Keeps the per-attribute buffers alive until the query is submitted
+  std::vector<cv::Mat> channels;
+
   if (_num_attributes == 1) {
     write_image_metadata(array);
     std::vector<uint64_t> subarray = {1, _img_height, 0, _img_width - 1};
@@ -338,20 +341,14 @@ void TDBImage::write(const std::string &image_id, bool metadata) {
     write_query.set_data_buffer(_attributes[0], _raw_data,
                                 _img_height * _img_width * _img_channels);
   } else {
-    size_t buffer_size = _img_height * _img_width;
-    unsigned char *blue_buffer = new unsigned char[buffer_size];
-    unsigned char *green_buffer = new unsigned char[buffer_size];
-    unsigned char *red_buffer = new unsigned char[buffer_size];
+    // One attribute per channel: de-interleave the pixels
+    cv::Mat img(cv::Size(_img_width, _img_height), CV_8UC3, _raw_data);
+    cv::split(img, channels);
 
-    int count = 0;
-    for (unsigned int i = 0; i < buffer_size; ++i) {
-      blue_buffer[i] = _raw_data[count];
-      green_buffer[i] = _raw_data[count + 1];
-      red_buffer[i] = _raw_data[count + 2];
-    }
-    write_query.set_data_buffer(_attributes[0], blue_buffer, buffer_size);
-    write_query.set_data_buffer(_attributes[1], green_buffer, buffer_size);
-    write_query.set_data_buffer(_attributes[2], red_buffer, buffer_size);
+    size_t buffer_size = _img_height * _img_width;
+    for (int i = 0; i < 3; ++i)
+      write_query.set_data_buffer(_attributes[i], channels[i].data,
+                                  buffer_size);
   }
 
   write_query.submit();
@@ -369,6 +366,7 @@ void TDBImage::write(const cv::Mat &cv_img, bool metadata) {
   if (tiledb::Object::object(_ctx, array_name).type() !=
       tiledb::Object::Type::Invalid)
     tiledb::Object::remove(_ctx, array_name);
+  delete_pyramid();
 
   set_dimension_lowerbounds(std::vector<uint64_t>{0, 0});
   set_dimension_upperbounds(std::vector<uint64_t>{(uint64_t)(cv_img.rows + 1),
@@ -399,44 +397,20 @@ void TDBImage::write(const cv::Mat &cv_img, bool metadata) {
   size_t buffer_size = _img_height * _img_width * _img_channels;
   _raw_data = new unsigned char[buffer_size];
 
+  // copyTo also handles images that are not continuous (e.g. ROIs)
+  cv::Mat raw(cv_img.size(), cv_img.type(), _raw_data);
+  cv_img.copyTo(raw);
+
+  std::vector<cv::Mat> channels;
+
   if (_num_attributes == 1) {
-    std::memcpy(_raw_data, cv_img.data, buffer_size);
     write_query.set_data_buffer(_attributes[0], _raw_data, buffer_size);
   } else {
-    std::vector<cv::Mat> channels(3);
-    cv::split(cv_img, channels);
-    size_t size = _img_height * _img_width;
-    unsigned char *blue_buffer = new unsigned char[size];
-    unsigned char *green_buffer = new unsigned char[size];
-    unsigned char *red_buffer = new unsigned char[size];
-
-    const unsigned char *bp;
-    for (unsigned int i = 0; i < _img_height; ++i) {
-      bp = channels[0].ptr<unsigned char>(i);
-      unsigned char *b = &blue_buffer[i * _img_width];
-      std::memcpy(b, bp, _img_width);
-    }
-
-    const unsigned char *gp;
-    for (int i = 0; i < _img_height; ++i) {
-      gp = channels[1].ptr<unsigned char>(i);
-      unsigned char *g = &green_buffer[i * _img_width];
-      std::memcpy(g, gp, _img_width);
-    }
-
-    const unsigned char *rp;
-    for (unsigned int i = 0; i < _img_height; ++i) {
-      rp = channels[2].ptr<unsigned char>(i);
-      unsigned char *r = &red_buffer[i * _img_width];
-      std::memcpy(r, rp, _img_width);
-    }
-    write_query.set_data_buffer(_attributes[0], blue_buffer, buffer_size);
-    write_query.set_data_buffer(_attributes[1], green_buffer, buffer_size);
-    write_query.set_data_buffer(_attributes[2], red_buffer, buffer_size);
+    cv::split(raw, channels);
 
-    delete[] blue_buffer;
-    delete[] green_buffer;
-    delete[] red_buffer;
+    size_t size = _img_height * _img_width;
+    for (int i = 0; i < 3; ++i)
+      write_query.set_data_buffer(_attributes[i], channels[i].data, size);
   }
 
   write_query.submit();
@@ -456,66 +430,139 @@ void TDBImage::read() {
 }
 
 void TDBImage::read(const Rectangle &rect) {
-  if (_raw_data == NULL) {
+  if (_raw_data == NULL && _img_height == 0)
+    read_image_metadata();
 
-    if (_img_height == 0)
-      read_image_metadata();
+  if (rect.x < 0 || rect.y < 0 || _img_height < rect.height + rect.y ||
+      _img_width < rect.width + rect.x)
+    throw VCLException(SizeMismatch, "Requested area is not within the image");
+
+  if (_raw_data == NULL) {
+    // Only the tiles of the area are read. Rows start at 1 (see
+    // write()), and the bounds are inclusive.
+    std::vector<uint64_t> subarray;
 
-    if (_img_height < rect.height + rect.y || _img_width < rect.width + rect.x)
-      throw VCLException(SizeMismatch,
-                         "Requested area is not within the image");
+    subarray.push_back(rect.y + 1);              // start row
+    subarray.push_back(rect.y + rect.height);    // end row
+    subarray.push_back(rect.x);                  // start column
+    subarray.push_back(rect.x + rect.width - 1); // end column
 
     _img_height = rect.height;
     _img_width = rect.width;
     _img_size = _img_height * _img_width * _img_channels;
 
-    std::vector<uint64_t> subarray;
-
-    subarray.push_back(rect.x);               // start row
-    subarray.push_back(rect.x + rect.height); // end row
-    subarray.push_back(rect.y);               // start column
-    subarray.push_back(rect.y + rect.width);  // end column
-
     read_from_tdb(subarray);
+  } else {
+    // Crop of the data already read
+    long row_size = _img_width * _img_channels;
+    long area_row_size = rect.width * _img_channels;
+    unsigned char *area = new unsigned char[rect.height * area_row_size];
+    for (int r = 0; r < rect.height; ++r)
+      std::memcpy(&area[r * area_row_size],
+                  &_raw_data[(rect.y + r) * row_size + rect.x * _img_channels],
+                  area_row_size);
+
+    delete[] _raw_data;
+    _raw_data = area;
+
+    _img_height = rect.height;
+    _img_width = rect.width;
+    _img_size = _img_height * _img_width * _img_channels;
   }
+
+  std::vector<uint64_t> values = {_img_height + 1, _img_width};
+  set_dimension_upperbounds(values);
 }
 
-void TDBImage::resize(const Rectangle &rect) {
-  if (_raw_data == NULL)
-    read();
+void TDBImage::read(const Rectangle &rect, const cv::Size &size) {
+  // The smallest level where the subset is still as large as the size
+  int level = 0;
+  if (_raw_data == NULL) {
+    if (_img_height == 0)
+      read_image_metadata();
 
-  int r, c;
+    int levels = n_levels();
+    while (level < levels) {
+      Rectangle area = level_area(rect, level + 1);
+      if (area.width < size.width || area.height < size.height)
+        break;
+      ++level;
+    }
+  }
 
-  int data_index = 0;
-  unsigned char *image_buffer =
-      new unsigned char[rect.height * rect.width * _img_channels];
-  memset(image_buffer, 0, rect.height * rect.width * _img_channels);
+  if (level == 0) {
+    read(rect);
+    return;
+  }
 
-  float row_ratio = _img_height / float(rect.height);
-  float column_ratio = _img_width / float(rect.width);
+  if (rect.x < 0 || rect.y < 0 || _img_height < rect.height + rect.y ||
+      _img_width < rect.width + rect.x)
+    throw VCLException(SizeMismatch, "Requested area is not within the image");
 
-  for (r = 0; r < rect.height; ++r) {
-    float scale_r = (r + 0.5) * row_ratio - 0.5;
+  TDBImage tdb;
+  setup_level(tdb, level);
+  tdb.read(level_area(rect, level));
 
-    for (c = 0; c < rect.width; ++c) {
-      float scale_c = (c + 0.5) * column_ratio - 0.5;
+  _raw_data = tdb._raw_data;
+  tdb._raw_data = NULL;
+  _array_dimension = tdb._array_dimension;
+  _tile_dimension = tdb._tile_dimension;
 
-      data_index = rect.width * r * _img_channels + c * _img_channels;
+  _img_height = tdb._img_height;
+  _img_width = tdb._img_width;
+  _img_channels = tdb._img_channels;
+  _img_size = _img_height * _img_width * _img_channels;
 
-      get_index_value(image_buffer, data_index, scale_r, scale_c);
-    }
+  std::vector<uint64_t> values = {_img_height + 1, _img_width};
+  set_dimension_upperbounds(values);
+}
+
+void TDBImage::resize(const Rectangle &rect) {
+  if (_raw_data == NULL) {
+    if (_img_height == 0)
+      read_image_metadata();
+    read(Rectangle(0, 0, _img_width, _img_height),
+         cv::Size(rect.width, rect.height));
   }
 
+  int type = _img_channels == 1 ? CV_8UC1 : CV_8UC3;
+  cv::Mat img(cv::Size(_img_width, _img_height), type, _raw_data);
+
+  // Bilinear, sampling at the centers of the pixels
+  cv::Mat resized;
+  cv::resize(img, resized, cv::Size(rect.width, rect.height), 0, 0,
+             cv::INTER_LINEAR);
+
   _img_height = rect.height;
   _img_width = rect.width;
   _img_size = _img_height * _img_width * _img_channels;
   std::vector<uint64_t> values = {_img_height + 1, _img_width};
   set_dimension_upperbounds(values);
 
+  delete[] _raw_data;
   _raw_data = new unsigned char[_img_size];
-  std::memcpy(_raw_data, image_buffer, _img_size);
+  std::memcpy(_raw_data, resized.data, _img_size);
+}
+
+void TDBImage::write_pyramid(int levels) {
+  cv::Mat level_img = get_cvmat();
+
+  for (int level = 1; level <= levels; ++level) {
+    if (level_img.rows < 2 || level_img.cols < 2)
+      break;
+
+    cv::Mat half;
+    cv::resize(level_img, half,
+               cv::Size((level_img.cols + 1) / 2, (level_img.rows + 1) / 2),
+               0, 0, cv::INTER_AREA);
 
-  delete[] image_buffer;
+    TDBImage tdb;
+    setup_level(tdb, level);
+    tdb.write(half);
+
+    level_img = half;
+    _levels = level;
+  }
 }
 
 void TDBImage::threshold(int value) {
@@ -543,6 +590,7 @@ void TDBImage::delete_image() {
   delete _raw_data;
   _raw_data = NULL;
   delete_object();
+  delete_pyramid();
 }
 
 /*  *********************** */
@@ -567,85 +615,6 @@ void TDBImage::get_tile_coordinates(int64_t *subarray, int current_row_tile,
   subarray[3] = column_end;
 }
 
-void TDBImage::get_index_value(unsigned char *image_buffer, int index,
-                               float scale_r, float scale_c) {
-  int column_left = floor(scale_c);
-  int column_right = floor(scale_c + 1);
-  int row_top = floor(scale_r);
-  int row_bottom = floor(scale_r + 1);
-
-  if (column_left < 0)
-    column_left = 0;
-  if (column_right > _img_width - 1)
-    column_right = _img_width - 1;
-
-  if (row_top < 0)
-    row_top = 0;
-  if (row_bottom > _img_height - 1)
-    row_bottom = _img_height - 1;
-
-  long top_left_index = get_index(row_top, column_left) * _img_channels;
-  long top_right_index = get_index(row_top, column_right) * _img_channels;
-  long bottom_left_index = get_index(row_bottom, column_left) * _img_channels;
-  long bottom_right_index = get_index(row_bottom, column_right) * _img_channels;
-
-  for (int x = 0; x < _img_channels; ++x) {
-    unsigned char top_left = _raw_data[top_left_index + x];
-    unsigned char top_right = _raw_data[top_right_index + x];
-    unsigned char bottom_left = _raw_data[bottom_left_index + x];
-    unsigned char bottom_right = _raw_data[bottom_right_index + x];
-
-    double top = linear_interpolation(column_left, top_left, column_right,
-                                      top_right, scale_c);
-    double bottom = linear_interpolation(column_left, bottom_left, column_right,
-                                         bottom_right, scale_c);
-    double middle =
-        linear_interpolation(row_top, top, row_bottom, bottom, scale_r);
-
-    // we want the middle of the pixel
-    unsigned char pixel_value = floor(middle + 0.5);
-    image_buffer[index + x] = pixel_value;
-  }
-}
-
-long TDBImage::get_index(int row, int column) const {
-  int tile_width = get_tile_width(column, _img_width / _tile_dimension[1]);
-  int tile_height = get_tile_height(row, _img_height / _tile_dimension[0]);
-
-  long tile_size = tile_width * tile_height;
-
-  long current_tile_row = row % long(_tile_dimension[0]);
-  long current_row_tile = row / long(_tile_dimension[0]);
-  long current_column_tile = column / long(_tile_dimension[1]);
-  long current_tile_column = column % long(_tile_dimension[1]);
-
-  long full_row_tile = _img_width * _tile_dimension[0];
-
-  long row_index =
-      current_row_tile * full_row_tile + current_tile_row * tile_width;
-  long column_index = current_column_tile * tile_size + current_tile_column;
-
-  return row_index + column_index;
-}
-
-int TDBImage::get_tile_height(int row, int number_tiles) const {
-  int tile_height = int(_tile_dimension[0]);
-
-  if (row / _tile_dimension[0] == (unsigned int)number_tiles)
-    tile_height = _img_height - (number_tiles)*_tile_dimension[0];
-
-  return tile_height;
-}
-
-int TDBImage::get_tile_width(int column, int number_tiles) const {
-  int tile_width = int(_tile_dimension[1]);
-
-  if (column / _tile_dimension[1] == (unsigned int)number_tiles)
-    tile_width = _img_width - (number_tiles)*_tile_dimension[1];
-
-  return tile_width;
-}
-
 /*  *********************** */
 /*   PRIVATE SET FUNCTIONS  */
 /*  *********************** */
@@ -682,6 +651,68 @@ std::string TDBImage::namespace_setup(const std::string &image_id) {
   return _group + _name;
 }
 
+/*  *********************** */
+/*         PYRAMID          */
+/*  *********************** */
+std::string TDBImage::level_id(int level) const {
+  return _group + _name + PYRAMID_GROUP + std::to_string(level);
+}
+
+// Levels are written from 1 on, one array each: the pyramid is as deep
+// as the number of arrays in its group.
+int TDBImage::n_levels() {
+  if (_levels >= 0)
+    return _levels;
+
+  _levels = 0;
+  std::string group = _group + _name + PYRAMID_GROUP;
+  if (tiledb::Object::object(_ctx, group).type() !=
+      tiledb::Object::Type::Group)
+    return _levels;
+
+  tiledb::ObjectIter iter(_ctx, group);
+  for (const auto &object : iter) {
+    if (object.type() == tiledb::Object::Type::Array)
+      ++_levels;
+  }
+  return _levels;
+}
+
+// Level l is ceil(height / 2^l) x ceil(width / 2^l). Its pixels that
+// are partly outside of rect are left out, so that the area never
+// covers more of the image than rect. The last ones of the level only
+// go past the image, and are kept when rect reaches its edge.
+Rectangle TDBImage::level_area(const Rectangle &rect, int level) const {
+  int scale = 1 << level;
+  int x = (rect.x + scale - 1) / scale;
+  int y = (rect.y + scale - 1) / scale;
+  int x_end = (rect.x + rect.width) / scale;
+  int y_end = (rect.y + rect.height) / scale;
+
+  if (uint64_t(rect.x + rect.width) == _img_width)
+    x_end = (_img_width + scale - 1) / scale;
+  if (uint64_t(rect.y + rect.height) == _img_height)
+    y_end = (_img_height + scale - 1) / scale;
+
+  return Rectangle(x, y, std::max(x_end - x, 0), std::max(y_end - y, 0));
+}
+
+void TDBImage::setup_level(TDBImage &tdb, int level) {
+  tdb._ctx = _ctx;
+  tdb._config = _config;
+  tdb._compressed = _compressed;
+  tdb._extent = _extent;
+  tdb.namespace_setup(level_id(level));
+}
+
+void TDBImage::delete_pyramid() {
+  std::string group = _group + _name + PYRAMID_GROUP;
+  if (tiledb::Object::object(_ctx, group).type() !=
+      tiledb::Object::Type::Invalid)
+    tiledb::Object::remove(_ctx, group);
+  _levels = 0;
+}
+
 /*  *********************** */
 /*   METADATA INTERACTION   */
 /*  *********************** */
@@ -759,13 +790,13 @@ void TDBImage::read_from_tdb(std::vector<uint64_t> subarray) {
 
     read_query.submit();
 
-    int count = 0;
-    for (int i = 0; i < buffer_size; ++i) {
-      _raw_data[count] = blue_buffer[i];
-      _raw_data[count + 1] = green_buffer[i];
-      _raw_data[count + 2] = red_buffer[i];
-      count += 3;
-    }
+    // Interleave the channels back into the raw data
+    std::vector<cv::Mat> channels = {
+        cv::Mat(_img_height, _img_width, CV_8UC1, blue_buffer),
+        cv::Mat(_img_height, _img_width, CV_8UC1, green_buffer),
+        cv::Mat(_img_height, _img_width, CV_8UC1, red_buffer)};
+    cv::Mat img(_img_height, _img_width, CV_8UC3, _raw_data);
+    cv::merge(channels, img);
 
     delete[] blue_buffer;
     delete[] green_buffer;
@@ -774,19 +805,3 @@ void TDBImage::read_from_tdb(std::vector<uint64_t> subarray) {
 
   array.close();
 }
-
-/*  *********************** */
-/*      MATH FUNCTIONS      */
-/*  *********************** */
-double TDBImage::linear_interpolation(double x1, double val1, double x2,
-                                      double val2, double x) {
-
-  if (x1 == x2)
-    return val1;
-
-  double value = val2 - val1;
-  double multiply = x - x1;
-  double divide = x2 - x1;
-
-  return val1 + (value / divide * multiply);
-}
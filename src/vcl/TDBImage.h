@@ -59,6 +59,9 @@ private:
   // threshold value
   int _threshold;
 
+  // Number of levels of the pyramid, -1 until listed
+  int _levels;
+
   // raw data of the image
   unsigned char *_raw_data;
   std::vector<unsigned char> _full_array;
@@ -209,6 +212,19 @@ public:
    */
   void read(const Rectangle &rect);
 
+  /**
+   *  Reads a subset of the raw data to be resized to the given size.
+   *    If the image has a pyramid, the subset is read from the smallest
+   *    level where it is at least as large as the size, so the data read
+   *    is smaller than the subset. Only the pixels of the level that lie
+   *    within the subset are read.
+   *
+   *  @param rect  A Rectangle structure containing the coordinates
+   *    and size of the subset of data to be read
+   *  @param size  The size the data will be resized to
+   */
+  void read(const Rectangle &rect, const cv::Size &size);
+
   /**
    *  Resizes the image to the height and width specified in
    *    the Rectangle using bilinear interpolation
@@ -219,6 +235,15 @@ public:
    */
   void resize(const Rectangle &rect);
 
+  /**
+   *  Writes the pyramid of the image: levels of half the height and
+   *    width of the previous one, stored as arrays of the
+   *    <object id>_levels group. Resizes read from them.
+   *
+   *  @param levels  The number of levels below the full image
+   */
+  void write_pyramid(int levels);
+
   /**
    *  Sets pixel values less than or equal to the specified
    *    value to zero
@@ -264,49 +289,6 @@ private:
   void get_tile_coordinates(int64_t *subarray, int current_column_tile,
                             int current_row_tile);
 
-  /**
-   *  Used for resizing, gets the value of the calculated index
-   *
-   *  @param  image_buffer  A buffer to store the resized image in
-   *  @param  index  The current index into the image_buffer
-   *  @param  scale_r  The row to be used to calculate the index into
-   *    the raw data
-   *  @param  scale_c  The column to be used to calculate the index into
-   *    the raw data
-   */
-  void get_index_value(unsigned char *image_buffer, int index, float scale_r,
-                       float scale_c);
-
-  /**
-   *  Used for resizing, calculates the index in the raw data where the
-   *    value found at [row, column] in the image can be found
-   *
-   *  @param  row  The row index
-   *  @param  column  The column index
-   *  @return  The index in the raw data where [row, column] is
-   */
-  long get_index(int row, int column) const;
-
-  /**
-   *  Used for resizing, calculates the height of the current tile (used
-   *    when the image height is not the same as the array height)
-   *
-   *  @param  row  The row index
-   *  @param  number_tiles  The number of row tiles in the image
-   *  @return  The height of the current tile
-   */
-  int get_tile_height(int row, int number_tiles) const;
-
-  /**
-   *  Used for resizing, calculates the width of the current tile (used
-   *    when the image width is not the same as the array width)
-   *
-   *  @param  column  The column index
-   *  @param  number_tiles  The number of column tiles in the image
-   *  @return  The width of the current tile
-   */
-  int get_tile_width(int column, int number_tiles) const;
-
   /*  *********************** */
   /*        SET FUNCTIONS     */
   /*  *********************** */
@@ -344,6 +326,48 @@ private:
    */
   std::string namespace_setup(const std::string &image_id);
 
+  /*  *********************** */
+  /*         PYRAMID          */
+  /*  *********************** */
+  /**
+   *  Gets the object id of a level of the pyramid
+   *
+   *  @param  level  The level, 1 being half the size of the image
+   *  @return  The object id of the level
+   */
+  std::string level_id(int level) const;
+
+  /**
+   *  Gets the number of levels of the pyramid, listed the first
+   *    time and then kept along with the image
+   *
+   *  @return  The number of levels below the full image
+   */
+  int n_levels();
+
+  /**
+   *  Gets the area of a level that lies within a subset of the image
+   *
+   *  @param  rect  The subset, in pixels of the full image
+   *  @param  level  The level
+   *  @return  The area, in pixels of the level
+   */
+  Rectangle level_area(const Rectangle &rect, int level) const;
+
+  /**
+   *  Sets up a TDBImage for a level of the pyramid, with the same
+   *    TileDB context and settings as this one
+   *
+   *  @param  tdb  An empty TDBImage
+   *  @param  level  The level
+   */
+  void setup_level(TDBImage &tdb, int level);
+
+  /**
+   *  Removes the pyramid of the image, if there is one
+   */
+  void delete_pyramid();
+
   /*  *********************** */
   /*   METADATA INTERACTION   */
   /*  *********************** */
@@ -372,21 +396,5 @@ private:
    *    to read
    */
   void read_from_tdb(std::vector<uint64_t> subarray);
-
-  /*  *********************** */
-  /*      MATH FUNCTIONS      */
-  /*  *********************** */
-  /**
-   *  Linearly interpolates two data points
-   *
-   *  @param  x1  The first reference point
-   *  @param  val1  The value at the first reference point
-   *  @param  x2  The second reference point
-   *  @param  val2  The value at the second reference point
-   *  @param  x  The desired point
-   *  @return  The value at the desired point
-   */
-  double linear_interpolation(double x1, double val1, double x2, double val2,
-                              double x);
 };
 }; // namespace VCL
@@ -27,6 +27,7 @@
  *
  */
 
+#include <algorithm>
 #include <cstring>
 #include <errno.h>
 #include <stddef.h>
@@ -383,9 +384,13 @@ void TDBObject::set_schema_dimensions(tiledb::ArraySchema &array_schema) {
   if (_extent == -1)
     find_tile_extents();
   else {
+    // The same extent in every dimension, at most the whole dimension
+    _array_dimension.clear();
     _tile_dimension.clear();
     for (int x = 0; x < _num_dimensions; ++x) {
-      _tile_dimension[x] = _extent;
+      uint64_t dimension = _upper_dimensions[x] - _lower_dimensions[x];
+      _array_dimension.push_back(dimension - _lower_dimensions[x]);
+      _tile_dimension.push_back(std::min<uint64_t>(_extent, dimension + 1));
     }
   }
 
@@ -27,6 +27,7 @@
  *
  */
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <iomanip>
@@ -34,7 +35,9 @@
 #include <numeric>
 #include <stdlib.h>
 #include <string>
+#include <unordered_map>
 
+#include "DistanceKernels.h"
 #include "TDBDescriptorSet.h"
 #include <tiledb/tiledb.h>
 
@@ -44,13 +47,75 @@
 #define DIMENSION_UPPER_LIMIT 10000
 #define DIMENSION_TILE_SIZE 250
 
+#define IVF_CENTROIDS_ARRAY "ivf_centroids"
+#define IVF_LISTS_ARRAY "ivf_lists"
+#define ATTRIBUTE_IVF_CENTROID "centroid"
+#define ATTRIBUTE_IVF_DESC "descriptor"
+#define DIMENSION_IVF_LIST "list"
+#define DIMENSION_IVF_ID "id"
+#define IVF_MAX_ID ((uint64_t(1) << 40) - 1)
+#define IVF_ID_TILE_SIZE 100000
+#define IVF_LIST_CAPACITY 1000
+#define IVF_MAX_NLIST 4096
+#define IVF_NPROBE 8
+#define IVF_TRAIN_POINTS_PER_LIST 64
+#define IVF_KMEANS_ITERATIONS 10
+// Size past which add() trains the IVF index, if train() was not called
+#define IVF_AUTO_TRAIN_SIZE 100000
+
+// Cells per read when the size of the result is not known
+#define READ_BATCH 10000
+
 using namespace VCL;
 
+namespace {
+
+// Reads the descriptors, ids and labels selected by query,
+// resubmitting it while the results do not fit in the buffers.
+template <typename IdType>
+void read_results(tiledb::Query &query, const std::string &desc_name,
+                  const std::string &id_name, unsigned dim,
+                  std::vector<float> &descriptors, std::vector<long> &ids,
+                  std::vector<long> &labels) {
+  descriptors.clear();
+  ids.clear();
+  labels.clear();
+
+  uint64_t batch = std::max<uint64_t>(
+      READ_BATCH, query.est_result_size(id_name) / sizeof(IdType));
+
+  std::vector<float> desc_buffer(batch * dim);
+  std::vector<IdType> id_buffer(batch);
+  std::vector<long> label_buffer(batch);
+
+  query.set_data_buffer(desc_name, desc_buffer);
+  query.set_data_buffer(id_name, id_buffer);
+  query.set_data_buffer(ATTRIBUTE_SPARSE_LABEL, label_buffer);
+
+  do {
+    query.submit();
+
+    uint64_t found = query.result_buffer_elements()[id_name].second;
+    descriptors.insert(descriptors.end(), desc_buffer.begin(),
+                       desc_buffer.begin() + found * dim);
+    ids.insert(ids.end(), id_buffer.begin(), id_buffer.begin() + found);
+    labels.insert(labels.end(), label_buffer.begin(),
+                  label_buffer.begin() + found);
+  } while (query.query_status() == tiledb::Query::Status::INCOMPLETE);
+}
+
+} // namespace
+
 TDBSparseDescriptorSet::TDBSparseDescriptorSet(const std::string &filename)
     : TDBDescriptorSet(filename) {
   _name = "unnecessary_name";
+  _ivf_centroids_path = _set_path + "/" + IVF_CENTROIDS_ARRAY;
+  _ivf_lists_path = _set_path + "/" + IVF_LISTS_ARRAY;
+  _nlist = 0;
+  _nprobe = IVF_NPROBE;
   TDBObject descriptorSetObject(_set_path);
   read_descriptor_metadata();
+  read_ivf();
 }
 
 TDBSparseDescriptorSet::TDBSparseDescriptorSet(const std::string &filename,
@@ -58,6 +123,11 @@ TDBSparseDescriptorSet::TDBSparseDescriptorSet(const std::string &filename,
                                                DistanceMetric metric)
     : TDBDescriptorSet(filename, dim) {
   _name = "unnecessary_name";
+  _ivf_centroids_path = _set_path + "/" + IVF_CENTROIDS_ARRAY;
+  _ivf_lists_path = _set_path + "/" + IVF_LISTS_ARRAY;
+  _nlist = 0;
+  _nprobe = IVF_NPROBE;
+  _metric = metric;
 
   std::vector<std::string> names;
   std::vector<float> uppers;
@@ -89,6 +159,10 @@ TDBSparseDescriptorSet::TDBSparseDescriptorSet(const std::string &filename,
 }
 
 void TDBSparseDescriptorSet::read_descriptor_metadata() {
+  if (read_array_metadata())
+    return;
+
+  // Legacy layout: metadata in a cell past the upper limit of the first dim
   tiledb::Array array(_ctx, _set_path, TILEDB_READ);
   _dimensions = array.schema().domain().ndim();
   std::vector<float> coords(_dimensions * 2, DIMENSION_UPPER_LIMIT);
@@ -111,28 +185,13 @@ void TDBSparseDescriptorSet::read_descriptor_metadata() {
 }
 
 void TDBSparseDescriptorSet::write_descriptor_metadata() {
-  std::vector<float> coords(_dimensions, DIMENSION_UPPER_LIMIT);
-  coords[0] += 1.0f;
-
-  long dims = _dimensions;
-  long n_total = _n_total;
-  tiledb::Array array(_ctx, _set_path, TILEDB_WRITE);
-  tiledb::Query query(_ctx, array);
-  query.set_layout(TILEDB_UNORDERED);
-  query.set_data_buffer(ATTRIBUTE_SPARSE_ID, &dims, 1);
-  query.set_data_buffer(ATTRIBUTE_SPARSE_LABEL, &n_total, 1);
-
-  query.set_data_buffer(TILEDB_COORDS, coords.data(), coords.size());
-
-  query.submit();
-
-  query.finalize();
-
-  array.close();
+  write_array_metadata();
 }
 
 long TDBSparseDescriptorSet::add(float *descriptors, unsigned int n,
                                  long *labels) {
+  std::shared_lock<std::shared_mutex> lock(_ivf_lock);
+
   try {
     std::vector<long> att_id(n);
     std::iota(att_id.begin(), att_id.end(), _n_total);
@@ -159,285 +218,387 @@ long TDBSparseDescriptorSet::add(float *descriptors, unsigned int n,
       query.finalize();
       array.close();
     }
+
+    if (_nlist > 0) {
+      add_to_ivf(descriptors, n, att_id.data(), labels_for_query);
+    }
   } catch (tiledb::TileDBError &e) {
     throw VCLException(UnsupportedOperation, "TileDBError, check logs");
   }
 
-  write_descriptor_metadata();
   _n_total += n;
-  return _n_total - n;
-}
+  write_descriptor_metadata();
+  long first = _n_total - n;
 
-void TDBSparseDescriptorSet::load_neighbors(float *q, unsigned k,
-                                            std::vector<float> &descriptors,
-                                            std::vector<long> &desc_ids,
-                                            std::vector<long> &desc_labels) {
-  bool flag_found = true;
-  long found = 0;
-  int attempt = 0;
+  bool untrained = _nlist == 0;
+  lock.unlock();
 
-  tiledb::Array array(_ctx, _set_path, TILEDB_READ);
-
-  while (found < k) {
-    // Calculate maximum buffer elements for the
-    // query results per attribute
+  // Searches would scan the whole set otherwise
+  if (untrained && _n_total >= IVF_AUTO_TRAIN_SIZE) {
+    std::unique_lock<std::shared_mutex> train_lock(_ivf_lock);
+    if (_nlist == 0)
+      build_ivf(NULL, 0);
+  }
 
-    std::vector<float> subarray(_dimensions * 2);
+  return first;
+}
 
-    float space = std::pow(2, 4 + attempt++);
+// IVF index
 
-    if (space >= (DIMENSION_UPPER_LIMIT - DIMENSION_LOWER_LIMIT) / 2) {
-      flag_found = false;
-      break;
-    }
+void TDBSparseDescriptorSet::read_ivf() {
+  if (tiledb::Object::object(_ctx, _ivf_centroids_path).type() !=
+      tiledb::Object::Type::Array) {
+    return; // Not trained
+  }
 
-#pragma omp parallel for
-    for (int i = 0; i < _dimensions; ++i) {
-      subarray[2 * i + 0] = (q[i] - space) > DIMENSION_LOWER_LIMIT
-                                ? (q[i] - space)
-                                : DIMENSION_LOWER_LIMIT;
-      subarray[2 * i + 1] = (q[i] + space) < DIMENSION_UPPER_LIMIT
-                                ? (q[i] + space)
-                                : DIMENSION_UPPER_LIMIT;
-    }
+  try {
+    tiledb::Array array(_ctx, _ivf_centroids_path, TILEDB_READ);
+    auto domain = array.schema().domain().dimension(0).domain<uint64_t>();
+    unsigned nlist = domain.second + 1;
 
-    // Create query
+    _centroids.resize(nlist * _dimensions);
 
     tiledb::Query query(_ctx, array);
-
-    descriptors.resize(query.est_result_size(TILEDB_COORDS));
-    desc_ids.resize(query.est_result_size(ATTRIBUTE_SPARSE_ID));
-    desc_labels.resize(query.est_result_size(ATTRIBUTE_SPARSE_LABEL));
     query.set_layout(TILEDB_ROW_MAJOR);
-    query.set_subarray(subarray)
-        .set_data_buffer(ATTRIBUTE_SPARSE_LABEL, desc_labels)
-        .set_data_buffer(ATTRIBUTE_SPARSE_ID, desc_ids)
-        .set_data_buffer(TILEDB_COORDS, descriptors);
-
+    query.set_subarray<uint64_t>({0, nlist - 1});
+    query.set_data_buffer(ATTRIBUTE_IVF_CENTROID, _centroids);
     query.submit();
+    array.close();
 
-    auto result_el = query.result_buffer_elements();
-    found = result_el[ATTRIBUTE_SPARSE_ID].second;
+    _nlist = nlist;
+  } catch (tiledb::TileDBError &e) {
+    throw VCLException(TileDBError, "Error: Reading IVF centroids");
+  }
+}
 
-    descriptors.resize(found * _dimensions);
-    desc_ids.resize(found);
-    desc_labels.resize(found);
+// Creates the IVF arrays for _nlist lists, replacing the previous ones,
+// and writes the centroids.
+void TDBSparseDescriptorSet::create_ivf() {
+  for (auto &path : {_ivf_centroids_path, _ivf_lists_path}) {
+    if (tiledb::Object::object(_ctx, path).type() ==
+        tiledb::Object::Type::Array)
+      tiledb::Object::remove(_ctx, path);
   }
 
+  tiledb::Domain centroids_domain(_ctx);
+  centroids_domain.add_dimension(tiledb::Dimension::create<uint64_t>(
+      _ctx, DIMENSION_IVF_LIST, {{0, _nlist - 1}}, _nlist));
+
+  tiledb::Attribute centroid =
+      tiledb::Attribute::create<float>(_ctx, ATTRIBUTE_IVF_CENTROID);
+  centroid.set_cell_val_num(_dimensions);
+
+  tiledb::ArraySchema centroids_schema(_ctx, TILEDB_DENSE);
+  centroids_schema.set_domain(centroids_domain);
+  centroids_schema.add_attribute(centroid);
+  tiledb::Array::create(_ivf_centroids_path, centroids_schema);
+
+  // One tile per list along the first dimension,
+  // so that reading a list only reads its own tiles.
+  tiledb::Domain lists_domain(_ctx);
+  lists_domain.add_dimension(tiledb::Dimension::create<uint64_t>(
+      _ctx, DIMENSION_IVF_LIST, {{0, _nlist - 1}}, 1));
+  lists_domain.add_dimension(tiledb::Dimension::create<uint64_t>(
+      _ctx, DIMENSION_IVF_ID, {{0, IVF_MAX_ID}}, IVF_ID_TILE_SIZE));
+
+  tiledb::Attribute descriptor =
+      tiledb::Attribute::create<float>(_ctx, ATTRIBUTE_IVF_DESC);
+  descriptor.set_cell_val_num(_dimensions);
+
+  tiledb::ArraySchema lists_schema(_ctx, TILEDB_SPARSE);
+  lists_schema.set_domain(lists_domain);
+  lists_schema.set_capacity(IVF_LIST_CAPACITY);
+  lists_schema.set_cell_order(TILEDB_ROW_MAJOR);
+  lists_schema.set_tile_order(TILEDB_ROW_MAJOR);
+  lists_schema.add_attribute(descriptor);
+  lists_schema.add_attribute(
+      tiledb::Attribute::create<long>(_ctx, ATTRIBUTE_SPARSE_LABEL));
+  tiledb::Array::create(_ivf_lists_path, lists_schema);
+
+  tiledb::Array array(_ctx, _ivf_centroids_path, TILEDB_WRITE);
+  tiledb::Query query(_ctx, array);
+  query.set_layout(TILEDB_ROW_MAJOR);
+  query.set_subarray<uint64_t>({0, _nlist - 1});
+  query.set_data_buffer(ATTRIBUTE_IVF_CENTROID, _centroids);
+  query.submit();
+  query.finalize();
   array.close();
-
-  if (flag_found == false) {
-    desc_ids.clear();
-    desc_labels.clear();
-    descriptors.clear();
-  }
 }
 
-void TDBSparseDescriptorSet::classify(float *descriptors, unsigned n,
-                                      long *labels, unsigned quorum) {
-  float *distances = new float[n * quorum];
-  long *ids_aux = new long[n * quorum];
-  long *labels_aux = new long[n * quorum];
+// Appends the descriptors to the list of their nearest centroid,
+// as a new fragment of the lists array.
+void TDBSparseDescriptorSet::add_to_ivf(const float *descriptors, unsigned n,
+                                        const long *ids, const long *labels) {
+  std::vector<long> nearest(n);
+  std::vector<float> distances(n);
+  DistanceKernels::knn(descriptors, n, _centroids.data(), _nlist, _dimensions,
+                       1, DistanceMetric::L2, nearest.data(),
+                       distances.data());
 
-  search(descriptors, n, quorum, ids_aux, distances, labels_aux);
+  std::vector<uint64_t> lists(nearest.begin(), nearest.end());
+  std::vector<uint64_t> list_ids(ids, ids + n);
 
-  for (int j = 0; j < n; ++j) {
+  tiledb::Array array(_ctx, _ivf_lists_path, TILEDB_WRITE);
+  tiledb::Query query(_ctx, array);
+  query.set_layout(TILEDB_UNORDERED);
+  query.set_data_buffer(DIMENSION_IVF_LIST, lists);
+  query.set_data_buffer(DIMENSION_IVF_ID, list_ids);
+  query.set_data_buffer(ATTRIBUTE_IVF_DESC, (float *)descriptors,
+                        n * _dimensions);
+  query.set_data_buffer(ATTRIBUTE_SPARSE_LABEL, (long *)labels, n);
+  query.submit();
+  query.finalize();
+  array.close();
+}
 
-    std::map<long, int> map_voting;
-    long winner = -1;
-    unsigned max = 0;
-    for (int i = 0; i < quorum; ++i) {
-      long idx = ids_aux[quorum * j + i];
-      if (idx < 0)
-        continue; // Means not found
-
-      long label_id = labels_aux[quorum * j + i];
-      map_voting[label_id] += 1;
-      if (max < map_voting[label_id]) {
-        max = map_voting[label_id];
-        winner = label_id;
-      }
-    }
-    labels[j] = winner;
-  }
-  delete[] distances;
-  delete[] ids_aux;
-  delete[] labels_aux;
+void TDBSparseDescriptorSet::train() { train(NULL, 0); }
+
+void TDBSparseDescriptorSet::train(float *descriptors, unsigned n) {
+  std::unique_lock<std::shared_mutex> lock(_ivf_lock);
+  build_ivf(descriptors, n);
 }
 
-void TDBSparseDescriptorSet::search(float *query, unsigned n, unsigned k,
-                                    long *ids, float *distances, long *labels) {
+// Expects _ivf_lock to be held exclusively, so that no descriptor is
+// added (or searched) while the lists are replaced.
+void TDBSparseDescriptorSet::build_ivf(float *descriptors, unsigned n) {
   std::vector<float> descs;
   std::vector<long> desc_ids;
   std::vector<long> desc_labels;
 
-  for (int i = 0; i < n; ++i) {
-
-    load_neighbors(query + i * _dimensions, k, descs, desc_ids, desc_labels);
+  try {
+    load_all(descs, desc_ids, desc_labels);
 
-    unsigned found = desc_ids.size();
-    std::vector<float> d(found);
-    std::vector<long> idxs(found);
+    if (descriptors == NULL || n == 0) {
+      descriptors = descs.data();
+      n = desc_ids.size();
+    }
 
-    compute_distances(query + i * _dimensions, d, descs);
+    if (n == 0) {
+      throw VCLException(UnsupportedOperation, "No descriptors to train on");
+    }
 
-    std::iota(idxs.begin(), idxs.end(), 0);
-    std::partial_sort(idxs.begin(), idxs.begin() + k, idxs.end(),
-                      [&d](size_t i1, size_t i2) { return d[i1] < d[i2]; });
+    _nlist = std::min<unsigned>(IVF_MAX_NLIST, std::max(1.0, std::sqrt(n)));
 
-    for (int j = 0; j < std::min(k, found); ++j) {
-      ids[i * k + j] = desc_ids[idxs[j]];
-      distances[i * k + j] = d[idxs[j]];
+    // Clustering on an evenly spread sample of the descriptors
+    size_t n_train =
+        std::min<size_t>(n, size_t(_nlist) * IVF_TRAIN_POINTS_PER_LIST);
+    std::vector<float> sample(n_train * _dimensions);
+    for (size_t i = 0; i < n_train; ++i) {
+      std::memcpy(&sample[i * _dimensions],
+                  descriptors + (i * n / n_train) * _dimensions,
+                  sizeof(float) * _dimensions);
     }
 
-    if (k > found) {
-      for (int j = found; j < k; ++j) {
-        ids[i * k + j] = -1;
-        distances[i * k + j] = -1;
-      }
-    }
+    _centroids.resize(_nlist * _dimensions);
+    DistanceKernels::kmeans(sample.data(), n_train, _dimensions, _nlist,
+                            IVF_KMEANS_ITERATIONS, _centroids.data());
 
-    // Include labels, needed for faster classify
-    // because it already gets the labels from the load_neighbor()
-    if (labels != NULL) {
-      for (int j = 0; j < std::min(k, found); ++j) {
-        labels[i * k + j] = desc_labels[idxs[j]];
-      }
+    create_ivf();
 
-      if (k > found) {
-        for (int j = found; j < k; ++j) {
-          labels[i * k + j] = -1;
-        }
-      }
+    if (!desc_ids.empty()) {
+      add_to_ivf(descs.data(), desc_ids.size(), desc_ids.data(),
+                 desc_labels.data());
     }
+  } catch (tiledb::TileDBError &e) {
+    _nlist = 0;
+    throw VCLException(TileDBError, "Error: Building IVF index");
   }
 }
 
-void TDBSparseDescriptorSet::search(float *query, unsigned n, unsigned k,
-                                    long *ids, float *distances) {
-  search(query, n, k, ids, distances, NULL);
-}
-
-void TDBSparseDescriptorSet::get_descriptors(long *ids, unsigned n,
-                                             float *descriptors) {
+void TDBSparseDescriptorSet::load_all(std::vector<float> &descriptors,
+                                      std::vector<long> &desc_ids,
+                                      std::vector<long> &desc_labels) {
+  // Leaves out the metadata cell, past the upper limit of the first dim.
   std::vector<float> subarray(_dimensions * 2);
-
-  float space = 20;
-
-#pragma omp parallel for
   for (int i = 0; i < _dimensions; ++i) {
     subarray[2 * i + 0] = DIMENSION_LOWER_LIMIT;
     subarray[2 * i + 1] = DIMENSION_UPPER_LIMIT;
   }
 
   tiledb::Array array(_ctx, _set_path, TILEDB_READ);
+  tiledb::Query query(_ctx, array);
+  query.set_layout(TILEDB_UNORDERED);
+  query.set_subarray(subarray);
 
-  std::vector<float> buffer;
+  read_results<long>(query, TILEDB_COORDS, ATTRIBUTE_SPARSE_ID, _dimensions,
+                     descriptors, desc_ids, desc_labels);
+  array.close();
+}
 
-  std::vector<long> desc_ids;
+// Loads the candidates for the neighbors of q: the descriptors in the
+// _nprobe lists closest to q, in a single query.
+void TDBSparseDescriptorSet::load_neighbors(float *q,
+                                            std::vector<float> &descriptors,
+                                            std::vector<long> &desc_ids,
+                                            std::vector<long> &desc_labels) {
+  unsigned nprobe = std::min(_nprobe, _nlist);
+  std::vector<long> lists(nprobe);
+  std::vector<float> distances(nprobe);
+  DistanceKernels::knn(q, 1, _centroids.data(), _nlist, _dimensions, nprobe,
+                       DistanceMetric::L2, lists.data(), distances.data());
+
+  tiledb::Array array(_ctx, _ivf_lists_path, TILEDB_READ);
+  tiledb::Subarray subarray(_ctx, array);
+  for (long list : lists) {
+    subarray.add_range<uint64_t>(0, list, list);
+  }
 
-  // Create query
   tiledb::Query query(_ctx, array);
-  desc_ids.resize(query.est_result_size(ATTRIBUTE_SPARSE_ID));
-  buffer.resize(query.est_result_size(TILEDB_COORDS));
-  query.set_layout(TILEDB_ROW_MAJOR);
+  query.set_layout(TILEDB_UNORDERED);
   query.set_subarray(subarray);
-  query.set_data_buffer(ATTRIBUTE_SPARSE_ID, desc_ids);
-  query.set_data_buffer(TILEDB_COORDS, buffer);
 
-  // Submit query
-  query.submit();
+  read_results<uint64_t>(query, ATTRIBUTE_IVF_DESC, DIMENSION_IVF_ID,
+                         _dimensions, descriptors, desc_ids, desc_labels);
+  array.close();
+}
+
+void TDBSparseDescriptorSet::classify(float *descriptors, unsigned n,
+                                      long *labels, unsigned quorum,
+                                      VoteWeighting weighting) {
+  std::vector<float> distances(n * quorum);
+  std::vector<long> ids_aux(n * quorum);
+  std::vector<long> labels_aux(n * quorum);
+
+  // Labels come along with the neighbors, -1 for the ones not found
+  search(descriptors, n, quorum, ids_aux.data(), distances.data(),
+         labels_aux.data());
+
+  for (int j = 0; j < n; ++j) {
+    labels[j] = vote(labels_aux.data() + quorum * j,
+                     distances.data() + quorum * j, quorum, weighting, _metric);
+  }
+}
 
-  // Print cell values (assumes all attributes are read)
-  auto result_el = query.result_buffer_elements();
-  unsigned n_found = result_el[ATTRIBUTE_SPARSE_ID].second;
+void TDBSparseDescriptorSet::search(float *query, unsigned n, unsigned k,
+                                    long *ids, float *distances, long *labels) {
+  std::vector<float> descs;
+  std::vector<long> desc_ids;
+  std::vector<long> desc_labels;
 
-  buffer.resize(n_found * _dimensions);
-  desc_ids.resize(n_found);
+  std::shared_lock<std::shared_mutex> lock(_ivf_lock);
 
-  // This is the worst algorithm ever, EVER.
-  // This is O(n), can be implemented using a binary search.
-  // We need to sort the desc_ids for this, need a trade off.
+  // Without the IVF index, every query goes through the whole set
+  bool exhaustive = _nlist == 0;
+
+  try {
+    if (exhaustive)
+      load_all(descs, desc_ids, desc_labels);
+  } catch (tiledb::TileDBError &e) {
+    throw VCLException(TileDBError, "Error: Reading Sparse array");
+  }
 
   for (int i = 0; i < n; ++i) {
-    long offset = i * _dimensions;
-    long id_q = ids[i];
-    bool found = false;
 
-    for (int j = 0; j < desc_ids.size(); ++j) {
-      if (id_q == desc_ids[j]) {
-        std::memcpy(descriptors + offset, &buffer[j * _dimensions],
-                    sizeof(float) * _dimensions);
-        found = true;
-        break;
+    if (!exhaustive) {
+      try {
+        load_neighbors(query + i * _dimensions, descs, desc_ids, desc_labels);
+      } catch (tiledb::TileDBError &e) {
+        throw VCLException(TileDBError, "Error: Reading IVF lists");
       }
     }
 
-    if (found) {
-      continue;
+    unsigned found = desc_ids.size();
+    std::vector<long> idxs(k);
+
+    // Padded with -1 ids when fewer than k neighbors were found
+    DistanceKernels::knn(query + i * _dimensions, 1, descs.data(), found,
+                         _dimensions, k, _metric, idxs.data(),
+                         distances + i * k);
+
+    for (int j = 0; j < k; ++j) {
+      if (idxs[j] >= 0) {
+        ids[i * k + j] = desc_ids[idxs[j]];
+      } else {
+        ids[i * k + j] = -1;
+        distances[i * k + j] = -1;
+      }
     }
 
-    for (int j = 0; j < _dimensions; ++j) {
-      descriptors[offset + j] = -1;
+    // Include labels, needed for faster classify
+    // because it already gets the labels from the load_neighbor()
+    if (labels != NULL) {
+      for (int j = 0; j < k; ++j) {
+        labels[i * k + j] = idxs[j] >= 0 ? desc_labels[idxs[j]] : -1;
+      }
     }
   }
 }
 
-void TDBSparseDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
-  std::vector<float> subarray(_dimensions * 2);
-
-#pragma omp parallel for
-  for (int i = 0; i < _dimensions; ++i) {
-    subarray[2 * i + 0] = DIMENSION_LOWER_LIMIT;
-    subarray[2 * i + 1] = DIMENSION_UPPER_LIMIT;
-  }
-
-  tiledb::Array array(_ctx, _set_path, TILEDB_READ);
-
-  // auto max_sizes = array.max_buffer_elements(subarray);
+void TDBSparseDescriptorSet::search(float *query, unsigned n, unsigned k,
+                                    long *ids, float *distances) {
+  search(query, n, k, ids, distances, NULL);
+}
 
-  // Create query
-  tiledb::Query query(_ctx, array);
+void TDBSparseDescriptorSet::load_ids(const long *ids, unsigned n,
+                                      float *descriptors, long *labels) {
+  std::vector<float> descs;
   std::vector<long> desc_ids;
   std::vector<long> desc_labels;
-  desc_ids.resize(query.est_result_size(ATTRIBUTE_SPARSE_ID));
-  desc_labels.resize(query.est_result_size(ATTRIBUTE_SPARSE_LABEL));
 
-  query.set_layout(TILEDB_ROW_MAJOR).set_subarray(subarray);
-  query.set_data_buffer(ATTRIBUTE_SPARSE_LABEL, desc_labels);
-  query.set_data_buffer(ATTRIBUTE_SPARSE_ID, desc_ids);
+  std::shared_lock<std::shared_mutex> lock(_ivf_lock);
 
-  // Submit query
-  query.submit();
+  try {
+    if (_nlist == 0) {
+      // Ids are not a dimension of the set array: scan it once
+      load_all(descs, desc_ids, desc_labels);
+    } else {
+      // Ids are a dimension of the lists, read the ranges of ids
+      // across all the lists in one query.
+      tiledb::Array array(_ctx, _ivf_lists_path, TILEDB_READ);
+      tiledb::Subarray subarray(_ctx, array);
+      subarray.add_range<uint64_t>(0, 0, _nlist - 1);
+      for (auto &range : id_ranges(ids, n)) {
+        subarray.add_range<uint64_t>(1, range.first, range.second);
+      }
 
-  // Print cell values (assumes all attributes are read)
-  auto result_el = query.result_buffer_elements();
-  unsigned n_found = result_el[ATTRIBUTE_SPARSE_ID].second;
+      tiledb::Query query(_ctx, array);
+      query.set_layout(TILEDB_UNORDERED);
+      query.set_subarray(subarray);
 
-  desc_ids.resize(n_found);
-  desc_labels.resize(n_found);
+      read_results<uint64_t>(query, ATTRIBUTE_IVF_DESC, DIMENSION_IVF_ID,
+                             _dimensions, descs, desc_ids, desc_labels);
+      array.close();
+    }
+  } catch (tiledb::TileDBError &e) {
+    throw VCLException(TileDBError, "Error: Reading Sparse array");
+  }
 
-  // This is the worst algo ever, EVER.
-  // This is O(n), can be implemented using a binary search.
-  // We need to sort the desc_ids for this, need a trade off.
+  std::unordered_map<long, size_t> position;
+  position.reserve(desc_ids.size());
+  for (size_t j = 0; j < desc_ids.size(); ++j) {
+    position[desc_ids[j]] = j;
+  }
 
   for (int i = 0; i < n; ++i) {
-    long offset = i * _dimensions;
-    long id_q = ids[i];
-    bool found = false;
-
-    for (int j = 0; j < desc_ids.size(); ++j) {
-      if (id_q == desc_ids[j]) {
-        labels[i] = desc_labels[j];
-        found = true;
-        break;
-      }
-    }
+    auto it = position.find(ids[i]);
+    bool found = it != position.end();
 
-    if (found) {
-      continue;
+    if (descriptors != NULL) {
+      float *desc = descriptors + i * _dimensions;
+      if (found)
+        std::memcpy(desc, &descs[it->second * _dimensions],
+                    sizeof(float) * _dimensions);
+      else
+        std::fill(desc, desc + _dimensions, -1);
     }
 
-    labels[i] = -1;
+    if (labels != NULL)
+      labels[i] = found ? desc_labels[it->second] : -1;
   }
 }
+
+void TDBSparseDescriptorSet::get_descriptors(long *ids, unsigned n,
+                                             float *descriptors) {
+  load_ids(ids, n, descriptors, NULL);
+}
+
+void TDBSparseDescriptorSet::get_labels(long *ids, unsigned n, long *labels) {
+  load_ids(ids, n, NULL, labels);
+}
+
+void TDBSparseDescriptorSet::set_path(const std::string &set_path) {
+  std::unique_lock<std::shared_mutex> lock(_ivf_lock);
+  _set_path = set_path;
+  _ivf_centroids_path = _set_path + "/" + IVF_CENTROIDS_ARRAY;
+  _ivf_lists_path = _set_path + "/" + IVF_LISTS_ARRAY;
+}
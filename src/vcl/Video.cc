@@ -29,11 +29,17 @@
 
 #include <algorithm>
 #include <fstream>
+#include <numeric>
 
 #include "../VDMSConfig.h"
 #include "VDMSConfigHelper.h"
 #include "vcl/Video.h"
 
+// x264 places a key frame at least every 250 frames by default. Frames
+// farther ahead are reached by seeking, which decodes from the key frame
+// before them, and closer ones by decoding forward.
+#define FRAME_SEEK_DISTANCE 250
+
 using namespace VCL;
 
 /*  *********************** */
@@ -154,30 +160,96 @@ cv::Mat Video::get_frame(unsigned frame_number, bool performOp) {
 }
 
 std::vector<cv::Mat> Video::get_frames(std::vector<unsigned> frame_list) {
-  std::vector<cv::Mat> image_list;
+  std::vector<cv::Mat> image_list(frame_list.size());
 
-  if (frame_list.size() < 1) {
-    return image_list;
-  }
+  decode_frames(frame_list,
+                [&](size_t i, cv::Mat &frame) { image_list[i] = frame; });
 
-  if (_key_frame_decoder == nullptr) {
-    // Key frame information is not available: video will be decoded using
-    // OpenCV.
-    for (const auto &f : frame_list)
-      image_list.push_back(get_frame(f));
-  } else {
-    // Key frame information is set, video will be partially decoded using
-    // _key_frame_decoder object.
+  return image_list;
+}
 
-    EncodedFrameList list = _key_frame_decoder->decode(frame_list);
+void Video::decode_frames(const std::vector<unsigned> &frame_list,
+                          std::function<void(size_t, cv::Mat &)> consumer) {
+  if (frame_list.empty())
+    return;
+
+  // Positions in frame_list, by frame number
+  std::vector<size_t> order(frame_list.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return frame_list[a] < frame_list[b];
+  });
+
+  // A frame requested more than once is decoded once, and each consumer
+  // gets its own copy.
+  auto deliver = [&](size_t &pos, cv::Mat &frame) {
+    unsigned frame_number = frame_list[order[pos]];
+    size_t first = pos;
+    while (pos < order.size() && frame_list[order[pos]] == frame_number) {
+      cv::Mat copy = pos == first ? frame : frame.clone();
+      consumer(order[pos++], copy);
+    }
+  };
+
+  if (_key_frame_decoder != nullptr) {
+    std::vector<unsigned> frames;
+    for (auto i : order) {
+      if (frames.empty() || frames.back() != frame_list[i])
+        frames.push_back(frame_list[i]);
+    }
+
+    EncodedFrameList list = _key_frame_decoder->decode(frames);
+    if (list.size() != frames.size())
+      throw VCLException(OutOfBounds, "Frame requested is out of bounds");
 
-    for (const auto &f : list) {
+    size_t pos = 0;
+    for (auto &f : list) {
       VCL::Image tmp((void *)&f[0], f.length());
-      image_list.push_back(tmp.get_cvmat());
+      cv::Mat frame = tmp.get_cvmat();
+      deliver(pos, frame);
     }
+    return;
   }
 
-  return image_list;
+  perform_operations();
+  if (frame_list[order.back()] >= _size.frame_count)
+    throw VCLException(OutOfBounds, "Frame requested is out of bounds");
+
+  cv::VideoCapture inputVideo(_video_id);
+
+  // Number of the frame read next
+  unsigned next = 0;
+
+  size_t pos = 0;
+  while (pos < order.size()) {
+    unsigned frame_number = frame_list[order[pos]];
+
+    if (frame_number - next > FRAME_SEEK_DISTANCE) {
+      if (!inputVideo.set(cv::CAP_PROP_POS_FRAMES, frame_number)) {
+        throw VCLException(UnsupportedOperation, "Set the frame index failed");
+      }
+      next = frame_number;
+    }
+
+    // Decodes the frames in between, without converting them
+    for (; next < frame_number; ++next) {
+      if (!inputVideo.grab()) {
+        throw VCLException(UnsupportedOperation,
+                           "Frame requested cannot be read");
+      }
+    }
+
+    cv::Mat frame;
+    if (!inputVideo.read(frame)) {
+      throw VCLException(UnsupportedOperation,
+                         "Frame requested cannot be read");
+    }
+    ++next;
+
+    deliver(pos, frame);
+  }
+
+  inputVideo.release();
 }
 
 long Video::get_frame_count(bool performOp) {
@@ -0,0 +1,176 @@
+/**
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "ContentStore.h"
+#include "gtest/gtest.h"
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+using namespace VDMS;
+
+namespace fs = std::filesystem;
+
+static const std::string cas_root = "cas_test";
+
+static void write_file(const std::string &path, const std::string &data) {
+  std::ofstream file(path, std::ios::binary);
+  file << data;
+}
+
+TEST(ContentStore, key) {
+  std::string blob(1000, 'a');
+  std::string other(1000, 'b');
+
+  EXPECT_EQ(ContentStore::key(blob, ""), ContentStore::key(blob, ""));
+  EXPECT_NE(ContentStore::key(blob, ""), ContentStore::key(other, ""));
+  EXPECT_NE(ContentStore::key(blob, ""), ContentStore::key(blob, "png"));
+
+  // SHA-256, then the size, separated
+  std::string key = ContentStore::key(blob, "");
+  EXPECT_EQ(key.find('-'), (size_t)64);
+  EXPECT_EQ(key.substr(65), "3e8");
+}
+
+TEST(ContentStore, image_salt) {
+  Json::Value resize;
+  resize["type"] = "resize";
+  resize["width"] = 100;
+  resize["height"] = 100;
+
+  Json::Value ops;
+  ops.append(resize);
+
+  std::string salt_png, salt_jpg;
+  EXPECT_TRUE(ContentStore::image_salt(ops, "png", salt_png));
+  EXPECT_TRUE(ContentStore::image_salt(ops, "jpg", salt_jpg));
+  EXPECT_NE(salt_png, salt_jpg);
+
+  // Remote operations may not give the same image each time
+  Json::Value remote;
+  remote["type"] = "remoteOp";
+  ops.append(remote);
+
+  std::string salt;
+  EXPECT_FALSE(ContentStore::image_salt(ops, "png", salt));
+}
+
+TEST(ContentStore, reference_counting) {
+  fs::remove_all(cas_root);
+
+  std::string blob(1000, 'a');
+  std::string key = ContentStore::key(blob, "");
+
+  bool stored = true;
+  std::string first = ContentStore::reference(cas_root, key, "bin", blob, stored);
+  EXPECT_FALSE(stored);
+  write_file(first, blob);
+  ContentStore::commit(first);
+
+  std::string second = ContentStore::reference(cas_root, key, "bin", blob, stored);
+  EXPECT_TRUE(stored);
+  EXPECT_NE(first, second);
+  EXPECT_TRUE(fs::equivalent(first, second));
+
+  // Two references and the object
+  EXPECT_EQ(fs::hard_link_count(second), 3);
+
+  fs::remove(first);
+  ContentStore::release(first);
+  EXPECT_EQ(fs::hard_link_count(second), 2);
+
+  fs::remove(second);
+  ContentStore::release(second);
+
+  // The object is removed with its last reference
+  stored = true;
+  std::string third = ContentStore::reference(cas_root, key, "bin", blob, stored);
+  EXPECT_FALSE(stored);
+
+  fs::remove_all(cas_root);
+}
+
+TEST(ContentStore, different_content_not_linked) {
+  fs::remove_all(cas_root);
+
+  std::string blob(1000, 'a');
+  std::string other(1000, 'b');
+  std::string key = ContentStore::key(blob, "");
+
+  // Other content stored under the key of blob, as a collision would
+  bool stored = true;
+  std::string first = ContentStore::reference(cas_root, key, "bin", other,
+                                              stored);
+  EXPECT_FALSE(stored);
+  write_file(first, other);
+  ContentStore::commit(first);
+
+  std::string second = ContentStore::reference(cas_root, key, "bin", blob,
+                                               stored);
+  EXPECT_FALSE(stored);
+  EXPECT_FALSE(fs::exists(second));
+  EXPECT_EQ(fs::hard_link_count(first), 2);
+
+  fs::remove_all(cas_root);
+}
+
+TEST(ContentStore, release_other_files) {
+  fs::create_directories(cas_root);
+  std::string path = cas_root + "/not_a_reference.bin";
+  write_file(path, "data");
+
+  ContentStore::release(path);
+  EXPECT_TRUE(fs::exists(path));
+
+  // Names with two dots under the store are not references
+  // unless they follow its layout
+  std::string dir = cas_root + "/cas/ab/";
+  fs::create_directories(dir);
+  write_file(dir + "photo.jpg", "data");
+  ContentStore::release(dir + "photo.v2.jpg");
+  EXPECT_TRUE(fs::exists(dir + "photo.jpg"));
+
+  // A reference is under the first two digits of its key
+  std::string key = ContentStore::key("data", "");
+  std::string other_dir = cas_root + "/cas/" +
+                          (key.substr(0, 2) == "00" ? "01" : "00") + "/";
+  fs::create_directories(other_dir);
+  write_file(other_dir + key + ".bin", "data");
+  ContentStore::release(other_dir + key + ".1f.bin");
+  EXPECT_TRUE(fs::exists(other_dir + key + ".bin"));
+
+  std::string key_dir = cas_root + "/cas/" + key.substr(0, 2) + "/";
+  fs::create_directories(key_dir);
+  write_file(key_dir + key + ".bin", "data");
+  ContentStore::release(key_dir + key + ".1f.bin");
+  EXPECT_FALSE(fs::exists(key_dir + key + ".bin"));
+
+  fs::remove_all(cas_root);
+}
@@ -29,13 +29,16 @@
  *
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <list>
+#include <thread>
 
 #include "helpers.h"
 #include "vcl/VCL.h"
@@ -89,20 +92,29 @@ TEST(Descriptors_Add, add_and_radius_search_flatl2_100d) {
 
   index.add(xb, nb);
 
-  long *desc_ids = new long[20];
-  float *distances = new float[20];
+  std::vector<long> desc_ids;
+  std::vector<float> distances;
   index.radius_search(xb, 2000, desc_ids, distances);
 
-  int exp = 0;
-
   float results[] = {float(std::pow(0, 2) * d), float(std::pow(1, 2) * d),
-                     float(std::pow(2, 2) * d), float(std::pow(3, 2) * d)};
+                     float(std::pow(2, 2) * d), float(std::pow(3, 2) * d),
+                     float(std::pow(4, 2) * d)};
 
-  for (int i = 0; i < 4; ++i) {
-    // std::cout << distances[i] <<  " ";
+  ASSERT_EQ(desc_ids.size(), 5);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(desc_ids[i], i);
     EXPECT_EQ(distances[i], results[i]);
   }
-  // std::cout << std::endl;
+
+  // Bounded, and without the removed descriptors
+  index.remove(&desc_ids[1], 1);
+  index.radius_search(xb, 2000, desc_ids, distances, 3);
+
+  ASSERT_EQ(desc_ids.size(), 3);
+  EXPECT_EQ(desc_ids[0], 0);
+  EXPECT_EQ(desc_ids[1], 2);
+  EXPECT_EQ(desc_ids[2], 3);
+  EXPECT_EQ(distances[1], results[2]);
 
   index.store();
 
@@ -738,6 +750,40 @@ TEST(Descriptors_Add, add_tiledbdense_100d_2add) {
   delete[] xb;
 }
 
+TEST(Descriptors_Add, add_tiledbdense_4d_over_100k) {
+  int d = 4;
+  int nb = 150000;
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  std::string index_filename = "dbs/add_tiledbdense_4d_over_100k";
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::TileDBDense);
+    index.add(xb, nb);
+    index.store();
+  }
+
+  VCL::DescriptorSet index(index_filename);
+  EXPECT_EQ(index.get_n_descriptors(), nb);
+  EXPECT_EQ(index.get_dimensions(), d);
+
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  index.search(xb + (nb - 1) * d, 1, 2, desc_ids, distances);
+
+  EXPECT_EQ(desc_ids[0], nb - 1);
+  EXPECT_EQ(desc_ids[1], nb - 2);
+  EXPECT_EQ(distances[0], 0);
+
+  std::vector<float> desc(d);
+  long id = nb - 1;
+  index.get_descriptors(&id, 1, desc.data());
+  for (int i = 0; i < d; ++i) {
+    EXPECT_EQ(desc[i], xb[(nb - 1) * d + i]);
+  }
+
+  delete[] xb;
+}
+
 // TileDB Sparse
 
 // #define TDB_SPARSE
@@ -1180,3 +1226,403 @@ TEST(Descriptors_Add, add_and_get_descriptors) {
     delete[] xb;
   }
 }
+
+TEST(Descriptors_Add, add_and_get_descriptors_batch) {
+  int d = 16;
+  int nb = 10000;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  // Unsorted, with repeated and consecutive ids
+  std::vector<long> ids = {9000, 3, 3, 500, 4, 9999, 0, 501};
+
+  for (auto eng : get_engines()) {
+    std::string index_filename =
+        "dbs/add_and_get_descriptors_batch_" + std::to_string(eng);
+
+    VCL::DescriptorSet index(index_filename, unsigned(d), eng);
+    index.add(xb, nb);
+
+    int rounds = eng == VCL::TileDBSparse ? 2 : 1;
+    for (int r = 0; r < rounds; ++r) {
+      // Second round reads through the IVF lists
+      if (r == 1)
+        index.train();
+
+      std::vector<float> recons(ids.size() * d);
+      index.get_descriptors(ids, recons.data());
+
+      for (int i = 0; i < ids.size(); ++i) {
+        for (int j = 0; j < d; ++j) {
+          EXPECT_NEAR(xb[ids[i] * d + j], recons[i * d + j], .01f);
+        }
+      }
+    }
+
+    index.store();
+  }
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Add, remove_update_compact) {
+  int d = 16;
+  int nb = 1000;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  std::vector<VCL::DescriptorSetEngine> engs = {
+      VCL::FaissFlat, VCL::FaissIVFFlat, VCL::TileDBDense, VCL::TileDBSparse};
+
+  for (auto eng : engs) {
+    std::string index_filename =
+        "dbs/remove_update_compact_" + std::to_string(eng);
+
+    std::vector<long> ids;
+    std::vector<float> distances;
+
+    {
+      VCL::DescriptorSet index(index_filename, unsigned(d), eng);
+      index.add(xb, nb);
+      // Trained with the descriptors, not the zero padding of the first add
+      if (eng == VCL::FaissIVFFlat)
+        index.train(xb, nb);
+
+      long removed[] = {10, 20};
+      index.remove(removed, 2);
+      EXPECT_EQ(index.get_n_descriptors(), nb - 2);
+      EXPECT_NEAR(index.removed_ratio(), 2.0 / nb, 1e-6);
+
+      index.search(xb + 10 * d, 1, 1, ids, distances);
+      EXPECT_NE(ids[0], 10);
+
+      // Id 30 moves to the descriptor of 500
+      index.update(30, xb + 500 * d);
+      index.search(xb + 30 * d, 1, 1, ids, distances);
+      EXPECT_NE(ids[0], 30);
+      index.search(xb + 500 * d, 1, 2, ids, distances);
+      std::sort(ids.begin(), ids.end());
+      EXPECT_EQ(ids[0], 30);
+      EXPECT_EQ(ids[1], 500);
+
+      // Nothing is removed if one of the ids does not exist
+      long missing[] = {11, 10};
+      EXPECT_THROW(index.remove(missing, 2), VCL::Exception);
+
+      index.compact();
+      EXPECT_EQ(index.removed_ratio(), 0);
+      EXPECT_EQ(index.get_n_descriptors(), nb - 2);
+      if (eng == VCL::FaissIVFFlat)
+        EXPECT_TRUE(index.is_trained());
+
+      index.search(xb + 11 * d, 1, 1, ids, distances);
+      EXPECT_EQ(ids[0], 11);
+      index.search(xb + 999 * d, 1, 1, ids, distances);
+      EXPECT_EQ(ids[0], 999);
+
+      std::vector<float> recons(d);
+      index.get_descriptors(&ids[0], 1, recons.data());
+      for (int j = 0; j < d; ++j) {
+        EXPECT_NEAR(xb[999 * d + j], recons[j], .01f);
+      }
+
+      index.store();
+    }
+
+    VCL::DescriptorSet index(index_filename);
+    index.search(xb + 500 * d, 1, 2, ids, distances);
+    std::sort(ids.begin(), ids.end());
+    EXPECT_EQ(ids[0], 30);
+    EXPECT_EQ(ids[1], 500);
+
+    // New ids do not reuse the removed ones
+    EXPECT_EQ(index.add(xb + 10 * d, 1), nb);
+  }
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Add, compact_recovery) {
+  int d = 16;
+  int nb = 100;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+  std::string index_filename = "dbs/compact_recovery";
+
+  std::vector<long> ids;
+  std::vector<float> distances;
+
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat);
+    index.add(xb, nb);
+    index.store();
+  }
+
+  // Crash between the renames of compact(), with the new set built
+  std::filesystem::remove_all(index_filename + ".old");
+  std::filesystem::rename(index_filename, index_filename + ".old");
+  std::filesystem::create_directory(index_filename + ".compact");
+
+  {
+    VCL::DescriptorSet index(index_filename);
+    EXPECT_EQ(index.get_n_descriptors(), nb);
+    index.search(xb + 42 * d, 1, 1, ids, distances);
+    EXPECT_EQ(ids[0], 42);
+  }
+  EXPECT_FALSE(std::filesystem::exists(index_filename + ".old"));
+  EXPECT_FALSE(std::filesystem::exists(index_filename + ".compact"));
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Add, remove_update_without_store) {
+  int d = 16;
+  int nb = 1000;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+  std::string index_filename = "dbs/remove_update_without_store";
+
+  std::vector<long> ids;
+  std::vector<float> distances;
+
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat);
+    index.add(xb, nb);
+    index.store();
+
+    // Only in the id log, the set is not stored again
+    long removed[] = {10};
+    index.remove(removed, 1);
+    index.update(30, xb + 500 * d);
+  }
+
+  VCL::DescriptorSet index(index_filename);
+  EXPECT_EQ(index.get_n_descriptors(), nb - 1);
+
+  index.search(xb + 10 * d, 1, 1, ids, distances);
+  EXPECT_NE(ids[0], 10);
+  index.search(xb + 500 * d, 1, 2, ids, distances);
+  std::sort(ids.begin(), ids.end());
+  EXPECT_EQ(ids[0], 30);
+  EXPECT_EQ(ids[1], 500);
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Add, add_and_search_sharded) {
+  int d = 16;
+  int nb = 10000;
+  unsigned n_shards = 4;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  int offset = 10;
+  std::vector<long> classes = classes_increasing_offset(nb, offset);
+
+  VCL::DescriptorParams param;
+  param.num_shards = n_shards;
+
+  for (auto eng : {VCL::FaissFlat, VCL::FaissIVFFlat}) {
+    std::string index_filename =
+        "dbs/add_and_search_sharded_" + std::to_string(eng);
+
+    {
+      VCL::DescriptorSet index(index_filename, unsigned(d), eng, VCL::L2,
+                               &param);
+
+      // A batch split across the shards, then concurrent single adds
+      EXPECT_EQ(index.add(xb, nb / 2, classes.data()), 0);
+
+      std::vector<std::thread> writers;
+      for (int t = 0; t < 4; ++t) {
+        writers.emplace_back([&, t] {
+          for (int i = nb / 2 + t; i < nb; i += 4)
+            index.add(xb + i * d, 1, classes.data() + i);
+        });
+      }
+      for (auto &w : writers)
+        w.join();
+
+      EXPECT_EQ(index.get_n_descriptors(), nb);
+      index.store();
+    }
+
+    VCL::DescriptorSet index(index_filename);
+
+    std::vector<float> distances;
+    std::vector<long> desc_ids;
+    index.search(xb + 100 * d, 1, 1, desc_ids, distances);
+    EXPECT_EQ(desc_ids[0], 100);
+
+    // Neighbors come from different shards
+    if (eng == VCL::FaissFlat) {
+      index.search(xb + 100 * d, 1, 3, desc_ids, distances);
+      std::sort(desc_ids.begin(), desc_ids.end());
+      EXPECT_EQ(desc_ids, std::vector<long>({99, 100, 101}));
+    }
+
+    // Concurrent single adds may have landed in any order
+    std::vector<long> ids = {7, 4999, 5000};
+    std::vector<float> recons(ids.size() * d);
+    index.get_descriptors(ids, recons.data());
+    EXPECT_NEAR(recons[0], xb[7 * d], .01f);
+    EXPECT_NEAR(recons[d], xb[4999 * d], .01f);
+
+    std::vector<long> labels = index.classify(xb + 50 * d, 1);
+    EXPECT_EQ(labels[0], 50 / offset);
+
+    EXPECT_EQ(index.add(xb, 1), nb);
+  }
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Add, sharded_padding_not_returned) {
+  int d = 16;
+  int nb = 12;
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  VCL::DescriptorParams param;
+  param.num_shards = 4;
+
+  std::string index_filename = "dbs/sharded_padding";
+
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat,
+                             VCL::L2, &param);
+    index.add(xb, 8);
+    index.store();
+
+    // Ids 8 to 11, one per shard, only in the write-ahead logs
+    index.add(xb + 8 * d, 4);
+  }
+
+  // As if the server crashed before the add reached the third shard:
+  // its id 10 is padded with zeros when the set is opened.
+  std::filesystem::resize_file(index_filename + "/shard_2/wal.log",
+                               sizeof(uint64_t));
+
+  VCL::DescriptorSet index(index_filename);
+  EXPECT_EQ(index.get_n_descriptors(), nb - 1);
+
+  // The padding is as close to descriptor 0 as descriptor 0 itself
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  index.search(xb, 1, 3, desc_ids, distances);
+  std::sort(desc_ids.begin(), desc_ids.end());
+  EXPECT_EQ(desc_ids, std::vector<long>({0, 1, 2}));
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Add, add_and_search_binary) {
+  int d = 64; // bits
+  int code_size = d / 8;
+  int nb = 1000;
+
+  std::vector<uint8_t> xb(nb * code_size);
+  srand(42);
+  for (auto &byte : xb)
+    byte = rand() % 256;
+
+  int offset = 10;
+  std::vector<long> classes = classes_increasing_offset(nb, offset);
+
+  // Query: descriptor 100 with one bit flipped
+  std::vector<uint8_t> query(xb.begin() + 100 * code_size,
+                             xb.begin() + 101 * code_size);
+  query[3] ^= 0x10;
+
+  for (auto eng :
+       {VCL::FaissBinaryFlat, VCL::FaissBinaryIVF, VCL::FaissBinaryHNSW}) {
+    std::string index_filename =
+        "dbs/add_and_search_binary_" + std::to_string(eng);
+
+    {
+      VCL::DescriptorSet index(index_filename, unsigned(d), eng);
+      EXPECT_EQ(index.get_descriptor_size(), code_size);
+
+      index.add((float *)xb.data(), nb / 2, classes.data());
+      index.store();
+
+      // Only in the write-ahead log
+      index.add((float *)(xb.data() + nb / 2 * code_size), nb - nb / 2,
+                classes.data() + nb / 2);
+    }
+
+    VCL::DescriptorSet index(index_filename);
+    EXPECT_EQ(index.get_n_descriptors(), nb);
+
+    std::vector<float> distances;
+    std::vector<long> desc_ids;
+    index.search((float *)query.data(), 1, 1, desc_ids, distances);
+    EXPECT_EQ(desc_ids[0], 100);
+    EXPECT_EQ(distances[0], 1);
+
+    std::vector<long> ids = {100, 7, 8, nb - 1};
+    std::vector<uint8_t> recons(ids.size() * code_size);
+    index.get_descriptors(ids, (float *)recons.data());
+    for (int i = 0; i < ids.size(); ++i) {
+      EXPECT_TRUE(std::equal(recons.begin() + i * code_size,
+                             recons.begin() + (i + 1) * code_size,
+                             xb.begin() + ids[i] * code_size));
+    }
+
+    // The other neighbors are far, at about d / 2 bits
+    std::vector<long> labels = index.classify((float *)query.data(), 1, 7,
+                                              VCL::DistanceWeightedVote);
+    EXPECT_EQ(labels[0], 100 / offset);
+  }
+
+  // Binary dimensions are whole bytes
+  EXPECT_THROW(VCL::DescriptorSet("dbs/add_binary_bad_dim", 12,
+                                  VCL::FaissBinaryFlat),
+               VCL::Exception);
+}
+
+TEST(Descriptors_Add, add_and_search_cosine) {
+  int d = 16;
+  int nb = 1000;
+
+  // Random directions, at different scales
+  float *xb = new float[nb * d];
+  srand(42);
+  for (int i = 0; i < nb; ++i) {
+    for (int j = 0; j < d; ++j)
+      xb[i * d + j] = (float(rand()) / RAND_MAX - 0.5f) * (1 + i % 7);
+  }
+
+  std::string index_filename = "dbs/add_and_search_cosine";
+
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat,
+                             VCL::Cosine);
+    index.add(xb, nb);
+    index.store();
+  }
+
+  VCL::DescriptorSet index(index_filename);
+  EXPECT_EQ(index.get_metric(), VCL::Cosine);
+
+  // Same direction as descriptor 500, ten times as long
+  std::vector<float> query(xb + 500 * d, xb + 501 * d);
+  for (auto &x : query)
+    x *= 10;
+
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  index.search(query.data(), 1, 1, desc_ids, distances);
+  EXPECT_EQ(desc_ids[0], 500);
+  EXPECT_NEAR(distances[0], 1, 1e-5);
+
+  // Stored normalized
+  std::vector<long> ids = {500};
+  std::vector<float> recons(d);
+  index.get_descriptors(ids, recons.data());
+  float norm = 0;
+  for (float x : recons)
+    norm += x * x;
+  EXPECT_NEAR(norm, 1, 1e-5);
+
+  delete[] xb;
+}
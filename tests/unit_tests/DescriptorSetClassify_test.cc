@@ -462,3 +462,36 @@ TEST(Descriptors_Classify, classify_tdbdense_4d) {
 
   delete[] xb;
 }
+
+TEST(Descriptors_Classify, classify_flatl2_4d_distance_weighted) {
+  int d = 4;
+  int nb = 5;
+
+  // One descriptor of class 0 at the query,
+  // and four of class 1 a bit further away
+  float *xb = generate_desc_linear_increase(d, nb, 0);
+  std::vector<long> classes = {0, 1, 1, 1, 1};
+
+  std::string index_filename = "dbs/classify_flatl2_4d_weighted.faiss";
+  VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat);
+  index.add(xb, nb, classes);
+
+  std::vector<long> majority = index.classify(xb, 1, 5, VCL::MajorityVote);
+  EXPECT_EQ(majority[0], 1);
+
+  std::vector<long> weighted =
+      index.classify(xb, 1, 5, VCL::DistanceWeightedVote);
+  EXPECT_EQ(weighted[0], 0);
+
+  // Batch: each descriptor is classified on its own
+  weighted = index.classify(xb, nb, 5, VCL::DistanceWeightedVote);
+  ASSERT_EQ(weighted.size(), nb);
+  EXPECT_EQ(weighted[0], 0);
+  for (int i = 1; i < nb; ++i) {
+    EXPECT_EQ(weighted[i], 1);
+  }
+
+  index.store();
+
+  delete[] xb;
+}
@@ -141,3 +141,96 @@ TEST(Descriptors_Store, add_tiledbdense_100d_2add_file) {
   index.store();
   delete[] xb;
 }
+
+TEST(Descriptors_Store, add_flatl2_100d_log_replay) {
+  int d = 100;
+  int nb = 10000;
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  std::string index_filename = "dbs/store_flatl2_100d_log_replay";
+  std::vector<long> classes = classes_increasing_offset(nb, 10);
+
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat);
+    index.add(xb, nb, classes);
+    EXPECT_TRUE(index.is_modified());
+    index.store();
+    EXPECT_FALSE(index.is_modified());
+
+    // Not stored, only recorded in the write-ahead log
+    generate_desc_linear_increase(d, nb, xb, .6);
+    index.add(xb, nb, classes);
+    EXPECT_TRUE(index.is_modified());
+  }
+
+  VCL::DescriptorSet index_f(index_filename);
+  EXPECT_EQ(index_f.get_n_descriptors(), 2 * nb);
+
+  // The replayed adds are not in the checkpoint yet
+  EXPECT_TRUE(index_f.is_modified());
+
+  generate_desc_linear_increase(d, 4, xb, 0);
+
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  index_f.search(xb, 1, 4, desc_ids, distances);
+
+  float results[] = {0, 36, 100, 256};
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(std::round(distances[i]), std::round(results[i]));
+  }
+
+  // Labels are recovered along with the descriptors
+  std::vector<long> labels = index_f.classify(xb, 1);
+  EXPECT_EQ(labels[0], 0);
+
+  index_f.store();
+  EXPECT_FALSE(index_f.is_modified());
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Store, add_flatl2_100d_mmap) {
+  int d = 100;
+  int nb = 10000;
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  std::string index_filename = "dbs/store_flatl2_100d_mmap";
+  std::vector<long> classes = classes_increasing_offset(nb, 10);
+
+  {
+    VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissFlat);
+    index.add(xb, nb, classes);
+    index.store();
+  }
+
+  VCL::DescriptorSet index_f(index_filename, VCL::LoadMmap);
+  EXPECT_EQ(index_f.get_n_descriptors(), nb);
+
+  generate_desc_linear_increase(d, 4, xb, 0);
+
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  index_f.search(xb, 1, 4, desc_ids, distances);
+
+  float results[] = {0, 100, 400, 900};
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(std::round(distances[i]), std::round(results[i]));
+  }
+
+  std::vector<long> labels = index_f.classify(xb, 1);
+  EXPECT_EQ(labels[0], 0);
+
+  // Nothing to rewrite while the set is still mapped
+  index_f.store();
+  EXPECT_EQ(index_f.get_n_descriptors(), nb);
+
+  // Adding loads the mapped set in memory
+  generate_desc_linear_increase(d, 4, xb, .6);
+  index_f.add(xb, 4);
+  EXPECT_EQ(index_f.get_n_descriptors(), nb + 4);
+
+  index_f.store();
+
+  delete[] xb;
+}
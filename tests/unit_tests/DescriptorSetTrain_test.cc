@@ -30,10 +30,12 @@
  */
 
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <thread>
 
 #include "helpers.h"
 #include "vcl/VCL.h"
@@ -373,3 +375,103 @@ TEST(Descriptors_Train, train_tdbdense_4d) {
 
   delete[] xb;
 }
+
+// TILEDBSparse tests
+
+TEST(Descriptors_Train, train_tdbsparse_4d) {
+  int d = 4;
+  int nb = 10000;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  std::string index_filename = "dbs/train_tdbsparse_4d";
+  VCL::DescriptorSet index(index_filename, unsigned(d), VCL::TileDBSparse);
+
+  int offset = 10;
+  std::vector<long> classes = classes_increasing_offset(nb, offset);
+
+  index.add(xb, nb, classes);
+  index.train();
+
+  // Added after training, goes straight into the lists
+  index.add(xb + (nb - 1) * d, 1);
+
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  index.search(xb, 1, 4, desc_ids, distances);
+
+  int exp = 0;
+  for (auto &desc : desc_ids) {
+    EXPECT_EQ(desc, exp++);
+  }
+
+  int results[] = {0, 4, 16, 36};
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(distances[i], results[i]);
+  }
+
+  desc_ids.clear();
+  distances.clear();
+  index.search(xb + (nb - 1) * d, 1, 2, desc_ids, distances);
+
+  EXPECT_EQ(distances[0], 0);
+  EXPECT_EQ(distances[1], 0);
+
+  index.store();
+
+  // The lists are read back from disk
+  VCL::DescriptorSet index_loaded(index_filename);
+
+  desc_ids.clear();
+  distances.clear();
+  index_loaded.search(xb, 1, 4, desc_ids, distances);
+
+  exp = 0;
+  for (auto &desc : desc_ids) {
+    EXPECT_EQ(desc, exp++);
+  }
+
+  delete[] xb;
+}
+
+TEST(Descriptors_Train, train_async_ivfflatl2_4d) {
+  int d = 4;
+  int nb = 50000;
+
+  float *xb = generate_desc_linear_increase(d, nb);
+
+  std::string index_filename = "dbs/train_async_ivfflatl2_4d";
+  VCL::DescriptorSet index(index_filename, unsigned(d), VCL::FaissIVFFlat);
+
+  int offset = 10;
+  std::vector<long> classes = classes_increasing_offset(nb, offset);
+
+  // Half of the descriptors are added while the index is trained
+  index.add(xb, nb / 2, classes.data());
+  index.train_async();
+
+  for (int i = nb / 2; i < nb; i += 1000) {
+    index.add(xb + i * d, 1000, classes.data() + i);
+  }
+
+  while (index.train_progress() >= 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  EXPECT_TRUE(index.is_trained());
+  EXPECT_EQ(index.get_n_descriptors(), nb);
+
+  std::vector<float> distances;
+  std::vector<long> desc_ids;
+  for (int q : {0, 1234, nb / 2 + 10, nb - 1}) {
+    index.search(xb + q * d, 1, 1, desc_ids, distances);
+    EXPECT_EQ(desc_ids[0], q);
+  }
+
+  std::vector<long> ret_ids = index.classify(xb + (nb - 1) * d, 1);
+  EXPECT_EQ(ret_ids[0], (nb - 1) / offset);
+
+  index.store();
+
+  delete[] xb;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file   DescriptorsManager_test.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files
+ * (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "DescriptorsManager.h"
+#include "helpers.h"
+#include "gtest/gtest.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using namespace VDMS;
+
+#define DIM 16
+#define N_DESC 100
+#define SET_MEMORY (N_DESC * DIM * sizeof(float))
+
+// Stored set with N_DESC descriptors, of SET_MEMORY bytes in memory
+static std::string create_set(const std::string &name) {
+  std::string path = "dbs/descriptors_manager_" + name;
+  std::filesystem::remove_all(path);
+
+  float *xb = generate_desc_linear_increase(DIM, N_DESC);
+  VCL::DescriptorSet set(path, DIM, VCL::FaissFlat);
+  set.add(xb, N_DESC);
+  set.store();
+  delete[] xb;
+
+  return path;
+}
+
+TEST(DescriptorsManager, lru_eviction) {
+  std::string a = create_set("lru_a");
+  std::string b = create_set("lru_b");
+  std::string c = create_set("lru_c");
+
+  DescriptorsManager dm(2 * SET_MEMORY);
+  dm.get_descriptors_handler(a);
+  dm.get_descriptors_handler(b);
+  dm.get_descriptors_handler(a); // "b" is now the oldest
+  dm.get_descriptors_handler(c);
+
+  EXPECT_TRUE(dm.get_stats(a).resident);
+  EXPECT_FALSE(dm.get_stats(b).resident);
+  EXPECT_TRUE(dm.get_stats(c).resident);
+  EXPECT_EQ(dm.get_stats(b).evictions, 1);
+  EXPECT_EQ(dm.get_stats(a).evictions, 0);
+  EXPECT_EQ(dm.get_stats(c).memory, SET_MEMORY);
+}
+
+TEST(DescriptorsManager, pinned_not_evicted) {
+  std::string a = create_set("pinned_a");
+  std::string b = create_set("pinned_b");
+  std::string c = create_set("pinned_c");
+
+  DescriptorsManager dm(SET_MEMORY);
+  {
+    DescriptorSetHandle pinned = dm.get_descriptors_handler(a);
+    dm.get_descriptors_handler(b);
+    dm.get_descriptors_handler(c);
+
+    // Over the budget, but the oldest set is in use
+    EXPECT_TRUE(dm.get_stats(a).resident);
+    EXPECT_EQ(dm.get_stats(a).pins, 1);
+    EXPECT_EQ(dm.get_stats(a).evictions, 0);
+    EXPECT_FALSE(dm.get_stats(b).resident);
+    EXPECT_EQ(pinned->get_n_descriptors(), N_DESC);
+  }
+
+  // Evicted once released, by the next set opened
+  dm.get_descriptors_handler(b);
+  EXPECT_FALSE(dm.get_stats(a).resident);
+  EXPECT_EQ(dm.get_stats(a).evictions, 1);
+}
+
+TEST(DescriptorsManager, reopen_after_eviction) {
+  std::string a = create_set("reopen_a");
+  std::string b = create_set("reopen_b");
+
+  float *xb = generate_desc_linear_increase(DIM, 10, N_DESC);
+
+  DescriptorsManager dm(SET_MEMORY + 10 * DIM * sizeof(float));
+  {
+    // Not stored: the adds are only in the write-ahead log
+    DescriptorSetHandle set = dm.get_descriptors_handler(a);
+    EXPECT_EQ(set->add(xb, 10), N_DESC);
+  }
+
+  dm.get_descriptors_handler(b);
+  EXPECT_FALSE(dm.get_stats(a).resident);
+
+  std::vector<long> ids;
+  std::vector<float> distances;
+  {
+    DescriptorSetHandle set = dm.get_descriptors_handler(a);
+    EXPECT_EQ(set->get_n_descriptors(), N_DESC + 10);
+    set->search(xb + 5 * DIM, 1, 1, ids, distances);
+    EXPECT_EQ(ids[0], N_DESC + 5);
+  }
+  EXPECT_EQ(dm.get_stats(a).loads, 2);
+  EXPECT_EQ(dm.get_stats(a).evictions, 1);
+
+  delete[] xb;
+}
+
+TEST(DescriptorsManager, stats_counters) {
+  std::string a = create_set("stats_a");
+
+  DescriptorsManager dm(0);
+  EXPECT_EQ(dm.get_stats(a).loads, 0);
+  EXPECT_FALSE(dm.get_stats(a).resident);
+
+  {
+    DescriptorSetHandle first = dm.get_descriptors_handler(a);
+    DescriptorSetHandle second = dm.get_descriptors_handler(a);
+    EXPECT_EQ(first.get(), second.get());
+    EXPECT_EQ(dm.get_stats(a).pins, 2);
+  }
+  dm.get_descriptors_handler(a);
+
+  DescriptorSetStats stats = dm.get_stats(a);
+  EXPECT_TRUE(stats.resident);
+  EXPECT_EQ(stats.pins, 0);
+  EXPECT_EQ(stats.loads, 1);
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.evictions, 0);
+  EXPECT_EQ(stats.memory, SET_MEMORY);
+
+  // Without a budget, nothing is evicted: flush() closes the sets
+  dm.flush();
+  EXPECT_FALSE(dm.get_stats(a).resident);
+  EXPECT_EQ(dm.get_stats(a).evictions, 0);
+}
@@ -0,0 +1,262 @@
+/**
+ * @file   DistanceKernels_test.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files
+ * (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "DistanceKernels.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+std::vector<float> random_floats(size_t n, unsigned seed) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  std::vector<float> v(n);
+  for (auto &x : v)
+    x = dist(gen);
+  return v;
+}
+
+} // namespace
+
+TEST(DistanceKernels, l2_and_inner_product_all_dims) {
+  // Covers the SIMD main loops and every tail length
+  for (size_t dim = 1; dim <= 70; ++dim) {
+    std::vector<float> x = random_floats(dim, dim);
+    std::vector<float> y = random_floats(dim, dim + 1000);
+
+    float l2 = 0, ip = 0;
+    for (size_t i = 0; i < dim; ++i) {
+      l2 += (x[i] - y[i]) * (x[i] - y[i]);
+      ip += x[i] * y[i];
+    }
+
+    EXPECT_NEAR(VCL::DistanceKernels::l2_sqr(x.data(), y.data(), dim), l2,
+                1e-4);
+    EXPECT_NEAR(VCL::DistanceKernels::inner_product(x.data(), y.data(), dim),
+                ip, 1e-4);
+  }
+}
+
+TEST(DistanceKernels, knn_l2_batch) {
+  size_t dim = 100, n = 5000, nq = 37;
+  unsigned k = 10;
+  std::vector<float> data = random_floats(n * dim, 1);
+  std::vector<float> queries(data.begin(), data.begin() + nq * dim);
+
+  std::vector<long> ids(nq * k);
+  std::vector<float> distances(nq * k);
+  VCL::DistanceKernels::knn(queries.data(), nq, data.data(), n, dim, k,
+                            VCL::L2, ids.data(), distances.data());
+
+  for (size_t q = 0; q < nq; ++q) {
+    // Each query is in the data
+    EXPECT_EQ(ids[q * k], q);
+    EXPECT_NEAR(distances[q * k], 0, 1e-4);
+
+    for (unsigned j = 1; j < k; ++j) {
+      EXPECT_LE(distances[q * k + j - 1], distances[q * k + j]);
+      float d = VCL::DistanceKernels::l2_sqr(queries.data() + q * dim,
+                                             data.data() + ids[q * k + j] * dim,
+                                             dim);
+      EXPECT_NEAR(distances[q * k + j], d, 1e-3);
+    }
+
+    // No descriptor closer than the k-th result was left out
+    size_t closer = 0;
+    for (size_t i = 0; i < n; ++i) {
+      float d = VCL::DistanceKernels::l2_sqr(queries.data() + q * dim,
+                                             data.data() + i * dim, dim);
+      if (d < distances[q * k + k - 1])
+        ++closer;
+    }
+    EXPECT_LE(closer, k - 1);
+  }
+}
+
+TEST(DistanceKernels, knn_inner_product) {
+  size_t dim = 16, n = 1000;
+  unsigned k = 5;
+  std::vector<float> data = random_floats(n * dim, 2);
+  std::vector<float> query = random_floats(dim, 3);
+
+  std::vector<long> ids(k);
+  std::vector<float> distances(k);
+  VCL::DistanceKernels::knn(query.data(), 1, data.data(), n, dim, k, VCL::IP,
+                            ids.data(), distances.data());
+
+  float best = -1e30;
+  long best_id = -1;
+  for (size_t i = 0; i < n; ++i) {
+    float ip = VCL::DistanceKernels::inner_product(query.data(),
+                                                   data.data() + i * dim, dim);
+    if (ip > best) {
+      best = ip;
+      best_id = i;
+    }
+  }
+
+  EXPECT_EQ(ids[0], best_id);
+  EXPECT_NEAR(distances[0], best, 1e-4);
+  for (unsigned j = 1; j < k; ++j) {
+    EXPECT_GE(distances[j - 1], distances[j]);
+  }
+}
+
+TEST(DistanceKernels, knn_fewer_than_k) {
+  size_t dim = 4, n = 3;
+  unsigned k = 5;
+  std::vector<float> data = random_floats(n * dim, 4);
+
+  std::vector<long> ids(k);
+  std::vector<float> distances(k);
+  VCL::DistanceKernels::knn(data.data(), 1, data.data(), n, dim, k, VCL::L2,
+                            ids.data(), distances.data());
+
+  EXPECT_EQ(ids[0], 0);
+  EXPECT_GE(ids[2], 0);
+  EXPECT_EQ(ids[3], -1);
+  EXPECT_EQ(ids[4], -1);
+}
+
+TEST(DistanceKernels, merge_knn_chunks) {
+  size_t dim = 16, n = 3000, nq = 5, chunk = 700;
+  unsigned k = 8;
+  std::vector<float> data = random_floats(n * dim, 3);
+  std::vector<float> queries = random_floats(nq * dim, 4);
+
+  for (auto metric : {VCL::L2, VCL::IP}) {
+    std::vector<long> ids(nq * k), best_ids(nq * k);
+    std::vector<float> distances(nq * k), best_distances(nq * k);
+    VCL::DistanceKernels::knn(queries.data(), nq, data.data(), n, dim, k,
+                              metric, ids.data(), distances.data());
+
+    // Same results searching the data one chunk at a time
+    for (size_t start = 0; start < n; start += chunk) {
+      size_t len = std::min(chunk, n - start);
+      std::vector<long> chunk_ids(nq * k);
+      std::vector<float> chunk_distances(nq * k);
+      VCL::DistanceKernels::knn(queries.data(), nq, data.data() + start * dim,
+                                len, dim, k, metric, chunk_ids.data(),
+                                chunk_distances.data());
+      if (start == 0) {
+        best_ids = chunk_ids;
+        best_distances = chunk_distances;
+      } else {
+        VCL::DistanceKernels::merge_knn(nq, k, metric, chunk_ids.data(),
+                                        chunk_distances.data(), start,
+                                        best_ids.data(), best_distances.data());
+      }
+    }
+
+    for (size_t j = 0; j < nq * k; ++j) {
+      EXPECT_EQ(best_ids[j], ids[j]);
+      EXPECT_FLOAT_EQ(best_distances[j], distances[j]);
+    }
+  }
+}
+
+TEST(DistanceKernels, kmeans_separated_clusters) {
+  size_t dim = 8, per_cluster = 200;
+  unsigned k = 4;
+
+  // Points around 0, 100, 200 and 300 in every dimension
+  std::vector<float> noise = random_floats(k * per_cluster * dim, 5);
+  std::vector<float> data(k * per_cluster * dim);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = 100.0f * (i / (per_cluster * dim)) + noise[i];
+  }
+
+  std::vector<float> centroids(k * dim);
+  VCL::DistanceKernels::kmeans(data.data(), k * per_cluster, dim, k, 10,
+                               centroids.data());
+
+  for (unsigned c = 0; c < k; ++c) {
+    for (size_t j = 0; j < dim; ++j) {
+      EXPECT_NEAR(centroids[c * dim + j], 100.0f * c, 0.5);
+    }
+  }
+}
+
+TEST(DistanceKernels, normalize) {
+  size_t dim = 19;
+  std::vector<float> data = random_floats(3 * dim, 7);
+  std::fill(data.begin() + 2 * dim, data.end(), 0.0f);
+
+  VCL::DistanceKernels::normalize(data.data(), 3, dim);
+
+  for (size_t i = 0; i < 2; ++i) {
+    const float *v = data.data() + i * dim;
+    EXPECT_NEAR(VCL::DistanceKernels::inner_product(v, v, dim), 1, 1e-5);
+  }
+
+  // Zero vectors stay zero
+  for (size_t j = 2 * dim; j < 3 * dim; ++j)
+    EXPECT_EQ(data[j], 0);
+}
+
+TEST(DistanceKernels, half_to_float) {
+  // 1, -2, 0.5, 65504 (largest), 2^-24 (smallest subnormal), 0, -0, inf,
+  // 1 + 2^-10, and the same again to go through the vector and tail paths
+  std::vector<uint16_t> fp16 = {0x3c00, 0xc000, 0x3800, 0x7bff, 0x0001,
+                                0x0000, 0x8000, 0x7c00, 0x3c01};
+  std::vector<float> expected = {1,     -2,
+                                 0.5,   65504,
+                                 std::ldexp(1.0f, -24), 0,
+                                 -0.0f, INFINITY,
+                                 1 + std::ldexp(1.0f, -10)};
+  fp16.insert(fp16.end(), fp16.begin(), fp16.end());
+  expected.insert(expected.end(), expected.begin(), expected.end());
+
+  std::vector<float> converted(fp16.size());
+  VCL::fp16_to_float(fp16.data(), fp16.size(), converted.data());
+  for (size_t i = 0; i < fp16.size(); ++i)
+    EXPECT_EQ(converted[i], expected[i]);
+
+  // bfloat16 is the upper half of a float
+  std::vector<float> values = random_floats(21, 100);
+  std::vector<uint16_t> bf16(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    uint32_t bits;
+    std::memcpy(&bits, &values[i], sizeof(bits));
+    bf16[i] = bits >> 16;
+  }
+
+  converted.resize(bf16.size());
+  VCL::bf16_to_float(bf16.data(), bf16.size(), converted.data());
+  for (size_t i = 0; i < values.size(); ++i)
+    EXPECT_NEAR(converted[i], values[i], std::abs(values[i]) / 128);
+}
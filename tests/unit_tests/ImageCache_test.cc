@@ -0,0 +1,155 @@
+/**
+ * @file   ImageCache_test.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files
+ * (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "ImageCache.h"
+#include "gtest/gtest.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using namespace VDMS;
+
+static std::vector<unsigned char> bytes(size_t n, unsigned char value) {
+  return std::vector<unsigned char>(n, value);
+}
+
+TEST(ImageCache, key_normalized) {
+  Json::Value a;
+  a["type"] = "resize";
+  a["width"] = 224;
+  a["height"] = 224;
+
+  Json::Value b;
+  b["height"] = 224;
+  b["width"] = 224;
+  b["type"] = "resize";
+
+  Json::Value ops_a, ops_b;
+  ops_a.append(a);
+  ops_b.append(b);
+
+  EXPECT_EQ(ImageCache::key("img.jpg", ops_a, "jpg"),
+            ImageCache::key("img.jpg", ops_b, "jpg"));
+  EXPECT_NE(ImageCache::key("img.jpg", ops_a, "jpg"),
+            ImageCache::key("img.jpg", ops_a, "png"));
+  EXPECT_NE(ImageCache::key("img.jpg", ops_a, ""),
+            ImageCache::key("img.jpg", Json::Value(), ""));
+}
+
+TEST(ImageCache, lru_eviction) {
+  ImageCache cache(300);
+
+  cache.insert("a", "a.jpg", bytes(100, 1));
+  cache.insert("b", "b.jpg", bytes(100, 2));
+  cache.insert("c", "c.jpg", bytes(100, 3));
+
+  std::vector<unsigned char> data;
+  ASSERT_TRUE(cache.lookup("a", data)); // "b" is now the oldest
+  EXPECT_EQ(data, bytes(100, 1));
+
+  cache.insert("d", "d.jpg", bytes(100, 4));
+  EXPECT_FALSE(cache.lookup("b", data));
+  EXPECT_TRUE(cache.lookup("a", data));
+  EXPECT_TRUE(cache.lookup("c", data));
+  EXPECT_TRUE(cache.lookup("d", data));
+
+  // Larger than the budget
+  cache.insert("e", "e.jpg", bytes(400, 5));
+  EXPECT_FALSE(cache.lookup("e", data));
+
+  ImageCacheStats stats = cache.get_stats();
+  EXPECT_EQ(stats.hits, 4);
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.memory, 300);
+  EXPECT_EQ(stats.entries, 3);
+}
+
+TEST(ImageCache, invalidate) {
+  ImageCache cache(1000);
+
+  cache.insert(ImageCache::key("a.jpg", Json::Value(), ""), "a.jpg",
+               bytes(10, 1));
+  cache.insert(ImageCache::key("a.jpg", Json::Value(), "png"), "a.jpg",
+               bytes(10, 2));
+  cache.insert(ImageCache::key("b.jpg", Json::Value(), ""), "b.jpg",
+               bytes(10, 3));
+
+  cache.invalidate("a.jpg");
+
+  std::vector<unsigned char> data;
+  EXPECT_FALSE(cache.lookup(ImageCache::key("a.jpg", Json::Value(), ""), data));
+  EXPECT_FALSE(
+      cache.lookup(ImageCache::key("a.jpg", Json::Value(), "png"), data));
+  EXPECT_TRUE(cache.lookup(ImageCache::key("b.jpg", Json::Value(), ""), data));
+  EXPECT_EQ(cache.get_stats().memory, 10);
+}
+
+TEST(ImageCache, spill) {
+  std::string spill_path = "tests_image_cache_spill";
+  std::filesystem::remove_all(spill_path);
+
+  {
+    ImageCache cache(200, spill_path, 200);
+
+    cache.insert("a", "a.jpg", bytes(100, 1));
+    cache.insert("b", "b.jpg", bytes(100, 2));
+    cache.insert("c", "c.jpg", bytes(100, 3)); // "a" is spilled
+    cache.insert("d", "d.jpg", bytes(100, 4)); // "b" is spilled
+
+    ImageCacheStats stats = cache.get_stats();
+    EXPECT_EQ(stats.memory, 200);
+    EXPECT_EQ(stats.spilled, 200);
+    EXPECT_EQ(stats.entries, 4);
+
+    // Back to memory, "c" is spilled in its place
+    std::vector<unsigned char> data;
+    ASSERT_TRUE(cache.lookup("a", data));
+    EXPECT_EQ(data, bytes(100, 1));
+
+    // Beyond the spill budget, "b" is dropped
+    cache.insert("e", "e.jpg", bytes(100, 5));
+    EXPECT_FALSE(cache.lookup("b", data));
+    ASSERT_TRUE(cache.lookup("c", data));
+    EXPECT_EQ(data, bytes(100, 3));
+
+    cache.invalidate("d.jpg");
+    EXPECT_FALSE(cache.lookup("d", data));
+
+    stats = cache.get_stats();
+    EXPECT_LE(stats.memory, 200);
+    EXPECT_LE(stats.spilled, 200);
+  }
+
+  // The spill files are removed with the cache
+  EXPECT_TRUE(std::filesystem::is_empty(spill_path));
+  std::filesystem::remove_all(spill_path);
+}
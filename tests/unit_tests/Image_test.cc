@@ -29,6 +29,7 @@
 
 #include "ImageLoop.h"
 #include "VDMSConfig.h"
+#include "WorkerPool.h"
 #include "stats/SystemStats.h"
 #include "vcl/Image.h"
 #include "gtest/gtest.h"
@@ -52,6 +53,7 @@ class ImageTest : public ::testing::Test {
 protected:
   virtual void SetUp() {
     VDMS::VDMSConfig::init("unit_tests/config-tests.json");
+    VDMS::WorkerPool::init();
     img_ = "test_images/large1.jpg";
     tdb_img_ = "tdb/test_image.tdb";
     cv_img_ = cv::imread(img_, -1);
@@ -612,6 +614,37 @@ TEST_F(ImageTest, CropMat) {
   compare_mat_mat(cv_img, mat);
 }
 
+TEST_F(ImageTest, CropMatCopy) {
+  VCL::Image img(img_);
+  img.crop(rect_);
+
+  // The copy does the crop fused with the read
+  VCL::Image copy(img);
+  cv::Mat cv_img = copy.get_cvmat();
+
+  cv::Mat mat(cv_img_, rect_);
+  compare_mat_mat(cv_img, mat);
+}
+
+TEST_F(ImageTest, CropResizeMatReduced) {
+  // Decoded at 1/8 of its size, close to an area resize of the crop
+  VCL::Rectangle area(128, 64, 512, 384);
+  VCL::Image img(img_);
+  img.crop(area);
+  img.resize(48, 64);
+
+  cv::Mat cv_img = img.get_cvmat();
+  ASSERT_EQ(48, cv_img.rows);
+  ASSERT_EQ(64, cv_img.cols);
+
+  cv::Mat expected;
+  cv::resize(cv::Mat(cv_img_, area), expected, cv::Size(64, 48), 0, 0,
+             cv::INTER_AREA);
+  double diff = cv::norm(cv_img, expected, cv::NORM_L1) /
+                (expected.total() * expected.channels());
+  EXPECT_LT(diff, 4);
+}
+
 TEST_F(ImageTest, Threshold) {
   VCL::TDBImage tdb(tdb_img_);
   tdb.write(cv_img_, false);
@@ -731,6 +764,45 @@ TEST_F(ImageTest, RotateResize) {
   compare_mat_mat(vcl_img_rot, cv_img_rot);
 }
 
+TEST_F(ImageTest, FlipFlipFused) {
+  VCL::Image img(img_);
+  cv::Mat cv_img = img.get_cvmat();
+  cv::Mat cv_img_flipped;
+  cv::flip(cv_img, cv_img_flipped, -1);
+
+  img.flip(1);
+  img.flip(0);
+  cv::Mat vcl_img_flipped = img.get_cvmat();
+
+  EXPECT_FALSE(vcl_img_flipped.empty());
+  compare_mat_mat(vcl_img_flipped, cv_img_flipped);
+}
+
+TEST_F(ImageTest, FlipRotateFused) {
+  float angle = 30;
+  VCL::Image img(img_);
+  cv::Mat cv_img = img.get_cvmat();
+
+  VCL::Image separate(cv_img);
+  separate.flip(1);
+  separate.get_cvmat();
+  separate.rotate(angle, false);
+  separate.get_cvmat();
+  separate.flip(0);
+  cv::Mat expected = separate.get_cvmat();
+
+  // A single warpAffine, sampling where the separate operations do
+  img.flip(1);
+  img.rotate(angle, false);
+  img.flip(0);
+  cv::Mat vcl_img_rot = img.get_cvmat();
+
+  ASSERT_EQ(expected.size(), vcl_img_rot.size());
+  double diff = cv::norm(vcl_img_rot, expected, cv::NORM_L1) /
+                (expected.total() * expected.channels());
+  EXPECT_LT(diff, 1);
+}
+
 TEST_F(ImageTest, TDBMatThrow) {
   VCL::TDBImage tdb(tdb_img_);
   tdb.write(cv_img_, false);
@@ -758,6 +830,51 @@ TEST_F(ImageTest, CropTDB) {
   EXPECT_EQ(rect_.height, cv_img.rows);
 }
 
+TEST_F(ImageTest, CropTDBArea) {
+  VCL::TDBImage tdb(tdb_img_);
+  tdb.write(cv_img_, false);
+
+  VCL::Rectangle area(30, 70, 200, 120);
+  VCL::Image img(tdb_img_);
+  img.crop(area);
+
+  cv::Mat cv_img = img.get_cvmat();
+  ASSERT_EQ(area.height, cv_img.rows);
+  ASSERT_EQ(area.width, cv_img.cols);
+
+  cv::Mat mat(cv_img_, area);
+  compare_mat_mat(cv_img, mat);
+}
+
+TEST_F(ImageTest, CropCropTDB) {
+  VCL::TDBImage tdb(tdb_img_);
+  tdb.write(cv_img_, false);
+
+  // Read as a single area
+  VCL::Image img(tdb_img_);
+  img.crop(VCL::Rectangle(30, 70, 200, 120));
+  img.crop(VCL::Rectangle(10, 20, 50, 40));
+
+  cv::Mat cv_img = img.get_cvmat();
+  cv::Mat mat(cv_img_, VCL::Rectangle(40, 90, 50, 40));
+  compare_mat_mat(cv_img, mat);
+}
+
+TEST_F(ImageTest, TileExtentTDB) {
+  VCL::Image img(cv_img_);
+  img.set_tile_extent(64);
+  img.store("tdb/tile_extent", VCL::Format::TDB);
+
+  VCL::Image stored("tdb/tile_extent.tdb");
+  stored.crop(rect_);
+
+  cv::Mat cv_img = stored.get_cvmat();
+  cv::Mat mat(cv_img_, rect_);
+  compare_mat_mat(cv_img, mat);
+
+  EXPECT_TRUE(stored.delete_image());
+}
+
 TEST_F(ImageTest, CompareMatAndBuffer) {
   VCL::Image img(img_);
 
@@ -909,19 +1026,13 @@ TEST_F(ImageTest, ImageLoop) {
   imageLoop.set_nrof_entities(1);
 
   imageLoop.enqueue(&img);
+  imageLoop.wait();
 
-  while (imageLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Image *> imageMap = imageLoop.get_image_map();
-  std::map<std::string, VCL::Image *>::iterator iter = imageMap.begin();
-
-  while (iter != imageMap.end()) {
+  ASSERT_TRUE(imageLoop.get_error().empty());
+  for (VCL::Image *image : imageLoop.get_images()) {
     std::vector<unsigned char> img_enc =
-        iter->second->get_encoded_image_async(img.get_image_format());
+        image->get_encoded_image_async(img.get_image_format());
     ASSERT_TRUE(!img_enc.empty());
-    iter++;
   }
 }
 
@@ -940,15 +1051,9 @@ TEST_F(ImageTest, ImageLoopURLError) {
   imageLoop.set_nrof_entities(1);
 
   imageLoop.enqueue(&img);
+  imageLoop.wait();
 
-  while (imageLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Image *> imageMap = imageLoop.get_image_map();
-  std::map<std::string, VCL::Image *>::iterator iter = imageMap.begin();
-
-  ASSERT_TRUE(iter->second->get_query_error_response() != "");
+  ASSERT_TRUE(imageLoop.get_error() != "");
 }
 
 TEST_F(ImageTest, ImageLoopRemoteFunctionError) {
@@ -966,15 +1071,9 @@ TEST_F(ImageTest, ImageLoopRemoteFunctionError) {
   imageLoop.set_nrof_entities(1);
 
   imageLoop.enqueue(&img);
+  imageLoop.wait();
 
-  while (imageLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Image *> imageMap = imageLoop.get_image_map();
-  std::map<std::string, VCL::Image *>::iterator iter = imageMap.begin();
-
-  ASSERT_TRUE(iter->second->get_query_error_response() != "");
+  ASSERT_TRUE(imageLoop.get_error() != "");
 }
 
 TEST_F(ImageTest, ImageLoopSyncRemoteFunctionError) {
@@ -992,15 +1091,9 @@ TEST_F(ImageTest, ImageLoopSyncRemoteFunctionError) {
   imageLoop.set_nrof_entities(1);
 
   imageLoop.enqueue(&img);
+  imageLoop.wait();
 
-  while (imageLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Image *> imageMap = imageLoop.get_image_map();
-  std::map<std::string, VCL::Image *>::iterator iter = imageMap.begin();
-
-  ASSERT_TRUE(iter->second->get_query_error_response() != "");
+  ASSERT_TRUE(imageLoop.get_error() != "");
 }
 
 TEST_F(ImageTest, PipelineException) {
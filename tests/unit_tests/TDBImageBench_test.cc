@@ -0,0 +1,170 @@
+/**
+ * @file   TDBImageBench_test.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// Throughput of the TDBImage write, read, read of an area and resize
+// paths, in MB/s of image data, at several image sizes. The numbers are
+// printed and recorded as test properties (--gtest_output=xml:...).
+
+#include "TDBImage.h"
+#include "gtest/gtest.h"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TDBImageBench : public ::testing::Test {
+
+protected:
+  static const int kRuns = 3;
+
+  // Sides of the square images benchmarked
+  const std::vector<int> sides_ = {256, 1024, 2048};
+
+  // Writes a random image of side x side pixels,
+  // and returns the path of its array
+  std::string write_image(int side, cv::Mat &cv_img) {
+    std::string tdb_path = "tdb/bench_" + std::to_string(side) + ".tdb";
+    cv_img = cv::Mat(side, side, CV_8UC3);
+    cv::randu(cv_img, cv::Scalar::all(0), cv::Scalar::all(255));
+
+    VCL::TDBImage tdb(tdb_path);
+    tdb.write(cv_img);
+    return tdb_path;
+  }
+
+  void delete_image(const std::string &tdb_path) {
+    VCL::TDBImage tdb(tdb_path);
+    tdb.delete_image();
+  }
+
+  // Best of kRuns, in MB/s of the given number of bytes
+  double measure(const std::string &name, int side, size_t bytes,
+                 std::function<void()> run) {
+    double best = 0;
+    for (int i = 0; i < kRuns; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      run();
+      std::chrono::duration<double> secs =
+          std::chrono::steady_clock::now() - start;
+      best = std::max(best, bytes / secs.count() / (1024 * 1024));
+    }
+
+    std::string size = std::to_string(side) + "x" + std::to_string(side);
+    std::cout << "[ BENCH    ] " << name << " " << size << ": " << best
+              << " MB/s" << std::endl;
+    RecordProperty(name + "_" + size + "_mbps", std::to_string(best));
+    return best;
+  }
+};
+
+TEST_F(TDBImageBench, Write) {
+  for (int side : sides_) {
+    cv::Mat cv_img;
+    std::string tdb_path = write_image(side, cv_img);
+    size_t bytes = cv_img.total() * cv_img.elemSize();
+
+    double mbps = measure("write", side, bytes, [&]() {
+      VCL::TDBImage tdb(tdb_path);
+      tdb.write(cv_img);
+    });
+
+    EXPECT_GT(mbps, 0);
+    delete_image(tdb_path);
+  }
+}
+
+TEST_F(TDBImageBench, Read) {
+  for (int side : sides_) {
+    cv::Mat cv_img;
+    std::string tdb_path = write_image(side, cv_img);
+    size_t bytes = cv_img.total() * cv_img.elemSize();
+
+    double mbps = measure("read", side, bytes, [&]() {
+      VCL::TDBImage tdb(tdb_path);
+      tdb.read();
+      ASSERT_EQ(cv_img.rows, tdb.get_image_height());
+    });
+
+    EXPECT_GT(mbps, 0);
+    delete_image(tdb_path);
+  }
+}
+
+TEST_F(TDBImageBench, ReadROI) {
+  for (int side : sides_) {
+    cv::Mat cv_img;
+    std::string tdb_path = write_image(side, cv_img);
+
+    int roi_side = side / 4;
+    VCL::Rectangle roi(roi_side, roi_side, roi_side, roi_side);
+    size_t bytes = roi_side * roi_side * cv_img.elemSize();
+
+    double mbps = measure("read_roi", side, bytes, [&]() {
+      VCL::TDBImage tdb(tdb_path);
+      tdb.read(roi);
+      ASSERT_EQ(roi_side, tdb.get_image_height());
+    });
+
+    EXPECT_GT(mbps, 0);
+    delete_image(tdb_path);
+  }
+}
+
+TEST_F(TDBImageBench, Resize) {
+  for (int side : sides_) {
+    cv::Mat cv_img;
+    std::string tdb_path = write_image(side, cv_img);
+
+    int half = side / 2;
+    VCL::Rectangle size(0, 0, half, half);
+    size_t bytes = cv_img.total() * cv_img.elemSize();
+
+    // Measures the resize alone, on data that is already in memory
+    VCL::TDBImage stored(tdb_path);
+    std::vector<std::unique_ptr<VCL::TDBImage>> copies;
+    for (int i = 0; i < kRuns; ++i)
+      copies.emplace_back(new VCL::TDBImage(stored));
+
+    int run = 0;
+    double mbps = measure("resize", side, bytes, [&]() {
+      VCL::TDBImage &tdb = *copies[run++];
+      tdb.resize(size);
+      ASSERT_EQ(half, tdb.get_image_height());
+    });
+
+    EXPECT_GT(mbps, 0);
+    delete_image(tdb_path);
+  }
+}
@@ -410,6 +410,59 @@ TEST_F(TDBImageTest, Resize) {
   EXPECT_EQ(100, tdb.get_image_width());
 }
 
+TEST_F(TDBImageTest, ResizeMatchesBilinear) {
+  VCL::TDBImage tdb("tdb/resize_bilinear.tdb");
+  tdb.write(cv_img_);
+
+  VCL::TDBImage stored("tdb/resize_bilinear.tdb");
+  stored.read();
+  stored.resize(rect_);
+
+  cv::Mat cv_small;
+  cv::resize(cv_img_, cv_small, cv::Size(rect_.width, rect_.height), 0, 0,
+             cv::INTER_LINEAR);
+
+  cv::Mat tdb_small = stored.get_cvmat();
+  compare_mat_mat(tdb_small, cv_small);
+
+  stored.delete_image();
+}
+
+TEST_F(TDBImageTest, ReadFromPyramid) {
+  VCL::TDBImage tdb("tdb/pyramid.tdb");
+  tdb.write(cv_img_);
+  tdb.write_pyramid(2);
+
+  cv::Mat half, quarter;
+  cv::resize(cv_img_, half, cv::Size((cv_img_.cols + 1) / 2,
+                                     (cv_img_.rows + 1) / 2),
+             0, 0, cv::INTER_AREA);
+  cv::resize(half, quarter, cv::Size((half.cols + 1) / 2,
+                                     (half.rows + 1) / 2),
+             0, 0, cv::INTER_AREA);
+
+  VCL::TDBImage stored("tdb/pyramid.tdb");
+  stored.read(VCL::Rectangle(0, 0, cv_img_.cols, cv_img_.rows),
+              cv::Size(quarter.cols, quarter.rows));
+
+  EXPECT_EQ(quarter.rows, stored.get_image_height());
+  EXPECT_EQ(quarter.cols, stored.get_image_width());
+
+  cv::Mat cv_level = stored.get_cvmat();
+  compare_mat_mat(cv_level, quarter);
+
+  // Only the pixels of the level within the subset: [1, 11) at level 2
+  VCL::TDBImage subset("tdb/pyramid.tdb");
+  subset.read(VCL::Rectangle(3, 3, 41, 41), cv::Size(5, 5));
+  EXPECT_EQ(subset.get_image_height(), 10);
+  EXPECT_EQ(subset.get_image_width(), 10);
+  cv::Mat tdb_subset = subset.get_cvmat();
+  cv::Mat cv_subset = quarter(cv::Rect(1, 1, 10, 10)).clone();
+  compare_mat_mat(tdb_subset, cv_subset);
+
+  stored.delete_image();
+}
+
 TEST_F(TDBImageTest, Threshold) {
   VCL::TDBImage tdb(tdb_img_);
 
@@ -48,6 +48,7 @@
 #include "helpers.h"
 
 #include "VDMSConfig.h"
+#include "WorkerPool.h"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -64,6 +65,7 @@ protected:
   virtual void SetUp() {
 
     VDMS::VDMSConfig::init("unit_tests/config-tests.json");
+    VDMS::WorkerPool::init();
     _video_path_avi_xvid = "videos/Megamind.avi";
     _video_path_mp4_h264 = "videos/Megamind.mp4";
 
@@ -998,23 +1000,15 @@ TEST_F(VideoTest, VideoLoopTest) {
   videoLoop.set_nrof_entities(1);
 
   videoLoop.enqueue(video_data);
-
-  while (videoLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Video> videoMap = videoLoop.get_video_map();
-  std::map<std::string, VCL::Video>::iterator iter = videoMap.begin();
+  videoLoop.wait();
 
   VCL::Video::Codec vcl_codec = VCL::Video::Codec::H264;
   const std::string vcl_container = "mp4";
 
-  while (iter != videoMap.end()) {
-    auto video_enc = iter->second.get_encoded(vcl_container, vcl_codec);
-    int size = video_enc.size();
-
+  ASSERT_TRUE(videoLoop.get_error().empty());
+  for (VCL::Video *video : videoLoop.get_videos()) {
+    auto video_enc = video->get_encoded(vcl_container, vcl_codec);
     ASSERT_TRUE(!video_enc.empty());
-    iter++;
   }
 }
 
@@ -1056,23 +1050,15 @@ TEST_F(VideoTest, VideoLoopPipelineTest) {
   videoLoop.set_nrof_entities(1);
 
   videoLoop.enqueue(video_data);
-
-  while (videoLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Video> videoMap = videoLoop.get_video_map();
-  std::map<std::string, VCL::Video>::iterator iter = videoMap.begin();
+  videoLoop.wait();
 
   VCL::Video::Codec vcl_codec = VCL::Video::Codec::H264;
   const std::string vcl_container = "mp4";
 
-  while (iter != videoMap.end()) {
-    auto video_enc = iter->second.get_encoded(vcl_container, vcl_codec);
-    int size = video_enc.size();
-
+  ASSERT_TRUE(videoLoop.get_error().empty());
+  for (VCL::Video *video : videoLoop.get_videos()) {
+    auto video_enc = video->get_encoded(vcl_container, vcl_codec);
     ASSERT_TRUE(!video_enc.empty());
-    iter++;
   }
 }
 
@@ -1106,15 +1092,9 @@ TEST_F(VideoTest, VideoLoopTestError) {
   videoLoop.set_nrof_entities(1);
 
   videoLoop.enqueue(video_data);
+  videoLoop.wait();
 
-  while (videoLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Video> videoMap = videoLoop.get_video_map();
-  std::map<std::string, VCL::Video>::iterator iter = videoMap.begin();
-
-  ASSERT_TRUE(iter->second.get_query_error_response() != "");
+  ASSERT_TRUE(videoLoop.get_error() != "");
 }
 
 /**
@@ -1148,15 +1128,9 @@ TEST_F(VideoTest, VideoLoopSyncRemoteTestError) {
   videoLoop.set_nrof_entities(1);
 
   videoLoop.enqueue(video_data);
+  videoLoop.wait();
 
-  while (videoLoop.is_loop_running()) {
-    continue;
-  }
-
-  std::map<std::string, VCL::Video> videoMap = videoLoop.get_video_map();
-  std::map<std::string, VCL::Video>::iterator iter = videoMap.begin();
-
-  ASSERT_TRUE(iter->second.get_query_error_response() != "");
+  ASSERT_TRUE(videoLoop.get_error() != "");
 }
 
 TEST_F(VideoTest, KeyFrameExtractionSuccess) {
@@ -1302,6 +1276,34 @@ TEST_F(VideoTest, CheckDecodedRandomFrames) {
   }
 }
 
+/**
+ * Get frames in a single pass over the video, requested out of order,
+ * twice, and far enough apart to be seeked.
+ * Should be the frames of the list, in its order.
+ */
+TEST_F(VideoTest, GetFramesUnsorted) {
+  std::vector<unsigned> frame_query = {265, 3, 10, 0, 10, 140};
+
+  try {
+    VCL::Video video_data(_video_path_mp4_h264);
+    std::vector<cv::Mat> mat_list = video_data.get_frames(frame_query);
+    ASSERT_EQ(mat_list.size(), frame_query.size());
+
+    for (int i = 0; i < frame_query.size(); ++i)
+      EXPECT_TRUE(
+          compare_mat_mat(mat_list[i], _frames_h264.at(frame_query[i])));
+
+    // Each copy of a frame requested twice is its own
+    EXPECT_NE(mat_list[2].data, mat_list[4].data);
+
+    frame_query.push_back(_frames_h264.size());
+    ASSERT_THROW(video_data.get_frames(frame_query), VCL::Exception);
+  } catch (VCL::Exception e) {
+    print_exception(e);
+    ASSERT_TRUE(false);
+  }
+}
+
 /**
  * Create a Video object of MP4 format and point to an existing file.
  * Imitates the VDMS read then store capability. Should have the same
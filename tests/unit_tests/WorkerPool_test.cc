@@ -0,0 +1,107 @@
+/**
+ * @file   WorkerPool_test.cc
+ *
+ * @section LICENSE
+ *
+ * The MIT License
+ *
+ * @copyright Copyright (c) 2017 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files
+ * (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "WorkerPool.h"
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace VDMS;
+
+TEST(WorkerPool, parallel_for_all_indexes) {
+  WorkerPool pool(4, 0);
+
+  std::vector<int> calls(1000, 0);
+  pool.parallel_for(calls.size(), [&](size_t i) { calls[i]++; });
+
+  for (int c : calls)
+    EXPECT_EQ(c, 1);
+
+  // Nothing to do
+  pool.parallel_for(0, [&](size_t i) { calls[i]++; });
+}
+
+TEST(WorkerPool, parallel_for_request_cap) {
+  WorkerPool pool(8, 3);
+
+  std::atomic<int> running(0);
+  std::atomic<int> max_running(0);
+
+  pool.parallel_for(64, [&](size_t i) {
+    int now = ++running;
+    int prev = max_running;
+    while (now > prev && !max_running.compare_exchange_weak(prev, now))
+      ;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    --running;
+  });
+
+  EXPECT_LE(max_running, 3);
+  EXPECT_GE(max_running, 1);
+}
+
+TEST(WorkerPool, parallel_for_busy_pool) {
+  WorkerPool pool(1, 0);
+
+  // Keeps the only thread of the pool busy: the caller does the work.
+  std::atomic<bool> release(false);
+  pool.submit([&]() {
+    while (!release)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  });
+
+  std::vector<int> calls(100, 0);
+  pool.parallel_for(calls.size(), [&](size_t i) { calls[i]++; });
+  release = true;
+
+  for (int c : calls)
+    EXPECT_EQ(c, 1);
+}
+
+TEST(WorkerPool, parallel_for_exception) {
+  WorkerPool pool(4, 0);
+
+  std::atomic<int> done(0);
+  EXPECT_THROW(pool.parallel_for(100,
+                                 [&](size_t i) {
+                                   if (i == 10)
+                                     throw std::runtime_error("failed");
+                                   ++done;
+                                 }),
+               std::runtime_error);
+
+  // The other indexes are still processed
+  EXPECT_EQ(done, 99);
+}
@@ -59,6 +59,47 @@ TEST(CLIENT_CPP, add_image_resize_operation) {
   EXPECT_EQ(status1, 0);
 }
 
+TEST(CLIENT_CPP, add_image_batch) {
+
+  std::string filename = "../tests/test_images/large1.jpg";
+
+  Meta_Data *meta_obj = new Meta_Data();
+  std::vector<std::string *> blobs;
+  blobs.push_back(meta_obj->read_blob(filename));
+  blobs.push_back(new std::string("not an image"));
+  blobs.push_back(meta_obj->read_blob(filename));
+
+  Json::Value props;
+  props["name"].append("batch_0");
+  props["name"].append("batch_1");
+  props["name"].append("batch_2");
+
+  Json::Value batch;
+  batch["count"] = 3;
+  batch["format"] = "png";
+  batch["properties"] = props;
+
+  Json::Value cmd;
+  cmd["AddImageBatch"] = batch;
+  Json::Value tuple;
+  tuple.append(cmd);
+
+  meta_obj->_aclient.reset(
+      new VDMS::VDMSClient(meta_obj->get_server(), meta_obj->get_port()));
+  VDMS::Response response =
+      meta_obj->_aclient->query(meta_obj->_fastwriter.write(tuple), blobs);
+  Json::Value result;
+  meta_obj->_reader.parse(response.json.c_str(), result);
+
+  // The image that cannot be decoded does not fail the others
+  const Json::Value &added = result[0]["AddImageBatch"];
+  EXPECT_EQ(added["status"].asInt(), 0);
+  EXPECT_EQ(added["count"].asInt(), 2);
+  EXPECT_EQ(added["items"][0]["status"].asInt(), 0);
+  EXPECT_EQ(added["items"][1]["status"].asInt(), -1);
+  EXPECT_EQ(added["items"][2]["status"].asInt(), 0);
+}
+
 TEST(CLIENT_CPP, find_image) {
 
   Meta_Data *meta_obj = new Meta_Data();